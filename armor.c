@@ -320,10 +320,15 @@ static size_t dearmor_getchar_c(void *ctx, size_t count, void *c)
 	return (rc == 0) ? i : 0;
 }
 
-int armor_openpgp_stream(size_t (*putchar_func)(void *ctx, size_t count,
+/*
+ * Armors either a packet list or, if packets is NULL, a buffer of already
+ * serialised packets.
+ */
+static int armor_openpgp_int(size_t (*putchar_func)(void *ctx, size_t count,
 						void *c),
 				void *ctx,
-				struct openpgp_packet_list *packets)
+				struct openpgp_packet_list *packets,
+				const uint8_t *data, size_t length)
 {
 	struct armor_context armor_ctx;
 
@@ -336,7 +341,11 @@ int armor_openpgp_stream(size_t (*putchar_func)(void *ctx, size_t count,
 	armor_init(&armor_ctx);
 	armor_ctx.putchar_func = putchar_func;
 	armor_ctx.ctx = ctx;
-	write_openpgp_stream(armor_putchar, &armor_ctx, packets);
+	if (packets != NULL) {
+		write_openpgp_stream(armor_putchar, &armor_ctx, packets);
+	} else {
+		armor_putchar(&armor_ctx, length, (void *) data);
+	}
 	armor_finish(&armor_ctx);
 
 	/*
@@ -348,6 +357,22 @@ int armor_openpgp_stream(size_t (*putchar_func)(void *ctx, size_t count,
 	return 0;
 }
 
+int armor_openpgp_stream(size_t (*putchar_func)(void *ctx, size_t count,
+						void *c),
+				void *ctx,
+				struct openpgp_packet_list *packets)
+{
+	return armor_openpgp_int(putchar_func, ctx, packets, NULL, 0);
+}
+
+int armor_openpgp_buffer(size_t (*putchar_func)(void *ctx, size_t count,
+						void *c),
+				void *ctx,
+				const uint8_t *data, size_t length)
+{
+	return armor_openpgp_int(putchar_func, ctx, NULL, data, length);
+}
+
 int dearmor_openpgp_stream(size_t (*getchar_func)(void *ctx, size_t count,
 						void *c),
 				void *ctx,
@@ -36,6 +36,21 @@ int armor_openpgp_stream(size_t (*putchar_func)(void *ctx, size_t count,
 				void *ctx,
 				struct openpgp_packet_list *packets);
 
+/**
+ * @brief Takes a buffer of binary OpenPGP packets and armors it.
+ * @param putchar_func The function to output the next armor character.
+ * @param ctx The context pointer for putchar_func.
+ * @param data The packet data to output.
+ * @param length The length of data.
+ *
+ * As armor_openpgp_stream(), but for packets that are already in their
+ * binary form, such as those returned by the fetch_key_*_raw DB functions.
+ */
+int armor_openpgp_buffer(size_t (*putchar_func)(void *ctx, size_t count,
+						void *c),
+				void *ctx,
+				const uint8_t *data, size_t length);
+
 /**
  * @brief Reads & decodes an ACSII armored OpenPGP msg.
  * @param getchar_func The function to get the next character from the stream.
@@ -0,0 +1,452 @@
+/*
+ * bulkadd.c - Parallel import of large numbers of keys.
+ *
+ * Copyright 2026 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "armor.h"
+#include "bulkadd.h"
+#include "charfuncs.h"
+#include "cleankey.h"
+#include "keydb.h"
+#include "keystructs.h"
+#include "log.h"
+#include "mem.h"
+#include "onak-conf.h"
+#include "parsekey.h"
+
+/*
+ * Cleaning policies that need to look at the DB. These can only be applied
+ * by the thread doing the DB updates, so if any are set it does all the
+ * cleaning; that checks each signature's hash once rather than in both the
+ * workers and the writer, and counts each cleaned key once.
+ */
+#define BULK_DB_POLICIES	(ONAK_CLEAN_VERIFY_SIGNATURES | \
+				 ONAK_CLEAN_NEED_OTHER_SIG)
+
+/**
+ * struct bulk_chunk - A set of keys read together from the input.
+ * @seq: The order the chunk was read in.
+ * @armored: The armored text read, until it's been dearmored.
+ * @armoredlen: The length of @armored.
+ * @packets: The packets read, until they've been parsed.
+ * @keys: The parsed and cleaned keys.
+ * @count: The number of keys parsed.
+ * @cleaned: The number of keys changed by cleaning.
+ * @next: The next chunk waiting to be parsed.
+ */
+struct bulk_chunk {
+	int seq;
+	char *armored;
+	size_t armoredlen;
+	struct openpgp_packet_list *packets;
+	struct openpgp_publickey *keys;
+	int count;
+	int cleaned;
+	struct bulk_chunk *next;
+};
+
+/**
+ * struct bulk_ctx - State shared between the bulk import threads.
+ * @lock: Protects everything below.
+ * @parsable: Signalled when a chunk is ready to parse, or reading is done.
+ * @space: Signalled when there's room to queue another chunk for parsing.
+ * @writable: Signalled when a chunk is ready to write, or the writer has
+ *            moved on to the next chunk.
+ * @head: The first chunk waiting to be parsed.
+ * @tail: Where to add the next chunk waiting to be parsed.
+ * @queued: The number of chunks waiting to be parsed.
+ * @window: The number of chunks allowed in each stage between threads.
+ * @done: Parsed chunks waiting to be written, indexed by seq % window.
+ * @nextwrite: The sequence number of the next chunk to write.
+ * @chunks: The number of chunks read so far.
+ * @eof: Set once we've finished reading the input.
+ * @chunksize: How many keys (or armored blocks) to read at a time.
+ * @binary: Set if the input is binary rather than armored.
+ * @clean: Set if the worker threads should clean the keys.
+ */
+struct bulk_ctx {
+	pthread_mutex_t lock;
+	pthread_cond_t parsable;
+	pthread_cond_t space;
+	pthread_cond_t writable;
+	struct bulk_chunk *head;
+	struct bulk_chunk **tail;
+	int queued;
+	int window;
+	struct bulk_chunk **done;
+	int nextwrite;
+	int chunks;
+	bool eof;
+	int chunksize;
+	bool binary;
+	bool clean;
+};
+
+/*
+ * Read up to count armored blocks from stdin, skipping anything outside
+ * them. The workers dearmor them; we only look for the header and footer
+ * lines. Returns NULL once there's nothing left to read.
+ */
+static char *bulk_read_armored(int count, size_t *len)
+{
+	char *line = NULL, *buf = NULL, *tmp;
+	size_t linesize = 0, size = 0;
+	ssize_t linelen;
+	bool inblock = false;
+
+	*len = 0;
+	while (count > 0 &&
+			(linelen = getline(&line, &linesize, stdin)) > 0) {
+		if (!inblock) {
+			if (strncmp(line, "-----BEGIN ", 11) != 0) {
+				continue;
+			}
+			inblock = true;
+		} else if (strncmp(line, "-----END ", 9) == 0) {
+			inblock = false;
+			count--;
+		}
+
+		if (*len + linelen + 1 > size) {
+			size = (*len + linelen + 1) * 2;
+			tmp = realloc(buf, size);
+			if (tmp == NULL) {
+				logthing(LOGTHING_CRITICAL,
+					"Couldn't allocate memory for "
+					"armored keys");
+				free(buf);
+				buf = NULL;
+				break;
+			}
+			buf = tmp;
+		}
+		memcpy(&buf[*len], line, linelen);
+		*len += linelen;
+		buf[*len] = 0;
+	}
+	free(line);
+
+	return buf;
+}
+
+/*
+ * Dearmor each of the blocks in a chunk. Each one is handed to the dearmor
+ * code on its own, so a damaged block can't run on into the next.
+ */
+static void bulk_dearmor(struct bulk_chunk *chunk)
+{
+	struct buffer_ctx buf;
+	char *end;
+
+	buf.buffer = chunk->armored;
+	buf.offset = 0;
+	while (buf.offset < chunk->armoredlen) {
+		end = strstr(&chunk->armored[buf.offset], "\n-----END ");
+		if (end != NULL) {
+			end = strchr(end + 1, '\n');
+		}
+		buf.size = (end != NULL) ? end + 1 - chunk->armored :
+			chunk->armoredlen;
+		dearmor_openpgp_stream(buffer_fetchchar, &buf,
+				&chunk->packets);
+		buf.offset = buf.size;
+	}
+}
+
+/*
+ * Read stdin a chunk at a time, queueing each chunk for the workers and
+ * blocking while the queue is full.
+ */
+static void *bulk_reader(void *arg)
+{
+	struct bulk_ctx *ctx = arg;
+	struct openpgp_packet_list *packets = NULL, *next = NULL;
+	struct bulk_chunk *chunk;
+	onak_status_t res = ONAK_E_OK;
+	char *armored = NULL;
+	size_t armoredlen = 0;
+
+	do {
+		if (ctx->binary) {
+			res = read_openpgp_stream_keys(stdin_getchar, NULL,
+					&packets, &next, ctx->chunksize);
+			if (res != ONAK_E_OK) {
+				logthing(LOGTHING_INFO,
+					"read_openpgp_stream: %d", res);
+			}
+			if (packets == NULL) {
+				break;
+			}
+		} else {
+			armored = bulk_read_armored(ctx->chunksize,
+					&armoredlen);
+			if (armored == NULL) {
+				break;
+			}
+		}
+
+		chunk = calloc(1, sizeof(*chunk));
+		if (chunk == NULL) {
+			logthing(LOGTHING_CRITICAL,
+				"Couldn't allocate memory for key chunk");
+			free_packet_list(packets);
+			free(armored);
+			break;
+		}
+		chunk->packets = packets;
+		packets = NULL;
+		chunk->armored = armored;
+		chunk->armoredlen = armoredlen;
+		armored = NULL;
+
+		pthread_mutex_lock(&ctx->lock);
+		while (ctx->queued >= ctx->window) {
+			pthread_cond_wait(&ctx->space, &ctx->lock);
+		}
+		chunk->seq = ctx->chunks++;
+		*ctx->tail = chunk;
+		ctx->tail = &chunk->next;
+		ctx->queued++;
+		pthread_cond_signal(&ctx->parsable);
+		pthread_mutex_unlock(&ctx->lock);
+	} while (res == ONAK_E_OK);
+	free_packet_list(next);
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->eof = true;
+	pthread_cond_broadcast(&ctx->parsable);
+	pthread_cond_broadcast(&ctx->writable);
+	pthread_mutex_unlock(&ctx->lock);
+
+	return NULL;
+}
+
+/*
+ * Dearmor, parse and clean chunks of keys, then hand them over to be written. A
+ * chunk can only be handed over once the writer is within a window of it,
+ * which keeps the number of chunks in memory bounded.
+ */
+static void *bulk_worker(void *arg)
+{
+	struct bulk_ctx *ctx = arg;
+	struct bulk_chunk *chunk;
+
+	while (true) {
+		pthread_mutex_lock(&ctx->lock);
+		while (ctx->head == NULL && !ctx->eof) {
+			pthread_cond_wait(&ctx->parsable, &ctx->lock);
+		}
+		chunk = ctx->head;
+		if (chunk == NULL) {
+			pthread_mutex_unlock(&ctx->lock);
+			break;
+		}
+		ctx->head = chunk->next;
+		if (ctx->head == NULL) {
+			ctx->tail = &ctx->head;
+		}
+		ctx->queued--;
+		pthread_cond_signal(&ctx->space);
+		pthread_mutex_unlock(&ctx->lock);
+
+		chunk->next = NULL;
+		if (chunk->armored != NULL) {
+			bulk_dearmor(chunk);
+			free(chunk->armored);
+			chunk->armored = NULL;
+		}
+		chunk->count = parse_keys(chunk->packets, &chunk->keys);
+		free_packet_list(chunk->packets);
+		chunk->packets = NULL;
+		if (ctx->clean) {
+			chunk->cleaned = cleankeys(NULL, &chunk->keys,
+					config.clean_policies);
+		}
+
+		pthread_mutex_lock(&ctx->lock);
+		while (chunk->seq >= ctx->nextwrite + ctx->window) {
+			pthread_cond_wait(&ctx->writable, &ctx->lock);
+		}
+		ctx->done[chunk->seq % ctx->window] = chunk;
+		pthread_cond_broadcast(&ctx->writable);
+		pthread_mutex_unlock(&ctx->lock);
+	}
+
+	return NULL;
+}
+
+void add_keys_chunk(struct onak_dbctx *dbctx, struct openpgp_publickey **keys,
+		bool clean, bool update, bool binary,
+		struct add_keys_stats *stats)
+{
+	struct openpgp_packet_list *packets = NULL;
+	struct openpgp_packet_list *list_end = NULL;
+
+	if (clean) {
+		stats->cleaned += cleankeys(dbctx, keys,
+				config.clean_policies);
+	}
+	stats->added += dbctx->update_keys(dbctx, keys, &config.blacklist,
+			(config.clean_policies & ONAK_CLEAN_UPDATE_ONLY),
+			false);
+	if (*keys != NULL) {
+		stats->changed = true;
+		if (update) {
+			flatten_publickey(*keys, &packets, &list_end);
+			if (binary) {
+				write_openpgp_stream(stdout_putchar, NULL,
+						packets);
+			} else {
+				armor_openpgp_stream(stdout_putchar, NULL,
+						packets);
+			}
+			free_packet_list(packets);
+		}
+		free_publickey(*keys);
+		*keys = NULL;
+	}
+
+	stats->chunks++;
+	logthing(LOGTHING_INFO, "Processed %d keys in %d chunks.",
+			stats->count, stats->chunks);
+}
+
+int add_keys_finish(struct add_keys_stats *stats)
+{
+	if (stats->chunks == 0) {
+		logthing(LOGTHING_NOTICE, "No keys read.");
+		return 1;
+	}
+
+	logthing(LOGTHING_INFO, "Finished reading %d keys.", stats->count);
+	logthing(LOGTHING_INFO, "%d keys cleaned.", stats->cleaned);
+	logthing(LOGTHING_NOTICE, "Got %d new keys.", stats->added);
+	if (!stats->changed) {
+		logthing(LOGTHING_NOTICE, "No changes.");
+		return 1;
+	}
+
+	return 0;
+}
+
+int bulk_add_keys(struct onak_dbctx *dbctx, int chunksize, int workers,
+		bool binary, bool update)
+{
+	struct add_keys_stats stats;
+	struct bulk_chunk *chunk;
+	struct bulk_ctx ctx;
+	pthread_t reader, *threads;
+	int i, ret, started;
+
+	if (workers < 1) {
+		workers = 1;
+	}
+
+	memset(&ctx, 0, sizeof(ctx));
+	pthread_mutex_init(&ctx.lock, NULL);
+	pthread_cond_init(&ctx.parsable, NULL);
+	pthread_cond_init(&ctx.space, NULL);
+	pthread_cond_init(&ctx.writable, NULL);
+	ctx.tail = &ctx.head;
+	ctx.window = workers * 2;
+	ctx.chunksize = chunksize;
+	ctx.binary = binary;
+	ctx.clean = !(config.clean_policies & BULK_DB_POLICIES);
+	memset(&stats, 0, sizeof(stats));
+
+	ctx.done = calloc(ctx.window, sizeof(ctx.done[0]));
+	threads = calloc(workers, sizeof(threads[0]));
+	if (ctx.done == NULL || threads == NULL) {
+		logthing(LOGTHING_CRITICAL,
+			"Couldn't allocate memory for bulk import");
+		free(ctx.done);
+		free(threads);
+		return 1;
+	}
+
+	for (started = 0; started < workers; started++) {
+		ret = pthread_create(&threads[started], NULL, bulk_worker,
+				&ctx);
+		if (ret != 0) {
+			logthing(LOGTHING_ERROR,
+				"Couldn't start bulk import thread: %s",
+				strerror(ret));
+			break;
+		}
+	}
+	if (started == 0 ||
+			pthread_create(&reader, NULL, bulk_reader, &ctx) != 0) {
+		logthing(LOGTHING_CRITICAL, "Couldn't start bulk import.");
+		pthread_mutex_lock(&ctx.lock);
+		ctx.eof = true;
+		pthread_cond_broadcast(&ctx.parsable);
+		pthread_mutex_unlock(&ctx.lock);
+		for (i = 0; i < started; i++) {
+			pthread_join(threads[i], NULL);
+		}
+		free(ctx.done);
+		free(threads);
+		return 1;
+	}
+	logthing(LOGTHING_INFO, "Bulk importing with %d worker threads.",
+			started);
+
+	/*
+	 * We're the writer; take the chunks in the order they were read and
+	 * merge them into the DB.
+	 */
+	while (true) {
+		pthread_mutex_lock(&ctx.lock);
+		while (ctx.done[ctx.nextwrite % ctx.window] == NULL &&
+				!(ctx.eof && ctx.nextwrite == ctx.chunks)) {
+			pthread_cond_wait(&ctx.writable, &ctx.lock);
+		}
+		chunk = ctx.done[ctx.nextwrite % ctx.window];
+		if (chunk == NULL) {
+			pthread_mutex_unlock(&ctx.lock);
+			break;
+		}
+		ctx.done[ctx.nextwrite % ctx.window] = NULL;
+		ctx.nextwrite++;
+		pthread_cond_broadcast(&ctx.writable);
+		pthread_mutex_unlock(&ctx.lock);
+
+		stats.count += chunk->count;
+		stats.cleaned += chunk->cleaned;
+		add_keys_chunk(dbctx, &chunk->keys,
+				!ctx.clean, update, binary, &stats);
+		free(chunk);
+	}
+
+	pthread_join(reader, NULL);
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+	free(ctx.done);
+	pthread_cond_destroy(&ctx.writable);
+	pthread_cond_destroy(&ctx.space);
+	pthread_cond_destroy(&ctx.parsable);
+	pthread_mutex_destroy(&ctx.lock);
+
+	return add_keys_finish(&stats);
+}
@@ -0,0 +1,88 @@
+/*
+ * bulkadd.h - Parallel import of large numbers of keys.
+ *
+ * Copyright 2026 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BULKADD_H__
+#define __BULKADD_H__
+
+#include <stdbool.h>
+
+#include "keydb.h"
+#include "keystructs.h"
+
+/**
+ * struct add_keys_stats - Running totals for a chunked key import.
+ * @count: The number of keys read.
+ * @cleaned: The number of keys changed by cleaning.
+ * @added: The number of new keys added to the DB.
+ * @chunks: The number of chunks processed.
+ * @changed: Set if any keys were changed in the DB.
+ */
+struct add_keys_stats {
+	int count;
+	int cleaned;
+	int added;
+	int chunks;
+	bool changed;
+};
+
+/**
+ *	add_keys_chunk - Merge a chunk of parsed keys into the DB.
+ *	@dbctx: The DB to add the keys to.
+ *	@keys: The keys to add. Freed, and set to NULL, on return.
+ *	@clean: True if @keys still need to be cleaned.
+ *	@update: Output the changes made to the keys on stdout.
+ *	@binary: Output the changes as binary rather than armored.
+ *	@stats: The totals to add this chunk to.
+ *
+ *	The keys are cleaned if need be, merged into the DB and,
+ *	if @update is set, whatever changed is written to stdout. The caller is
+ *	responsible for adding the number of keys in the chunk to @stats.
+ */
+void add_keys_chunk(struct onak_dbctx *dbctx, struct openpgp_publickey **keys,
+		bool clean, bool update, bool binary,
+		struct add_keys_stats *stats);
+
+/**
+ *	add_keys_finish - Log the totals for a chunked key import.
+ *	@stats: The totals.
+ *
+ *	Returns 0 if some keys were changed, 1 otherwise.
+ */
+int add_keys_finish(struct add_keys_stats *stats);
+
+/**
+ *	bulk_add_keys - Add keys from stdin using several threads.
+ *	@dbctx: The DB to add the keys to.
+ *	@chunksize: How many keys to read and process together.
+ *	@workers: How many threads to use for parsing and cleaning keys.
+ *	@binary: The keys are binary rather than armored.
+ *	@update: Output the changes made to the keys on stdout.
+ *
+ *	Intended for initial loads of large keydumps. stdin is read a chunk
+ *	of keys at a time, or @chunksize armored blocks at a time if it's
+ *	armored; the chunks are dearmored, parsed and cleaned by a pool of
+ *	worker threads, then merged into the DB in the order they were read
+ *	by the calling thread, which is the only one to touch @dbctx. If the
+ *	cleaning policies need the DB the calling thread does the cleaning.
+ *
+ *	Returns 0 if some keys were changed, 1 otherwise.
+ */
+int bulk_add_keys(struct onak_dbctx *dbctx, int chunksize, int workers,
+		bool binary, bool update);
+
+#endif /* __BULKADD_H__ */
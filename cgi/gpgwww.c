@@ -74,8 +74,8 @@ int getkeyspath(struct onak_dbctx *dbctx,
 	/*
 	 * Make sure the keys we have and want are in the cache.
 	 */
-	dbctx->cached_getkeysigs(dbctx, have);
-	dbctx->cached_getkeysigs(dbctx, want);
+	statskeysigs(dbctx, have);
+	statskeysigs(dbctx, want);
 
 	if ((keyinfoa = findinhash(have)) == NULL) {
 		return 1;
@@ -185,6 +185,7 @@ int main(int argc, char *argv[])
 		goto err;
 	}
 	inithash();
+	initgraph();
 	logthing(LOGTHING_NOTICE, "Looking for path from 0x%016" PRIX64
 			" to 0x%016"
 			PRIX64,
@@ -195,6 +196,7 @@ int main(int argc, char *argv[])
 	} else {
 		dofindpath(dbctx, from, to, true, 3);
 	}
+	cleanupgraph();
 	destroyhash();
 	dbctx->cleanupdb(dbctx);
 
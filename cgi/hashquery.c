@@ -103,12 +103,38 @@ int main(__unused int argc, __unused char *argv[])
 		doerror("Can't fetch by skshash with this backend.");
 	}
 
-	for (i = 0; i < count; i++) {
-		dbctx->fetch_key_skshash(dbctx,
-				(struct skshash *) hashes[i], &keys[found]);
-		if (keys[found] != NULL) {
-			found++;
+	if (dbctx->fetch_keys_skshash != NULL) {
+		/* Ask for all of the hashes at once */
+		struct skshash *batch;
+
+		batch = calloc(count, sizeof(*batch));
+		if (batch == NULL) {
+			dbctx->cleanupdb(dbctx);
+			doerror("Couldn't allocate memory for query.\n");
+		}
+		for (i = 0; i < count; i++) {
+			memcpy(batch[i].hash, hashes[i], sizeof(batch[i].hash));
+		}
+		dbctx->fetch_keys_skshash(dbctx, batch, count, keys);
+		free(batch);
+
+		/* Compact the results down to just the keys we found */
+		for (i = 0; i < count; i++) {
+			if (keys[i] != NULL) {
+				keys[found++] = keys[i];
+			}
 		}
+	} else {
+		for (i = 0; i < count; i++) {
+			dbctx->fetch_key_skshash(dbctx,
+					(struct skshash *) hashes[i],
+					&keys[found]);
+			if (keys[found] != NULL) {
+				found++;
+			}
+		}
+	}
+	for (i = 0; i < count; i++) {
 		free(hashes[i]);
 		hashes[i] = NULL;
 	}
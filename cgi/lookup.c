@@ -126,7 +126,9 @@ int main(int argc, char *argv[])
 	struct openpgp_packet_list *list_end = NULL;
 	int result;
 	struct skshash hash;
+	struct openpgp_raw_key raw;
 	struct onak_dbctx *dbctx;
+	bool rawok;
 
 	params = getcgivars(argc, argv);
 	for (i = 0; params != NULL && params[i] != NULL; i += 2) {
@@ -236,7 +238,31 @@ int main(int argc, char *argv[])
 		switch (op) {
 		case OP_GET:
 		case OP_HGET:
-			if (op == OP_HGET) {
+			/*
+			 * If our cleaning policies only look at the key itself
+			 * then it was already cleaned with them when it was
+			 * added, so where we can hand out the stored key
+			 * exactly as it is rather than parsing it. Policies
+			 * that check it against other keys in the DB have to
+			 * be applied again, as those may have changed.
+			 */
+			rawok = (config.clean_policies &
+					~ONAK_CLEAN_KEY_ONLY) == 0;
+			raw.length = 0;
+			if (rawok && op == OP_HGET &&
+					dbctx->fetch_key_skshash_raw != NULL) {
+				parse_skshash(search, &hash);
+				result = dbctx->fetch_key_skshash_raw(dbctx,
+					&hash, &raw);
+			} else if (rawok && op == OP_GET && ishex &&
+					dbctx->fetch_key_id_raw != NULL) {
+				result = dbctx->fetch_key_id_raw(dbctx, keyid,
+					&raw, false);
+			} else if (rawok && op == OP_GET && isfp &&
+					dbctx->fetch_key_fp_raw != NULL) {
+				result = dbctx->fetch_key_fp_raw(dbctx,
+					&fingerprint, &raw, false);
+			} else if (op == OP_HGET) {
 				parse_skshash(search, &hash);
 				result = dbctx->fetch_key_skshash(dbctx,
 					&hash, &publickey);
@@ -251,7 +277,17 @@ int main(int argc, char *argv[])
 					search,
 					&publickey);
 			}
-			if (result) {
+			if (raw.length > 0) {
+				logthing(LOGTHING_NOTICE,
+					"Found %d key(s) for search %s",
+					result,
+					search);
+				puts("<pre>");
+				armor_openpgp_buffer(stdout_putchar, NULL,
+						raw.data, raw.length);
+				puts("</pre>");
+				free_raw_key(&raw);
+			} else if (result) {
 				logthing(LOGTHING_NOTICE,
 					"Found %d key(s) for search %s",
 					result,
@@ -16,8 +16,10 @@
  * this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "build-config.h"
 #include "cleankey.h"
@@ -27,7 +29,9 @@
 #include "log.h"
 #include "mem.h"
 #include "merge.h"
+#include "onak-conf.h"
 #include "openpgp.h"
+#include "sigcache.h"
 #include "sigcheck.h"
 
 /**
@@ -52,8 +56,11 @@ int dedupuids(struct openpgp_publickey *key)
 			logthing(LOGTHING_INFO, "Found duplicate uid: %.*s",
 					(int) curuid->packet->length,
 					curuid->packet->data);
+			/* If we can't merge them, leave both be. */
+			if (merge_packet_sigs(curuid, dup) != 0) {
+				break;
+			}
 			merged++;
-			merge_packet_sigs(curuid, dup);
 			/*
 			 * Remove the duplicate uid.
 			 */
@@ -71,6 +78,10 @@ int dedupuids(struct openpgp_publickey *key)
 		curuid = curuid->next;
 	}
 
+	if (merged > 0) {
+		key->have_skshash = false;
+	}
+
 	return merged;
 }
 
@@ -98,8 +109,10 @@ int dedupsubkeys(struct openpgp_publickey *key)
 			logthing(LOGTHING_INFO,
 				"Found duplicate subkey: 0x%016" PRIX64,
 				subkeyid);
+			if (merge_packet_sigs(cursubkey, dup) != 0) {
+				break;
+			}
 			merged++;
-			merge_packet_sigs(cursubkey, dup);
 			/*
 			 * Remove the duplicate uid.
 			 */
@@ -118,117 +131,710 @@ int dedupsubkeys(struct openpgp_publickey *key)
 		cursubkey = cursubkey->next;
 	}
 
+	if (merged > 0) {
+		key->have_skshash = false;
+	}
+
 	return merged;
 }
 
+/* How many signatures we gather up before verifying them */
+#define SIGCHECK_BATCH_SIZE	1024
+/* Number of hash buckets for looking up signing keys; must be a power of 2 */
+#define SIGCHECK_ISSUER_BUCKETS	1024
+
+enum sigcheck_result {
+	/* The signature is bad and should be removed */
+	SIGCHECK_BAD = 0,
+	/* The signature is ok, as far as we checked it */
+	SIGCHECK_OK,
+	/* The signature has been verified as a self signature */
+	SIGCHECK_SELF,
+	/* The signature has been verified as from another key */
+	SIGCHECK_OTHER,
+};
+
+/**
+ * struct sigcheck_signer - A public key that may have made signatures.
+ * @packet: The public key packet.
+ * @material: The parsed key material; NULL if it couldn't be parsed.
+ * @status: Why @material couldn't be parsed.
+ * @fp: The fingerprint of the key, for the signature cache.
+ * @havefp: Whether @fp is valid.
+ */
+struct sigcheck_signer {
+	struct openpgp_packet *packet;
+	struct onak_key_material *material;
+	onak_status_t status;
+	struct openpgp_fingerprint fp;
+	bool havefp;
+};
+
+/**
+ * struct sigcheck_issuer - The keys in the DB with a particular key ID.
+ * @keyid: The key ID.
+ * @keys: The keys, as fetched from the DB.
+ * @signers: The primary key from each of @keys, ready to check with.
+ * @count: Number of entries in @signers.
+ * @next: Next issuer in the same hash bucket.
+ *
+ * Each issuer is only fetched from the DB and parsed once per batch, no
+ * matter how many of the signatures in the batch it has made.
+ */
+struct sigcheck_issuer {
+	uint64_t keyid;
+	struct openpgp_publickey *keys;
+	struct sigcheck_signer *signers;
+	size_t count;
+	struct sigcheck_issuer *next;
+};
+
+/**
+ * struct sigcheck_job - A signature we're checking.
+ * @sig: The signature packet.
+ * @key: Index of the key the signature is on within the batch.
+ * @self: If true, verify against the key's own public key.
+ * @issuer: Otherwise, the keys matching the issuer key ID.
+ * @sigid: The issuer key ID.
+ * @hashtype: The type of hash the signature is over.
+ * @hash: The hash of the signed data.
+ * @pending: True if the signature still needs verified.
+ * @result: What we found.
+ */
+struct sigcheck_job {
+	struct openpgp_packet *sig;
+	size_t key;
+	bool self;
+	struct sigcheck_issuer *issuer;
+	uint64_t sigid;
+	uint8_t hashtype;
+	uint8_t hash[64];
+	bool pending;
+	enum sigcheck_result result;
+};
+
+/**
+ * struct sigcheck_key - A key with signatures in a sigcheck_batch.
+ * @needother: Whether we need a signature from another key on a UID.
+ * @count: Changes already made to the key before checking signatures.
+ * @self: The key's own public key, for checking self signatures.
+ */
+struct sigcheck_key {
+	bool needother;
+	int count;
+	struct sigcheck_signer self;
+};
+
+/**
+ * struct sigcheck_batch - Signatures from a set of keys being checked.
+ * @dbctx: DB context for looking up the signing keys.
+ * @fullverify: Whether to do full cryptographic verification.
+ * @jobs: The signatures, in the order they appear on the keys.
+ * @count: Number of entries in @jobs.
+ * @size: Number of entries @jobs has room for.
+ * @keys: Details of each key the signatures are from.
+ * @nkeys: Number of entries in @keys.
+ * @keyssize: Number of entries @keys has room for.
+ * @issuers: Hash of the signing keys we've fetched from the DB.
+ * @lock: Protects @next while the workers are running.
+ * @next: The next job for a worker to look at.
+ * @applied: The next job to apply the result of.
+ * @helpers: Number of pool threads working on the batch.
+ * @queued: Next batch waiting for help from the pool.
+ *
+ * Gathering the signatures up first means the expensive verification can
+ * be spread over several threads. The results are then applied back to
+ * the keys in order, so what gets removed doesn't depend on the number of
+ * threads or the order they finish in.
+ */
+struct sigcheck_batch {
+	struct onak_dbctx *dbctx;
+	bool fullverify;
+	struct sigcheck_job *jobs;
+	size_t count;
+	size_t size;
+	struct sigcheck_key *keys;
+	size_t nkeys;
+	size_t keyssize;
+	struct sigcheck_issuer *issuers[SIGCHECK_ISSUER_BUCKETS];
+	pthread_mutex_t lock;
+	size_t next;
+	size_t applied;
+	int helpers;
+	struct sigcheck_batch *queued;
+};
+
+/**
+ * struct sigcheck_pool - Threads that help verify signatures.
+ * @lock: Protects the rest of the pool, and each batch's @helpers/@queued.
+ * @work: Signalled when a batch is queued, or we're shutting down.
+ * @done: Signalled when the last helper leaves a batch.
+ * @threads: The worker threads.
+ * @count: Number of entries in @threads.
+ * @started: Whether we've tried to start the threads yet.
+ * @stopping: Tells the threads to exit.
+ * @queue: Batches waiting for help.
+ *
+ * The threads are started the first time there's anything to verify and
+ * live until cleankeys_cleanup(), rather than being created for every
+ * batch. A batch can be queued from several threads at once (e.g. by
+ * bulk add), so the pool works through whatever's queued.
+ */
+struct sigcheck_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	pthread_t *threads;
+	int count;
+	bool started;
+	bool stopping;
+	struct sigcheck_batch *queue;
+};
+
+#if HAVE_CRYPTO
+static struct sigcheck_pool sigcheck_pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ *	check_sig_cached - Check a signature, using the cache if we can.
+ *	@signer: The key that made the signature
+ *	@sig: The signature packet
+ *	@hash: Hash digest the signature is over
+ *	@hashtype: Type of hash (OPENPGP_HASH_*)
+ *
+ *	As onak_check_hash_sig, but skips the actual verification for
+ *	signatures we've already found to be good and records new good ones.
+ */
+static onak_status_t check_sig_cached(struct sigcheck_signer *signer,
+		struct openpgp_packet *sig,
+		uint8_t *hash,
+		uint8_t hashtype)
+{
+	onak_status_t ret;
+
+	if (signer->material == NULL) {
+		return signer->status;
+	}
+
+	if (config.sigcache == NULL || !signer->havefp) {
+		return onak_check_hash_sig_material(signer->material, sig,
+				hash, hashtype);
+	}
+
+	if (sigcache_find(sig, hashtype, hash, &signer->fp)) {
+		return ONAK_E_OK;
+	}
+
+	ret = onak_check_hash_sig_material(signer->material, sig, hash,
+			hashtype);
+	if (ret == ONAK_E_OK) {
+		sigcache_add(sig, hashtype, hash, &signer->fp);
+	}
+
+	return ret;
+}
+
+static void sigcheck_signer_init(struct sigcheck_signer *signer,
+		struct openpgp_packet *packet)
+{
+	signer->packet = packet;
+	signer->status = onak_key_material_new(packet, &signer->material);
+	signer->havefp = get_fingerprint(packet, &signer->fp) == ONAK_E_OK;
+}
+
 /**
- *	check_sighashes - Check that sig hashes are correct.
- *	@key - the check to check the sig hashes of.
+ *	sigcheck_issuer_get - Get the keys with a key ID for checking sigs.
+ *	@batch: The batch the keys are needed for.
+ *	@keyid: The key ID of the signing key.
  *
- *	Given an OpenPGP key confirm that all of the sigs on it have the
- *	appropriate 2 octet hash beginning, as stored as part of the sig.
- *	This is a simple way to remove junk sigs and, for example, catches
- *	subkey sig corruption as produced by old pksd implementations.
- *	Any sig that has an incorrect hash is removed from the key. If the
- *	hash cannot be checked (eg we don't support that hash type) we err
- *	on the side of caution and keep it.
+ *	Returns the keys that match @keyid, fetching them from the DB if
+ *	they're not already cached for this batch. Returns NULL if we
+ *	couldn't allocate memory.
  */
-int clean_sighashes(struct onak_dbctx *dbctx,
+static struct sigcheck_issuer *sigcheck_issuer_get(
+		struct sigcheck_batch *batch, uint64_t keyid)
+{
+	struct sigcheck_issuer **bucket, *issuer;
+	struct openpgp_publickey *curkey;
+	size_t i;
+
+	bucket = &batch->issuers[keyid & (SIGCHECK_ISSUER_BUCKETS - 1)];
+	for (issuer = *bucket; issuer != NULL; issuer = issuer->next) {
+		if (issuer->keyid == keyid) {
+			return issuer;
+		}
+	}
+
+	issuer = calloc(1, sizeof(*issuer));
+	if (issuer == NULL) {
+		return NULL;
+	}
+	issuer->keyid = keyid;
+	batch->dbctx->fetch_key_id(batch->dbctx, keyid, &issuer->keys, false);
+	for (curkey = issuer->keys; curkey != NULL; curkey = curkey->next) {
+		issuer->count++;
+	}
+	if (issuer->count > 0) {
+		issuer->signers = calloc(issuer->count,
+				sizeof(issuer->signers[0]));
+		if (issuer->signers == NULL) {
+			free_publickey(issuer->keys);
+			free(issuer);
+			return NULL;
+		}
+	}
+	for (i = 0, curkey = issuer->keys; curkey != NULL;
+			i++, curkey = curkey->next) {
+		sigcheck_signer_init(&issuer->signers[i], curkey->publickey);
+	}
+
+	issuer->next = *bucket;
+	*bucket = issuer;
+
+	return issuer;
+}
+#endif
+
+static void sigcheck_signer_free(struct sigcheck_signer *signer)
+{
+#if HAVE_CRYPTO
+	onak_key_material_free(signer->material);
+#endif
+	signer->material = NULL;
+}
+
+static void sigcheck_batch_reset(struct sigcheck_batch *batch)
+{
+	struct sigcheck_issuer *issuer;
+	size_t i, j;
+
+	for (i = 0; i < SIGCHECK_ISSUER_BUCKETS; i++) {
+		while ((issuer = batch->issuers[i]) != NULL) {
+			batch->issuers[i] = issuer->next;
+			for (j = 0; j < issuer->count; j++) {
+				sigcheck_signer_free(&issuer->signers[j]);
+			}
+			free(issuer->signers);
+			free_publickey(issuer->keys);
+			free(issuer);
+		}
+	}
+	for (i = 0; i < batch->nkeys; i++) {
+		sigcheck_signer_free(&batch->keys[i].self);
+	}
+	batch->count = batch->nkeys = 0;
+	batch->next = batch->applied = 0;
+}
+
+static void sigcheck_batch_free(struct sigcheck_batch *batch)
+{
+	sigcheck_batch_reset(batch);
+	free(batch->jobs);
+	batch->jobs = NULL;
+	free(batch->keys);
+	batch->keys = NULL;
+	batch->size = batch->keyssize = 0;
+	pthread_mutex_destroy(&batch->lock);
+}
+
+static void sigcheck_batch_init(struct sigcheck_batch *batch,
+		struct onak_dbctx *dbctx, bool fullverify)
+{
+	memset(batch, 0, sizeof(*batch));
+	batch->dbctx = dbctx;
+	batch->fullverify = fullverify;
+	pthread_mutex_init(&batch->lock, NULL);
+}
+
+static struct sigcheck_key *sigcheck_add_key(struct sigcheck_batch *batch)
+{
+	struct sigcheck_key *keys;
+	size_t size;
+
+	if (batch->nkeys == batch->keyssize) {
+		size = batch->keyssize ? batch->keyssize * 2 : 64;
+		keys = realloc(batch->keys, size * sizeof(*keys));
+		if (keys == NULL) {
+			return NULL;
+		}
+		batch->keys = keys;
+		batch->keyssize = size;
+	}
+	memset(&batch->keys[batch->nkeys], 0, sizeof(batch->keys[0]));
+
+	return &batch->keys[batch->nkeys++];
+}
+
+/**
+ *	sigcheck_queue_sigs - Queue up a list of signatures to be checked.
+ *	@batch: The batch to add the signatures to.
+ *	@key: The key the signatures are on.
+ *	@keyid: The key ID of @key.
+ *	@sigdata: The UID or subkey the signatures are over; NULL for the key.
+ *	@sigs: The signatures.
+ *
+ *	Checks that the sigs have the appropriate 2 octet hash beginning, as
+ *	stored as part of the sig. This is a simple way to remove junk sigs
+ *	and, for example, catches subkey sig corruption as produced by old
+ *	pksd implementations. If the hash cannot be checked (eg we don't
+ *	support that hash type) we err on the side of caution and keep it,
+ *	unless we're doing full verification.
+ *
+ *	For full verification this also looks up the keys that might have
+ *	made each signature, ready for sigcheck_batch_run(). Returns false if
+ *	we couldn't allocate memory.
+ */
+static bool sigcheck_queue_sigs(struct sigcheck_batch *batch,
 		struct openpgp_publickey *key,
+		size_t keyidx,
+		uint64_t keyid,
 		struct openpgp_packet *sigdata,
-		struct openpgp_packet_list **sigs,
-		bool fullverify,
-		bool *selfsig, bool *othersig)
+		struct openpgp_packet_list *sigs)
 {
-	struct openpgp_packet_list *tmpsig;
-	struct openpgp_publickey *sigkeys = NULL, *curkey;
+	struct onak_sighash_cache hashcache;
+	struct sigcheck_job *job, *jobs;
 	onak_status_t ret;
-	uint8_t hashtype;
-	uint8_t hash[64];
 	uint8_t *sighash;
-	int removed = 0;
-	uint64_t keyid, sigid;
-	bool remove;
+	size_t size;
 
-	get_keyid(key, &keyid);
-	if (selfsig != NULL) {
-		*selfsig = false;
-	}
-	while (*sigs != NULL) {
-		remove = false;
-		ret = calculate_packet_sighash(key, sigdata, (*sigs)->packet,
-				&hashtype, hash, &sighash);
+	onak_sighash_cache_init(&hashcache, key, sigdata);
+	for (; sigs != NULL; sigs = sigs->next) {
+		if (batch->count == batch->size) {
+			size = batch->size ? batch->size * 2 : 64;
+			jobs = realloc(batch->jobs, size * sizeof(*jobs));
+			if (jobs == NULL) {
+				return false;
+			}
+			batch->jobs = jobs;
+			batch->size = size;
+		}
+		job = &batch->jobs[batch->count++];
+		memset(job, 0, sizeof(*job));
+		job->sig = sigs->packet;
+		job->key = keyidx;
+		job->result = SIGCHECK_OK;
+
+		ret = calculate_packet_sighash_cached(&hashcache, sigs->packet,
+				&job->hashtype, job->hash, &sighash);
 
 		if (ret == ONAK_E_UNSUPPORTED_FEATURE) {
-			get_keyid(key, &keyid);
 			logthing(LOGTHING_ERROR,
 				"Unsupported signature hash type %d on 0x%016"
 				PRIX64,
-				hashtype,
+				job->hashtype,
 				keyid);
-			if (fullverify) {
-				remove = true;
+			if (batch->fullverify) {
+				job->result = SIGCHECK_BAD;
 			}
-		} else if (ret != ONAK_E_OK || (!fullverify &&
-				!(hash[0] == sighash[0] &&
-					hash[1] == sighash[1]))) {
-			remove = true;
+		} else if (ret != ONAK_E_OK || (!batch->fullverify &&
+				!(job->hash[0] == sighash[0] &&
+					job->hash[1] == sighash[1]))) {
+			job->result = SIGCHECK_BAD;
 		}
 
 #if HAVE_CRYPTO
-		if (fullverify && !remove) {
-			sig_info((*sigs)->packet, &sigid, NULL);
+		if (batch->fullverify && job->result != SIGCHECK_BAD) {
+			sig_info(sigs->packet, &job->sigid, NULL);
 
 			/* Start by assuming it's a bad sig */
-
-			remove = true;
-			if (sigid == keyid) {
-				ret = onak_check_hash_sig(key->publickey,
-						(*sigs)->packet,
-						hash, hashtype);
-
-				/* We have a valid self signature */
-				if (ret == ONAK_E_OK) {
-					remove = false;
-					if (selfsig != NULL) {
-						*selfsig = true;
-					}
+			job->result = SIGCHECK_BAD;
+			job->pending = true;
+			if (job->sigid == keyid) {
+				job->self = true;
+			} else {
+				job->issuer = sigcheck_issuer_get(batch,
+						job->sigid);
+				if (job->issuer == NULL) {
+					return false;
 				}
 			}
+		}
+#endif
+	}
 
-			if (remove) {
-				dbctx->fetch_key_id(dbctx, sigid,
-						&sigkeys, false);
-			}
+	return true;
+}
 
-			/*
-			 * A 64 bit collision is probably a sign of something
-			 * sneaky happening, but if the signature verifies we
-			 * should keep it.
-			 */
-			for (curkey = sigkeys; curkey != NULL;
-					curkey = curkey->next) {
-
-				ret = onak_check_hash_sig(curkey->publickey,
-						(*sigs)->packet,
-						hash, hashtype);
-
-				/* Got a valid signature */
-				if (ret == ONAK_E_OK) {
-					remove = false;
-					if (othersig != NULL) {
-						*othersig = true;
-					}
-					break;
-				}
-			}
+/**
+ *	sigcheck_queue_key - Queue up all the signatures on a key.
+ *	@batch: The batch to add the signatures to.
+ *	@key: The key; the last one added to the batch with sigcheck_add_key.
+ *
+ *	Returns false if we couldn't allocate memory.
+ */
+static bool sigcheck_queue_key(struct sigcheck_batch *batch,
+		struct openpgp_publickey *key)
+{
+	struct openpgp_signedpacket_list *cur;
+	size_t keyidx = batch->nkeys - 1;
+	uint64_t keyid;
+
+#if HAVE_CRYPTO
+	if (batch->fullverify) {
+		sigcheck_signer_init(&batch->keys[keyidx].self,
+				key->publickey);
+	}
+#endif
+
+	get_keyid(key, &keyid);
+	if (!sigcheck_queue_sigs(batch, key, keyidx, keyid, NULL,
+				key->sigs)) {
+		return false;
+	}
+	for (cur = key->uids; cur != NULL; cur = cur->next) {
+		if (!sigcheck_queue_sigs(batch, key, keyidx, keyid,
+					cur->packet, cur->sigs)) {
+			return false;
+		}
+	}
+	for (cur = key->subkeys; cur != NULL; cur = cur->next) {
+		if (!sigcheck_queue_sigs(batch, key, keyidx, keyid,
+					cur->packet, cur->sigs)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+#if HAVE_CRYPTO
+static void sigcheck_job_run(struct sigcheck_batch *batch,
+		struct sigcheck_job *job)
+{
+	size_t i;
+
+	if (job->self) {
+		/* We have a valid self signature */
+		if (check_sig_cached(&batch->keys[job->key].self, job->sig,
+				job->hash, job->hashtype) == ONAK_E_OK) {
+			job->result = SIGCHECK_SELF;
+		}
+		return;
+	}
 
-			free_publickey(sigkeys);
-			sigkeys = NULL;
+	/*
+	 * A 64 bit collision is probably a sign of something sneaky
+	 * happening, but if the signature verifies we should keep it.
+	 */
+	for (i = 0; job->issuer != NULL && i < job->issuer->count; i++) {
+		/* Got a valid signature */
+		if (check_sig_cached(&job->issuer->signers[i], job->sig,
+				job->hash, job->hashtype) == ONAK_E_OK) {
+			job->result = SIGCHECK_OTHER;
+			break;
+		}
+	}
+}
+
+static void sigcheck_worker(struct sigcheck_batch *batch)
+{
+	size_t i;
+
+	while (true) {
+		pthread_mutex_lock(&batch->lock);
+		i = batch->next++;
+		pthread_mutex_unlock(&batch->lock);
+
+		if (i >= batch->count) {
+			break;
+		}
+		if (batch->jobs[i].pending) {
+			sigcheck_job_run(batch, &batch->jobs[i]);
+			batch->jobs[i].pending = false;
+		}
+	}
+}
+
+/* Take a batch off the pool's queue. Called with the pool lock held. */
+static void sigcheck_pool_unqueue(struct sigcheck_batch *batch)
+{
+	struct sigcheck_batch **cur;
+
+	for (cur = &sigcheck_pool.queue; *cur != NULL;
+			cur = &(*cur)->queued) {
+		if (*cur == batch) {
+			*cur = batch->queued;
+			batch->queued = NULL;
+			break;
+		}
+	}
+}
+
+static void *sigcheck_pool_thread(void *arg)
+{
+	struct sigcheck_batch *batch;
+
+	pthread_mutex_lock(&sigcheck_pool.lock);
+	while (!sigcheck_pool.stopping) {
+		batch = sigcheck_pool.queue;
+		if (batch == NULL) {
+			pthread_cond_wait(&sigcheck_pool.work,
+					&sigcheck_pool.lock);
+			continue;
+		}
+		batch->helpers++;
+		pthread_mutex_unlock(&sigcheck_pool.lock);
+
+		sigcheck_worker(batch);
+
+		pthread_mutex_lock(&sigcheck_pool.lock);
+		/* Everything's been handed out, so nobody else needs it. */
+		sigcheck_pool_unqueue(batch);
+		if (--batch->helpers == 0) {
+			pthread_cond_broadcast(&sigcheck_pool.done);
+		}
+	}
+	pthread_mutex_unlock(&sigcheck_pool.lock);
+
+	return NULL;
+}
+
+/*
+ * Start verify_workers - 1 threads, the caller being the last worker. Called
+ * with the pool lock held. Returns the number of threads running.
+ */
+static int sigcheck_pool_start(void)
+{
+	int ret;
+
+	if (sigcheck_pool.started) {
+		return sigcheck_pool.count;
+	}
+	sigcheck_pool.started = true;
+	if (config.verify_workers <= 1) {
+		return 0;
+	}
+
+	sigcheck_pool.threads = calloc(config.verify_workers - 1,
+			sizeof(*sigcheck_pool.threads));
+	if (sigcheck_pool.threads == NULL) {
+		return 0;
+	}
+	while (sigcheck_pool.count < config.verify_workers - 1) {
+		ret = pthread_create(
+				&sigcheck_pool.threads[sigcheck_pool.count],
+				NULL, sigcheck_pool_thread, NULL);
+		if (ret != 0) {
+			logthing(LOGTHING_ERROR,
+				"Couldn't start signature check thread: %s",
+				strerror(ret));
+			break;
 		}
+		sigcheck_pool.count++;
+	}
+
+	return sigcheck_pool.count;
+}
+
+/*
+ * Verify all the pending signatures, with help from the pool threads if
+ * there's more than one.
+ */
+static void sigcheck_run_pending(struct sigcheck_batch *batch)
+{
+	size_t i, pending = 0;
+	bool queued = false;
+
+	for (i = 0; i < batch->count; i++) {
+		if (batch->jobs[i].pending) {
+			pending++;
+		}
+	}
+	if (pending == 0) {
+		return;
+	}
+
+	batch->next = 0;
+	if (pending > 1) {
+		pthread_mutex_lock(&sigcheck_pool.lock);
+		if (sigcheck_pool_start() > 0) {
+			batch->queued = sigcheck_pool.queue;
+			sigcheck_pool.queue = batch;
+			pthread_cond_broadcast(&sigcheck_pool.work);
+			queued = true;
+		}
+		pthread_mutex_unlock(&sigcheck_pool.lock);
+	}
+
+	sigcheck_worker(batch);
+
+	if (queued) {
+		pthread_mutex_lock(&sigcheck_pool.lock);
+		sigcheck_pool_unqueue(batch);
+		while (batch->helpers > 0) {
+			pthread_cond_wait(&sigcheck_pool.done,
+					&sigcheck_pool.lock);
+		}
+		pthread_mutex_unlock(&sigcheck_pool.lock);
+	}
+}
 #endif
 
-		if (remove) {
+/**
+ *	sigcheck_batch_run - Verify the signatures queued in a batch.
+ *	@batch: The batch.
+ */
+static void sigcheck_batch_run(struct sigcheck_batch *batch)
+{
+#if HAVE_CRYPTO
+	struct sigcheck_job *job;
+	size_t i;
+
+	sigcheck_run_pending(batch);
+
+	/*
+	 * Self signatures that didn't verify against the key we were given
+	 * get a second chance against what's in the DB with the same key ID.
+	 */
+	for (i = 0; i < batch->count; i++) {
+		job = &batch->jobs[i];
+		if (job->self && job->result == SIGCHECK_BAD) {
+			job->self = false;
+			job->pending = true;
+			job->issuer = sigcheck_issuer_get(batch, job->sigid);
+		}
+	}
+
+	sigcheck_run_pending(batch);
+#endif
+}
+
+/**
+ *	sigcheck_apply_sigs - Remove the bad signatures from a list.
+ *	@batch: The batch with the results for the list.
+ *	@sigs: The signatures.
+ *	@selfsig: Set to true if there's a valid self signature.
+ *	@othersig: Set to true if there's a valid signature from another key.
+ *
+ *	The list must be in the same position, relative to the other lists
+ *	in the batch, as when it was queued. Returns the number of signatures
+ *	removed.
+ */
+static int sigcheck_apply_sigs(struct sigcheck_batch *batch,
+		struct openpgp_packet_list **sigs,
+		bool *selfsig, bool *othersig)
+{
+	struct openpgp_packet_list *tmpsig;
+	struct sigcheck_job *job;
+	int removed = 0;
+
+	if (selfsig != NULL) {
+		*selfsig = false;
+	}
+	while (*sigs != NULL) {
+		job = &batch->jobs[batch->applied++];
+		log_assert(job->sig == (*sigs)->packet);
+
+		if (job->result == SIGCHECK_SELF && selfsig != NULL) {
+			*selfsig = true;
+		} else if (job->result == SIGCHECK_OTHER && othersig != NULL) {
+			*othersig = true;
+		}
+
+		if (job->result == SIGCHECK_BAD) {
 			tmpsig = *sigs;
 			*sigs = (*sigs)->next;
 			tmpsig->next = NULL;
@@ -242,10 +848,9 @@ int clean_sighashes(struct onak_dbctx *dbctx,
 	return removed;
 }
 
-int clean_list_sighashes(struct onak_dbctx *dbctx,
-			struct openpgp_publickey *key,
+static int sigcheck_apply_list(struct sigcheck_batch *batch,
 			struct openpgp_signedpacket_list **siglist,
-			bool fullverify, bool needother)
+			bool needother)
 {
 	struct openpgp_signedpacket_list **orig, *tmp = NULL;
 	bool selfsig, othersig;
@@ -256,10 +861,10 @@ int clean_list_sighashes(struct onak_dbctx *dbctx,
 	while (siglist != NULL && *siglist != NULL) {
 		selfsig = false;
 
-		removed += clean_sighashes(dbctx, key, (*siglist)->packet,
-			&(*siglist)->sigs, fullverify, &selfsig, &othersig);
+		removed += sigcheck_apply_sigs(batch, &(*siglist)->sigs,
+				&selfsig, &othersig);
 
-		if (fullverify && !selfsig) {
+		if (batch->fullverify && !selfsig) {
 			/* Remove the UID/subkey if there's no selfsig */
 			tmp = *siglist;
 			*siglist = (*siglist)->next;
@@ -274,7 +879,7 @@ int clean_list_sighashes(struct onak_dbctx *dbctx,
 	 * We need at least one UID to have a signature from another key,
 	 * otherwise we remove all of them if needother is set.
 	 */
-	if (needother && fullverify && !othersig) {
+	if (needother && batch->fullverify && !othersig) {
 		siglist = orig;
 		while (siglist != NULL && *siglist != NULL) {
 			tmp = *siglist;
@@ -287,17 +892,27 @@ int clean_list_sighashes(struct onak_dbctx *dbctx,
 	return removed;
 }
 
-int clean_key_signatures(struct onak_dbctx *dbctx,
-		struct openpgp_publickey *key, bool fullverify, bool needother)
+/**
+ *	sigcheck_apply_key - Remove the bad signatures from a key.
+ *	@batch: The batch with the results for the key.
+ *	@key: The key.
+ *	@needother: Remove all the UIDs unless one has a signature from
+ *	            another key.
+ *
+ *	Keys must be applied in the order they were queued. Returns the
+ *	number of signatures removed.
+ */
+static int sigcheck_apply_key(struct sigcheck_batch *batch,
+		struct openpgp_publickey *key, bool needother)
 {
 	int removed;
 
-	removed = clean_sighashes(dbctx, key, NULL, &key->sigs, fullverify,
-			NULL, NULL);
-	removed += clean_list_sighashes(dbctx, key, &key->uids, fullverify,
-			needother);
-	removed += clean_list_sighashes(dbctx, key, &key->subkeys, fullverify,
-			false);
+	removed = sigcheck_apply_sigs(batch, &key->sigs, NULL, NULL);
+	removed += sigcheck_apply_list(batch, &key->uids, needother);
+	removed += sigcheck_apply_list(batch, &key->subkeys, false);
+	if (removed > 0) {
+		key->have_skshash = false;
+	}
 
 	return removed;
 }
@@ -347,6 +962,10 @@ int clean_large_packets(struct openpgp_publickey *key)
 		}
 	}
 
+	if (dropped > 0) {
+		key->have_skshash = false;
+	}
+
 	return dropped;
 }
 
@@ -359,70 +978,169 @@ int clean_large_packets(struct openpgp_publickey *key)
  *	apply all available cleaning options. Returns 0 if no changes were
  *	made, otherwise the number of keys cleaned. Note that some options
  *	may result in keys being removed entirely from the list.
+ *
+ *	Signatures are checked in batches of keys, so that full verification
+ *	can be done by several threads (see the verification:verify_workers
+ *	config option).
  */
 int cleankeys(struct onak_dbctx *dbctx, struct openpgp_publickey **keys,
 		uint64_t policies)
 {
-	struct openpgp_publickey **curkey, *tmp;
+	struct openpgp_publickey **curkey, **start, *tmp;
 	struct openpgp_fingerprint fp;
-	int changed = 0, count = 0;
-	bool needother;
+	struct sigcheck_batch batch;
+	struct sigcheck_key *batchkey;
+	int changed = 0, count = 0, carry = 0, keycount;
+	bool needother, checksigs;
+	size_t i, queued;
 
 	if (keys == NULL)
 		return 0;
 
+	checksigs = policies & (ONAK_CLEAN_CHECK_SIGHASH |
+			ONAK_CLEAN_VERIFY_SIGNATURES);
+	sigcheck_batch_init(&batch, dbctx,
+			policies & ONAK_CLEAN_VERIFY_SIGNATURES);
+
 	curkey = keys;
 	while (*curkey != NULL) {
-		if (policies & ONAK_CLEAN_DROP_V3_KEYS) {
-			if ((*curkey)->publickey->data[0] < 4) {
-				/* Remove the key from the list if it's < v4 */
-				tmp = *curkey;
-				*curkey = tmp->next;
-				tmp->next = NULL;
-				free_publickey(tmp);
-				changed++;
-				continue;
+		/*
+		 * First pass: do the cheap cleaning and queue up the
+		 * signatures from enough keys to fill a batch.
+		 */
+		start = curkey;
+		sigcheck_batch_reset(&batch);
+		while (*curkey != NULL && batch.count < SIGCHECK_BATCH_SIZE) {
+			if (policies & ONAK_CLEAN_DROP_V3_KEYS) {
+				if ((*curkey)->publickey->data[0] < 4) {
+					/*
+					 * Remove the key from the list if
+					 * it's < v4
+					 */
+					tmp = *curkey;
+					*curkey = tmp->next;
+					tmp->next = NULL;
+					free_publickey(tmp);
+					changed++;
+					continue;
+				}
 			}
-		}
-		if (policies & ONAK_CLEAN_LARGE_PACKETS) {
-			count += clean_large_packets(*curkey);
-		}
-		count += dedupuids(*curkey);
-		count += dedupsubkeys(*curkey);
-		if (policies & (ONAK_CLEAN_CHECK_SIGHASH |
-					ONAK_CLEAN_VERIFY_SIGNATURES)) {
-
-			needother = policies & ONAK_CLEAN_NEED_OTHER_SIG;
-			if (needother) {
-				/*
-				 * Check if we already have the key; if we do
-				 * then we can skip the check to make sure we
-				 * have signatures from other keys.
-				 */
-				get_fingerprint((*curkey)->publickey, &fp);
-				tmp = NULL;
-				needother = dbctx->fetch_key(dbctx, &fp,
-						&tmp, false) == 0;
-				free_publickey(tmp);
+			batchkey = sigcheck_add_key(&batch);
+			if (batchkey == NULL) {
+				break;
 			}
+			batchkey->count = carry;
+			carry = 0;
+			if (policies & ONAK_CLEAN_LARGE_PACKETS) {
+				batchkey->count +=
+					clean_large_packets(*curkey);
+			}
+			batchkey->count += dedupuids(*curkey);
+			batchkey->count += dedupsubkeys(*curkey);
+			if (checksigs) {
+				needother = policies &
+					ONAK_CLEAN_NEED_OTHER_SIG;
+				if (needother) {
+					/*
+					 * Check if we already have the key;
+					 * if we do then we can skip the
+					 * check to make sure we have
+					 * signatures from other keys.
+					 */
+					get_fingerprint((*curkey)->publickey,
+							&fp);
+					tmp = NULL;
+					needother = dbctx->fetch_key(dbctx,
+							&fp, &tmp, false) == 0;
+					free_publickey(tmp);
+				}
+				batchkey->needother = needother;
 
-			count += clean_key_signatures(dbctx, *curkey,
-				policies & ONAK_CLEAN_VERIFY_SIGNATURES,
-				needother);
+				queued = batch.count;
+				if (!sigcheck_queue_key(&batch, *curkey)) {
+					/*
+					 * Leave this key for the next
+					 * batch; it'll be re-queued in full.
+					 */
+					batch.count = queued;
+					sigcheck_signer_free(&batchkey->self);
+					carry = batchkey->count;
+					batch.nkeys--;
+					break;
+				}
+			}
+			curkey = &(*curkey)->next;
 		}
-		if (count > 0) {
+
+		if (batch.nkeys == 0 && *curkey != NULL) {
+			/*
+			 * We couldn't check any of the remaining keys, so
+			 * drop them rather than let them through unchecked.
+			 */
+			logthing(LOGTHING_CRITICAL,
+				"Couldn't allocate memory to check signatures");
+			free_publickey(*curkey);
+			*curkey = NULL;
 			changed++;
+			break;
 		}
-		if ((*curkey)->uids == NULL) {
-			/* No valid UIDS so remove the key from the list */
-			tmp = *curkey;
-			*curkey = tmp->next;
-			tmp->next = NULL;
-			free_publickey(tmp);
-		} else {
-			curkey = &(*curkey)->next;
+
+		if (checksigs) {
+			if (policies & ONAK_CLEAN_VERIFY_SIGNATURES) {
+				sigcache_refresh();
+			}
+			sigcheck_batch_run(&batch);
+		}
+
+		/* Second pass: apply the results, in order */
+		curkey = start;
+		for (i = 0; i < batch.nkeys; i++) {
+			keycount = batch.keys[i].count;
+			if (checksigs) {
+				keycount += sigcheck_apply_key(&batch,
+					*curkey, batch.keys[i].needother);
+			}
+			count += keycount;
+			if (count > 0) {
+				changed++;
+			}
+			if ((*curkey)->uids == NULL) {
+				/* No valid UIDS so remove the key */
+				tmp = *curkey;
+				*curkey = tmp->next;
+				tmp->next = NULL;
+				free_publickey(tmp);
+			} else {
+				curkey = &(*curkey)->next;
+			}
 		}
 	}
 
+	sigcheck_batch_free(&batch);
+
+	if (policies & ONAK_CLEAN_VERIFY_SIGNATURES) {
+		sigcache_flush();
+	}
+
 	return changed;
 }
+
+void cleankeys_cleanup(void)
+{
+#if HAVE_CRYPTO
+	int i;
+
+	pthread_mutex_lock(&sigcheck_pool.lock);
+	sigcheck_pool.stopping = true;
+	pthread_cond_broadcast(&sigcheck_pool.work);
+	pthread_mutex_unlock(&sigcheck_pool.lock);
+
+	for (i = 0; i < sigcheck_pool.count; i++) {
+		pthread_join(sigcheck_pool.threads[i], NULL);
+	}
+	free(sigcheck_pool.threads);
+	sigcheck_pool.threads = NULL;
+	sigcheck_pool.count = 0;
+	sigcheck_pool.started = sigcheck_pool.stopping = false;
+#endif
+}
@@ -30,6 +30,16 @@
 #define ONAK_CLEAN_NEED_OTHER_SIG	(1 << 5)
 #define ONAK_CLEAN_ALL			(uint64_t) -1
 
+/*
+ * Policies that only look at the key itself, so a key that was cleaned with
+ * them when it was stored won't be changed by cleaning it again. The rest
+ * depend on what else is in the DB, or don't affect cleankeys().
+ */
+#define ONAK_CLEAN_KEY_ONLY		(ONAK_CLEAN_CHECK_SIGHASH | \
+					 ONAK_CLEAN_LARGE_PACKETS | \
+					 ONAK_CLEAN_DROP_V3_KEYS | \
+					 ONAK_CLEAN_UPDATE_ONLY)
+
 /**
  *	cleankeys - Apply all available cleaning options on a list of keys.
  *	@dbctx: A database context suitable for looking up signing keys
@@ -45,4 +55,13 @@
 int cleankeys(struct onak_dbctx *dbctx, struct openpgp_publickey **keys,
 		uint64_t policies);
 
+/**
+ *	cleankeys_cleanup - Stop the signature verification threads.
+ *
+ *	cleankeys() starts verify_workers - 1 threads the first time it has
+ *	signatures to verify, which are reused until this is called. Must not
+ *	be called while cleankeys() is running.
+ */
+void cleankeys_cleanup(void);
+
 #endif
@@ -0,0 +1,1045 @@
+/*
+ * graph.c - Compact snapshot of the web of trust graph.
+ *
+ * Copyright 2026 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "decodekey.h"
+#include "graph.h"
+#include "keydb.h"
+#include "keyid.h"
+#include "keystructs.h"
+#include "log.h"
+#include "onak.h"
+
+/*
+ * The snapshot file is the header, followed by the keyids, sigstart, sigs,
+ * signstart, signs and flags arrays from struct onak_graph, each padded to
+ * a multiple of 8 bytes. Everything is in host byte order; the byteorder
+ * field lets us spot a file from a machine that differs.
+ */
+#define GRAPH_MAGIC		"ONAKWOT"
+#define GRAPH_VERSION		1
+#define GRAPH_BYTEORDER		0x01020304
+
+struct graph_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteorder;
+	uint64_t nodes;
+	uint64_t edges;
+	uint64_t built;
+};
+
+#define GRAPH_PAD(len)		(((len) + 7) & ~((size_t) 7))
+
+enum graph_section {
+	GRAPH_KEYIDS,
+	GRAPH_SIGSTART,
+	GRAPH_SIGS,
+	GRAPH_SIGNSTART,
+	GRAPH_SIGNS,
+	GRAPH_FLAGS,
+	GRAPH_SECTIONS
+};
+
+/*
+ * Work out where each array lives in the file, returning the total size.
+ */
+static size_t graph_layout(uint64_t nodes, uint64_t edges,
+		size_t offsets[GRAPH_SECTIONS])
+{
+	size_t len[GRAPH_SECTIONS];
+	size_t offset;
+	int i;
+
+	len[GRAPH_KEYIDS] = nodes * sizeof(uint64_t);
+	len[GRAPH_SIGSTART] = (nodes + 1) * sizeof(uint32_t);
+	len[GRAPH_SIGS] = edges * sizeof(uint32_t);
+	len[GRAPH_SIGNSTART] = (nodes + 1) * sizeof(uint32_t);
+	len[GRAPH_SIGNS] = edges * sizeof(uint32_t);
+	len[GRAPH_FLAGS] = nodes;
+
+	offset = GRAPH_PAD(sizeof(struct graph_header));
+	for (i = 0; i < GRAPH_SECTIONS; i++) {
+		offsets[i] = offset;
+		offset += GRAPH_PAD(len[i]);
+	}
+
+	return offset;
+}
+
+static size_t graph_search(const uint64_t *keyids, size_t count,
+		uint64_t keyid)
+{
+	size_t bottom = 0, top = count, mid;
+
+	while (bottom < top) {
+		mid = bottom + (top - bottom) / 2;
+		if (keyids[mid] < keyid) {
+			bottom = mid + 1;
+		} else {
+			top = mid;
+		}
+	}
+
+	return (bottom < count && keyids[bottom] == keyid) ? bottom : count;
+}
+
+uint32_t onak_graph_find(const struct onak_graph *graph, uint64_t keyid)
+{
+	size_t node;
+
+	node = graph_search(graph->keyids, graph->nodes, keyid);
+
+	return (node < graph->nodes) ? node : ONAK_GRAPH_NONE;
+}
+
+/**
+ * struct graph_build_id - A keyid and what it refers to.
+ * @keyid: The keyid.
+ * @index: A key in graph_build_ctx.keys, or a position in a list of sigs.
+ */
+struct graph_build_id {
+	uint64_t keyid;
+	size_t index;
+};
+
+/**
+ * struct graph_build_key - A key read from the DB.
+ * @keyid: The keyid of the key.
+ * @sigstart: Where the keyids of the signers start in graph_build_ctx.sigs.
+ * @sigcount: How many different keys have signed it.
+ * @revoked: If the key is revoked.
+ */
+struct graph_build_key {
+	uint64_t keyid;
+	size_t sigstart;
+	size_t sigcount;
+	bool revoked;
+};
+
+struct graph_build_ctx {
+	struct graph_build_key *keys;
+	size_t keycount;
+	size_t keysize;
+	uint64_t *sigs;
+	size_t sigcount;
+	size_t sigsize;
+	struct graph_build_id *subkeys;
+	size_t subkeycount;
+	size_t subkeysize;
+	struct graph_build_id *tmp;
+	size_t tmpsize;
+	bool failed;
+};
+
+static bool graph_grow(void **array, size_t *size, size_t needed,
+		size_t elemsize)
+{
+	size_t newsize;
+	void *newarray;
+
+	if (needed <= *size) {
+		return true;
+	}
+	newsize = *size ? *size : 1024;
+	while (newsize < needed) {
+		newsize *= 2;
+	}
+	newarray = realloc(*array, newsize * elemsize);
+	if (newarray == NULL) {
+		return false;
+	}
+	*array = newarray;
+	*size = newsize;
+
+	return true;
+}
+
+static int graph_id_cmp(const void *a, const void *b)
+{
+	const struct graph_build_id *ida = a, *idb = b;
+
+	if (ida->keyid != idb->keyid) {
+		return (ida->keyid < idb->keyid) ? -1 : 1;
+	}
+	if (ida->index != idb->index) {
+		return (ida->index < idb->index) ? -1 : 1;
+	}
+	return 0;
+}
+
+static int graph_index_cmp(const void *a, const void *b)
+{
+	const struct graph_build_id *ida = a, *idb = b;
+
+	if (ida->index != idb->index) {
+		return (ida->index < idb->index) ? -1 : 1;
+	}
+	return 0;
+}
+
+static int graph_keyid_cmp(const void *a, const void *b)
+{
+	const uint64_t *keyida = a, *keyidb = b;
+
+	if (*keyida != *keyidb) {
+		return (*keyida < *keyidb) ? -1 : 1;
+	}
+	return 0;
+}
+
+/*
+ * Find the first entry for a keyid in a sorted array of graph_build_ids.
+ */
+static struct graph_build_id *graph_id_search(struct graph_build_id *ids,
+		size_t count, uint64_t keyid)
+{
+	size_t bottom = 0, top = count, mid;
+
+	while (bottom < top) {
+		mid = bottom + (top - bottom) / 2;
+		if (ids[mid].keyid < keyid) {
+			bottom = mid + 1;
+		} else {
+			top = mid;
+		}
+	}
+
+	return (bottom < count && ids[bottom].keyid == keyid) ?
+		&ids[bottom] : NULL;
+}
+
+/*
+ * iterate_keys callback; record the keyid, signers and subkeys of a key.
+ * Stops the iteration once we've failed to allocate memory.
+ */
+static bool graph_build_add(void *ctx, struct openpgp_publickey *key)
+{
+	struct graph_build_ctx *state = ctx;
+	struct openpgp_signedpacket_list *uids, *subkeys;
+	struct openpgp_packet_list *sig;
+	struct graph_build_key *newkey;
+	uint64_t keyid;
+	size_t count, i, kept;
+
+	if (state->failed || get_keyid(key, &keyid) != ONAK_E_OK) {
+		return !state->failed;
+	}
+
+	count = 0;
+	for (uids = key->uids; uids != NULL; uids = uids->next) {
+		for (sig = uids->sigs; sig != NULL; sig = sig->next) {
+			if (!graph_grow((void **) &state->tmp,
+					&state->tmpsize, count + 1,
+					sizeof(*state->tmp))) {
+				state->failed = true;
+				return !state->failed;
+			}
+			state->tmp[count].keyid = sig_keyid(sig->packet);
+			state->tmp[count].index = count;
+			if (state->tmp[count].keyid != 0) {
+				count++;
+			}
+		}
+	}
+
+	/*
+	 * Only keep one signature from each signer; the last one, as that's
+	 * the first that a search working from the cached list of sigs (which
+	 * lladd builds backwards) comes across.
+	 */
+	qsort(state->tmp, count, sizeof(*state->tmp), graph_id_cmp);
+	for (i = kept = 0; i < count; i++) {
+		if (i + 1 == count ||
+				state->tmp[i + 1].keyid != state->tmp[i].keyid) {
+			state->tmp[kept++] = state->tmp[i];
+		}
+	}
+	qsort(state->tmp, kept, sizeof(*state->tmp), graph_index_cmp);
+
+	if (!graph_grow((void **) &state->sigs, &state->sigsize,
+				state->sigcount + kept, sizeof(*state->sigs)) ||
+			!graph_grow((void **) &state->keys, &state->keysize,
+				state->keycount + 1, sizeof(*state->keys))) {
+		state->failed = true;
+		return !state->failed;
+	}
+	newkey = &state->keys[state->keycount];
+	newkey->keyid = keyid;
+	newkey->sigstart = state->sigcount;
+	newkey->sigcount = kept;
+	newkey->revoked = key->revoked;
+	for (i = 0; i < kept; i++) {
+		state->sigs[state->sigcount++] = state->tmp[i].keyid;
+	}
+
+	for (subkeys = key->subkeys; subkeys != NULL;
+			subkeys = subkeys->next) {
+		if (get_packetid(subkeys->packet, &keyid) != ONAK_E_OK) {
+			continue;
+		}
+		if (!graph_grow((void **) &state->subkeys,
+				&state->subkeysize, state->subkeycount + 1,
+				sizeof(*state->subkeys))) {
+			state->failed = true;
+			return !state->failed;
+		}
+		state->subkeys[state->subkeycount].keyid = keyid;
+		state->subkeys[state->subkeycount].index = state->keycount;
+		state->subkeycount++;
+	}
+
+	state->keycount++;
+	if ((state->keycount % 100000) == 0) {
+		logthing(LOGTHING_INFO, "Read %zu keys for graph.",
+				state->keycount);
+	}
+
+	return true;
+}
+
+static bool graph_write(FILE *f, const void *data, size_t len)
+{
+	static const uint8_t pad[8];
+
+	if (len > 0 && fwrite(data, len, 1, f) != 1) {
+		return false;
+	}
+	if (GRAPH_PAD(len) != len &&
+			fwrite(pad, GRAPH_PAD(len) - len, 1, f) != 1) {
+		return false;
+	}
+
+	return true;
+}
+
+onak_status_t onak_graph_build(struct onak_dbctx *dbctx, const char *file)
+{
+	struct graph_build_ctx state;
+	struct graph_build_id *byid = NULL, *found;
+	struct graph_build_key *key;
+	struct graph_header header;
+	uint64_t *keyids = NULL;
+	uint32_t *sigstart = NULL, *sigs = NULL;
+	uint32_t *signstart = NULL, *signs = NULL;
+	uint8_t *flags = NULL;
+	size_t *rows = NULL;
+	size_t nodes, edges, i, j, node;
+	char *tmpfile = NULL;
+	FILE *f = NULL;
+	onak_status_t ret = ONAK_E_NOMEM;
+
+	memset(&state, 0, sizeof(state));
+	dbctx->iterate_keys(dbctx, graph_build_add, &state);
+	if (state.failed) {
+		logthing(LOGTHING_ERROR, "Couldn't allocate memory for graph.");
+		goto out;
+	}
+	if (state.keycount == 0) {
+		logthing(LOGTHING_ERROR, "No keys found to build graph from; "
+				"the backend may not support iterating keys.");
+	}
+
+	/*
+	 * Every key, and every key that's signed one, gets a node, numbered
+	 * in keyid order.
+	 */
+	keyids = malloc((state.keycount + state.sigcount + 1) *
+			sizeof(*keyids));
+	byid = malloc((state.keycount + 1) * sizeof(*byid));
+	if (keyids == NULL || byid == NULL) {
+		goto out;
+	}
+	for (i = 0; i < state.keycount; i++) {
+		keyids[i] = byid[i].keyid = state.keys[i].keyid;
+		byid[i].index = i;
+	}
+	memcpy(&keyids[state.keycount], state.sigs,
+			state.sigcount * sizeof(*keyids));
+	qsort(keyids, state.keycount + state.sigcount, sizeof(*keyids),
+			graph_keyid_cmp);
+	for (i = nodes = 0; i < state.keycount + state.sigcount; i++) {
+		if (nodes == 0 || keyids[nodes - 1] != keyids[i]) {
+			keyids[nodes++] = keyids[i];
+		}
+	}
+	qsort(byid, state.keycount, sizeof(*byid), graph_id_cmp);
+	qsort(state.subkeys, state.subkeycount, sizeof(*state.subkeys),
+			graph_id_cmp);
+
+	/*
+	 * Find the key each node gets its signatures from. If there's more
+	 * than one key with the same keyid we use the first one we saw; a
+	 * subkey uses its primary key.
+	 */
+	rows = malloc((nodes + 1) * sizeof(*rows));
+	sigstart = malloc((nodes + 1) * sizeof(*sigstart));
+	signstart = calloc(nodes + 1, sizeof(*signstart));
+	flags = calloc(nodes + 1, sizeof(*flags));
+	if (rows == NULL || sigstart == NULL || signstart == NULL ||
+			flags == NULL) {
+		goto out;
+	}
+	edges = 0;
+	for (i = 0; i < nodes; i++) {
+		found = graph_id_search(byid, state.keycount, keyids[i]);
+		if (found == NULL) {
+			found = graph_id_search(state.subkeys,
+					state.subkeycount, keyids[i]);
+		}
+		sigstart[i] = edges;
+		rows[i] = SIZE_MAX;
+		if (found != NULL) {
+			rows[i] = found->index;
+			key = &state.keys[found->index];
+			flags[i] = ONAK_GRAPH_PRESENT;
+			if (key->revoked) {
+				flags[i] |= ONAK_GRAPH_REVOKED;
+			}
+			edges += key->sigcount;
+		}
+		if (nodes >= UINT32_MAX || edges >= UINT32_MAX) {
+			logthing(LOGTHING_ERROR,
+				"Too many keys or signatures for graph.");
+			ret = ONAK_E_UNSUPPORTED_FEATURE;
+			goto out;
+		}
+	}
+	sigstart[nodes] = edges;
+
+	sigs = malloc((edges + 1) * sizeof(*sigs));
+	signs = malloc((edges + 1) * sizeof(*signs));
+	if (sigs == NULL || signs == NULL) {
+		goto out;
+	}
+	for (i = 0; i < nodes; i++) {
+		if (rows[i] == SIZE_MAX) {
+			continue;
+		}
+		key = &state.keys[rows[i]];
+		for (j = 0; j < key->sigcount; j++) {
+			node = graph_search(keyids, nodes,
+					state.sigs[key->sigstart + j]);
+			sigs[sigstart[i] + j] = node;
+			signstart[node + 1]++;
+		}
+	}
+
+	/* The signs lists are just the sigs lists turned around */
+	for (i = 0; i < nodes; i++) {
+		signstart[i + 1] += signstart[i];
+	}
+	for (i = 0; i < nodes; i++) {
+		for (j = sigstart[i]; j < sigstart[i + 1]; j++) {
+			signs[signstart[sigs[j]]++] = i;
+		}
+	}
+	memmove(&signstart[1], signstart, nodes * sizeof(*signstart));
+	signstart[0] = 0;
+
+	tmpfile = malloc(strlen(file) + 5);
+	if (tmpfile == NULL) {
+		goto out;
+	}
+	sprintf(tmpfile, "%s.tmp", file);
+	f = fopen(tmpfile, "w");
+	if (f == NULL) {
+		logthing(LOGTHING_ERROR, "Couldn't open %s: %s", tmpfile,
+				strerror(errno));
+		ret = ONAK_E_IO_ERROR;
+		goto out;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, GRAPH_MAGIC, sizeof(GRAPH_MAGIC));
+	header.version = GRAPH_VERSION;
+	header.byteorder = GRAPH_BYTEORDER;
+	header.nodes = nodes;
+	header.edges = edges;
+	header.built = time(NULL);
+
+	if (!graph_write(f, &header, sizeof(header)) ||
+		!graph_write(f, keyids, nodes * sizeof(*keyids)) ||
+		!graph_write(f, sigstart, (nodes + 1) * sizeof(*sigstart)) ||
+		!graph_write(f, sigs, edges * sizeof(*sigs)) ||
+		!graph_write(f, signstart, (nodes + 1) * sizeof(*signstart)) ||
+		!graph_write(f, signs, edges * sizeof(*signs)) ||
+		!graph_write(f, flags, nodes * sizeof(*flags)) ||
+		fclose(f) != 0) {
+		logthing(LOGTHING_ERROR, "Couldn't write %s: %s", tmpfile,
+				strerror(errno));
+		f = NULL;
+		unlink(tmpfile);
+		ret = ONAK_E_IO_ERROR;
+		goto out;
+	}
+	f = NULL;
+
+	if (rename(tmpfile, file) != 0) {
+		logthing(LOGTHING_ERROR, "Couldn't rename %s to %s: %s",
+				tmpfile, file, strerror(errno));
+		unlink(tmpfile);
+		ret = ONAK_E_IO_ERROR;
+		goto out;
+	}
+
+	logthing(LOGTHING_NOTICE,
+		"Built graph of %zu keys with %zu nodes and %zu signatures.",
+		state.keycount, nodes, edges);
+	ret = ONAK_E_OK;
+
+out:
+	if (f != NULL) {
+		fclose(f);
+		unlink(tmpfile);
+	}
+	free(tmpfile);
+	free(flags);
+	free(signs);
+	free(signstart);
+	free(sigs);
+	free(sigstart);
+	free(rows);
+	free(byid);
+	free(keyids);
+	free(state.tmp);
+	free(state.subkeys);
+	free(state.sigs);
+	free(state.keys);
+
+	return ret;
+}
+
+onak_status_t onak_graph_open(const char *file, struct onak_graph **graph)
+{
+	struct onak_graph *newgraph;
+	struct graph_header *header;
+	size_t offsets[GRAPH_SECTIONS];
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		return ONAK_E_NOT_FOUND;
+	}
+	if (fstat(fd, &st) < 0 ||
+			st.st_size < (off_t) sizeof(struct graph_header)) {
+		close(fd);
+		return ONAK_E_IO_ERROR;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return ONAK_E_IO_ERROR;
+	}
+
+	header = map;
+	if (memcmp(header->magic, GRAPH_MAGIC, sizeof(GRAPH_MAGIC)) != 0 ||
+			header->version != GRAPH_VERSION ||
+			header->byteorder != GRAPH_BYTEORDER) {
+		munmap(map, st.st_size);
+		return ONAK_E_UNKNOWN_VER;
+	}
+	if (header->nodes >= UINT32_MAX || header->edges >= UINT32_MAX ||
+			graph_layout(header->nodes, header->edges, offsets) !=
+			(size_t) st.st_size) {
+		munmap(map, st.st_size);
+		return ONAK_E_IO_ERROR;
+	}
+
+	newgraph = calloc(1, sizeof(*newgraph));
+	if (newgraph == NULL) {
+		munmap(map, st.st_size);
+		return ONAK_E_NOMEM;
+	}
+	newgraph->map = map;
+	newgraph->maplen = st.st_size;
+	newgraph->nodes = header->nodes;
+	newgraph->edges = header->edges;
+	newgraph->keyids = (uint64_t *) ((uint8_t *) map +
+			offsets[GRAPH_KEYIDS]);
+	newgraph->sigstart = (uint32_t *) ((uint8_t *) map +
+			offsets[GRAPH_SIGSTART]);
+	newgraph->sigs = (uint32_t *) ((uint8_t *) map +
+			offsets[GRAPH_SIGS]);
+	newgraph->signstart = (uint32_t *) ((uint8_t *) map +
+			offsets[GRAPH_SIGNSTART]);
+	newgraph->signs = (uint32_t *) ((uint8_t *) map +
+			offsets[GRAPH_SIGNS]);
+	newgraph->flags = (uint8_t *) map + offsets[GRAPH_FLAGS];
+
+	if (newgraph->sigstart[newgraph->nodes] != newgraph->edges ||
+			newgraph->signstart[newgraph->nodes] !=
+			newgraph->edges) {
+		onak_graph_close(newgraph);
+		return ONAK_E_IO_ERROR;
+	}
+
+	*graph = newgraph;
+
+	return ONAK_E_OK;
+}
+
+void onak_graph_close(struct onak_graph *graph)
+{
+	if (graph != NULL) {
+		munmap(graph->map, graph->maplen);
+		free(graph);
+	}
+}
+
+/**
+ * struct graph_bfs - State for breadth first searches of the graph.
+ * @mark: The search that last reached each node.
+ * @queue: The nodes the search has reached, in the order it reached them.
+ * @search: The number of the current search.
+ *
+ * Each thread has its own, so they can all search the graph at once.
+ */
+struct graph_bfs {
+	uint32_t *mark;
+	uint32_t *queue;
+	uint32_t search;
+};
+
+/*
+ * Breadth first search from a node, following the signatures on each node
+ * or the nodes each has signed, and only visiting nodes set in allowed if
+ * it's not NULL. Returns the distance to the furthest node reached and
+ * stores that node in far. If levels isn't NULL it's filled in with where
+ * the nodes at each distance start in bfs->queue, plus the end of the last
+ * distance; it needs room for the number of nodes plus one.
+ */
+static uint32_t graph_bfs(const struct onak_graph *graph,
+		struct graph_bfs *bfs, uint32_t node, bool signs,
+		const uint8_t *allowed, uint32_t *far, uint32_t *levels)
+{
+	const uint32_t *start = signs ? graph->signstart : graph->sigstart;
+	const uint32_t *adj = signs ? graph->signs : graph->sigs;
+	uint32_t head, tail, levelend, distance, cur, next, i;
+
+	if (++bfs->search == 0) {
+		memset(bfs->mark, 0, graph->nodes * sizeof(*bfs->mark));
+		bfs->search = 1;
+	}
+	bfs->mark[node] = bfs->search;
+	bfs->queue[0] = node;
+	head = distance = 0;
+	tail = levelend = 1;
+	*far = node;
+	if (levels != NULL) {
+		levels[0] = 0;
+	}
+
+	while (head < tail) {
+		if (head == levelend) {
+			distance++;
+			levelend = tail;
+			*far = bfs->queue[head];
+			if (levels != NULL) {
+				levels[distance] = head;
+			}
+		}
+		cur = bfs->queue[head++];
+		for (i = start[cur]; i < start[cur + 1]; i++) {
+			next = adj[i];
+			if (bfs->mark[next] != bfs->search &&
+					(allowed == NULL || allowed[next])) {
+				bfs->mark[next] = bfs->search;
+				bfs->queue[tail++] = next;
+			}
+		}
+	}
+	if (levels != NULL) {
+		levels[distance + 1] = tail;
+	}
+
+	return distance;
+}
+
+/**
+ * struct graph_ecc - A set of searches to spread over several threads.
+ * @graph: The graph we're searching.
+ * @allowed: If not NULL, the only nodes the searches may visit.
+ * @nodes: The nodes to search from, or NULL to search from every node.
+ * @count: The number of searches.
+ * @sigcount: The searches before this follow signatures, the rest follow
+ *            the keys each node has signed.
+ * @lock: Protects @next and @best.
+ * @next: The next search to hand out.
+ * @best: The longest path the searches have found.
+ * @bestsearch: The search that found @best, so ties are broken the same
+ *              way however the searches are spread over the threads.
+ */
+struct graph_ecc {
+	const struct onak_graph *graph;
+	const uint8_t *allowed;
+	const uint32_t *nodes;
+	uint32_t count;
+	uint32_t sigcount;
+	pthread_mutex_t lock;
+	uint32_t next;
+	struct onak_graph_path best;
+	uint32_t bestsearch;
+};
+
+struct graph_ecc_thread {
+	pthread_t thread;
+	struct graph_ecc *ecc;
+	struct graph_bfs bfs;
+};
+
+static void *graph_ecc_worker(void *arg)
+{
+	struct graph_ecc_thread *thread = arg;
+	struct graph_ecc *ecc = thread->ecc;
+	struct onak_graph_path best;
+	uint32_t bestsearch = UINT32_MAX;
+	uint32_t search, node, far, distance;
+	bool signs;
+
+	memset(&best, 0, sizeof(best));
+	while (true) {
+		pthread_mutex_lock(&ecc->lock);
+		search = ecc->next;
+		if (search < ecc->count) {
+			ecc->next++;
+		}
+		pthread_mutex_unlock(&ecc->lock);
+
+		if (search >= ecc->count) {
+			break;
+		}
+		if (ecc->nodes == NULL && (search % 100000) == 0 &&
+				search > 0) {
+			logthing(LOGTHING_INFO,
+				"Searched from %" PRIu32 " of %" PRIu32
+				" nodes.", search, ecc->count);
+		}
+
+		node = (ecc->nodes != NULL) ? ecc->nodes[search] : search;
+		signs = (search >= ecc->sigcount);
+		distance = graph_bfs(ecc->graph, &thread->bfs, node, signs,
+				ecc->allowed, &far, NULL);
+		/*
+		 * We get the searches in order, so the first longest one we
+		 * find is the earliest.
+		 */
+		if (distance > best.length) {
+			best.start = signs ? node : far;
+			best.end = signs ? far : node;
+			best.length = distance;
+			bestsearch = search;
+		}
+	}
+
+	pthread_mutex_lock(&ecc->lock);
+	if (bestsearch != UINT32_MAX &&
+			(best.length > ecc->best.length ||
+			 (best.length == ecc->best.length &&
+			  bestsearch < ecc->bestsearch))) {
+		ecc->best = best;
+		ecc->bestsearch = bestsearch;
+	}
+	pthread_mutex_unlock(&ecc->lock);
+
+	return NULL;
+}
+
+/*
+ * Run a set of searches, spread over the threads we have (including this
+ * one).
+ */
+static void graph_ecc_run(struct graph_ecc *ecc,
+		struct graph_ecc_thread *threads, int nthreads)
+{
+	int started, i, ret;
+
+	ecc->next = 0;
+	memset(&ecc->best, 0, sizeof(ecc->best));
+	ecc->bestsearch = UINT32_MAX;
+
+	if ((uint32_t) nthreads > ecc->count) {
+		nthreads = ecc->count;
+	}
+	for (started = 1; started < nthreads; started++) {
+		threads[started].ecc = ecc;
+		ret = pthread_create(&threads[started].thread, NULL,
+				graph_ecc_worker, &threads[started]);
+		if (ret != 0) {
+			logthing(LOGTHING_ERROR,
+				"Couldn't start graph search thread: %s",
+				strerror(ret));
+			break;
+		}
+	}
+	threads[0].ecc = ecc;
+	graph_ecc_worker(&threads[0]);
+	for (i = 1; i < started; i++) {
+		pthread_join(threads[i].thread, NULL);
+	}
+}
+
+static void graph_threads_free(struct graph_ecc_thread *threads,
+		int nthreads)
+{
+	int i;
+
+	for (i = 0; i < nthreads; i++) {
+		free(threads[i].bfs.mark);
+		free(threads[i].bfs.queue);
+	}
+	free(threads);
+}
+
+/*
+ * Set up the search state for each thread. Returns how many threads we
+ * could allocate it for, which is 0 if we couldn't even manage one.
+ */
+static int graph_threads_init(const struct onak_graph *graph, int nthreads,
+		struct graph_ecc_thread **threads)
+{
+	struct graph_ecc_thread *newthreads;
+	int i;
+
+	if (nthreads < 1) {
+		nthreads = 1;
+	}
+	newthreads = calloc(nthreads, sizeof(*newthreads));
+	if (newthreads == NULL) {
+		return 0;
+	}
+	for (i = 0; i < nthreads; i++) {
+		newthreads[i].bfs.mark = calloc(graph->nodes + 1,
+				sizeof(*newthreads[i].bfs.mark));
+		newthreads[i].bfs.queue = malloc((graph->nodes + 1) *
+				sizeof(*newthreads[i].bfs.queue));
+		if (newthreads[i].bfs.mark == NULL ||
+				newthreads[i].bfs.queue == NULL) {
+			free(newthreads[i].bfs.mark);
+			free(newthreads[i].bfs.queue);
+			break;
+		}
+	}
+	if (i == 0) {
+		free(newthreads);
+		return 0;
+	}
+	if (i < nthreads) {
+		logthing(LOGTHING_ERROR,
+			"Couldn't allocate memory for %d graph search threads;"
+			" using %d.", nthreads, i);
+	}
+	*threads = newthreads;
+
+	return i;
+}
+
+onak_status_t onak_graph_diameter(const struct onak_graph *graph,
+		int threads, struct onak_graph_path *path)
+{
+	struct graph_ecc_thread *state;
+	struct graph_ecc ecc;
+	int nthreads;
+
+	nthreads = graph_threads_init(graph, threads, &state);
+	if (nthreads == 0) {
+		return ONAK_E_NOMEM;
+	}
+
+	memset(&ecc, 0, sizeof(ecc));
+	ecc.graph = graph;
+	ecc.count = ecc.sigcount = graph->nodes;
+	pthread_mutex_init(&ecc.lock, NULL);
+	graph_ecc_run(&ecc, state, nthreads);
+	pthread_mutex_destroy(&ecc.lock);
+	graph_threads_free(state, nthreads);
+
+	*path = ecc.best;
+
+	return ONAK_E_OK;
+}
+
+onak_status_t onak_graph_diameter_bounded(const struct onak_graph *graph,
+		int threads, uint32_t seed, struct onak_graph_path *path)
+{
+	struct graph_ecc_thread *state;
+	struct graph_ecc ecc;
+	struct graph_bfs *bfs;
+	struct onak_graph_path best;
+	uint8_t *allowed = NULL;
+	uint32_t *levels = NULL, *fwd = NULL, *fwdlevels = NULL;
+	uint32_t *bwd = NULL, *bwdlevels = NULL, *jobs = NULL;
+	uint32_t fwdecc, bwdecc, fwdfar, bwdfar, far, distance;
+	uint32_t centre, degree, maxdegree, setsize, searches, count;
+	uint32_t i, node;
+	int nthreads;
+	onak_status_t ret = ONAK_E_NOMEM;
+
+	nthreads = graph_threads_init(graph, threads, &state);
+	if (nthreads == 0) {
+		return ONAK_E_NOMEM;
+	}
+	bfs = &state[0].bfs;
+
+	allowed = calloc(graph->nodes + 1, sizeof(*allowed));
+	levels = malloc((graph->nodes + 1) * sizeof(*levels));
+	if (allowed == NULL || levels == NULL) {
+		goto out;
+	}
+
+	/*
+	 * The strongly connected set is everything we can both reach from
+	 * the seed and get to the seed from.
+	 */
+	distance = graph_bfs(graph, bfs, seed, true, NULL, &far, levels);
+	for (i = 0; i < levels[distance + 1]; i++) {
+		allowed[bfs->queue[i]] = 1;
+	}
+	distance = graph_bfs(graph, bfs, seed, false, NULL, &far, levels);
+	for (i = 0; i < levels[distance + 1]; i++) {
+		allowed[bfs->queue[i]] |= 2;
+	}
+
+	/*
+	 * Base the bounds on the best connected key in the set; a search out
+	 * from it reaches everything else quickly, which keeps them tight.
+	 */
+	setsize = maxdegree = 0;
+	centre = seed;
+	for (node = 0; node < graph->nodes; node++) {
+		allowed[node] = (allowed[node] == 3);
+		if (!allowed[node]) {
+			continue;
+		}
+		setsize++;
+		degree = (graph->sigstart[node + 1] - graph->sigstart[node]) +
+			(graph->signstart[node + 1] - graph->signstart[node]);
+		if (degree > maxdegree) {
+			maxdegree = degree;
+			centre = node;
+		}
+	}
+
+	fwd = malloc(setsize * sizeof(*fwd));
+	fwdlevels = malloc((setsize + 1) * sizeof(*fwdlevels));
+	bwd = malloc(setsize * sizeof(*bwd));
+	bwdlevels = malloc((setsize + 1) * sizeof(*bwdlevels));
+	jobs = malloc(setsize * 2 * sizeof(*jobs));
+	if (fwd == NULL || fwdlevels == NULL || bwd == NULL ||
+			bwdlevels == NULL || jobs == NULL) {
+		goto out;
+	}
+
+	fwdecc = graph_bfs(graph, bfs, centre, true, allowed, &fwdfar,
+			fwdlevels);
+	memcpy(fwd, bfs->queue, setsize * sizeof(*fwd));
+	bwdecc = graph_bfs(graph, bfs, centre, false, allowed, &bwdfar,
+			bwdlevels);
+	memcpy(bwd, bfs->queue, setsize * sizeof(*bwd));
+
+	if (fwdecc >= bwdecc) {
+		best.start = centre;
+		best.end = fwdfar;
+		best.length = fwdecc;
+	} else {
+		best.start = bwdfar;
+		best.end = centre;
+		best.length = bwdecc;
+	}
+	logthing(LOGTHING_INFO,
+		"Strongly connected set has %" PRIu32 " nodes; paths of at "
+		"least %" PRIu32 " and at most %" PRIu32 " steps.",
+		setsize, best.length,
+		2 * ((fwdecc > bwdecc) ? fwdecc : bwdecc));
+
+	memset(&ecc, 0, sizeof(ecc));
+	ecc.graph = graph;
+	ecc.allowed = allowed;
+	ecc.nodes = jobs;
+	pthread_mutex_init(&ecc.lock, NULL);
+
+	/*
+	 * Any path between keys that are both within i - 1 steps of the
+	 * centre (going into it and coming out of it respectively) is at most
+	 * 2(i - 1) steps long. So we work inwards a level at a time, checking
+	 * the longest path out of each key i steps in and into each key i
+	 * steps out, and once we've found one at least that long there's no
+	 * need to look further.
+	 */
+	searches = 2;
+	for (i = (fwdecc > bwdecc) ? fwdecc : bwdecc;
+			i > 0 && best.length < 2 * i; i--) {
+		count = 0;
+		if (i <= fwdecc) {
+			memcpy(jobs, &fwd[fwdlevels[i]],
+				(fwdlevels[i + 1] - fwdlevels[i]) *
+				sizeof(*jobs));
+			count = fwdlevels[i + 1] - fwdlevels[i];
+		}
+		ecc.sigcount = count;
+		if (i <= bwdecc) {
+			memcpy(&jobs[count], &bwd[bwdlevels[i]],
+				(bwdlevels[i + 1] - bwdlevels[i]) *
+				sizeof(*jobs));
+			count += bwdlevels[i + 1] - bwdlevels[i];
+		}
+		ecc.count = count;
+		graph_ecc_run(&ecc, state, nthreads);
+		searches += count;
+		if (ecc.best.length > best.length) {
+			best = ecc.best;
+		}
+		logthing(LOGTHING_DEBUG,
+			"Level %" PRIu32 ": %" PRIu32 " searches, longest "
+			"path %" PRIu32 " steps.", i, count, best.length);
+	}
+	pthread_mutex_destroy(&ecc.lock);
+	logthing(LOGTHING_INFO,
+		"Found %" PRIu32 " step diameter with %" PRIu32 " searches.",
+		best.length, searches);
+
+	*path = best;
+	ret = ONAK_E_OK;
+
+out:
+	free(jobs);
+	free(bwdlevels);
+	free(bwd);
+	free(fwdlevels);
+	free(fwd);
+	free(levels);
+	free(allowed);
+	graph_threads_free(state, nthreads);
+
+	return ret;
+}
@@ -0,0 +1,147 @@
+/*
+ * graph.h - Compact snapshot of the web of trust graph.
+ *
+ * Copyright 2026 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GRAPH_H__
+#define __GRAPH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "keydb.h"
+#include "onak.h"
+
+/** Returned by onak_graph_find() for a keyid that isn't in the graph. */
+#define ONAK_GRAPH_NONE		UINT32_MAX
+
+/** The key is revoked. */
+#define ONAK_GRAPH_REVOKED	1
+/** We have the key, rather than just signatures made by it. */
+#define ONAK_GRAPH_PRESENT	2
+
+/**
+ * @brief A web of trust graph snapshot mapped into memory
+ *
+ * Every key in the DB, and every key that's made a signature on one, is a
+ * node, numbered from 0 in keyid order. The signatures on each node and the
+ * nodes each one signs are held in compressed sparse row form; the
+ * signatures on node n are sigs[sigstart[n]] to sigs[sigstart[n + 1] - 1].
+ * Signatures by a subkey are treated as made by a node for the subkey that
+ * has the same signatures as its primary key, as with fetching the key by
+ * the subkey's keyid.
+ */
+struct onak_graph {
+	/** The number of nodes in the graph. */
+	uint32_t nodes;
+	/** The number of signatures in the graph. */
+	uint32_t edges;
+	/** The keyid of each node, sorted. */
+	const uint64_t *keyids;
+	/** ONAK_GRAPH_* flags for each node. */
+	const uint8_t *flags;
+	/** Where each node's signatures start in @a sigs; nodes + 1 entries. */
+	const uint32_t *sigstart;
+	/** The nodes that have signed each node. */
+	const uint32_t *sigs;
+	/** Where each node's signees start in @a signs; nodes + 1 entries. */
+	const uint32_t *signstart;
+	/** The nodes that each node has signed. */
+	const uint32_t *signs;
+	/** The mapped file. */
+	void *map;
+	/** The length of the mapped file. */
+	size_t maplen;
+};
+
+/**
+ * @brief A longest shortest path through the graph
+ *
+ * @a start signs the next key on the path, which signs the one after, and
+ * so on until @a end.
+ */
+struct onak_graph_path {
+	/** The node the path starts at. */
+	uint32_t start;
+	/** The node the path ends at. */
+	uint32_t end;
+	/** The number of signatures on the path. */
+	uint32_t length;
+};
+
+/**
+ * @brief Build a graph snapshot from all the keys in a DB
+ * @param dbctx The DB to read the keys from
+ * @param file The file to write the snapshot to
+ *
+ * Makes one pass over the DB with iterate_keys and writes the snapshot out
+ * to a temporary file, then renames it into place so anything using an
+ * existing snapshot isn't disturbed.
+ */
+onak_status_t onak_graph_build(struct onak_dbctx *dbctx, const char *file);
+
+/**
+ * @brief Map a graph snapshot into memory
+ * @param file The snapshot file
+ * @param graph Set to the mapped graph on success
+ */
+onak_status_t onak_graph_open(const char *file, struct onak_graph **graph);
+
+/**
+ * @brief Unmap and free a graph snapshot
+ * @param graph The graph to close
+ */
+void onak_graph_close(struct onak_graph *graph);
+
+/**
+ * @brief Find the node for a keyid
+ * @param graph The graph to look in
+ * @param keyid The keyid to look for
+ *
+ * Returns the node number, or ONAK_GRAPH_NONE if the key isn't in the graph.
+ */
+uint32_t onak_graph_find(const struct onak_graph *graph, uint64_t keyid);
+
+/**
+ * @brief Find the diameter of the graph
+ * @param graph The graph to search
+ * @param threads How many threads to spread the searches over
+ * @param path Set to the longest shortest path in the graph
+ *
+ * Does a breadth first search from every node, so the answer is exact but
+ * it takes time proportional to the number of nodes times the number of
+ * signatures. Revoked keys are included, as they are by furthestkey().
+ */
+onak_status_t onak_graph_diameter(const struct onak_graph *graph,
+		int threads, struct onak_graph_path *path);
+
+/**
+ * @brief Find the diameter of the strongly connected set around a node
+ * @param graph The graph to search
+ * @param threads How many threads to spread the searches over
+ * @param seed A node in the strongly connected set
+ * @param path Set to the longest shortest path in the set
+ *
+ * Only considers the keys that can both reach and be reached from @a seed
+ * (the strong set, if @a seed is in it). Within that set it uses the
+ * bounds from a search out of a well connected node to stop once no longer
+ * path can exist (the DiFUB algorithm), which usually needs a small
+ * fraction of the searches onak_graph_diameter() does.
+ */
+onak_status_t onak_graph_diameter_bounded(const struct onak_graph *graph,
+		int threads, uint32_t seed, struct onak_graph_path *path);
+
+#endif /* __GRAPH_H__ */
@@ -21,87 +21,157 @@
 #include "onak.h"
 #include "openpgp.h"
 
-onak_status_t onak_hash(struct onak_hash_data *data, uint8_t *hash)
+onak_status_t onak_hash_init(struct onak_hash_ctx *ctx, uint8_t hashtype)
 {
-	struct onak_hash_ctx hash_ctx;
-	int i;
-
-	if (data == NULL) {
-		return ONAK_E_INVALID_PARAM;
+	switch (hashtype) {
+	case OPENPGP_HASH_MD5:
+		md5_init(&ctx->md5);
+		break;
+	case OPENPGP_HASH_SHA1:
+		sha1_init(&ctx->sha1);
+		break;
+	case OPENPGP_HASH_SHA1X:
+		sha1x_init(&ctx->sha1x);
+		break;
+#ifdef HAVE_NETTLE
+	case OPENPGP_HASH_RIPEMD160:
+		ripemd160_init(&ctx->ripemd160);
+		break;
+	case OPENPGP_HASH_SHA224:
+		sha224_init(&ctx->sha224);
+		break;
+	case OPENPGP_HASH_SHA256:
+		sha256_init(&ctx->sha256);
+		break;
+	case OPENPGP_HASH_SHA384:
+		sha384_init(&ctx->sha384);
+		break;
+	case OPENPGP_HASH_SHA512:
+		sha512_init(&ctx->sha512);
+		break;
+#endif
+	default:
+		return ONAK_E_UNSUPPORTED_FEATURE;
 	}
 
-	if (data->chunks > MAX_HASH_CHUNKS) {
-		return ONAK_E_INVALID_PARAM;
+	ctx->type = hashtype;
+
+	return ONAK_E_OK;
+}
+
+void onak_hash_update(struct onak_hash_ctx *ctx, size_t len, uint8_t *data)
+{
+	switch (ctx->type) {
+	case OPENPGP_HASH_MD5:
+		md5_update(&ctx->md5, len, data);
+		break;
+	case OPENPGP_HASH_SHA1:
+		sha1_update(&ctx->sha1, len, data);
+		break;
+	case OPENPGP_HASH_SHA1X:
+		sha1x_update(&ctx->sha1x, len, data);
+		break;
+#ifdef HAVE_NETTLE
+	case OPENPGP_HASH_RIPEMD160:
+		ripemd160_update(&ctx->ripemd160, len, data);
+		break;
+	case OPENPGP_HASH_SHA224:
+		sha224_update(&ctx->sha224, len, data);
+		break;
+	case OPENPGP_HASH_SHA256:
+		sha256_update(&ctx->sha256, len, data);
+		break;
+	case OPENPGP_HASH_SHA384:
+		sha384_update(&ctx->sha384, len, data);
+		break;
+	case OPENPGP_HASH_SHA512:
+		sha512_update(&ctx->sha512, len, data);
+		break;
+#endif
 	}
+}
 
-	switch (data->hashtype) {
+void onak_hash_digest(struct onak_hash_ctx *ctx, uint8_t *hash)
+{
+	switch (ctx->type) {
 	case OPENPGP_HASH_MD5:
-		md5_init(&hash_ctx.md5);
-		for (i = 0; i < data->chunks; i++) {
-			md5_update(&hash_ctx.md5, data->len[i], data->data[i]);
-		}
-		md5_digest(&hash_ctx.md5, MD5_DIGEST_SIZE, hash);
+		md5_digest(&ctx->md5, MD5_DIGEST_SIZE, hash);
 		break;
 	case OPENPGP_HASH_SHA1:
-		sha1_init(&hash_ctx.sha1);
-		for (i = 0; i < data->chunks; i++) {
-			sha1_update(&hash_ctx.sha1, data->len[i], data->data[i]);
-		}
-		sha1_digest(&hash_ctx.sha1, SHA1_DIGEST_SIZE, hash);
+		sha1_digest(&ctx->sha1, SHA1_DIGEST_SIZE, hash);
 		break;
 	case OPENPGP_HASH_SHA1X:
-		sha1x_init(&hash_ctx.sha1x);
-		for (i = 0; i < data->chunks; i++) {
-			sha1x_update(&hash_ctx.sha1x, data->len[i], data->data[i]);
-		}
-		sha1x_digest(&hash_ctx.sha1x, SHA1X_DIGEST_SIZE, hash);
+		sha1x_digest(&ctx->sha1x, SHA1X_DIGEST_SIZE, hash);
 		break;
 #ifdef HAVE_NETTLE
 	case OPENPGP_HASH_RIPEMD160:
-		ripemd160_init(&hash_ctx.ripemd160);
-		for (i = 0; i < data->chunks; i++) {
-			ripemd160_update(&hash_ctx.ripemd160, data->len[i],
-				data->data[i]);
-		}
-		ripemd160_digest(&hash_ctx.ripemd160, RIPEMD160_DIGEST_SIZE,
+		ripemd160_digest(&ctx->ripemd160, RIPEMD160_DIGEST_SIZE,
 			hash);
 		break;
 	case OPENPGP_HASH_SHA224:
-		sha224_init(&hash_ctx.sha224);
-		for (i = 0; i < data->chunks; i++) {
-			sha224_update(&hash_ctx.sha224, data->len[i],
-				data->data[i]);
-		}
-		sha224_digest(&hash_ctx.sha224, SHA224_DIGEST_SIZE, hash);
+		sha224_digest(&ctx->sha224, SHA224_DIGEST_SIZE, hash);
 		break;
 	case OPENPGP_HASH_SHA256:
-		sha256_init(&hash_ctx.sha256);
-		for (i = 0; i < data->chunks; i++) {
-			sha256_update(&hash_ctx.sha256, data->len[i],
-				data->data[i]);
-		}
-		sha256_digest(&hash_ctx.sha256, SHA256_DIGEST_SIZE, hash);
+		sha256_digest(&ctx->sha256, SHA256_DIGEST_SIZE, hash);
 		break;
 	case OPENPGP_HASH_SHA384:
-		sha384_init(&hash_ctx.sha384);
-		for (i = 0; i < data->chunks; i++) {
-			sha384_update(&hash_ctx.sha384, data->len[i],
-				data->data[i]);
-		}
-		sha384_digest(&hash_ctx.sha384, SHA384_DIGEST_SIZE, hash);
+		sha384_digest(&ctx->sha384, SHA384_DIGEST_SIZE, hash);
 		break;
 	case OPENPGP_HASH_SHA512:
-		sha512_init(&hash_ctx.sha512);
-		for (i = 0; i < data->chunks; i++) {
-			sha512_update(&hash_ctx.sha512, data->len[i],
-				data->data[i]);
-		}
-		sha512_digest(&hash_ctx.sha512, SHA512_DIGEST_SIZE, hash);
+		sha512_digest(&ctx->sha512, SHA512_DIGEST_SIZE, hash);
 		break;
 #endif
-	default:
-		return ONAK_E_UNSUPPORTED_FEATURE;
 	}
+}
+
+onak_status_t onak_hash(struct onak_hash_data *data, uint8_t *hash)
+{
+	struct onak_hash_ctx hash_ctx;
+	onak_status_t ret;
+	int i;
+
+	if (data == NULL) {
+		return ONAK_E_INVALID_PARAM;
+	}
+
+	if (data->chunks > MAX_HASH_CHUNKS) {
+		return ONAK_E_INVALID_PARAM;
+	}
+
+	ret = onak_hash_init(&hash_ctx, data->hashtype);
+	if (ret != ONAK_E_OK) {
+		return ret;
+	}
+	for (i = 0; i < data->chunks; i++) {
+		onak_hash_update(&hash_ctx, data->len[i], data->data[i]);
+	}
+	onak_hash_digest(&hash_ctx, hash);
 
 	return ONAK_E_OK;
 }
+
+size_t onak_hash_length(uint8_t hashtype)
+{
+	switch (hashtype) {
+	case OPENPGP_HASH_MD5:
+		return MD5_DIGEST_SIZE;
+	case OPENPGP_HASH_SHA1:
+		return SHA1_DIGEST_SIZE;
+	case OPENPGP_HASH_SHA1X:
+		return SHA1X_DIGEST_SIZE;
+#ifdef HAVE_NETTLE
+	case OPENPGP_HASH_RIPEMD160:
+		return RIPEMD160_DIGEST_SIZE;
+	case OPENPGP_HASH_SHA224:
+		return SHA224_DIGEST_SIZE;
+	case OPENPGP_HASH_SHA256:
+		return SHA256_DIGEST_SIZE;
+	case OPENPGP_HASH_SHA384:
+		return SHA384_DIGEST_SIZE;
+	case OPENPGP_HASH_SHA512:
+		return SHA512_DIGEST_SIZE;
+#endif
+	default:
+		return 0;
+	}
+}
@@ -62,4 +62,37 @@ struct onak_hash_data {
 
 onak_status_t onak_hash(struct onak_hash_data *data, uint8_t *hash);
 
+/**
+ * onak_hash_init - Start an incremental hash calculation
+ * @ctx: The hash context to initialise
+ * @hashtype: The type of hash (OPENPGP_HASH_*)
+ *
+ * The context is a plain structure, so a partially completed hash can be
+ * copied and then finished more than once with different data.
+ */
+onak_status_t onak_hash_init(struct onak_hash_ctx *ctx, uint8_t hashtype);
+
+/**
+ * onak_hash_update - Add data to an incremental hash calculation
+ * @ctx: The hash context, set up by onak_hash_init
+ * @len: The length of the data
+ * @data: The data to add
+ */
+void onak_hash_update(struct onak_hash_ctx *ctx, size_t len, uint8_t *data);
+
+/**
+ * onak_hash_digest - Finish an incremental hash calculation
+ * @ctx: The hash context, set up by onak_hash_init
+ * @hash: Where to put the digest; must have room for onak_hash_length bytes
+ */
+void onak_hash_digest(struct onak_hash_ctx *ctx, uint8_t *hash);
+
+/**
+ * onak_hash_length - Get the length of the digest for a type of hash
+ * @hashtype: The type of hash (OPENPGP_HASH_*)
+ *
+ * Returns the digest length in bytes, or 0 if we don't support the hash.
+ */
+size_t onak_hash_length(uint8_t hashtype);
+
 #endif /* __HASH_HELPER_H__ */
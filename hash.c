@@ -16,6 +16,8 @@
  * this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,52 +25,51 @@
 #include "hash.h"
 #include "keystructs.h"
 #include "ll.h"
-#include "mem.h"
 #include "stats.h"
 
+/*
+ * Keys are allocated in slabs of HASH_SLAB_KEYS, so they're contiguous in
+ * memory, numbered in the order they're added and never move. The table
+ * itself is open addressed with linear probing and holds pointers into
+ * the slabs; it's doubled whenever it gets more than half full.
+ */
+#define HASH_SLAB_KEYS	4096
+#define HASH_MIN_SIZE	1024
+
 /**
- *	hashtable - the hash table array.
+ *	hashtable - the hash table array; NULL means an empty slot.
  */
-static struct ll *hashtable[HASHSIZE];
+static struct stats_key **hashtable;
 
 /**
- *	elements - the number of elements in the hash table.
+ *	hashsize - the number of slots in the hash table (a power of 2).
  */
-static unsigned long elements;
+static unsigned long hashsize;
 
 /**
- *	free_statskey - free an stats key structure.
- *	@key: The key to free.
- *
- *	Takes a stats key and frees the memory used by it and the linked list
- *	of sigs under it. Doesn't recurse into the list as it's assumed all the
- *	objects referenced also exist in the hash.
+ *	slabs - the arrays of keys the hash table points into.
  */
-static void free_statskey(struct stats_key *key)
-{
-	if (key != NULL) {
-		if (key->sigs != NULL) {
-			llfree(key->sigs, NULL);
-			key->sigs = NULL;
-		}
-		if (key->signs != NULL) {
-			llfree(key->signs, NULL);
-			key->signs = NULL;
-		}
-		free(key);
-	}
-}
+static struct stats_key **slabs;
+
+/**
+ *	slabcount - the number of slabs we have space for in slabs.
+ */
+static unsigned long slabcount;
+
+/**
+ *	elements - the number of elements in the hash table.
+ */
+static unsigned long elements;
 
 /**
  *	inithash - Initialize the hash ready for use.
  */
 void inithash(void)
 {
-	unsigned int i;
-
-	for (i = 0; i < HASHSIZE; i++) {
-		hashtable[i] = NULL;
-	}
+	hashtable = NULL;
+	hashsize = 0;
+	slabs = NULL;
+	slabcount = 0;
 	elements = 0;
 }
 
@@ -80,32 +81,90 @@ void inithash(void)
  */
 void destroyhash(void)
 {
-	int i;
-	struct ll *curll = NULL;
-
-	for (i = 0; i < HASHSIZE; i++) {
-		curll = hashtable[i];
-		/*
-		 * TODO: The problem is the object has pointers that
-		 * need freed too.
-		 */
-		llfree(curll, (void (*)(void *)) free_statskey);
-		hashtable[i] = NULL;
+	unsigned long i;
+
+	/*
+	 * The sigs and signs lists only point to other keys in the hash, so
+	 * we just need to free the lists themselves.
+	 */
+	for (i = 0; i < elements; i++) {
+		llfree(gethashelement(i)->sigs, NULL);
+		llfree(gethashelement(i)->signs, NULL);
 	}
-	elements = 0;
+	for (i = 0; i < slabcount; i++) {
+		free(slabs[i]);
+	}
+	free(slabs);
+	free(hashtable);
+	inithash();
 }
 
-/**
- *	addtohash - Adds a key to the hash.
- *	@key: The key to add.
- *
- *	Takes a key and stores it in the hash.
+/*
+ * Keyids are mostly random, but the ones we're given aren't always (e.g.
+ * v3 keys), so mix all the bits in before picking a slot.
  */
-void addtohash(struct stats_key *key)
+static unsigned long hashslot(struct stats_key **table, unsigned long size,
+		uint64_t keyid)
+{
+	unsigned long slot;
+
+	slot = (keyid * 0x9E3779B97F4A7C15ULL) >> 32;
+	slot &= size - 1;
+	while (table[slot] != NULL && table[slot]->keyid != keyid) {
+		slot = (slot + 1) & (size - 1);
+	}
+
+	return slot;
+}
+
+static bool growhash(void)
+{
+	struct stats_key **table;
+	unsigned long i, size;
+
+	size = hashsize ? hashsize * 2 : HASH_MIN_SIZE;
+	table = calloc(size, sizeof(*table));
+	if (table == NULL) {
+		return false;
+	}
+	for (i = 0; i < hashsize; i++) {
+		if (hashtable[i] != NULL) {
+			table[hashslot(table, size, hashtable[i]->keyid)] =
+				hashtable[i];
+		}
+	}
+	free(hashtable);
+	hashtable = table;
+	hashsize = size;
+
+	return true;
+}
+
+static struct stats_key *newstatskey(void)
 {
-	++elements;
-	hashtable[key->keyid & HASHMASK]=
-		lladd(hashtable[key->keyid & HASHMASK], key);
+	struct stats_key **newslabs;
+	unsigned long slab, count;
+
+	slab = elements / HASH_SLAB_KEYS;
+	if (slab >= slabcount) {
+		count = slabcount ? slabcount * 2 : 16;
+		newslabs = realloc(slabs, count * sizeof(*slabs));
+		if (newslabs == NULL) {
+			return NULL;
+		}
+		memset(&newslabs[slabcount], 0,
+				(count - slabcount) * sizeof(*slabs));
+		slabs = newslabs;
+		slabcount = count;
+	}
+	if (slabs[slab] == NULL) {
+		slabs[slab] = malloc(HASH_SLAB_KEYS * sizeof(struct stats_key));
+		if (slabs[slab] == NULL) {
+			return NULL;
+		}
+	}
+
+	return &slabs[slab][elements % HASH_SLAB_KEYS];
 }
 
 /**
@@ -119,35 +178,38 @@ void addtohash(struct stats_key *key)
 struct stats_key *createandaddtohash(uint64_t keyid)
 {
 	struct stats_key *tmpkey;
+	unsigned long slot;
+
+	/* Keep the table no more than half full */
+	if ((elements + 1) * 2 > hashsize && !growhash()) {
+		return NULL;
+	}
 
 	/*
 	 * Check if the key already exists and if not create and add it.
 	 */
-	tmpkey = findinhash(keyid);
-	if (tmpkey == NULL) {
-		tmpkey = malloc(sizeof(*tmpkey));
+	slot = hashslot(hashtable, hashsize, keyid);
+	if (hashtable[slot] == NULL) {
+		tmpkey = newstatskey();
+		if (tmpkey == NULL) {
+			return NULL;
+		}
 		memset(tmpkey, 0, sizeof(*tmpkey));
 		tmpkey->keyid = keyid;
-		addtohash(tmpkey);
+		hashtable[slot] = tmpkey;
+		elements++;
 	}
-	return tmpkey;
-}
 
-static int stats_key_cmp(struct stats_key *key, uint64_t *keyid)
-{
-	return !(key != NULL && key->keyid == *keyid);
+	return hashtable[slot];
 }
 
 struct stats_key *findinhash(uint64_t keyid)
 {
-	int (*p)(const void *, const void *);
-	struct ll *found;
-
-	p = (int (*)(const void *, const void *))stats_key_cmp;
-	if ((found = llfind(hashtable[keyid & HASHMASK], &keyid, p))==NULL) {
+	if (hashsize == 0) {
 		return NULL;
 	}
-	return found->object;
+
+	return hashtable[hashslot(hashtable, hashsize, keyid)];
 }
 
 unsigned long hashelements(void)
@@ -155,7 +217,7 @@ unsigned long hashelements(void)
 	return elements;
 }
 
-struct ll *gethashtableentry(unsigned int entry)
+struct stats_key *gethashelement(unsigned long entry)
 {
-	return hashtable[entry];
+	return &slabs[entry / HASH_SLAB_KEYS][entry % HASH_SLAB_KEYS];
 }
@@ -23,9 +23,6 @@
 #include "ll.h"
 #include "stats.h"
 
-#define HASHSIZE 1024
-#define HASHMASK 0x3FF
-
 /**
  *	inithash - Initialize the hash ready for use.
  *
@@ -42,21 +39,15 @@ void inithash(void);
  */
 void destroyhash(void);
 
-/**
- *	addtohash - Adds a key to the hash.
- *	@key: The key to add.
- *
- *	Takes a key and stores it in the hash.
- */
-void addtohash(struct stats_key *key);
-
 /**
  *	createandaddtohash - Creates a key and adds it to the hash.
  *	@keyid: The key to create and add.
  *
  *	Takes a key, checks if it exists in the hash and if not creates it
  *	and adds it to the hash. Returns the key from the hash whether it
- *	already existed or we just created it.
+ *	already existed or we just created it. Keys are never moved once
+ *	created, so the pointer remains valid until destroyhash() is called.
+ *	Returns NULL if we couldn't allocate memory for the key.
  */
 struct stats_key *createandaddtohash(uint64_t keyid);
 
@@ -76,12 +67,13 @@ struct stats_key *findinhash(uint64_t keyid);
 unsigned long hashelements(void);
 
 /**
- *	gethashtableentry - Returns an entry from the hash table.
- *	@entry: The entry to return. 0 <= entry < HASHSIZE must hold.
+ *	gethashelement - Returns an element from the hash.
+ *	@entry: The element to return. 0 <= entry < hashelements() must hold.
  *
- *	Gets a particular entry from the hash. Useful for doing something over
- *	all entries in the hash.
+ *	Elements are numbered in the order they were added to the hash, so
+ *	this can be used to do something over all of the keys in the hash,
+ *	including any that are added while doing so.
  */
-struct ll *gethashtableentry(unsigned int entry);
+struct stats_key *gethashelement(unsigned long entry);
 
 #endif /* __HASH_H__ */
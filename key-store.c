@@ -16,6 +16,9 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "build-config.h"
@@ -24,6 +27,7 @@
 #include "charfuncs.h"
 #include "key-store.h"
 #include "keystructs.h"
+#include "mem.h"
 #include "onak.h"
 #include "parsekey.h"
 
@@ -77,3 +81,80 @@ onak_status_t onak_read_openpgp_file(const char *file,
 
 	return res;
 }
+
+/**
+ *	onak_read_openpgp_file_raw - Reads a file of OpenPGP packets unparsed
+ *	@file: The file to open and read
+ *	@raw: The returned raw key data
+ *
+ *	As onak_read_openpgp_file, but returns the binary packet data rather
+ *	than parsing it. ASCII armored files are decoded. The caller should
+ *	release raw with free_raw_key.
+ *
+ *	We read rather than mmap() the file; keys are updated by truncating and
+ *	rewriting their file in place, which would leave a concurrent reader of
+ *	a mapping open to SIGBUS.
+ *
+ *	Returns a status code indicating any error.
+ */
+onak_status_t onak_read_openpgp_file_raw(const char *file,
+		struct openpgp_raw_key *raw)
+{
+	struct openpgp_packet_list *packets = NULL;
+	struct buffer_ctx buf;
+	struct stat sb;
+	onak_status_t res = ONAK_E_OK;
+	ssize_t count;
+	int fd;
+
+	memset(raw, 0, sizeof(*raw));
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		return (errno == ENOENT) ? ONAK_E_NOT_FOUND : ONAK_E_IO_ERROR;
+	}
+
+	if (fstat(fd, &sb) < 0 || sb.st_size == 0) {
+		close(fd);
+		return ONAK_E_IO_ERROR;
+	}
+
+	buf.offset = 0;
+	buf.size = sb.st_size;
+	buf.buffer = malloc(buf.size);
+	if (buf.buffer == NULL) {
+		close(fd);
+		return ONAK_E_NOMEM;
+	}
+	while (buf.offset < buf.size) {
+		count = read(fd, &buf.buffer[buf.offset],
+				buf.size - buf.offset);
+		if (count <= 0) {
+			break;
+		}
+		buf.offset += count;
+	}
+
+	/* See onak_read_openpgp_file for why we check the top bit. */
+	if (buf.offset == 0) {
+		res = ONAK_E_IO_ERROR;
+	} else if (!(buf.buffer[0] & 0x80)) {
+		lseek(fd, 0, SEEK_SET);
+		res = dearmor_openpgp_stream(file_fetchchar, &fd, &packets);
+		buf.offset = 0;
+		if (res == ONAK_E_OK) {
+			write_openpgp_stream(buffer_putchar, &buf, packets);
+		}
+		free_packet_list(packets);
+	}
+	close(fd);
+
+	if (res == ONAK_E_OK) {
+		raw->data = (uint8_t *) buf.buffer;
+		raw->length = buf.offset;
+		raw->storage = OPENPGP_RAW_MALLOC;
+	} else {
+		free(buf.buffer);
+	}
+
+	return res;
+}
@@ -38,4 +38,18 @@
 onak_status_t onak_read_openpgp_file(const char *file,
 		struct openpgp_packet_list **packets);
 
+/**
+ *	onak_read_openpgp_file_raw - Reads a file of OpenPGP packets unparsed
+ *	@file: The file to open and read
+ *	@raw: The returned raw key data
+ *
+ *	As onak_read_openpgp_file, but returns the binary packet data rather
+ *	than parsing it. ASCII armored files are decoded. The caller should
+ *	release raw with free_raw_key.
+ *
+ *	Returns a status code indicating any error.
+ */
+onak_status_t onak_read_openpgp_file_raw(const char *file,
+		struct openpgp_raw_key *raw);
+
 #endif /* __KEY_STORE_H__ */
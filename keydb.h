@@ -57,6 +57,14 @@ struct onak_dbctx {
  */
 	void (*endtrans)(struct onak_dbctx *);
 
+/**
+ * @brief Abort a transaction.
+ *
+ * Ends a transaction, discarding any changes made within it. This is
+ * optional; backends that can't roll back leave it NULL.
+ */
+	void (*aborttrans)(struct onak_dbctx *);
+
 /**
  * @brief Given a fingerprint fetch the key from storage.
  * @param fp The fingerprint to fetch.
@@ -133,6 +141,97 @@ struct onak_dbctx {
 			const struct skshash *hash,
 			struct openpgp_publickey **publickey);
 
+/**
+ * @brief Given a set of SKS hashes fetch the matching keys from storage.
+ * @param hashes The hashes to fetch.
+ * @param count The number of hashes.
+ * @param keys An array of count pointers to return the keys in.
+ * @return Number of keys returned.
+ *
+ * keys[i] is set to the key matching hashes[i], or left NULL if there is
+ * no such key. This is optional; backends that can't do better than
+ * calling fetch_key_skshash for each hash leave it NULL.
+ */
+	int (*fetch_keys_skshash)(struct onak_dbctx *,
+			const struct skshash *hashes, int count,
+			struct openpgp_publickey **keys);
+
+/**
+ * @brief Given a fingerprint fetch the stored key data without parsing it.
+ * @param fingerprint The fingerprint to fetch.
+ * @param raw Filled in with the key data.
+ * @param intrans  If we're already in a transaction.
+ * @return Number of keys returned.
+ *
+ * The raw equivalent of fetch_key; raw is set to the binary OpenPGP packets
+ * for the key, exactly as flatten_publickey() and write_openpgp_stream()
+ * would produce them, and must be released with free_raw_key(). Data
+ * borrowed from the backend is only valid until the next call on this
+ * context. raw is left empty if no key is found.
+ *
+ * This and the other raw fetch functions are optional; backends that
+ * can't avoid parsing the key leave them NULL, and callers should fall
+ * back to the parsed versions.
+ */
+	int (*fetch_key_raw)(struct onak_dbctx *,
+			struct openpgp_fingerprint *fingerprint,
+			struct openpgp_raw_key *raw,
+			bool intrans);
+
+/**
+ * @brief Given a fingerprint fetch the stored key data without parsing it.
+ * @param fingerprint The fingerprint to fetch.
+ * @param raw Filled in with the key data.
+ * @param intrans  If we're already in a transaction.
+ * @return Number of keys returned.
+ *
+ * The raw equivalent of fetch_key_fp, which may also match subkeys. If
+ * multiple keys match their packets are concatenated.
+ */
+	int (*fetch_key_fp_raw)(struct onak_dbctx *,
+			struct openpgp_fingerprint *fingerprint,
+			struct openpgp_raw_key *raw,
+			bool intrans);
+
+/**
+ * @brief Given a keyid fetch the stored key data without parsing it.
+ * @param keyid The keyid to fetch.
+ * @param raw Filled in with the key data.
+ * @param intrans  If we're already in a transaction.
+ * @return Number of keys returned.
+ *
+ * The raw equivalent of fetch_key_id. If multiple keys match their packets
+ * are concatenated.
+ */
+	int (*fetch_key_id_raw)(struct onak_dbctx *,
+			uint64_t keyid,
+			struct openpgp_raw_key *raw,
+			bool intrans);
+
+/**
+ * @brief Given an SKS hash fetch the stored key data without parsing it.
+ * @param hash The hash to search for.
+ * @param raw Filled in with the key data.
+ * @return Number of keys returned.
+ *
+ * The raw equivalent of fetch_key_skshash.
+ */
+	int (*fetch_key_skshash_raw)(struct onak_dbctx *,
+			const struct skshash *hash,
+			struct openpgp_raw_key *raw);
+
+/**
+ * @brief Check if we have a key with a given SKS hash.
+ * @param hash The hash to search for.
+ * @return True if a key with exactly that hash is stored.
+ *
+ * Allows update_keys to skip keys we already have without fetching and
+ * merging them. This is optional, and should only be provided by backends
+ * that can answer it from an index of the current hashes.
+ */
+	bool (*have_skshash)(struct onak_dbctx *,
+			const struct skshash *hash);
+
 /**
  * @brief Takes a key and stores it.
  * @param publickey A pointer to the public key to store.
@@ -221,12 +320,13 @@ struct onak_dbctx {
  *
  * Calls iterfunc once for each key in the database. ctx is passed
  * unaltered to iterfunc. This function is intended to aid database dumps
- * and statistic calculations.
+ * and statistic calculations. If iterfunc returns false no further keys
+ * are passed to it.
  *
  * Returns the number of keys we iterated over.
  */
 	int (*iterate_keys)(struct onak_dbctx *,
-			void (*iterfunc)(void *ctx,
+			bool (*iterfunc)(void *ctx,
 			struct openpgp_publickey *key),	void *ctx);
 
 /**
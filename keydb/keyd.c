@@ -22,10 +22,14 @@
 #include <inttypes.h>
 #include <poll.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
@@ -40,6 +44,8 @@
 
 #include "charfuncs.h"
 #include "cleanup.h"
+#include "decodekey.h"
+#include "keyarray.h"
 #include "keyd.h"
 #include "keydb.h"
 #include "keyid.h"
@@ -47,15 +53,272 @@
 #include "log.h"
 #include "mem.h"
 #include "onak-conf.h"
+#include "openpgp.h"
 #include "parsekey.h"
 
 /* Maximum number of clients we're prepared to accept at once */
-#define MAX_CLIENTS 16
+#define MAX_CLIENTS 256
+
+/* Maximum number of epoll events to handle per wakeup */
+#define MAX_EVENTS 64
+
+/*
+ * How long (in ms) a client can go without sending or receiving anything part
+ * way through a command before we drop it.
+ */
+#define KEYD_IO_TIMEOUT 30000
+
+/* How long (in ms) a client can keep us waiting before it counts as slow */
+#define KEYD_IO_GRACE 100
+
+/* Maximum pipelined requests to handle for a client before moving on */
+#define KEYD_MAX_PIPELINE 32
+
+/* Maximum number of key writes to group into a single transaction */
+#define KEYD_MAX_COMMIT 256
+
+/* Attempts to store a key on its own after its batch's transaction failed */
+#define KEYD_STORE_RETRIES 3
+
+/*
+ * A key store, update or delete waiting for the writer thread to commit it.
+ */
+struct keyd_write {
+	/**
+	 * The key(s) to store; owned by the writer thread once queued. NULL
+	 * if this is a delete.
+	 */
+	struct openpgp_publickey *key;
+	/** The fingerprint of the key to delete, if @a key is NULL. */
+	struct openpgp_fingerprint fp;
+	/** True if this is an update of an existing key. */
+	bool update;
+	/** The stored copies of the key(s) we're replacing; see keyd_old_keys(). */
+	struct openpgp_publickey *old;
+	/** Set by the writer thread once the transaction has committed. */
+	bool done;
+	/**
+	 * Set by the writer thread if the backend failed to store the key, or
+	 * didn't have the key to delete.
+	 */
+	bool failed;
+	/** Next write in the writer thread's queue. */
+	struct keyd_write *next;
+	/** Next write queued by the same worker. */
+	struct keyd_write *wnext;
+};
+
+struct keyd_worker {
+	/** Our worker number, for logging. */
+	int id;
+	/** The worker thread. */
+	pthread_t thread;
+	/** This worker's connection to the backend database. */
+	struct onak_dbctx *dbctx;
+	/** The client we're currently handling a command for. */
+	int fd;
+	/** When the client last sent or received anything, for KEYD_IO_TIMEOUT. */
+	uint64_t lastio;
+	/** Set if the client has kept us waiting; see keyd_wait(). */
+	bool slow;
+	/** Microseconds spent in the backend for the current command. */
+	uint64_t backend_usec;
+	/** Number of backend calls made for the current command. */
+	int backend_calls;
+	/** Microseconds spent (de)serialising keys for the current command. */
+	uint64_t serialise_usec;
+	/** Bytes of key data sent for the current command. */
+	uint64_t bytes_sent;
+	/** Writes we've queued for our client that may not be committed. */
+	struct keyd_write *writes;
+	/** Set if any of our client's writes have failed since its last sync. */
+	bool write_failed;
+	/** The protocol version our client has said it speaks, or 0. */
+	uint32_t version;
+};
+
+/*
+ * Number of buckets in our latency histograms. Bucket n counts times of up to
+ * 2^n microseconds, with the last catching everything slower than that.
+ */
+#define KEYD_HIST_BUCKETS 24
+
+struct keyd_histogram {
+	/** Number of samples. */
+	uint64_t count;
+	/** Sum of all samples, in microseconds. */
+	uint64_t sum;
+	/** Per bucket sample counts; not cumulative. */
+	uint64_t buckets[KEYD_HIST_BUCKETS];
+};
+
+/*
+ * Names we use for each command in the metrics output.
+ */
+static const char *keyd_cmd_names[KEYD_CMD_LAST] = {
+	[KEYD_CMD_UNKNOWN] = "unknown",
+	[KEYD_CMD_VERSION] = "version",
+	[KEYD_CMD_GET_ID] = "get_id",
+	[KEYD_CMD_STORE] = "store",
+	[KEYD_CMD_DELETE] = "delete",
+	[KEYD_CMD_GET_TEXT] = "get_text",
+	[KEYD_CMD_GETFULLKEYID] = "getfullkeyid",
+	[KEYD_CMD_KEYITER] = "keyiter",
+	[KEYD_CMD_CLOSE] = "close",
+	[KEYD_CMD_QUIT] = "quit",
+	[KEYD_CMD_STATS] = "stats",
+	[KEYD_CMD_GET_SKSHASH] = "get_skshash",
+	[KEYD_CMD_GET_FP] = "get_fp",
+	[KEYD_CMD_UPDATE] = "update",
+	[KEYD_CMD_GET] = "get",
+	[KEYD_CMD_GET_BATCH] = "get_batch",
+	[KEYD_CMD_METRICS] = "metrics",
+	[KEYD_CMD_SYNC] = "sync",
+	[KEYD_CMD_CLIENT_VERSION] = "client_version",
+};
+
+/*
+ * Per client state is carried alongside the fd in the upper half of the
+ * epoll event data, so it follows the client from worker to worker.
+ */
+#define KEYD_CLIENT_FD(c)		((int) ((c) & 0xFFFFFFFF))
+#define KEYD_CLIENT_WRITE_FAILED	(UINT64_C(1) << 32)
+#define KEYD_CLIENT_SLOW		(UINT64_C(1) << 34)
+#define KEYD_CLIENT_VERSION(c)		((uint32_t) ((c) >> 48))
+#define KEYD_CLIENT_SET_VERSION(v)	(((uint64_t) (v)) << 48)
+
+/*
+ * Clients with a pending request, waiting for a worker. As each client fd is
+ * EPOLLONESHOT it can only be queued once, so MAX_CLIENTS entries is enough.
+ * Clients that have been slow to keep up with us wait on a queue of their own,
+ * so they can't hold up everyone else; see keyd_queue_pop().
+ */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	uint64_t clients[MAX_CLIENTS];
+	int head;
+	int count;
+	uint64_t slowclients[MAX_CLIENTS];
+	int slowhead;
+	int slowcount;
+	/** Number of workers handling a slow client. */
+	int slow;
+	bool shutdown;
+} queue = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.ready = PTHREAD_COND_INITIALIZER,
+};
+
+/* Number of connected clients; protected by queue.lock */
+static int numclients = 0;
+
+/*
+ * Key writes waiting to be grouped into a transaction by the writer thread.
+ * If dbctx is NULL then group commit is disabled and workers store keys
+ * themselves.
+ */
+static struct {
+	pthread_mutex_t lock;
+	/** Signalled when writes are queued or a worker starts waiting. */
+	pthread_cond_t ready;
+	/** Broadcast when a transaction has been committed. */
+	pthread_cond_t done;
+	struct keyd_write *head;
+	struct keyd_write **tail;
+	int count;
+	/** Number of workers currently handling a client. */
+	int busy;
+	/** Number of workers blocked waiting for their writes to commit. */
+	int waiting;
+	bool shutdown;
+	pthread_t thread;
+	/** The writer thread's connection to the backend database. */
+	struct onak_dbctx *dbctx;
+} commit = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+	.tail = &commit.head,
+};
+
+static int epollfd = -1;
+static int listenfd = -1;
+static int wakefd = -1;
 
 static bool using_socket_activation = false;
 
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
 static struct keyd_stats *stats;
 
+/*
+ * Per command timing information for KEYD_CMD_METRICS; protected by
+ * stats_lock.
+ */
+static struct {
+	/** Total time taken to handle each command. */
+	struct keyd_histogram latency[KEYD_CMD_LAST];
+	/** Time spent in the backend for each command. */
+	struct keyd_histogram backend[KEYD_CMD_LAST];
+	/** Total microseconds spent (de)serialising keys. */
+	uint64_t serialise_usec[KEYD_CMD_LAST];
+	/** Total bytes of key data sent. */
+	uint64_t bytes_sent[KEYD_CMD_LAST];
+	/** Number of transactions committed by the writer thread. */
+	uint64_t commits;
+	/** Number of key writes committed by the writer thread. */
+	uint64_t committed_keys;
+} metrics;
+
+/* Number of hash buckets in the key cache; must be a power of 2 */
+#define KEYD_CACHE_HASHSIZE 4096
+
+/*
+ * A serialised key in our cache. Entries are reference counted so a worker
+ * can carry on writing one to a slow client after it's been evicted.
+ */
+struct keyd_cache_entry {
+	/** Fingerprint of the primary key. */
+	struct openpgp_fingerprint fp;
+	/** 64 bit key ID of the primary key. */
+	uint64_t keyid;
+	/** True if this is the only key matching keyid. */
+	bool byid;
+	/** Number of references; the cache itself holds one. */
+	unsigned int refs;
+	/** The key, exactly as we send it on the wire. */
+	uint8_t *data;
+	/** Length of data. */
+	size_t len;
+	/** Next entry in this hash bucket. */
+	struct keyd_cache_entry *hnext;
+	/** More recently used entry. */
+	struct keyd_cache_entry *prev;
+	/** Less recently used entry. */
+	struct keyd_cache_entry *next;
+};
+
+/*
+ * LRU cache of recently fetched keys, shared between all the workers.
+ */
+static struct {
+	pthread_mutex_t lock;
+	/** Total bytes of key data currently cached. */
+	size_t size;
+	/** Maximum bytes of key data to cache; 0 disables the cache. */
+	size_t maxsize;
+	/** Bumped on every invalidation. */
+	uint64_t generation;
+	struct keyd_cache_entry *buckets[KEYD_CACHE_HASHSIZE];
+	/** Most recently used entry. */
+	struct keyd_cache_entry *head;
+	/** Least recently used entry; the next to be evicted. */
+	struct keyd_cache_entry *tail;
+} cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void keyd_wakeup(void);
+
 static void daemonize(void)
 {
 	pid_t pid;
@@ -106,327 +369,1705 @@ static void daemonize(void)
 	return;
 }
 
-static bool keyd_write_key(int fd, struct openpgp_publickey *key)
+/**
+ *	keyd_usec - Get a monotonic timestamp in microseconds.
+ */
+static uint64_t keyd_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ *	keyd_poll - Wait on a client socket.
+ */
+static int keyd_poll(int fd, short events, int timeout)
+{
+	struct pollfd pfd;
+	int ret;
+
+	pfd.fd = fd;
+	pfd.events = events;
+	pfd.revents = 0;
+
+	do {
+		ret = poll(&pfd, 1, timeout);
+	} while (ret == -1 && errno == EINTR);
+
+	return ret;
+}
+
+/**
+ *	keyd_slow_limit - How many workers may handle slow clients at once.
+ *
+ *	We keep one worker back for clients that keep up, such as a fingerprint
+ *	get, unless there's only one.
+ */
+static int keyd_slow_limit(void)
+{
+	return (config.keyd_workers > 1) ? config.keyd_workers - 1 : 1;
+}
+
+/**
+ *	keyd_wait - Wait for a non-blocking socket to become ready.
+ *	@worker: The worker handling the client.
+ *	@events: The poll events (POLLIN / POLLOUT) to wait for.
+ *
+ *	Client sockets are non-blocking so that a slow or stalled client can't
+ *	tie up a worker forever; when we get EAGAIN part way through a command
+ *	we wait here for the socket to be ready again. We give up on a client
+ *	once it's gone KEYD_IO_TIMEOUT milliseconds without making any
+ *	progress, but a client that's slowly working through a big reply can
+ *	take as long as it needs.
+ *
+ *	Clients normally answer within KEYD_IO_GRACE milliseconds, as they
+ *	wait for our reply before sending a command's arguments. One that
+ *	doesn't is marked as slow, and from then on only gets a worker when
+ *	fewer than keyd_slow_limit() are busy with slow clients; until then its
+ *	requests stay unread and it has to wait for us.
+ */
+static bool keyd_wait(struct keyd_worker *worker, short events)
+{
+	int ret, remaining;
+
+	if (!worker->slow) {
+		ret = keyd_poll(worker->fd, events, KEYD_IO_GRACE);
+		if (ret != 0) {
+			return (ret == 1);
+		}
+
+		logthing(LOGTHING_INFO, "Client %d is slow; queueing it "
+				"separately.", worker->fd);
+		worker->slow = true;
+		pthread_mutex_lock(&queue.lock);
+		queue.slow++;
+		pthread_mutex_unlock(&queue.lock);
+	}
+
+	remaining = KEYD_IO_TIMEOUT -
+		(int) ((keyd_usec() - worker->lastio) / 1000);
+	if (remaining <= 0 || keyd_poll(worker->fd, events, remaining) != 1) {
+		logthing(LOGTHING_DEBUG, "Timed out waiting on client %d.",
+				worker->fd);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ *	keyd_read - Read an exact number of bytes from a client.
+ *	@worker: The worker handling the client.
+ *	@buf: The buffer to read into.
+ *	@count: The number of bytes to read.
+ *
+ *	Returns true if all @count bytes were read, false on EOF, error or
+ *	timeout.
+ */
+static bool keyd_read(struct keyd_worker *worker, void *buf, size_t count)
+{
+	uint8_t *p = buf;
+	ssize_t  bytes;
+
+	while (count > 0) {
+		bytes = read(worker->fd, p, count);
+		if (bytes > 0) {
+			p += bytes;
+			count -= bytes;
+			worker->lastio = keyd_usec();
+		} else if (bytes == 0) {
+			return false;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			if (!keyd_wait(worker, POLLIN)) {
+				return false;
+			}
+		} else if (errno != EINTR) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ *	keyd_write - Write an exact number of bytes to a client.
+ *	@worker: The worker handling the client.
+ *	@buf: The data to write.
+ *	@count: The number of bytes to write.
+ *
+ *	Returns true if all @count bytes were written, false on error or
+ *	timeout.
+ */
+static bool keyd_write(struct keyd_worker *worker, const void *buf,
+		size_t count)
+{
+	const uint8_t *p = buf;
+	ssize_t        bytes;
+
+	while (count > 0) {
+		bytes = write(worker->fd, p, count);
+		if (bytes > 0) {
+			p += bytes;
+			count -= bytes;
+			worker->lastio = keyd_usec();
+		} else if (bytes == -1 &&
+				(errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (!keyd_wait(worker, POLLOUT)) {
+				return false;
+			}
+		} else if (bytes == 0 || errno != EINTR) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool keyd_write_reply(struct keyd_worker *worker,
+		enum keyd_reply _reply)
+{
+	uint32_t reply = _reply;
+
+	return keyd_write(worker, &reply, sizeof(reply));
+}
+
+static bool keyd_write_size(struct keyd_worker *worker, size_t size)
+{
+	return keyd_write(worker, &size, sizeof(size));
+}
+
+static void keyd_hist_add(struct keyd_histogram *hist, uint64_t usec)
+{
+	int bucket = 0;
+
+	while (bucket < (KEYD_HIST_BUCKETS - 1) &&
+			usec > (UINT64_C(1) << bucket)) {
+		bucket++;
+	}
+
+	hist->count++;
+	hist->sum += usec;
+	hist->buckets[bucket]++;
+}
+
+/**
+ *	keyd_record_timing - Add a finished command to our metrics.
+ *	@worker: The worker that handled the command.
+ *	@cmd: The command.
+ *	@usec: The total time taken to handle the command.
+ */
+static void keyd_record_timing(struct keyd_worker *worker, uint32_t cmd,
+		uint64_t usec)
+{
+	if (cmd >= KEYD_CMD_LAST) {
+		cmd = KEYD_CMD_UNKNOWN;
+	}
+
+	pthread_mutex_lock(&stats_lock);
+	keyd_hist_add(&metrics.latency[cmd], usec);
+	if (worker->backend_calls > 0) {
+		keyd_hist_add(&metrics.backend[cmd], worker->backend_usec);
+	}
+	metrics.serialise_usec[cmd] += worker->serialise_usec;
+	metrics.bytes_sent[cmd] += worker->bytes_sent;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/**
+ *	keyd_flatten_key - Serialise a key into the bytes we send on the wire.
+ *	@key: The key to serialise.
+ *	@buf: The buffer context to serialise into. Must be freed by the caller.
+ */
+static void keyd_flatten_key(struct openpgp_publickey *key,
+		struct buffer_ctx *buf)
 {
 	struct openpgp_packet_list *packets = NULL;
 	struct openpgp_packet_list *list_end = NULL;
-	struct buffer_ctx           storebuf;
-	ssize_t written;
-	bool    ok = true;
 
-	storebuf.offset = 0;
-	storebuf.size = 8192;
-	storebuf.buffer = malloc(8192);
+	buf->offset = 0;
+	buf->size = 8192;
+	buf->buffer = malloc(8192);
 
 	flatten_publickey(key,
 				&packets,
 				&list_end);
 	write_openpgp_stream(buffer_putchar,
-				&storebuf,
+				buf,
 				packets);
+	free_packet_list(packets);
+	packets = list_end = NULL;
+}
+
+/**
+ *	keyd_write_bytes - Send an already serialised key to a client.
+ *	@worker: The worker handling the client.
+ *	@data: The serialised key.
+ *	@len: The length of @data.
+ */
+static bool keyd_write_bytes(struct keyd_worker *worker, const void *data,
+		size_t len)
+{
+	bool ok;
+
 	logthing(LOGTHING_TRACE,
 				"Sending %zd bytes.",
-				storebuf.offset);
-	written = write(fd, &storebuf.offset,
-			sizeof(storebuf.offset));
-	if (written == 0) {
-		ok = false;
-	} else {
-		written = write(fd, storebuf.buffer,
-			storebuf.offset);
-		if (written != storebuf.offset) {
-			ok = false;
-		}
+				len);
+	ok = keyd_write(worker, &len, sizeof(len));
+	if (ok) {
+		ok = keyd_write(worker, data, len);
 	}
 
+	return (ok);
+}
+
+static bool keyd_write_key(struct keyd_worker *worker,
+		struct openpgp_publickey *key)
+{
+	struct buffer_ctx storebuf;
+	uint64_t start;
+	bool ok;
+
+	start = keyd_usec();
+	keyd_flatten_key(key, &storebuf);
+	worker->serialise_usec += keyd_usec() - start;
+	ok = keyd_write_bytes(worker, storebuf.buffer, storebuf.offset);
+	worker->bytes_sent += sizeof(storebuf.offset) + storebuf.offset;
+
 	free(storebuf.buffer);
 	storebuf.buffer = NULL;
 	storebuf.size = storebuf.offset = 0;
-	free_packet_list(packets);
-	packets = list_end = NULL;
 
 	return (ok);
 }
 
-static bool keyd_write_reply(int fd, enum keyd_reply _reply)
+/**
+ *	keyd_cache_bucket - Work out which hash bucket a key lives in.
+ *	@keyid: The 64 bit key ID of the primary key.
+ *
+ *	We hash on key ID rather than fingerprint so that lookups by either
+ *	end up in the same chain.
+ */
+static inline unsigned int keyd_cache_bucket(uint64_t keyid)
 {
-	uint32_t reply = _reply;
-	ssize_t written;
-	bool ok = true;
+	return keyid & (KEYD_CACHE_HASHSIZE - 1);
+}
+
+static void keyd_cache_unref(struct keyd_cache_entry *entry)
+{
+	if (--entry->refs == 0) {
+		free(entry->data);
+		free(entry);
+	}
+}
+
+/**
+ *	keyd_cache_unlink - Remove an entry from the cache.
+ *	@entry: The entry to remove.
+ *
+ *	Must be called with the cache lock held. The entry is freed once any
+ *	workers still sending it to a client have released it.
+ */
+static void keyd_cache_unlink(struct keyd_cache_entry *entry)
+{
+	struct keyd_cache_entry **cur;
+
+	cur = &cache.buckets[keyd_cache_bucket(entry->keyid)];
+	while (*cur != entry) {
+		cur = &(*cur)->hnext;
+	}
+	*cur = entry->hnext;
+
+	if (entry->prev != NULL) {
+		entry->prev->next = entry->next;
+	} else {
+		cache.head = entry->next;
+	}
+	if (entry->next != NULL) {
+		entry->next->prev = entry->prev;
+	} else {
+		cache.tail = entry->prev;
+	}
+
+	cache.size -= entry->len;
+	keyd_cache_unref(entry);
+}
+
+/**
+ *	keyd_cache_find - Look up a key in the cache.
+ *	@fp: The fingerprint of the key to find, or NULL to search by key ID.
+ *	@keyid: The key ID to find, if @fp is NULL.
+ *
+ *	Returns a referenced entry which must be handed back with
+ *	keyd_cache_release(), or NULL if the key isn't cached. Key ID lookups
+ *	only match entries that were added as the sole result of a key ID
+ *	fetch, so we never hide a colliding key from the client.
+ */
+static struct keyd_cache_entry *keyd_cache_find(
+		struct openpgp_fingerprint *fp, uint64_t keyid)
+{
+	struct keyd_cache_entry *entry;
+
+	if (cache.maxsize == 0) {
+		return NULL;
+	}
 
-	written = write(fd, &reply, sizeof(reply));
-	if (written != sizeof(reply)) {
-		ok = false;
+	if (fp != NULL) {
+		keyid = fingerprint2keyid(fp);
 	}
 
-	return (ok);
-}
+	pthread_mutex_lock(&cache.lock);
+	for (entry = cache.buckets[keyd_cache_bucket(keyid)]; entry != NULL;
+			entry = entry->hnext) {
+		if (fp != NULL && fingerprint_cmp(fp, &entry->fp) == 0) {
+			break;
+		} else if (fp == NULL && entry->byid &&
+				entry->keyid == keyid) {
+			break;
+		}
+	}
+
+	if (entry != NULL) {
+		/* Move to the head of the LRU list */
+		if (entry->prev != NULL) {
+			entry->prev->next = entry->next;
+			if (entry->next != NULL) {
+				entry->next->prev = entry->prev;
+			} else {
+				cache.tail = entry->prev;
+			}
+			entry->prev = NULL;
+			entry->next = cache.head;
+			cache.head->prev = entry;
+			cache.head = entry;
+		}
+		entry->refs++;
+	}
+	pthread_mutex_unlock(&cache.lock);
+
+	pthread_mutex_lock(&stats_lock);
+	if (entry != NULL) {
+		stats->cache_hits++;
+	} else {
+		stats->cache_misses++;
+	}
+	pthread_mutex_unlock(&stats_lock);
+
+	return entry;
+}
+
+static void keyd_cache_release(struct keyd_cache_entry *entry)
+{
+	pthread_mutex_lock(&cache.lock);
+	keyd_cache_unref(entry);
+	pthread_mutex_unlock(&cache.lock);
+}
+
+/**
+ *	keyd_cache_add - Add a serialised key to the cache.
+ *	@entry: The entry to add, as returned by keyd_new_entry().
+ *	@generation: The cache generation from before the key was fetched.
+ *
+ *	The cache takes its own reference to @entry; the caller still needs to
+ *	release theirs. If the cache has been invalidated since @generation was
+ *	read then the key may be stale, so we don't cache it.
+ */
+static void keyd_cache_add(struct keyd_cache_entry *entry,
+		uint64_t generation)
+{
+	struct keyd_cache_entry *old;
+	unsigned int bucket;
+
+	if (cache.maxsize == 0 || entry->len > cache.maxsize / 4) {
+		return;
+	}
+
+	bucket = keyd_cache_bucket(entry->keyid);
+
+	pthread_mutex_lock(&cache.lock);
+	if (generation != cache.generation) {
+		pthread_mutex_unlock(&cache.lock);
+		return;
+	}
+
+	for (old = cache.buckets[bucket]; old != NULL; old = old->hnext) {
+		if (fingerprint_cmp(&entry->fp, &old->fp) == 0) {
+			entry->byid |= old->byid;
+			keyd_cache_unlink(old);
+			break;
+		}
+	}
+
+	entry->refs++;
+	entry->hnext = cache.buckets[bucket];
+	cache.buckets[bucket] = entry;
+	entry->next = cache.head;
+	if (cache.head != NULL) {
+		cache.head->prev = entry;
+	} else {
+		cache.tail = entry;
+	}
+	cache.head = entry;
+	cache.size += entry->len;
+
+	while (cache.size > cache.maxsize && cache.tail != NULL) {
+		keyd_cache_unlink(cache.tail);
+	}
+	pthread_mutex_unlock(&cache.lock);
+}
+
+/**
+ *	keyd_cache_invalidate - Drop any cached copies of a key.
+ *	@fp: The primary fingerprint of the key that has been changed.
+ *
+ *	Removes anything cached for the fingerprint, or its key ID,
+ *	and bumps the cache generation so in flight fetches don't re-add an old
+ *	copy.
+ */
+static void keyd_cache_invalidate(struct openpgp_fingerprint *fp)
+{
+	struct keyd_cache_entry *entry, *next;
+	uint64_t keyid;
+
+	if (cache.maxsize == 0) {
+		return;
+	}
+
+	keyid = fingerprint2keyid(fp);
+
+	pthread_mutex_lock(&cache.lock);
+	cache.generation++;
+	for (entry = cache.buckets[keyd_cache_bucket(keyid)]; entry != NULL;
+			entry = next) {
+		next = entry->hnext;
+		if (entry->keyid == keyid ||
+				fingerprint_cmp(fp, &entry->fp) == 0) {
+			keyd_cache_unlink(entry);
+		}
+	}
+	pthread_mutex_unlock(&cache.lock);
+}
+
+/**
+ *	keyd_cache_invalidate_key - Drop any cached copies of a list of keys.
+ *	@key: The key(s) that have been changed.
+ *
+ *	A key can turn up in the results for its subkeys' key IDs too, so we
+ *	invalidate every fingerprint in each key rather than just the primary.
+ */
+static void keyd_cache_invalidate_key(struct openpgp_publickey *key)
+{
+	struct openpgp_fingerprint fingerprint, *subkeys;
+	int i;
+
+	if (cache.maxsize == 0) {
+		return;
+	}
+
+	for (; key != NULL; key = key->next) {
+		if (get_fingerprint(key->publickey, &fingerprint) ==
+				ONAK_E_OK) {
+			keyd_cache_invalidate(&fingerprint);
+		}
+		subkeys = keysubkeys(key);
+		if (subkeys != NULL) {
+			for (i = 0; subkeys[i].length != 0; i++) {
+				keyd_cache_invalidate(&subkeys[i]);
+			}
+			free(subkeys);
+		}
+	}
+}
+
+/**
+ *	keyd_old_keys - Fetch the stored copies of keys we're about to replace.
+ *	@dbctx: The database context to fetch with.
+ *	@key: The key(s) about to be stored, or NULL.
+ *	@fp: The fingerprint of a key about to be deleted, if @key is NULL.
+ *	@intrans: If we're already in a transaction.
+ *
+ *	Subkeys that are being dropped won't be in the new key, so we need the
+ *	old one to know everything that has to go from the cache once the write
+ *	is visible. Returns NULL without looking if we have no cache.
+ */
+static struct openpgp_publickey *keyd_old_keys(struct onak_dbctx *dbctx,
+		struct openpgp_publickey *key, struct openpgp_fingerprint *fp,
+		bool intrans)
+{
+	struct openpgp_publickey *old = NULL;
+	struct openpgp_fingerprint fingerprint;
+
+	if (cache.maxsize == 0) {
+		return NULL;
+	}
+
+	if (key == NULL) {
+		dbctx->fetch_key_fp(dbctx, fp, &old, intrans);
+	}
+	for (; key != NULL; key = key->next) {
+		if (get_fingerprint(key->publickey, &fingerprint) ==
+				ONAK_E_OK) {
+			dbctx->fetch_key_fp(dbctx, &fingerprint, &old,
+					intrans);
+		}
+	}
+
+	return old;
+}
+
+static uint64_t keyd_cache_generation(void)
+{
+	uint64_t generation;
+
+	pthread_mutex_lock(&cache.lock);
+	generation = cache.generation;
+	pthread_mutex_unlock(&cache.lock);
+
+	return generation;
+}
+
+static void keyd_cache_cleanup(void)
+{
+	pthread_mutex_lock(&cache.lock);
+	while (cache.tail != NULL) {
+		keyd_cache_unlink(cache.tail);
+	}
+	pthread_mutex_unlock(&cache.lock);
+}
+
+/**
+ *	keyd_new_entry - Serialise a key into a (not yet cached) cache entry.
+ *	@worker: The worker doing the serialisation.
+ *	@key: The key, or keys, to serialise.
+ *
+ *	Returns an entry with a single reference, owned by the caller.
+ */
+static struct keyd_cache_entry *keyd_new_entry(struct keyd_worker *worker,
+		struct openpgp_publickey *key)
+{
+	struct keyd_cache_entry *entry;
+	struct buffer_ctx storebuf;
+	uint64_t start;
+
+	entry = calloc(1, sizeof(*entry));
+	if (entry == NULL) {
+		return NULL;
+	}
+
+	start = keyd_usec();
+	keyd_flatten_key(key, &storebuf);
+	worker->serialise_usec += keyd_usec() - start;
+	get_fingerprint(key->publickey, &entry->fp);
+	entry->keyid = fingerprint2keyid(&entry->fp);
+	entry->refs = 1;
+	entry->data = (uint8_t *) storebuf.buffer;
+	entry->len = storebuf.offset;
+
+	return entry;
+}
+
+/**
+ *	keyd_raw_packet - Find the next packet in a raw key.
+ *	@data: The raw key data.
+ *	@len: The length of @data.
+ *	@offset: Offset of the packet header; updated to the following packet.
+ *	@packet: Filled in with the packet tag and a view of its body.
+ *
+ *	Only walks the packet headers; nothing is copied. Returns false at the
+ *	end of the data or if we hit something we don't understand (such as a
+ *	partial body length), in which case the caller shouldn't trust what
+ *	it's seen.
+ */
+static bool keyd_raw_packet(const uint8_t *data, size_t len, size_t *offset,
+		struct openpgp_packet *packet)
+{
+	size_t pos = *offset;
+	size_t hdrlen, i;
+	uint8_t tag;
+
+	if (pos >= len || !(data[pos] & 0x80)) {
+		return false;
+	}
+	tag = data[pos++];
+	memset(packet, 0, sizeof(*packet));
+	packet->newformat = (tag & 0x40);
+
+	if (packet->newformat) {
+		packet->tag = tag & 0x3F;
+		if (pos >= len) {
+			return false;
+		}
+		if (data[pos] < 192) {
+			packet->length = data[pos++];
+		} else if (data[pos] < 224) {
+			if (pos + 2 > len) {
+				return false;
+			}
+			packet->length = ((data[pos] - 192) << 8) +
+				data[pos + 1] + 192;
+			pos += 2;
+		} else if (data[pos] == 255) {
+			if (pos + 5 > len) {
+				return false;
+			}
+			packet->length = ((size_t) data[pos + 1] << 24) |
+				(data[pos + 2] << 16) |
+				(data[pos + 3] << 8) | data[pos + 4];
+			pos += 5;
+		} else {
+			return false;
+		}
+	} else {
+		packet->tag = (tag & 0x3C) >> 2;
+		if ((tag & 3) == 3) {
+			return false;
+		}
+		hdrlen = 1 << (tag & 3);
+		if (pos + hdrlen > len) {
+			return false;
+		}
+		for (i = 0; i < hdrlen; i++) {
+			packet->length = (packet->length << 8) | data[pos++];
+		}
+	}
+
+	if (packet->length > len - pos) {
+		return false;
+	}
+	packet->data = (unsigned char *) &data[pos];
+	*offset = pos + packet->length;
+
+	return true;
+}
+
+/**
+ *	keyd_raw_entry - Turn a raw key from the backend into a cache entry.
+ *	@raw: The raw key, as returned by one of the fetch_*_raw functions.
+ *	@single: Set to true if @raw contains exactly one primary key.
+ *
+ *	Copies the data straight into the entry, avoiding parsing and then
+ *	re-serialising it; the fingerprint is worked out from the first
+ *	public key packet. Returns an entry with a single reference, owned by
+ *	the caller.
+ */
+static struct keyd_cache_entry *keyd_raw_entry(struct openpgp_raw_key *raw,
+		bool *single)
+{
+	struct keyd_cache_entry *entry;
+	struct openpgp_packet packet;
+	size_t offset = 0;
+	int keys = 0;
+
+	*single = false;
+	entry = calloc(1, sizeof(*entry));
+	if (entry == NULL) {
+		return NULL;
+	}
+	entry->data = malloc(raw->length);
+	if (entry->data == NULL) {
+		free(entry);
+		return NULL;
+	}
+	memcpy(entry->data, raw->data, raw->length);
+	entry->len = raw->length;
+	entry->refs = 1;
+
+	while (keyd_raw_packet(raw->data, raw->length, &offset, &packet)) {
+		if (packet.tag != OPENPGP_PACKET_PUBLICKEY) {
+			continue;
+		}
+		if (keys++ == 0 &&
+				get_fingerprint(&packet, &entry->fp) ==
+					ONAK_E_OK) {
+			entry->keyid = fingerprint2keyid(&entry->fp);
+		}
+	}
+	*single = (offset == raw->length && keys == 1 &&
+			entry->fp.length > 0);
+
+	return entry;
+}
+
+/**
+ *	keyd_fetch_raw - Fetch a key from the backend without parsing it.
+ *	@worker: The worker doing the fetch.
+ *	@cmd: The command we're handling; picks which lookup we do.
+ *	@arg: A fingerprint, key ID or SKS hash, depending on @cmd.
+ *	@raw: The raw key structure to fill in.
+ *
+ *	Returns true if the backend supports raw fetches for @cmd, in which
+ *	case @raw is left empty if there's no such key. Otherwise the caller
+ *	should fall back to a parsed fetch.
+ */
+static bool keyd_fetch_raw(struct keyd_worker *worker, enum keyd_ops cmd,
+		const void *arg, struct openpgp_raw_key *raw)
+{
+	struct onak_dbctx *dbctx = worker->dbctx;
+	uint64_t start;
+	int count;
+
+	memset(raw, 0, sizeof(*raw));
+	switch (cmd) {
+	case KEYD_CMD_GET:
+		if (dbctx->fetch_key_raw == NULL) {
+			return false;
+		}
+		break;
+	case KEYD_CMD_GET_FP:
+		if (dbctx->fetch_key_fp_raw == NULL) {
+			return false;
+		}
+		break;
+	case KEYD_CMD_GET_ID:
+		if (dbctx->fetch_key_id_raw == NULL) {
+			return false;
+		}
+		break;
+	case KEYD_CMD_GET_SKSHASH:
+		if (dbctx->fetch_key_skshash_raw == NULL) {
+			return false;
+		}
+		break;
+	default:
+		return false;
+	}
+
+	start = keyd_usec();
+	switch (cmd) {
+	case KEYD_CMD_GET:
+		count = dbctx->fetch_key_raw(dbctx,
+				(struct openpgp_fingerprint *) arg, raw, false);
+		break;
+	case KEYD_CMD_GET_FP:
+		count = dbctx->fetch_key_fp_raw(dbctx,
+				(struct openpgp_fingerprint *) arg, raw, false);
+		break;
+	case KEYD_CMD_GET_ID:
+		count = dbctx->fetch_key_id_raw(dbctx, *(uint64_t *) arg,
+				raw, false);
+		break;
+	default:
+		count = dbctx->fetch_key_skshash_raw(dbctx,
+				(const struct skshash *) arg, raw);
+		break;
+	}
+	worker->backend_usec += keyd_usec() - start;
+	worker->backend_calls++;
+	logthing(LOGTHING_INFO, "Fetching raw for command %d, result: %d",
+			cmd, count);
+
+	return true;
+}
+
+/**
+ *	keyd_fetch - Fetch a key in wire format, from the cache if possible.
+ *	@worker: The worker doing the fetch.
+ *	@cmd: The command we're handling; picks which lookup we do.
+ *	@arg: A fingerprint, key ID or SKS hash, depending on @cmd.
+ *
+ *	Returns a referenced entry holding the serialised result, which must be
+ *	released with keyd_cache_release(), or NULL if no key was found. We only
+ *	cache exact, unambiguous answers: a single key whose primary fingerprint
+ *	(or full 64 bit key ID) is the one the client asked for. SKS hash
+ *	lookups aren't cached at all.
+ */
+static struct keyd_cache_entry *keyd_fetch(struct keyd_worker *worker,
+		enum keyd_ops cmd, const void *arg)
+{
+	struct onak_dbctx *dbctx = worker->dbctx;
+	struct openpgp_fingerprint *fp = NULL;
+	struct openpgp_publickey *key = NULL;
+	struct keyd_cache_entry *entry = NULL;
+	struct openpgp_raw_key raw;
+	uint64_t generation, keyid = 0, start;
+	bool cacheable = false, single;
+	int count = 0;
+
+	if (cmd == KEYD_CMD_GET || cmd == KEYD_CMD_GET_FP) {
+		fp = (struct openpgp_fingerprint *) arg;
+		entry = keyd_cache_find(fp, 0);
+	} else if (cmd == KEYD_CMD_GET_ID) {
+		keyid = *(uint64_t *) arg;
+		entry = keyd_cache_find(NULL, keyid);
+	}
+	if (entry != NULL) {
+		logthing(LOGTHING_INFO, "Fetching for command %d, cached",
+				cmd);
+		return entry;
+	}
+
+	generation = keyd_cache_generation();
+	if (keyd_fetch_raw(worker, cmd, arg, &raw)) {
+		if (raw.length == 0) {
+			return NULL;
+		}
+		entry = keyd_raw_entry(&raw, &single);
+		free_raw_key(&raw);
+		goto cache;
+	}
+
+	start = keyd_usec();
+	switch (cmd) {
+	case KEYD_CMD_GET:
+		count = dbctx->fetch_key(dbctx, fp, &key, false);
+		break;
+	case KEYD_CMD_GET_FP:
+		count = dbctx->fetch_key_fp(dbctx, fp, &key, false);
+		break;
+	case KEYD_CMD_GET_ID:
+		count = dbctx->fetch_key_id(dbctx, keyid, &key, false);
+		break;
+	case KEYD_CMD_GET_SKSHASH:
+		count = dbctx->fetch_key_skshash(dbctx,
+				(const struct skshash *) arg, &key);
+		break;
+	default:
+		break;
+	}
+	worker->backend_usec += keyd_usec() - start;
+	worker->backend_calls++;
+	logthing(LOGTHING_INFO, "Fetching for command %d, result: %d",
+			cmd, count);
+
+	if (key == NULL) {
+		return NULL;
+	}
+
+	entry = keyd_new_entry(worker, key);
+	single = (key->next == NULL);
+	free_publickey(key);
+
+cache:
+	if (entry != NULL && single) {
+		if (fp != NULL) {
+			cacheable = (fingerprint_cmp(fp, &entry->fp) == 0);
+		} else if (cmd == KEYD_CMD_GET_ID) {
+			cacheable = (entry->keyid == keyid);
+			entry->byid = true;
+		}
+	}
+	if (cacheable) {
+		keyd_cache_add(entry, generation);
+	}
+
+	return entry;
+}
+
+/**
+ *	keyd_send_entry - Send a fetch result to the client and release it.
+ *	@worker: The worker handling the client.
+ *	@entry: The result from keyd_fetch(); NULL if nothing was found.
+ */
+static bool keyd_send_entry(struct keyd_worker *worker,
+		struct keyd_cache_entry *entry)
+{
+	bool ok;
+
+	worker->bytes_sent += sizeof(size_t);
+	if (entry == NULL) {
+		return keyd_write_size(worker, 0);
+	}
+
+	ok = keyd_write_bytes(worker, entry->data, entry->len);
+	worker->bytes_sent += entry->len;
+	keyd_cache_release(entry);
+
+	return ok;
+}
+
+/**
+ *	keyd_do_batch - Handle the body of a KEYD_CMD_GET_BATCH request.
+ *	@worker: The worker handling the client.
+ *
+ *	Reads the list of lookups and replies with a single frame holding the
+ *	result of each, in the order they were asked for. See keyd.h for the
+ *	wire format.
+ */
+static bool keyd_do_batch(struct keyd_worker *worker)
+{
+	struct openpgp_fingerprint fingerprint;
+	struct keyd_cache_entry *entry;
+	struct buffer_ctx reply;
+	struct skshash hash;
+	uint64_t keyid;
+	uint32_t count, i;
+	uint8_t cmd, len;
+	size_t size;
+	bool ok;
+
+	if (!keyd_read(worker, &count, sizeof(count)) ||
+			count > KEYD_MAX_BATCH) {
+		return false;
+	}
+	logthing(LOGTHING_DEBUG, "Handling batch of %u fetches.", count);
+
+	reply.offset = 0;
+	reply.size = 8192;
+	reply.buffer = malloc(reply.size);
+	if (reply.buffer == NULL) {
+		return false;
+	}
+
+	ok = true;
+	for (i = 0; ok && i < count; i++) {
+		entry = NULL;
+		if (!keyd_read(worker, &cmd, 1) || !keyd_read(worker, &len, 1)) {
+			ok = false;
+			break;
+		}
+		switch (cmd) {
+		case KEYD_CMD_GET:
+		case KEYD_CMD_GET_FP:
+			if (len > MAX_FINGERPRINT_LEN) {
+				ok = false;
+				break;
+			}
+			fingerprint.length = len;
+			ok = keyd_read(worker, fingerprint.fp, len);
+			if (ok) {
+				entry = keyd_fetch(worker, cmd, &fingerprint);
+			}
+			break;
+		case KEYD_CMD_GET_ID:
+			if (len != sizeof(keyid)) {
+				ok = false;
+				break;
+			}
+			ok = keyd_read(worker, &keyid, len);
+			if (ok) {
+				entry = keyd_fetch(worker, cmd, &keyid);
+			}
+			break;
+		case KEYD_CMD_GET_SKSHASH:
+			if (len != sizeof(hash.hash)) {
+				ok = false;
+				break;
+			}
+			ok = keyd_read(worker, hash.hash, len);
+			if (ok) {
+				entry = keyd_fetch(worker, cmd, &hash);
+			}
+			break;
+		default:
+			logthing(LOGTHING_ERROR,
+				"Got unsupported batch command: %d", cmd);
+			ok = false;
+		}
+
+		size = (entry != NULL) ? entry->len : 0;
+		buffer_putchar(&reply, sizeof(size), &size);
+		if (entry != NULL) {
+			buffer_putchar(&reply, entry->len, entry->data);
+			keyd_cache_release(entry);
+		}
+	}
+
+	if (ok) {
+		ok = keyd_write_bytes(worker, reply.buffer, reply.offset);
+		worker->bytes_sent += sizeof(reply.offset) + reply.offset;
+	}
+	free(reply.buffer);
+
+	return ok;
+}
+
+/**
+ *	keyd_pending - Check if a client has more requests queued up.
+ *	@fd: The client socket.
+ *
+ *	Clients may pipeline requests, so once we've dealt with one we peek to
+ *	see if there's another waiting rather than going back through epoll.
+ */
+static bool keyd_pending(int fd)
+{
+	uint8_t c;
+
+	return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 1;
+}
+
+struct keyd_iter_ctx {
+	struct keyd_worker *worker;
+	/** Cleared if we fail to send a key, which stops the iteration. */
+	bool ok;
+};
+
+static bool iteratefunc(void *ctx, struct openpgp_publickey *key)
+{
+	struct keyd_iter_ctx *iterctx = (struct keyd_iter_ctx *) ctx;
+	uint64_t  keyid;
+
+	if (key != NULL) {
+		get_keyid(key, &keyid);
+		logthing(LOGTHING_TRACE,
+				"Iterating over 0x%016" PRIX64 ".",
+				keyid);
+
+		iterctx->ok = keyd_write_key(iterctx->worker, key);
+	}
+
+	return iterctx->ok;
+}
+
+static int sock_init(const char *sockname)
+{
+	struct sockaddr_un sock;
+	int                fd = -1;
+	int                ret = -1;
+#ifdef HAVE_SYSTEMD
+	int                n;
+
+	n = sd_listen_fds(0);
+	if (n > 1) {
+		logthing(LOGTHING_ERROR,
+			"Too many file descriptors received from systemd.");
+	} else if (n == 1) {
+		fd = SD_LISTEN_FDS_START + 0;
+		if (sd_is_socket_unix(fd, SOCK_STREAM, 1, NULL, 0) <= 0) {
+			logthing(LOGTHING_ERROR,
+				"systemd passed an invalid socket.");
+			fd = -1;
+		}
+		using_socket_activation = true;
+	} else {
+#endif
+		fd = socket(PF_UNIX, SOCK_STREAM, 0);
+		if (fd != -1) {
+			ret = fcntl(fd, F_SETFD, FD_CLOEXEC);
+		}
+
+		if (ret != -1) {
+			sock.sun_family = AF_UNIX;
+			strncpy(sock.sun_path, sockname,
+					sizeof(sock.sun_path) - 1);
+			unlink(sockname);
+			ret = bind(fd, (struct sockaddr *) &sock,
+					sizeof(sock));
+		}
+
+		if (ret != -1) {
+			ret = listen(fd, 5);
+		}
+
+		if (ret == -1) {
+			logthing(LOGTHING_ERROR,
+				"Couldn't open socket to listen on: %s (%d)",
+				strerror(errno),
+				errno);
+			close(fd);
+			fd = -1;
+		}
+#ifdef HAVE_SYSTEMD
+	}
+#endif
+
+	return fd;
+}
+
+/**
+ *	keyd_commit_queue - Hand a key to the writer thread to store or delete.
+ *	@worker: The worker handling the client that sent the key.
+ *	@key: The key(s) to store, or NULL to delete @fp. Ownership passes to
+ *	      the writer thread.
+ *	@fp: The fingerprint of the key to delete, if @key is NULL.
+ *	@update: True if this is an update of an existing key.
+ *
+ *	The write is also remembered by the worker, so it can wait for it to be
+ *	committed before answering anything else from the same client. Deletes
+ *	go through here too so they can't overtake a store queued before them.
+ */
+static bool keyd_commit_queue(struct keyd_worker *worker,
+		struct openpgp_publickey *key, struct openpgp_fingerprint *fp,
+		bool update)
+{
+	struct keyd_write *write;
+
+	write = calloc(1, sizeof(*write));
+	if (write == NULL) {
+		return false;
+	}
+	write->key = key;
+	if (key == NULL) {
+		write->fp = *fp;
+	}
+	write->update = update;
+
+	pthread_mutex_lock(&commit.lock);
+	*commit.tail = write;
+	commit.tail = &write->next;
+	commit.count++;
+	pthread_cond_signal(&commit.ready);
+	pthread_mutex_unlock(&commit.lock);
+
+	write->wnext = worker->writes;
+	worker->writes = write;
+
+	return true;
+}
+
+/**
+ *	keyd_commit_wait - Wait for all of a worker's queued writes to commit.
+ *	@worker: The worker.
+ *
+ *	Returns the time spent waiting, in microseconds.
+ */
+static uint64_t keyd_commit_wait(struct keyd_worker *worker)
+{
+	struct keyd_write *write, *next;
+	uint64_t start;
+
+	if (worker->writes == NULL) {
+		return 0;
+	}
+
+	start = keyd_usec();
+	pthread_mutex_lock(&commit.lock);
+	commit.waiting++;
+	pthread_cond_signal(&commit.ready);
+	for (write = worker->writes; write != NULL; write = next) {
+		while (!write->done) {
+			pthread_cond_wait(&commit.done, &commit.lock);
+		}
+		if (write->failed) {
+			worker->write_failed = true;
+		}
+		next = write->wnext;
+		free(write);
+	}
+	commit.waiting--;
+	pthread_mutex_unlock(&commit.lock);
+	worker->writes = NULL;
+
+	return keyd_usec() - start;
+}
+
+/**
+ *	keyd_commit_busy - Note a worker starting or finishing with a client.
+ *	@busy: True if the worker is starting to handle a client.
+ *
+ *	The writer thread stops waiting for more writes to add to a transaction
+ *	once every busy worker is waiting on it, as nothing else can arrive.
+ */
+static void keyd_commit_busy(bool busy)
+{
+	pthread_mutex_lock(&commit.lock);
+	if (busy) {
+		commit.busy++;
+	} else {
+		commit.busy--;
+		pthread_cond_signal(&commit.ready);
+	}
+	pthread_mutex_unlock(&commit.lock);
+}
+
+/**
+ *	keyd_commit_write - Pass a queued write on to the backend.
+ *	@dbctx: The writer thread's database context.
+ *	@write: The key write to store or delete.
+ *	@intrans: If we're already in a transaction.
+ *
+ *	Returns the backend's result; less than 0 if it failed and the
+ *	transaction has to be thrown away.
+ */
+static int keyd_commit_write(struct onak_dbctx *dbctx,
+		struct keyd_write *write, bool intrans)
+{
+	int ret;
+
+	free_publickey(write->old);
+	write->old = keyd_old_keys(dbctx, write->key, &write->fp, intrans);
+	if (write->key != NULL) {
+		return dbctx->store_key(dbctx, write->key, intrans,
+				write->update);
+	}
+
+	ret = dbctx->delete_key(dbctx, &write->fp, intrans);
+	logthing(LOGTHING_INFO, "Deleting 0x%" PRIX64 ", result: %d",
+			fingerprint2keyid(&write->fp), ret);
+
+	return ret;
+}
+
+/**
+ *	keyd_commit_one - Store a single key write in its own transaction.
+ *	@dbctx: The writer thread's database context.
+ *	@write: The key write to store.
+ *
+ *	Used to replay a batch whose transaction failed; the backend must
+ *	support aborttrans. Returns false if the key still couldn't be stored
+ *	after KEYD_STORE_RETRIES attempts.
+ */
+static bool keyd_commit_one(struct onak_dbctx *dbctx, struct keyd_write *write)
+{
+	bool intrans;
+	int tries, ret;
+
+	for (tries = 0; tries < KEYD_STORE_RETRIES; tries++) {
+		intrans = dbctx->starttrans(dbctx);
+		ret = keyd_commit_write(dbctx, write, intrans);
+		if (ret >= 0) {
+			dbctx->endtrans(dbctx);
+			return (ret == 0);
+		}
+		dbctx->aborttrans(dbctx);
+	}
+
+	logthing(LOGTHING_ERROR, "Couldn't store key, giving up on it.");
+	return false;
+}
+
+/**
+ *	keyd_committer - Writer thread, committing queued key writes.
+ *	@arg: Unused.
+ *
+ *	Rather than every store or update being its own transaction, paying for
+ *	its own log flush, we wait up to keyd_commit_window ms after the first
+ *	write arrives for others to join it and then commit them all at once.
+ *	Clients don't get any further replies until their writes are committed.
+ */
+static void *keyd_committer(__unused void *arg)
+{
+	struct onak_dbctx *dbctx = commit.dbctx;
+	struct keyd_write *batch, *write, *next;
+	struct timespec deadline;
+	bool intrans, failed;
+	int count, ret;
+
+	pthread_mutex_lock(&commit.lock);
+	while (true) {
+		while (commit.head == NULL && !commit.shutdown) {
+			pthread_cond_wait(&commit.ready, &commit.lock);
+		}
+		if (commit.head == NULL) {
+			break;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += config.keyd_commit_window / 1000;
+		deadline.tv_nsec += (config.keyd_commit_window % 1000) *
+			1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while (!commit.shutdown && commit.count < KEYD_MAX_COMMIT &&
+				commit.waiting < commit.busy) {
+			if (pthread_cond_timedwait(&commit.ready, &commit.lock,
+					&deadline) == ETIMEDOUT) {
+				break;
+			}
+		}
+
+		batch = commit.head;
+		count = commit.count;
+		commit.head = NULL;
+		commit.tail = &commit.head;
+		commit.count = 0;
+		pthread_mutex_unlock(&commit.lock);
+
+		logthing(LOGTHING_DEBUG, "Committing %d key writes.", count);
+		intrans = dbctx->starttrans(dbctx);
+		failed = false;
+		for (write = batch; write != NULL; write = write->next) {
+			ret = keyd_commit_write(dbctx, write, intrans);
+			if (ret < 0) {
+				failed = true;
+				if (dbctx->aborttrans != NULL) {
+					break;
+				}
+			}
+			write->failed = (ret != 0);
+		}
+
+		/*
+		 * If we can roll back then do so, rather than committing half
+		 * a batch, and store each key in its own transaction so one
+		 * bad key (or a deadlock) doesn't fail the rest.
+		 */
+		if (failed && dbctx->aborttrans != NULL) {
+			dbctx->aborttrans(dbctx);
+			logthing(LOGTHING_INFO,
+				"Transaction failed; retrying %d key writes "
+				"individually.", count);
+			for (write = batch; write != NULL;
+					write = write->next) {
+				write->failed = !keyd_commit_one(dbctx, write);
+			}
+		} else {
+			dbctx->endtrans(dbctx);
+		}
+
+		/*
+		 * Only drop cached copies now the new versions are visible,
+		 * so a concurrent fetch can't re-cache the old key.
+		 */
+		for (write = batch; write != NULL; write = write->next) {
+			if (write->key == NULL) {
+				keyd_cache_invalidate(&write->fp);
+			}
+			keyd_cache_invalidate_key(write->key);
+			keyd_cache_invalidate_key(write->old);
+			free_publickey(write->key);
+			write->key = NULL;
+			free_publickey(write->old);
+			write->old = NULL;
+		}
 
-static bool keyd_write_size(int fd, size_t size)
-{
-	ssize_t written;
-	bool ok = true;
+		pthread_mutex_lock(&stats_lock);
+		metrics.commits++;
+		metrics.committed_keys += count;
+		pthread_mutex_unlock(&stats_lock);
 
-	written = write(fd, &size, sizeof(size));
-	if (written != sizeof(size)) {
-		ok = false;
+		pthread_mutex_lock(&commit.lock);
+		for (write = batch; write != NULL; write = next) {
+			/* Once it's done the worker may free it. */
+			next = write->next;
+			write->done = true;
+		}
+		pthread_cond_broadcast(&commit.done);
 	}
+	pthread_mutex_unlock(&commit.lock);
 
-	return (ok);
+	return NULL;
 }
 
-static void iteratefunc(void *ctx, struct openpgp_publickey *key)
+/**
+ *	keyd_metrics_printf - Append formatted text to a metrics buffer.
+ */
+static void keyd_metrics_printf(struct buffer_ctx *buf, const char *fmt, ...)
 {
-	int      *fd = (int *) ctx;
-	uint64_t  keyid;
+	char line[256];
+	va_list ap;
+	int len;
 
-	if (key != NULL) {
-		get_keyid(key, &keyid);
-		logthing(LOGTHING_TRACE,
-				"Iterating over 0x%016" PRIX64 ".",
-				keyid);
+	va_start(ap, fmt);
+	len = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
 
-		keyd_write_key(*fd, key);
+	if (len > 0) {
+		if (len >= sizeof(line)) {
+			len = sizeof(line) - 1;
+		}
+		buffer_putchar(buf, len, (uint8_t *) line);
 	}
-
-	return;
 }
 
-static int sock_init(const char *sockname)
+static void keyd_metrics_histogram(struct buffer_ctx *buf, const char *name,
+		const char *help, struct keyd_histogram *hists)
 {
-	struct sockaddr_un sock;
-	int                fd = -1;
-	int                ret = -1;
-#ifdef HAVE_SYSTEMD
-	int                n;
-
-	n = sd_listen_fds(0);
-	if (n > 1) {
-		logthing(LOGTHING_ERROR,
-			"Too many file descriptors received from systemd.");
-	} else if (n == 1) {
-		fd = SD_LISTEN_FDS_START + 0;
-		if (sd_is_socket_unix(fd, SOCK_STREAM, 1, NULL, 0) <= 0) {
-			logthing(LOGTHING_ERROR,
-				"systemd passed an invalid socket.");
-			fd = -1;
+	uint64_t total;
+	int cmd, i;
+
+	keyd_metrics_printf(buf, "# HELP %s %s\n", name, help);
+	keyd_metrics_printf(buf, "# TYPE %s histogram\n", name);
+	for (cmd = 0; cmd < KEYD_CMD_LAST; cmd++) {
+		if (hists[cmd].count == 0) {
+			continue;
 		}
-		using_socket_activation = true;
-	} else {
-#endif
-		fd = socket(PF_UNIX, SOCK_STREAM, 0);
-		if (fd != -1) {
-			ret = fcntl(fd, F_SETFD, FD_CLOEXEC);
+		total = 0;
+		for (i = 0; i < KEYD_HIST_BUCKETS - 1; i++) {
+			total += hists[cmd].buckets[i];
+			keyd_metrics_printf(buf,
+				"%s_bucket{command=\"%s\",le=\"%.6f\"} %" PRIu64
+				"\n", name, keyd_cmd_names[cmd],
+				(double) (UINT64_C(1) << i) / 1000000, total);
 		}
+		keyd_metrics_printf(buf,
+			"%s_bucket{command=\"%s\",le=\"+Inf\"} %" PRIu64 "\n",
+			name, keyd_cmd_names[cmd], hists[cmd].count);
+		keyd_metrics_printf(buf, "%s_sum{command=\"%s\"} %.6f\n",
+			name, keyd_cmd_names[cmd],
+			(double) hists[cmd].sum / 1000000);
+		keyd_metrics_printf(buf, "%s_count{command=\"%s\"} %" PRIu64
+			"\n", name, keyd_cmd_names[cmd], hists[cmd].count);
+	}
+}
 
-		if (ret != -1) {
-			sock.sun_family = AF_UNIX;
-			strncpy(sock.sun_path, sockname,
-					sizeof(sock.sun_path) - 1);
-			unlink(sockname);
-			ret = bind(fd, (struct sockaddr *) &sock,
-					sizeof(sock));
+/**
+ *	keyd_format_metrics - Produce the reply to KEYD_CMD_METRICS.
+ *	@buf: Buffer to fill in; the caller must free buf->buffer.
+ *
+ *	Builds a snapshot of our counters and timing histograms in the
+ *	Prometheus text exposition format, suitable for handing straight to a
+ *	textfile collector or similar.
+ */
+static void keyd_format_metrics(struct buffer_ctx *buf)
+{
+	struct keyd_stats curstats;
+	struct keyd_histogram hists[KEYD_CMD_LAST];
+	uint64_t serialise[KEYD_CMD_LAST], sent[KEYD_CMD_LAST];
+	uint64_t commits, committed_keys;
+	int cmd;
+
+	buf->offset = 0;
+	buf->size = 8192;
+	buf->buffer = malloc(buf->size);
+
+	pthread_mutex_lock(&stats_lock);
+	memcpy(&curstats, stats, sizeof(curstats));
+	memcpy(serialise, metrics.serialise_usec, sizeof(serialise));
+	memcpy(sent, metrics.bytes_sent, sizeof(sent));
+	memcpy(hists, metrics.latency, sizeof(hists));
+	commits = metrics.commits;
+	committed_keys = metrics.committed_keys;
+	pthread_mutex_unlock(&stats_lock);
+
+	keyd_metrics_printf(buf, "# HELP onak_keyd_start_time_seconds "
+		"Start time of keyd since the Unix epoch.\n"
+		"# TYPE onak_keyd_start_time_seconds gauge\n");
+	keyd_metrics_printf(buf, "onak_keyd_start_time_seconds %lld\n",
+		(long long) curstats.started);
+	keyd_metrics_printf(buf, "# HELP onak_keyd_connections_total "
+		"Client connections accepted.\n"
+		"# TYPE onak_keyd_connections_total counter\n");
+	keyd_metrics_printf(buf, "onak_keyd_connections_total %" PRIu32 "\n",
+		curstats.connects);
+	keyd_metrics_printf(buf, "# HELP onak_keyd_commands_total "
+		"Commands received.\n"
+		"# TYPE onak_keyd_commands_total counter\n");
+	for (cmd = 0; cmd < KEYD_CMD_LAST; cmd++) {
+		if (curstats.command_stats[cmd] == 0) {
+			continue;
 		}
-
-		if (ret != -1) {
-			ret = listen(fd, 5);
+		keyd_metrics_printf(buf,
+			"onak_keyd_commands_total{command=\"%s\"} %" PRIu32
+			"\n", keyd_cmd_names[cmd],
+			curstats.command_stats[cmd]);
+	}
+	keyd_metrics_printf(buf, "# HELP onak_keyd_cache_hits_total "
+		"Key fetches answered from the cache.\n"
+		"# TYPE onak_keyd_cache_hits_total counter\n");
+	keyd_metrics_printf(buf, "onak_keyd_cache_hits_total %" PRIu32 "\n",
+		curstats.cache_hits);
+	keyd_metrics_printf(buf, "# HELP onak_keyd_cache_misses_total "
+		"Key fetches that went to the backend.\n"
+		"# TYPE onak_keyd_cache_misses_total counter\n");
+	keyd_metrics_printf(buf, "onak_keyd_cache_misses_total %" PRIu32 "\n",
+		curstats.cache_misses);
+
+	keyd_metrics_histogram(buf, "onak_keyd_command_duration_seconds",
+		"Time taken to handle each command.", hists);
+
+	pthread_mutex_lock(&stats_lock);
+	memcpy(hists, metrics.backend, sizeof(hists));
+	pthread_mutex_unlock(&stats_lock);
+	keyd_metrics_histogram(buf, "onak_keyd_backend_duration_seconds",
+		"Time spent in the database backend for each command.", hists);
+
+	keyd_metrics_printf(buf, "# HELP onak_keyd_serialise_seconds_total "
+		"Time spent serialising and parsing keys.\n"
+		"# TYPE onak_keyd_serialise_seconds_total counter\n");
+	for (cmd = 0; cmd < KEYD_CMD_LAST; cmd++) {
+		if (serialise[cmd] == 0) {
+			continue;
 		}
-
-		if (ret == -1) {
-			logthing(LOGTHING_ERROR,
-				"Couldn't open socket to listen on: %s (%d)",
-				strerror(errno),
-				errno);
-			close(fd);
-			fd = -1;
+		keyd_metrics_printf(buf,
+			"onak_keyd_serialise_seconds_total{command=\"%s\"} "
+			"%.6f\n", keyd_cmd_names[cmd],
+			(double) serialise[cmd] / 1000000);
+	}
+	keyd_metrics_printf(buf, "# HELP onak_keyd_sent_bytes_total "
+		"Bytes of key data sent to clients.\n"
+		"# TYPE onak_keyd_sent_bytes_total counter\n");
+	for (cmd = 0; cmd < KEYD_CMD_LAST; cmd++) {
+		if (sent[cmd] == 0) {
+			continue;
 		}
-#ifdef HAVE_SYSTEMD
+		keyd_metrics_printf(buf,
+			"onak_keyd_sent_bytes_total{command=\"%s\"} %" PRIu64
+			"\n", keyd_cmd_names[cmd], sent[cmd]);
 	}
-#endif
-
-	return fd;
+	keyd_metrics_printf(buf, "# HELP onak_keyd_commits_total "
+		"Transactions committed by the writer thread.\n"
+		"# TYPE onak_keyd_commits_total counter\n");
+	keyd_metrics_printf(buf, "onak_keyd_commits_total %" PRIu64 "\n",
+		commits);
+	keyd_metrics_printf(buf, "# HELP onak_keyd_committed_keys_total "
+		"Key writes committed by the writer thread.\n"
+		"# TYPE onak_keyd_committed_keys_total counter\n");
+	keyd_metrics_printf(buf, "onak_keyd_committed_keys_total %" PRIu64
+		"\n", committed_keys);
 }
 
-static int sock_do(struct onak_dbctx *dbctx, int fd)
+static int sock_do(struct keyd_worker *worker, int fd)
 {
+	struct onak_dbctx *dbctx = worker->dbctx;
 	uint32_t cmd = KEYD_CMD_UNKNOWN;
 	ssize_t  bytes = 0;
 	ssize_t  count = 0;
 	int	 ret = 0;
+	uint8_t  fplen = 0;
 	uint64_t keyid = 0;
 	char     *search = NULL;
-	struct openpgp_publickey *key = NULL;
+	struct openpgp_publickey *key = NULL, *oldkey = NULL;
 	struct openpgp_packet_list *packets = NULL;
 	struct buffer_ctx storebuf;
 	struct skshash hash;
 	struct openpgp_fingerprint fingerprint;
+	struct keyd_stats curstats;
+	struct keyd_cache_entry *entry;
+	struct keyd_iter_ctx iterctx;
+	uint32_t op;
+	uint64_t start, tstart;
+
+	worker->fd = fd;
+	worker->lastio = keyd_usec();
 
 	/*
-	 * Get the command from the client.
+	 * Get the command from the client. We're only called once epoll has
+	 * told us there's data waiting, so a zero byte read here means the
+	 * client has gone away.
 	 */
 	bytes = read(fd, &cmd, sizeof(cmd));
 
 	logthing(LOGTHING_DEBUG, "Read %zd bytes, command: %d", bytes, cmd);
 
-	if (bytes != sizeof(cmd)) {
+	if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		/* Spurious wakeup; nothing to do yet. */
+		return 0;
+	} else if (bytes > 0 && bytes != sizeof(cmd)) {
+		if (!keyd_read(worker, ((uint8_t *) &cmd) + bytes,
+				sizeof(cmd) - bytes)) {
+			ret = 1;
+		}
+	} else if (bytes != sizeof(cmd)) {
 		ret = 1;
 	}
 
 	if (ret == 0) {
+		start = keyd_usec();
+		op = cmd;
+		worker->backend_usec = 0;
+		worker->backend_calls = 0;
+		worker->serialise_usec = 0;
+		worker->bytes_sent = 0;
+
+		pthread_mutex_lock(&stats_lock);
 		if (cmd < KEYD_CMD_LAST) {
 			stats->command_stats[cmd]++;
 		} else {
 			stats->command_stats[KEYD_CMD_UNKNOWN]++;
 		}
+		pthread_mutex_unlock(&stats_lock);
+
+		/*
+		 * Everything has to see the results of any writes the client
+		 * has already sent us. Clients that don't get told when their
+		 * writes are committed also mustn't get any further reply, even
+		 * to another write, until they are.
+		 */
+		if (worker->writes != NULL) {
+			worker->backend_usec += keyd_commit_wait(worker);
+			worker->backend_calls++;
+		}
+
 		switch (cmd) {
 		case KEYD_CMD_VERSION:
-			if (!keyd_write_reply(fd, KEYD_REPLY_OK)) {
+			if (!keyd_write_reply(worker, KEYD_REPLY_OK)) {
 				ret = 1;
 			}
 			if (ret == 0) {
 				cmd = sizeof(keyd_version);
-				bytes = write(fd, &cmd, sizeof(cmd));
-				if (bytes != sizeof(cmd)) {
+				if (!keyd_write(worker, &cmd, sizeof(cmd))) {
 					ret = 1;
 				}
 			}
+			/*
+			 * Only tell clients about newer versions if they've
+			 * said they know about them; older ones complain about
+			 * anything but the version they speak.
+			 */
 			if (ret == 0) {
-				bytes = write(fd, &keyd_version,
-					sizeof(keyd_version));
-				if (bytes != sizeof(keyd_version)) {
+				cmd = (worker->version > keyd_min_version) ?
+					worker->version : keyd_min_version;
+				if (!keyd_write(worker, &cmd, sizeof(cmd))) {
 					ret = 1;
 				}
 			}
 			break;
 		case KEYD_CMD_GET:
-			if (!keyd_write_reply(fd, KEYD_REPLY_OK)) {
+		case KEYD_CMD_GET_FP:
+			if (!keyd_write_reply(worker, KEYD_REPLY_OK)) {
 				ret = 1;
 			}
 			if (ret == 0) {
-				if ((read(fd, &bytes, 1) != 1) ||
-						(bytes > MAX_FINGERPRINT_LEN)) {
+				if (!keyd_read(worker, &fplen, 1) ||
+						(fplen > MAX_FINGERPRINT_LEN)) {
 					ret = 1;
 				} else {
-					fingerprint.length = bytes;
-					bytes = read(fd, fingerprint.fp,
-						fingerprint.length);
-					if (bytes != fingerprint.length) {
+					fingerprint.length = fplen;
+					if (!keyd_read(worker, fingerprint.fp,
+							fingerprint.length)) {
 						ret = 1;
 					}
 				}
 			}
 			if (ret == 0) {
-				logthing(LOGTHING_INFO,
-						"Fetching by fingerprint"
-						", result: %d",
-						dbctx->fetch_key(dbctx,
-							&fingerprint,
-							&key, false));
-				if (key != NULL) {
-					keyd_write_key(fd, key);
-					free_publickey(key);
-					key = NULL;
-				} else {
-					if (!keyd_write_size(fd, 0)) {
-						ret = 1;
-					}
+				entry = keyd_fetch(worker, cmd, &fingerprint);
+				if (!keyd_send_entry(worker, entry)) {
+					ret = 1;
 				}
 			}
 			break;
 		case KEYD_CMD_GET_ID:
-			if (!keyd_write_reply(fd, KEYD_REPLY_OK)) {
+			if (!keyd_write_reply(worker, KEYD_REPLY_OK)) {
 				ret = 1;
 			}
 			if (ret == 0) {
-				bytes = read(fd, &keyid, sizeof(keyid));
-				if (bytes != sizeof(keyid)) {
+				if (!keyd_read(worker, &keyid, sizeof(keyid))) {
 					ret = 1;
 				}
 			}
 			if (ret == 0) {
-				logthing(LOGTHING_INFO,
-						"Fetching 0x%" PRIX64
-						", result: %d",
-						keyid,
-						dbctx->fetch_key_id(dbctx,
-							keyid,
-							&key, false));
-				if (key != NULL) {
-					keyd_write_key(fd, key);
-					free_publickey(key);
-					key = NULL;
-				} else {
-					if (!keyd_write_size(fd, 0)) {
-						ret = 1;
-					}
+				entry = keyd_fetch(worker, cmd, &keyid);
+				if (!keyd_send_entry(worker, entry)) {
+					ret = 1;
 				}
 			}
 			break;
-		case KEYD_CMD_GET_FP:
-			if (!keyd_write_reply(fd, KEYD_REPLY_OK)) {
+		case KEYD_CMD_GET_BATCH:
+			if (!keyd_write_reply(worker, KEYD_REPLY_OK)) {
 				ret = 1;
 			}
-			if (ret == 0) {
-				if ((read(fd, &bytes, 1) != 1) ||
-						(bytes > MAX_FINGERPRINT_LEN)) {
-					ret = 1;
-				} else {
-					fingerprint.length = bytes;
-					bytes = read(fd, fingerprint.fp,
-						fingerprint.length);
-					if (bytes != fingerprint.length) {
-						ret = 1;
-					}
-				}
-			}
-			if (ret == 0) {
-				logthing(LOGTHING_INFO,
-						"Fetching by fingerprint"
-						", result: %d",
-						dbctx->fetch_key_fp(dbctx,
-							&fingerprint,
-							&key, false));
-				if (key != NULL) {
-					keyd_write_key(fd, key);
-					free_publickey(key);
-					key = NULL;
-				} else {
-					if (!keyd_write_size(fd, 0)) {
-						ret = 1;
-					}
-				}
+			if (ret == 0 && !keyd_do_batch(worker)) {
+				ret = 1;
 			}
 			break;
 		case KEYD_CMD_GET_TEXT:
-			if (!keyd_write_reply(fd, KEYD_REPLY_OK)) {
+			if (!keyd_write_reply(worker, KEYD_REPLY_OK)) {
 				ret = 1;
 			}
 			if (ret == 0) {
-				bytes = read(fd, &count, sizeof(count));
-				if (bytes != sizeof(count)) {
+				if (!keyd_read(worker, &count, sizeof(count)) ||
+						count < 0) {
 					ret = 1;
 				}
 			}
 			if (ret == 0) {
 				search = malloc(count+1);
-				bytes = read(fd, search, count);
-				if (bytes != count) {
+				if (!keyd_read(worker, search, count)) {
 					ret = 1;
 					free(search);
 					break;
 				}
 				search[count] = 0;
+				tstart = keyd_usec();
+				count = dbctx->fetch_key_text(dbctx, search,
+						&key);
+				worker->backend_usec += keyd_usec() - tstart;
+				worker->backend_calls++;
 				logthing(LOGTHING_INFO,
-						"Fetching %s, result: %d",
-						search,
-						dbctx->fetch_key_text(dbctx,
-							search, &key));
+						"Fetching %s, result: %zd",
+						search, count);
 				if (key != NULL) {
-					keyd_write_key(fd, key);
+					if (!keyd_write_key(worker, key)) {
+						ret = 1;
+					}
 					free_publickey(key);
 					key = NULL;
 				} else {
-					if (!keyd_write_size(fd, 0)) {
+					if (!keyd_write_size(worker, 0)) {
 						ret = 1;
 					}
 				}
@@ -435,151 +2076,255 @@ static int sock_do(struct onak_dbctx *dbctx, int fd)
 			break;
 		case KEYD_CMD_STORE:
 		case KEYD_CMD_UPDATE:
-			if (!keyd_write_reply(fd, KEYD_REPLY_OK)) {
+			if (!keyd_write_reply(worker, KEYD_REPLY_OK)) {
 				ret = 1;
 			}
 			if (ret == 0) {
-				bytes = read(fd, &storebuf.size,
-					sizeof(storebuf.size));
-				logthing(LOGTHING_TRACE, "Reading %zu bytes.",
-					storebuf.size);
-				if (bytes != sizeof(storebuf.size)) {
+				if (!keyd_read(worker, &storebuf.size,
+						sizeof(storebuf.size))) {
 					ret = 1;
 				}
+				logthing(LOGTHING_TRACE, "Reading %zu bytes.",
+					storebuf.size);
 			}
 			if (ret == 0 && storebuf.size > 0) {
 				storebuf.buffer = malloc(storebuf.size);
 				storebuf.offset = 0;
-				bytes = count = 0;
-				while (bytes >= 0 && count < storebuf.size) {
-					bytes = read(fd,
-						&storebuf.buffer[count],
-						storebuf.size - count);
-					logthing(LOGTHING_TRACE,
-							"Read %zd bytes.",
-							bytes);
-					count += bytes;
-				}
 
-				if (bytes < 0) {
+				if (storebuf.buffer == NULL ||
+						!keyd_read(worker, storebuf.buffer,
+							storebuf.size)) {
 					ret = 1;
 				} else {
-					read_openpgp_stream(buffer_fetchchar,
-							&storebuf,
+					tstart = keyd_usec();
+					read_openpgp_buffer(storebuf.buffer,
+							storebuf.size,
 							&packets,
 							0);
 					parse_keys(packets, &key);
-					dbctx->store_key(dbctx, key, false,
-						(cmd == KEYD_CMD_UPDATE));
+					worker->serialise_usec +=
+						keyd_usec() - tstart;
 					free_packet_list(packets);
 					packets = NULL;
+					if (key == NULL) {
+						worker->write_failed = true;
+					}
+				}
+				if (key != NULL && commit.dbctx != NULL &&
+						keyd_commit_queue(worker, key, NULL,
+						(cmd == KEYD_CMD_UPDATE))) {
+					key = NULL;
+				} else if (key != NULL) {
+					tstart = keyd_usec();
+					oldkey = keyd_old_keys(dbctx, key,
+							NULL, false);
+					if (dbctx->store_key(dbctx, key, false,
+						(cmd == KEYD_CMD_UPDATE)) < 0) {
+						worker->write_failed = true;
+					}
+					worker->backend_usec +=
+						keyd_usec() - tstart;
+					worker->backend_calls++;
+					keyd_cache_invalidate_key(key);
+					keyd_cache_invalidate_key(oldkey);
 					free_publickey(key);
 					key = NULL;
+					free_publickey(oldkey);
+					oldkey = NULL;
 				}
 
 				free(storebuf.buffer);
 				storebuf.buffer = NULL;
 				storebuf.size = storebuf.offset = 0;
 			}
+			/*
+			 * Clients that asked for it are told whether this key
+			 * was stored once it's committed, rather than having to
+			 * send a KEYD_CMD_SYNC.
+			 */
+			if (ret == 0 && worker->version >= 6) {
+				worker->backend_usec +=
+					keyd_commit_wait(worker);
+				if (!keyd_write_reply(worker,
+						worker->write_failed ?
+						KEYD_REPLY_FAILED :
+						KEYD_REPLY_OK)) {
+					ret = 1;
+				}
+				worker->write_failed = false;
+			}
 			break;
 		case KEYD_CMD_DELETE:
-			if (!keyd_write_reply(fd, KEYD_REPLY_OK)) {
+			if (!keyd_write_reply(worker, KEYD_REPLY_OK)) {
 				ret = 1;
 			}
 			if (ret == 0) {
-				bytes = read(fd, &fingerprint,
-						sizeof(fingerprint));
-				if (bytes != sizeof(fingerprint)) {
+				if (!keyd_read(worker, &fingerprint,
+						sizeof(fingerprint))) {
 					ret = 1;
 				}
 			}
-			if (ret == 0) {
+			if (ret == 0 && commit.dbctx != NULL &&
+					keyd_commit_queue(worker, NULL,
+						&fingerprint, false)) {
+				/* The writer thread will do the delete */
+			} else if (ret == 0) {
+				tstart = keyd_usec();
+				oldkey = keyd_old_keys(dbctx, NULL,
+						&fingerprint, false);
+				count = dbctx->delete_key(dbctx, &fingerprint,
+						false);
+				worker->backend_usec += keyd_usec() - tstart;
+				worker->backend_calls++;
 				logthing(LOGTHING_INFO,
 						"Deleting 0x%" PRIX64
-						", result: %d",
-						keyid,
-						dbctx->delete_key(dbctx,
-							&fingerprint, false));
+						", result: %zd",
+						fingerprint2keyid(&fingerprint),
+						count);
+				if (count != 0) {
+					worker->write_failed = true;
+				}
+				keyd_cache_invalidate(&fingerprint);
+				keyd_cache_invalidate_key(oldkey);
+				free_publickey(oldkey);
+				oldkey = NULL;
+			}
+			/* As with stores, say whether it worked if asked. */
+			if (ret == 0 && worker->version >= 6) {
+				worker->backend_usec +=
+					keyd_commit_wait(worker);
+				if (!keyd_write_reply(worker,
+						worker->write_failed ?
+						KEYD_REPLY_FAILED :
+						KEYD_REPLY_OK)) {
+					ret = 1;
+				}
+				worker->write_failed = false;
 			}
 			break;
 		case KEYD_CMD_KEYITER:
-			if (!keyd_write_reply(fd, KEYD_REPLY_OK)) {
+			if (!keyd_write_reply(worker, KEYD_REPLY_OK)) {
 				ret = 1;
 			}
 			if (ret == 0) {
+				iterctx.worker = worker;
+				iterctx.ok = true;
 				dbctx->iterate_keys(dbctx, iteratefunc,
-					&fd);
-				if (!keyd_write_size(fd, 0)) {
+					&iterctx);
+				if (!iterctx.ok || !keyd_write_size(worker, 0)) {
 					ret = 1;
 				}
 			}
 			break;
 		case KEYD_CMD_CLOSE:
 			/* We're going to close the FD even if this fails */
-			(void) keyd_write_reply(fd, KEYD_REPLY_OK);
+			(void) keyd_write_reply(worker, KEYD_REPLY_OK);
 			ret = 1;
 			break;
 		case KEYD_CMD_QUIT:
 			/* We're going to quit even if this fails */
-			(void) keyd_write_reply(fd, KEYD_REPLY_OK);
+			(void) keyd_write_reply(worker, KEYD_REPLY_OK);
 			logthing(LOGTHING_NOTICE,
 				"Exiting due to quit request.");
 			ret = 1;
 			trytocleanup();
+			keyd_wakeup();
 			break;
 		case KEYD_CMD_STATS:
-			if (!keyd_write_reply(fd, KEYD_REPLY_OK)) {
+			if (!keyd_write_reply(worker, KEYD_REPLY_OK)) {
 				ret = 1;
 			}
 			if (ret == 0) {
-				cmd = sizeof(*stats);
-				bytes = write(fd, &cmd, sizeof(cmd));
-				if (bytes != sizeof(cmd)) {
+				pthread_mutex_lock(&stats_lock);
+				memcpy(&curstats, stats, sizeof(curstats));
+				pthread_mutex_unlock(&stats_lock);
+
+				cmd = (worker->version >= 6) ?
+					sizeof(curstats) : KEYD_STATS_V5_SIZE;
+				if (!keyd_write(worker, &cmd, sizeof(cmd))) {
 					ret = 1;
 				}
 			}
 			if (ret == 0) {
-				bytes = write(fd, stats, sizeof(*stats));
-				if (bytes != sizeof(*stats)) {
+				if (!keyd_write(worker, &curstats, cmd)) {
 					ret = 1;
 				}
 			}
 			break;
 		case KEYD_CMD_GET_SKSHASH:
-			if (!keyd_write_reply(fd, KEYD_REPLY_OK)) {
+			if (!keyd_write_reply(worker, KEYD_REPLY_OK)) {
 				ret = 1;
 			}
 			if (ret == 0) {
-				bytes = read(fd, hash.hash, sizeof(hash.hash));
-				if (bytes != sizeof(hash.hash)) {
+				if (!keyd_read(worker, hash.hash,
+						sizeof(hash.hash))) {
 					ret = 1;
 				}
 			}
 			if (ret == 0) {
-				logthing(LOGTHING_INFO,
-						"Fetching by hash"
-						", result: %d",
-						dbctx->fetch_key_skshash(dbctx,
-							&hash, &key));
-				if (key != NULL) {
-					keyd_write_key(fd, key);
-					free_publickey(key);
-					key = NULL;
-				} else {
-					if (!keyd_write_size(fd, 0)) {
-						ret = 1;
-					}
+				entry = keyd_fetch(worker, cmd, &hash);
+				if (!keyd_send_entry(worker, entry)) {
+					ret = 1;
+				}
+			}
+			break;
+		case KEYD_CMD_SYNC:
+			/* Any pending writes have been waited for above. */
+			if (!keyd_write_reply(worker, worker->write_failed ?
+					KEYD_REPLY_FAILED : KEYD_REPLY_OK)) {
+				ret = 1;
+			}
+			worker->write_failed = false;
+			break;
+		case KEYD_CMD_CLIENT_VERSION:
+			if (!keyd_write_reply(worker, KEYD_REPLY_OK)) {
+				ret = 1;
+			}
+			if (ret == 0) {
+				if (!keyd_read(worker, &cmd, sizeof(cmd))) {
+					ret = 1;
+				}
+			}
+			if (ret == 0) {
+				logthing(LOGTHING_DEBUG,
+					"Client speaks keyd protocol version "
+					"%d", cmd);
+				worker->version = (cmd < keyd_version) ?
+					cmd : keyd_version;
+			}
+			break;
+		case KEYD_CMD_METRICS:
+			if (!keyd_write_reply(worker, KEYD_REPLY_OK)) {
+				ret = 1;
+			}
+			if (ret == 0) {
+				keyd_format_metrics(&storebuf);
+				cmd = storebuf.offset;
+				if (!keyd_write(worker, &cmd, sizeof(cmd)) ||
+						!keyd_write(worker,
+							storebuf.buffer,
+							storebuf.offset)) {
+					ret = 1;
 				}
+				free(storebuf.buffer);
 			}
 			break;
 
 		default:
 			logthing(LOGTHING_ERROR, "Got unknown command: %d",
 					cmd);
-			if (!keyd_write_reply(fd, KEYD_REPLY_UNKNOWN_CMD)) {
+			if (!keyd_write_reply(worker, KEYD_REPLY_UNKNOWN_CMD)) {
 				ret = 1;
 			}
 		}
+
+		/*
+		 * Don't let a QUIT, or a client closing the connection, skew
+		 * the timings; we only want commands that did real work.
+		 */
+		if (ret == 0) {
+			keyd_record_timing(worker, op, keyd_usec() - start);
+		}
 	}
 
 	return(ret);
@@ -603,14 +2348,228 @@ static int sock_accept(int fd)
 	if (srv != -1) {
 		ret = fcntl(srv, F_SETFD, FD_CLOEXEC);
 	}
+	if (ret != -1) {
+		ret = fcntl(srv, F_SETFL, fcntl(srv, F_GETFL) | O_NONBLOCK);
+	}
 
 	if (ret != -1) {
+		pthread_mutex_lock(&stats_lock);
 		stats->connects++;
+		pthread_mutex_unlock(&stats_lock);
+	} else if (srv != -1) {
+		close(srv);
+		srv = -1;
 	}
 
 	return (srv);
 }
 
+/**
+ *	keyd_wakeup - Kick the main loop out of epoll_wait.
+ *
+ *	Used by the workers when they've been asked to quit, so the main
+ *	thread notices the cleanup flag without waiting for more activity.
+ */
+static void keyd_wakeup(void)
+{
+	uint64_t val = 1;
+
+	if (write(wakefd, &val, sizeof(val)) != sizeof(val)) {
+		logthing(LOGTHING_ERROR, "Couldn't wake main loop: %s",
+				strerror(errno));
+	}
+}
+
+/**
+ *	keyd_arm - (Re)arm a file descriptor in our epoll set.
+ *	@client: The file descriptor to arm, plus any KEYD_CLIENT_* flags.
+ *	@op: EPOLL_CTL_ADD for a new fd, EPOLL_CTL_MOD to re-arm an existing one.
+ *
+ *	All of our descriptors are registered EPOLLONESHOT; once an event has
+ *	been delivered for a client it's owned by whichever worker is handling
+ *	it until that worker re-arms it, so we never have two threads talking
+ *	to the same client at once.
+ */
+static bool keyd_arm(uint64_t client, int op)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.u64 = client;
+
+	if (epoll_ctl(epollfd, op, KEYD_CLIENT_FD(client), &ev) == -1) {
+		logthing(LOGTHING_ERROR, "Couldn't arm fd %d: %s",
+				KEYD_CLIENT_FD(client), strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ *	keyd_client_closed - Note that a client connection has gone away.
+ *
+ *	If we'd hit our client limit then the listening socket won't have been
+ *	re-armed, so do that now that there's room for another connection.
+ */
+static void keyd_client_closed(void)
+{
+	pthread_mutex_lock(&queue.lock);
+	if (numclients-- == MAX_CLIENTS) {
+		keyd_arm(listenfd, EPOLL_CTL_MOD);
+	}
+	pthread_mutex_unlock(&queue.lock);
+}
+
+static void keyd_queue_push(uint64_t client)
+{
+	pthread_mutex_lock(&queue.lock);
+	if (client & KEYD_CLIENT_SLOW) {
+		queue.slowclients[(queue.slowhead + queue.slowcount) %
+			MAX_CLIENTS] = client;
+		queue.slowcount++;
+	} else {
+		queue.clients[(queue.head + queue.count) % MAX_CLIENTS] =
+			client;
+		queue.count++;
+	}
+	pthread_cond_signal(&queue.ready);
+	pthread_mutex_unlock(&queue.lock);
+}
+
+/**
+ *	keyd_queue_pop - Get the next client with a pending request.
+ *
+ *	Blocks until there's a client to service. Slow clients are only handed
+ *	out while fewer than keyd_slow_limit() workers are busy with them, so
+ *	there's always a worker for clients that keep up. Returns false when
+ *	we're shutting down and the worker should exit.
+ */
+static bool keyd_queue_pop(uint64_t *client)
+{
+	bool ok = false;
+
+	pthread_mutex_lock(&queue.lock);
+	while (!ok) {
+		if (queue.slowcount > 0 && queue.slow < keyd_slow_limit()) {
+			*client = queue.slowclients[queue.slowhead];
+			queue.slowhead = (queue.slowhead + 1) % MAX_CLIENTS;
+			queue.slowcount--;
+			queue.slow++;
+			ok = true;
+		} else if (queue.count > 0) {
+			*client = queue.clients[queue.head];
+			queue.head = (queue.head + 1) % MAX_CLIENTS;
+			queue.count--;
+			ok = true;
+		} else if (queue.shutdown) {
+			break;
+		} else {
+			pthread_cond_wait(&queue.ready, &queue.lock);
+		}
+	}
+	pthread_mutex_unlock(&queue.lock);
+
+	return ok;
+}
+
+/**
+ *	keyd_slow_done - Note a worker has finished with a slow client.
+ *
+ *	Lets another worker pick up a slow client that's waiting its turn.
+ */
+static void keyd_slow_done(void)
+{
+	pthread_mutex_lock(&queue.lock);
+	queue.slow--;
+	if (queue.slowcount > 0) {
+		pthread_cond_signal(&queue.ready);
+	}
+	pthread_mutex_unlock(&queue.lock);
+}
+
+static void *keyd_worker(void *arg)
+{
+	struct keyd_worker *worker = (struct keyd_worker *) arg;
+	uint64_t client;
+	int fd, ret, count;
+
+	while (keyd_queue_pop(&client)) {
+		fd = KEYD_CLIENT_FD(client);
+		logthing(LOGTHING_DEBUG,
+			"Worker %d handling connection %d.", worker->id, fd);
+		worker->write_failed = (client & KEYD_CLIENT_WRITE_FAILED);
+		worker->version = KEYD_CLIENT_VERSION(client);
+		worker->slow = (client & KEYD_CLIENT_SLOW);
+		keyd_commit_busy(true);
+		/*
+		 * Work through any pipelined requests, up to a limit so one
+		 * busy client can't monopolise the worker.
+		 */
+		count = 0;
+		do {
+			ret = sock_do(worker, fd);
+		} while (ret == 0 && ++count < KEYD_MAX_PIPELINE &&
+				!cleanup() && keyd_pending(fd));
+		/*
+		 * Don't leave the client's writes uncommitted while it waits
+		 * for its next turn; if any failed remember that so a later
+		 * KEYD_CMD_SYNC can report it.
+		 */
+		keyd_commit_wait(worker);
+		keyd_commit_busy(false);
+		client = fd;
+		if (worker->write_failed) {
+			client |= KEYD_CLIENT_WRITE_FAILED;
+		}
+		client |= KEYD_CLIENT_SET_VERSION(worker->version);
+		if (worker->slow) {
+			client |= KEYD_CLIENT_SLOW;
+			keyd_slow_done();
+		}
+		if (ret || cleanup()) {
+			sock_close(fd);
+			keyd_client_closed();
+			logthing(LOGTHING_DEBUG,
+				"Closed connection %d.", fd);
+		} else if (!keyd_arm(client, EPOLL_CTL_MOD)) {
+			sock_close(fd);
+			keyd_client_closed();
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ *	keyd_accept - Accept any pending connections on the listening socket.
+ *	@fd: The listening socket.
+ */
+static void keyd_accept(int fd)
+{
+	int client;
+
+	pthread_mutex_lock(&queue.lock);
+	while (numclients < MAX_CLIENTS) {
+		client = sock_accept(fd);
+		if (client == -1) {
+			break;
+		}
+		if (!keyd_arm(client, EPOLL_CTL_ADD)) {
+			sock_close(client);
+			continue;
+		}
+		numclients++;
+		logthing(LOGTHING_INFO, "Accepted connection %d.", client);
+	}
+	/* Leave the listening socket disarmed until we have space. */
+	if (numclients < MAX_CLIENTS) {
+		keyd_arm(fd, EPOLL_CTL_MOD);
+	}
+	pthread_mutex_unlock(&queue.lock);
+}
+
 static void usage(void)
 {
 	puts("keyd " ONAK_VERSION " - backend key serving daemon for the "
@@ -626,13 +2585,16 @@ static void usage(void)
 
 int main(int argc, char *argv[])
 {
-	int fd = -1, fdcount, i, curfd, clients[MAX_CLIENTS];
-	struct pollfd rfds[MAX_CLIENTS];
+	int fd = -1, i, nfds, numworkers;
+	struct epoll_event events[MAX_EVENTS];
+	struct keyd_worker *workers = NULL;
+	pthread_condattr_t condattr;
+	sigset_t allsigs, oldsigs;
+	uint64_t val;
 	char sockname[100];
 	char *configfile = NULL;
 	bool foreground = false;
 	int optchar;
-	struct onak_dbctx *dbctx;
 
 	while ((optchar = getopt(argc, argv, "c:fh")) != -1 ) {
 		switch (optchar) {
@@ -674,69 +2636,146 @@ int main(int argc, char *argv[])
 	}
 	stats->started = time(NULL);
 
+	cache.maxsize = (size_t) config.keyd_cache_size * 1024 * 1024;
+
+	numworkers = config.keyd_workers;
+	if (numworkers < 1) {
+		numworkers = 1;
+	}
+
 	snprintf(sockname, sizeof(sockname) - 1, "%s/%s",
 			config.sock_dir, KEYD_SOCKET);
 	fd = sock_init(sockname);
 
 	if (fd != -1) {
-		memset(rfds, 0, sizeof(rfds));
-		rfds[0].fd = fd;
-		rfds[0].events = POLLIN;
-		fdcount = 1;
-		memset(clients, -1, sizeof (clients));
+		listenfd = fd;
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+		epollfd = epoll_create1(EPOLL_CLOEXEC);
+		wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (epollfd == -1 || wakefd == -1) {
+			logthing(LOGTHING_CRITICAL,
+				"Couldn't create epoll instance: %s",
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		keyd_arm(fd, EPOLL_CTL_ADD);
+		memset(events, 0, sizeof(events));
+		events[0].events = EPOLLIN;
+		events[0].data.u64 = wakefd;
+		epoll_ctl(epollfd, EPOLL_CTL_ADD, wakefd, &events[0]);
+
+		/*
+		 * Each worker gets its own DB context, so backends don't need
+		 * to cope with a single handle being used from multiple
+		 * threads.
+		 */
+		workers = calloc(numworkers, sizeof(*workers));
+		if (workers == NULL) {
+			logthing(LOGTHING_CRITICAL,
+				"Couldn't allocate memory for workers.");
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < numworkers; i++) {
+			workers[i].id = i;
+			workers[i].dbctx = config.dbinit(config.backend,
+					false);
+			if (workers[i].dbctx == NULL) {
+				logthing(LOGTHING_CRITICAL,
+					"Failed to open key database.");
+				exit(EXIT_FAILURE);
+			}
+		}
 
-		dbctx = config.dbinit(config.backend, false);
+		/*
+		 * The writer thread's deadline is measured against the
+		 * monotonic clock so it isn't upset by changes to the time.
+		 */
+		pthread_condattr_init(&condattr);
+		pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+		pthread_cond_init(&commit.ready, &condattr);
+		pthread_condattr_destroy(&condattr);
+		if (config.keyd_commit_window > 0) {
+			commit.dbctx = config.dbinit(config.backend, false);
+			if (commit.dbctx == NULL) {
+				logthing(LOGTHING_CRITICAL,
+					"Failed to open key database.");
+				exit(EXIT_FAILURE);
+			}
+		}
 
-		logthing(LOGTHING_NOTICE, "Accepting connections%s",
-			using_socket_activation ? " (via systemd)" : "");
-		while (!cleanup() && poll(rfds, fdcount, -1) != -1) {
-			/*
-			 * Deal with existing clients first; if we're at our
-			 * connection limit then processing them might free
-			 * things up and let us accept the next client below.
-			 */
-			curfd = 0;
-			for (i = 0; i < MAX_CLIENTS; i++) {
-				if (clients[i] != -1 && (rfds[++curfd].revents & POLLIN)) {
-					logthing(LOGTHING_DEBUG,
-						"Handling connection for client %d.", i);
-					if (sock_do(dbctx, clients[i])) {
-						sock_close(clients[i]);
-						clients[i] = -1;
-						logthing(LOGTHING_DEBUG,
-							"Closed connection for client %d.", i);
-					}
-				}
+		/* Only the main thread should see our signals. */
+		sigfillset(&allsigs);
+		pthread_sigmask(SIG_SETMASK, &allsigs, &oldsigs);
+		for (i = 0; i < numworkers; i++) {
+			if (pthread_create(&workers[i].thread, NULL,
+					keyd_worker, &workers[i]) != 0) {
+				logthing(LOGTHING_CRITICAL,
+					"Couldn't start worker thread %d.", i);
+				exit(EXIT_FAILURE);
 			}
-			/*
-			 * Check if we have a new incoming connection to accept.
-			 */
-			if (rfds[0].revents & POLLIN) {
-				for (i = 0; i < MAX_CLIENTS; i++) {
-					if (clients[i] == -1) {
-						break;
-					}
-				}
-				if (i < MAX_CLIENTS) {
-					logthing(LOGTHING_INFO,
-						"Accepted connection %d.", i);
-					clients[i] = sock_accept(fd);
+		}
+		if (commit.dbctx != NULL && pthread_create(&commit.thread,
+				NULL, keyd_committer, NULL) != 0) {
+			logthing(LOGTHING_CRITICAL,
+				"Couldn't start writer thread.");
+			exit(EXIT_FAILURE);
+		}
+		pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+
+		logthing(LOGTHING_NOTICE,
+			"Accepting connections%s with %d workers",
+			using_socket_activation ? " (via systemd)" : "",
+			numworkers);
+		while (!cleanup()) {
+			nfds = epoll_wait(epollfd, events, MAX_EVENTS, -1);
+			if (nfds == -1) {
+				if (errno == EINTR) {
+					continue;
 				}
+				logthing(LOGTHING_ERROR,
+					"epoll_wait failed: %s",
+					strerror(errno));
+				break;
 			}
-
-			memset(rfds, 0, sizeof(rfds));
-			rfds[0].fd = fd;
-			rfds[0].events = POLLIN;
-			fdcount = 1;
-			for (i = 0; i < MAX_CLIENTS; i++) {
-				if (clients[i] != -1) {
-					rfds[fdcount].fd = clients[i];
-					rfds[fdcount].events = POLLIN;
-					fdcount++;
+			for (i = 0; i < nfds; i++) {
+				if (events[i].data.u64 == (uint64_t) wakefd) {
+					(void) !read(wakefd, &val,
+							sizeof(val));
+				} else if (events[i].data.u64 == (uint64_t) fd) {
+					keyd_accept(fd);
+				} else {
+					keyd_queue_push(events[i].data.u64);
 				}
 			}
 		}
-		dbctx->cleanupdb(dbctx);
+
+		pthread_mutex_lock(&queue.lock);
+		queue.shutdown = true;
+		pthread_cond_broadcast(&queue.ready);
+		pthread_mutex_unlock(&queue.lock);
+		for (i = 0; i < numworkers; i++) {
+			pthread_join(workers[i].thread, NULL);
+			workers[i].dbctx->cleanupdb(workers[i].dbctx);
+		}
+		free(workers);
+		workers = NULL;
+
+		/* Workers wait for their writes, so none can still be queued. */
+		if (commit.dbctx != NULL) {
+			pthread_mutex_lock(&commit.lock);
+			commit.shutdown = true;
+			pthread_cond_signal(&commit.ready);
+			pthread_mutex_unlock(&commit.lock);
+			pthread_join(commit.thread, NULL);
+			commit.dbctx->cleanupdb(commit.dbctx);
+			commit.dbctx = NULL;
+		}
+		pthread_cond_destroy(&commit.ready);
+		keyd_cache_cleanup();
+
+		close(wakefd);
+		close(epollfd);
 #ifdef HAVE_SYSTEMD
 		if (!using_socket_activation) {
 #endif
@@ -20,6 +20,7 @@
 #ifndef __KEYD_H__
 #define __KEYD_H__
 
+#include <stddef.h>
 #include <stdint.h>
 
 /**
@@ -46,6 +47,10 @@ enum keyd_ops {
 	KEYD_CMD_GET_FP,
 	KEYD_CMD_UPDATE,
 	KEYD_CMD_GET,
+	KEYD_CMD_GET_BATCH,
+	KEYD_CMD_METRICS,
+	KEYD_CMD_SYNC,
+	KEYD_CMD_CLIENT_VERSION,
 	KEYD_CMD_LAST			/* Placeholder */
 };
 
@@ -54,13 +59,68 @@ enum keyd_ops {
  */
 enum keyd_reply {
 	KEYD_REPLY_OK = 0,
-	KEYD_REPLY_UNKNOWN_CMD = 1
+	KEYD_REPLY_UNKNOWN_CMD = 1,
+	KEYD_REPLY_FAILED = 2
 };
 
 /**
  * @brief Version of the keyd protocol currently supported
+ *
+ * Version 6 is a superset of version 5. It adds:
+ *
+ * - Pipelining; a client may send further commands without waiting for the
+ *   reply to the previous one. Replies are always sent in the order the
+ *   commands were received.
+ *
+ * - @a KEYD_CMD_GET_BATCH, which takes a uint32_t count followed by that
+ *   many lookups, each a uint8_t command (@a KEYD_CMD_GET,
+ *   @a KEYD_CMD_GET_FP, @a KEYD_CMD_GET_ID or @a KEYD_CMD_GET_SKSHASH),
+ *   a uint8_t length and the fingerprint, key ID or hash. The reply is a
+ *   single size_t length followed by a frame holding, for each lookup in
+ *   order, a size_t length and the key data (zero length if not found).
+ *
+ * - @a KEYD_CMD_METRICS, which replies with a uint32_t length followed by
+ *   per command latency histograms, backend and serialisation times and
+ *   bytes sent, in the Prometheus text exposition format.
+ *
+ * - @a KEYD_CMD_SYNC, which is only answered once all keys previously
+ *   stored or updated on the connection have been committed to the backend.
+ *   The reply is @a KEYD_REPLY_OK if they all were, or @a KEYD_REPLY_FAILED
+ *   if any could not be stored.
+ *
+ * - @a KEYD_CMD_CLIENT_VERSION, which takes a uint32_t giving the protocol
+ *   version the client speaks. A client should send it before
+ *   @a KEYD_CMD_VERSION; a version 5 keyd answers it with
+ *   @a KEYD_REPLY_UNKNOWN_CMD.
+ *
+ * keyd answers @a KEYD_CMD_VERSION with the newest version both it and the
+ * client speak, taking clients that haven't sent @a KEYD_CMD_CLIENT_VERSION
+ * to speak version 5, and only changes its replies for clients that have
+ * said they speak version 6:
+ *
+ * - @a KEYD_CMD_STORE and @a KEYD_CMD_UPDATE send a second reply after the
+ *   key data, once the key has been committed to the backend:
+ *   @a KEYD_REPLY_OK if it was stored, @a KEYD_REPLY_FAILED if not.
+ *   @a KEYD_CMD_DELETE does the same after the fingerprint, replying
+ *   @a KEYD_REPLY_FAILED if the key couldn't be deleted or wasn't there.
+ *
+ * - The @a KEYD_CMD_STATS reply is the whole of struct keyd_stats, rather
+ *   than the first @a KEYD_STATS_V5_SIZE bytes.
+ *
+ * Version 5 clients instead aren't sent any further replies until their
+ * stores, updates and deletes have been committed.
  */
-static const uint32_t keyd_version = 5;
+static const uint32_t keyd_version = 6;
+
+/**
+ * @brief The oldest keyd protocol version we can talk to
+ */
+static const uint32_t keyd_min_version = 5;
+
+/**
+ * @brief Maximum number of lookups in a @a KEYD_CMD_GET_BATCH request
+ */
+#define KEYD_MAX_BATCH 4096
 
 /**
  * @brief Response structure for the @a KEYD_CMD_STATS response
@@ -72,6 +132,19 @@ struct keyd_stats {
 	uint32_t connects;
 	/** Count of the number of times each command has been used */
 	uint32_t command_stats[KEYD_CMD_LAST];
+	/** Number of fetches answered from the key cache */
+	uint32_t cache_hits;
+	/** Number of fetches that had to go to the backend */
+	uint32_t cache_misses;
 };
 
+/**
+ * @brief Size of the @a KEYD_CMD_STATS reply sent to version 5 clients
+ *
+ * They only know about commands up to @a KEYD_CMD_GET, and expect nothing
+ * after their counts.
+ */
+#define KEYD_STATS_V5_SIZE (offsetof(struct keyd_stats, command_stats) + \
+		(KEYD_CMD_GET + 1) * sizeof(uint32_t))
+
 #endif /* __KEYD_H__ */
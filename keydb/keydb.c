@@ -25,7 +25,9 @@
  */
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "decodekey.h"
 #include "hash.h"
@@ -35,6 +37,7 @@
 #include "ll.h"
 #include "mem.h"
 #include "merge.h"
+#include "onak-conf.h"
 #include "openpgp.h"
 #include "sendsync.h"
 #include "stats.h"
@@ -90,6 +93,7 @@ struct ll *generic_getkeysigs(struct onak_dbctx *dbctx,
 	struct openpgp_signedpacket_list *uids = NULL;
 	struct openpgp_packet_list *cursig;
 	struct openpgp_publickey *publickey = NULL;
+	struct stats_key *sigkey;
 
 	dbctx->fetch_key_id(dbctx, keyid, &publickey, false);
 
@@ -97,9 +101,11 @@ struct ll *generic_getkeysigs(struct onak_dbctx *dbctx,
 		for (uids = publickey->uids; uids != NULL; uids = uids->next) {
 			for (cursig = uids->sigs; cursig != NULL;
 					cursig = cursig->next) {
-				sigs = lladd(sigs,
-						createandaddtohash(sig_keyid(
-							cursig->packet)));
+				sigkey = createandaddtohash(sig_keyid(
+							cursig->packet));
+				if (sigkey != NULL) {
+					sigs = lladd(sigs, sigkey);
+				}
 			}
 		}
 		if (revoked != NULL) {
@@ -142,6 +148,10 @@ struct ll *generic_cached_getkeysigs(struct onak_dbctx *dbctx, uint64_t keyid)
 		if (key == NULL) {
 			key = createandaddtohash(keyid);
 		}
+		if (key == NULL) {
+			llfree(sigs, NULL);
+			return NULL;
+		}
 		key->sigs = sigs;
 		key->revoked = revoked;
 		for (cursig = key->sigs; cursig != NULL;
@@ -156,6 +166,21 @@ struct ll *generic_cached_getkeysigs(struct onak_dbctx *dbctx, uint64_t keyid)
 }
 
 #ifdef NEED_UPDATEKEYS
+/*
+ * How many times we'll try to store a key on its own before giving up on it,
+ * if the backend keeps aborting its transaction.
+ */
+#define UPDATE_KEY_RETRIES	3
+
+static uint64_t update_time_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
 /**
  *	update_keys - Takes a list of public keys and updates them in the DB.
  *	@keys: The keys to update in the DB.
@@ -168,6 +193,13 @@ struct ll *generic_cached_getkeysigs(struct onak_dbctx *dbctx, uint64_t keyid)
  *	update to contain the minimum set of updates required to get from what
  *	we had before to what we have now (ie the set of data that was added to
  *	the DB). Returns the number of entirely new keys added.
+ *
+ *	Keys are committed in batches of up to update_batch_keys keys, or
+ *	whatever's been done in update_batch_time ms. If the backend fails to
+ *	store a key and can abort the transaction (e.g. a db4 deadlock) the
+ *	whole batch is rolled back and redone a key per transaction. A key we
+ *	can't merge (e.g. out of memory) is treated the same way, or dropped
+ *	if the backend can't roll back.
  */
 int generic_update_keys(struct onak_dbctx *dbctx,
 		struct openpgp_publickey **keys,
@@ -175,13 +207,17 @@ int generic_update_keys(struct onak_dbctx *dbctx,
 		bool updateonly,
 		bool sendsync)
 {
-	struct openpgp_publickey **curkey, *tmp = NULL;
+	struct openpgp_publickey **curkey, **batchstart, *tmp = NULL;
 	struct openpgp_publickey *oldkey = NULL;
 	struct openpgp_fingerprint fp;
+	struct skshash hash;
 	int newkeys = 0, ret;
-	bool intrans;
+	int batchkeys = 0, batchnew = 0, batchleft = 0, singlekeys = 0;
+	int retries = 0;
+	uint64_t batchtime = 0;
+	bool intrans = false, failed, isnew;
 
-	curkey = keys;
+	curkey = batchstart = keys;
 	while (*curkey != NULL) {
 		get_fingerprint((*curkey)->publickey, &fp);
 		if (blacklist && array_find(blacklist, &fp)) {
@@ -193,13 +229,36 @@ int generic_update_keys(struct onak_dbctx *dbctx,
 			continue;
 		}
 
-		intrans = dbctx->starttrans(dbctx);
+		if (batchkeys == 0) {
+			intrans = dbctx->starttrans(dbctx);
+			batchstart = curkey;
+			batchtime = update_time_ms();
+			batchnew = batchleft = 0;
+		}
+		batchkeys++;
+		failed = isnew = false;
+
+		/*
+		 * Peers mostly send us keys we already have; if the backend
+		 * has exactly this key there's nothing to merge.
+		 */
+		if (dbctx->have_skshash != NULL &&
+				get_skshash(*curkey, &hash) == ONAK_E_OK &&
+				dbctx->have_skshash(dbctx, &hash)) {
+			logthing(LOGTHING_INFO, "Skipping unchanged key.");
+			tmp = *curkey;
+			*curkey = (*curkey)->next;
+			tmp->next = NULL;
+			free_publickey(tmp);
+			goto next;
+		}
 
 		ret = dbctx->fetch_key_fp(dbctx, &fp, &oldkey, intrans);
 		if (ret == 0 && updateonly) {
 			logthing(LOGTHING_INFO,
 				"Skipping new key as update only set.");
 			curkey = &(*curkey)->next;
+			batchleft++;
 			goto next;
 		}
 
@@ -210,31 +269,105 @@ int generic_update_keys(struct onak_dbctx *dbctx,
 		 * one that we send out.
 		 */
 		if (oldkey != NULL) {
-			merge_keys(oldkey, *curkey);
-			if ((*curkey)->sigs == NULL &&
+			if (merge_keys(oldkey, *curkey) != 0) {
+				/*
+				 * We may have only merged part of it, so
+				 * don't store it. If we can roll back we
+				 * retry it like any other failure, otherwise
+				 * drop the key so it isn't sent to our peers.
+				 */
+				logthing(LOGTHING_ERROR,
+					"Couldn't merge key.");
+				free_publickey(oldkey);
+				oldkey = NULL;
+				failed = true;
+				if (dbctx->aborttrans == NULL) {
+					tmp = *curkey;
+					*curkey = (*curkey)->next;
+					tmp->next = NULL;
+					free_publickey(tmp);
+					goto next;
+				}
+			} else if ((*curkey)->sigs == NULL &&
 					(*curkey)->uids == NULL &&
 					(*curkey)->subkeys == NULL) {
 				tmp = *curkey;
 				*curkey = (*curkey)->next;
 				tmp->next = NULL;
 				free_publickey(tmp);
+				free_publickey(oldkey);
+				oldkey = NULL;
+				goto next;
 			} else {
 				logthing(LOGTHING_INFO,
 					"Merged key; storing updated key.");
-				dbctx->store_key(dbctx, oldkey, intrans,
-					true);
-				curkey = &(*curkey)->next;
+				failed = dbctx->store_key(dbctx, oldkey,
+						intrans, true) < 0;
+				free_publickey(oldkey);
+				oldkey = NULL;
 			}
-			free_publickey(oldkey);
-			oldkey = NULL;
 		} else {
 			logthing(LOGTHING_INFO,
 				"Storing completely new key.");
-			dbctx->store_key(dbctx, *curkey, intrans, false);
+			failed = dbctx->store_key(dbctx, *curkey, intrans,
+					false) < 0;
+			isnew = true;
+		}
+
+		/*
+		 * If we can roll back then do so and try again. What's left of
+		 * each key in the list is what it added to the DB, so merging
+		 * it in again gets us the same result.
+		 */
+		if (failed && dbctx->aborttrans != NULL) {
+			dbctx->aborttrans(dbctx);
+			newkeys -= batchnew;
+			/*
+			 * Only the keys still in the list get redone;
+			 * anything we dropped from the batch stays dropped.
+			 */
+			if (batchleft > 0) {
+				logthing(LOGTHING_INFO,
+					"Transaction failed; retrying %d keys "
+					"individually.", batchleft + 1);
+				singlekeys = batchleft + 1;
+				curkey = batchstart;
+			} else if (++retries >= UPDATE_KEY_RETRIES) {
+				logthing(LOGTHING_ERROR,
+					"Couldn't store key, giving up on it.");
+				tmp = *curkey;
+				*curkey = (*curkey)->next;
+				tmp->next = NULL;
+				free_publickey(tmp);
+				retries = 0;
+				if (singlekeys > 0) {
+					singlekeys--;
+				}
+			}
+			batchkeys = 0;
+			continue;
+		}
+
+		if (isnew) {
 			newkeys++;
-			curkey = &(*curkey)->next;
+			batchnew++;
 		}
+		curkey = &(*curkey)->next;
+		batchleft++;
 next:
+		retries = 0;
+		if (singlekeys > 0) {
+			singlekeys--;
+		}
+		if (singlekeys > 0 || batchkeys >= config.update_batch_keys ||
+				(config.update_batch_time > 0 &&
+				 update_time_ms() - batchtime >=
+				 (uint64_t) config.update_batch_time)) {
+			dbctx->endtrans(dbctx);
+			batchkeys = 0;
+		}
+	}
+	if (batchkeys > 0) {
 		dbctx->endtrans(dbctx);
 	}
 
@@ -52,12 +52,13 @@ struct onak_db4_dbctx {
 	DB_ENV *dbenv;	/* The database environment context */
 	int numdbs;	/* Number of data databases in use */
 	DB **dbconns;	/* Connections to the key data databases */
-	DB *worddb;	/* Connection to the word lookup database */
+	DB *worddb;	/* Connection to the word posting list database */
 	DB *id32db;	/* Connection to the 32 bit ID lookup database */
 	DB *id64db;	/* Connection to the 64 bit ID lookup database */
 	DB *skshashdb;	/* Connection to the SKS hash database */
 	DB *subkeydb;	/* Connection to the subkey ID lookup database */
 	DB_TXN *txn;	/* Our current transaction ID */
+	bool oldwords;	/* worddb is an unconverted, read only word index */
 };
 
 DB *keydb_id(struct onak_db4_dbctx *privctx, uint64_t keyid)
@@ -161,6 +162,32 @@ static void db4_endtrans(struct onak_dbctx *dbctx)
 	return;
 }
 
+/**
+ *	aborttrans - Abort a transaction.
+ *
+ *	Ends a transaction, discarding any changes made in it. Needed when
+ *	we've been picked as the victim of a deadlock.
+ */
+static void db4_aborttrans(struct onak_dbctx *dbctx)
+{
+	struct onak_db4_dbctx *privctx = (struct onak_db4_dbctx *) dbctx->priv;
+	int ret;
+
+	log_assert(privctx->dbenv != NULL);
+	log_assert(privctx->txn != NULL);
+
+	ret = privctx->txn->abort(privctx->txn);
+	if (ret != 0) {
+		logthing(LOGTHING_CRITICAL,
+				"Error aborting transaction: %s",
+				db_strerror(ret));
+		exit(1);
+	}
+	privctx->txn = NULL;
+
+	return;
+}
+
 /**
  *	db4_upgradedb - Upgrade a DB4 database
  *
@@ -238,6 +265,19 @@ static int db4_upgradedb(struct onak_dbctx *dbctx)
 			db_strerror(ret));
 	}
 
+	ret = db_create(&curdb, NULL, 0);
+	if (ret == 0) {
+		snprintf(buf, sizeof(buf) - 1, "%s/wordpostdb",
+			dbctx->config->location);
+		logthing(LOGTHING_DEBUG, "Upgrading %s", buf);
+		curdb->upgrade(curdb, buf, 0);
+		curdb->close(curdb, 0);
+	} else {
+		logthing(LOGTHING_ERROR, "Error upgrading DB %s : %s",
+			buf,
+			db_strerror(ret));
+	}
+
 	ret = db_create(&curdb, NULL, 0);
 	if (ret == 0) {
 		snprintf(buf, sizeof(buf) - 1, "%s/id32db", dbctx->config->location);
@@ -294,91 +334,108 @@ static int db4_upgradedb(struct onak_dbctx *dbctx)
 }
 
 /**
- *	fetch_key_fp - Given a fingerprint fetch the key from storage.
+ *	db4_fetch_key_data - Look up the stored data for a key.
+ *	@fingerprint: The fingerprint to fetch.
+ *	@data: Returns the key data; owned by the DB handle.
+ *	@dosubkey: Also look for keys with a matching subkey.
+ *
+ *	Must be called within a transaction. The returned data is only valid
+ *	until the next call on the key data DB handle. Returns 0 if the key
+ *	was found, otherwise a DB error code.
  */
-static int db4_fetch_key_int(struct onak_dbctx *dbctx,
+static int db4_fetch_key_data(struct onak_db4_dbctx *privctx,
 		struct openpgp_fingerprint *fingerprint,
-		struct openpgp_publickey **publickey,
-		bool intrans,
+		DBT *data,
 		bool dosubkey)
 {
-	struct onak_db4_dbctx *privctx = (struct onak_db4_dbctx *) dbctx->priv;
-	struct openpgp_packet_list *packets = NULL;
-	DBT key, data;
+	DBT key;
 	int ret = 0;
-	int numkeys = 0;
-	struct buffer_ctx fetchbuf;
 	struct openpgp_fingerprint subfp;
 
 	memset(&key, 0, sizeof(key));
-	memset(&data, 0, sizeof(data));
+	memset(data, 0, sizeof(*data));
 
-	data.size = 0;
-	data.data = NULL;
+	data->size = 0;
+	data->data = NULL;
 
 	key.size = fingerprint->length;
 	key.data = fingerprint->fp;
 
-	if (!intrans) {
-		db4_starttrans(dbctx);
-	}
-
 	ret = keydb_fp(privctx, fingerprint)->get(keydb_fp(privctx,
 							fingerprint),
 			privctx->txn,
 			&key,
-			&data,
+			data,
 			0); /* flags*/
 
 	if (ret == DB_NOTFOUND && dosubkey) {
 		/* If we didn't find the key ID see if it's a subkey ID */
 		memset(&key, 0, sizeof(key));
-		memset(&data, 0, sizeof(data));
-		data.data = subfp.fp;
-		data.ulen = MAX_FINGERPRINT_LEN;
-		data.flags = DB_DBT_USERMEM;
+		memset(data, 0, sizeof(*data));
+		data->data = subfp.fp;
+		data->ulen = MAX_FINGERPRINT_LEN;
+		data->flags = DB_DBT_USERMEM;
 		key.data = fingerprint->fp;
 		key.size = fingerprint->length;
 
 		ret = privctx->subkeydb->get(privctx->subkeydb,
 			privctx->txn,
 			&key,
-			&data,
+			data,
 			0); /* flags*/
 
 		if (ret == 0) {
 			/* We got a subkey match; retrieve the actual key */
 			memset(&key, 0, sizeof(key));
-			key.size = subfp.length = data.size;
+			key.size = subfp.length = data->size;
 			key.data = subfp.fp;
 
-			memset(&data, 0, sizeof(data));
-			data.size = 0;
-			data.data = NULL;
+			memset(data, 0, sizeof(*data));
+			data->size = 0;
+			data->data = NULL;
 
 			ret = keydb_fp(privctx, &subfp)->get(
 				keydb_fp(privctx, &subfp),
 				privctx->txn,
 				&key,
-				&data,
+				data,
 				0); /* flags*/
 		}
 	}
 
-	if (ret == 0) {
-		fetchbuf.buffer = data.data;
-		fetchbuf.offset = 0;
-		fetchbuf.size = data.size;
-		read_openpgp_stream(buffer_fetchchar, &fetchbuf,
-				&packets, 0);
+	if (ret != 0 && ret != DB_NOTFOUND) {
+		logthing(LOGTHING_ERROR,
+				"Problem retrieving key: %s",
+				db_strerror(ret));
+	}
+
+	return ret;
+}
+
+/**
+ *	fetch_key_fp - Given a fingerprint fetch the key from storage.
+ */
+static int db4_fetch_key_int(struct onak_dbctx *dbctx,
+		struct openpgp_fingerprint *fingerprint,
+		struct openpgp_publickey **publickey,
+		bool intrans,
+		bool dosubkey)
+{
+	struct onak_db4_dbctx *privctx = (struct onak_db4_dbctx *) dbctx->priv;
+	struct openpgp_packet_list *packets = NULL;
+	DBT data;
+	int numkeys = 0;
+
+	if (!intrans) {
+		db4_starttrans(dbctx);
+	}
+
+	if (db4_fetch_key_data(privctx, fingerprint, &data, dosubkey) == 0) {
+		read_openpgp_buffer(data.data, data.size, &packets, 0);
 		parse_keys(packets, publickey);
 		free_packet_list(packets);
 		packets = NULL;
 		numkeys++;
-	} else if (ret != DB_NOTFOUND) {
-		logthing(LOGTHING_ERROR,
-				"Problem retrieving key: %s",
-				db_strerror(ret));
 	}
 
 	if (!intrans) {
@@ -388,6 +445,90 @@ static int db4_fetch_key_int(struct onak_dbctx *dbctx,
 	return (numkeys);
 }
 
+/*
+ * Add the data for a key to a raw key. The first key is borrowed from the
+ * DB handle; if we find more they have to be copied.
+ */
+static void db4_add_raw(struct openpgp_raw_key *raw, DBT *data)
+{
+	uint8_t *buf;
+
+	if (raw->data == NULL) {
+		raw->data = data->data;
+		raw->length = data->size;
+		raw->storage = OPENPGP_RAW_BORROWED;
+		return;
+	}
+
+	buf = realloc((void *) raw->data, raw->length + data->size);
+	memcpy(&buf[raw->length], data->data, data->size);
+	raw->data = buf;
+	raw->length += data->size;
+}
+
+/*
+ * Take our own copy of borrowed key data, before a further lookup on the DB
+ * handle it belongs to overwrites it.
+ */
+static void db4_own_raw(struct openpgp_raw_key *raw)
+{
+	uint8_t *buf;
+
+	if (raw->data != NULL && raw->storage == OPENPGP_RAW_BORROWED) {
+		buf = malloc(raw->length);
+		memcpy(buf, raw->data, raw->length);
+		raw->data = buf;
+		raw->storage = OPENPGP_RAW_MALLOC;
+	}
+}
+
+/**
+ *	fetch_key_fp_raw - Given a fingerprint fetch the stored key data.
+ */
+static int db4_fetch_key_raw_int(struct onak_dbctx *dbctx,
+		struct openpgp_fingerprint *fingerprint,
+		struct openpgp_raw_key *raw,
+		bool intrans,
+		bool dosubkey)
+{
+	struct onak_db4_dbctx *privctx = (struct onak_db4_dbctx *) dbctx->priv;
+	DBT data;
+	int numkeys = 0;
+
+	memset(raw, 0, sizeof(*raw));
+
+	if (!intrans) {
+		db4_starttrans(dbctx);
+	}
+
+	if (db4_fetch_key_data(privctx, fingerprint, &data, dosubkey) == 0) {
+		db4_add_raw(raw, &data);
+		numkeys++;
+	}
+
+	if (!intrans) {
+		db4_endtrans(dbctx);
+	}
+
+	return (numkeys);
+}
+
+static int db4_fetch_key_raw(struct onak_dbctx *dbctx,
+		struct openpgp_fingerprint *fingerprint,
+		struct openpgp_raw_key *raw,
+		bool intrans)
+{
+	return db4_fetch_key_raw_int(dbctx, fingerprint, raw, intrans, false);
+}
+
+static int db4_fetch_key_fp_raw(struct onak_dbctx *dbctx,
+		struct openpgp_fingerprint *fingerprint,
+		struct openpgp_raw_key *raw,
+		bool intrans)
+{
+	return db4_fetch_key_raw_int(dbctx, fingerprint, raw, intrans, true);
+}
+
 static int db4_fetch_key(struct onak_dbctx *dbctx,
 		struct openpgp_fingerprint *fingerprint,
 		struct openpgp_publickey **publickey,
@@ -412,7 +553,7 @@ static int db4_fetch_key_fp(struct onak_dbctx *dbctx,
  *
  *	We use the hex representation of the keyid as the filename to fetch the
  *	key from. The key is stored in the file as a binary OpenPGP stream of
- *	packets, so we can just use read_openpgp_stream() to read the packets
+ *	packets, so we can just use read_openpgp_buffer() to read the packets
  *	in and then parse_keys() to parse the packets into a publickey
  *	structure.
  */
@@ -492,115 +633,785 @@ static int db4_fetch_key_id(struct onak_dbctx *dbctx, uint64_t keyid,
 	return (numkeys);
 }
 
+/**
+ *	fetch_key_id_raw - Given a keyid fetch the stored key data.
+ *	@keyid: The keyid to fetch.
+ *	@raw: Returns the key data.
+ *	@intrans: If we're already in a transaction.
+ */
+static int db4_fetch_key_id_raw(struct onak_dbctx *dbctx, uint64_t keyid,
+		struct openpgp_raw_key *raw,
+		bool intrans)
+{
+	struct onak_db4_dbctx *privctx = (struct onak_db4_dbctx *) dbctx->priv;
+	DBT key, data, keydata;
+	DBC *cursor = NULL;
+	int ret = 0;
+	int numkeys = 0;
+	uint32_t  shortkeyid = 0;
+	struct openpgp_fingerprint fingerprint;
+	bool first;
+
+	memset(raw, 0, sizeof(*raw));
+
+	if (!intrans) {
+		db4_starttrans(dbctx);
+	}
+
+	memset(&key, 0, sizeof(key));
+	/* If the key ID fits in 32 bits assume it's a short key id */
+	if (keyid < 0x100000000LL) {
+		ret = privctx->id32db->cursor(privctx->id32db,
+				privctx->txn,
+				&cursor,
+				0);   /* flags */
+
+		shortkeyid = keyid & 0xFFFFFFFF;
+		key.data = &shortkeyid;
+		key.size = sizeof(shortkeyid);
+	} else {
+		ret = privctx->id64db->cursor(privctx->id64db,
+				privctx->txn,
+				&cursor,
+				0); /* flags*/
+
+		key.data = &keyid;
+		key.size = sizeof(keyid);
+	}
+
+	if (ret != 0) {
+		if (!intrans) {
+			db4_endtrans(dbctx);
+		}
+		return 0;
+	}
+
+	memset(&data, 0, sizeof(data));
+	data.ulen = MAX_FINGERPRINT_LEN;
+	data.data = fingerprint.fp;
+	data.flags = DB_DBT_USERMEM;
+
+	first = true;
+	while (cursor->c_get(cursor, &key, &data,
+				first ? DB_SET : DB_NEXT_DUP) == 0) {
+		/* We got a match; retrieve the actual key */
+		fingerprint.length = data.size;
+
+		db4_own_raw(raw);
+		if (db4_fetch_key_data(privctx, &fingerprint, &keydata,
+					true) == 0) {
+			db4_add_raw(raw, &keydata);
+			numkeys++;
+		}
+
+		memset(&data, 0, sizeof(data));
+		data.ulen = MAX_FINGERPRINT_LEN;
+		data.data = fingerprint.fp;
+		data.flags = DB_DBT_USERMEM;
+		first = false;
+	}
+	cursor->c_close(cursor);
+	cursor = NULL;
+
+	if (!intrans) {
+		db4_endtrans(dbctx);
+	}
+
+	return (numkeys);
+}
+
+/*
+ * The word index maps each word to a posting list; the sorted fingerprints
+ * of the keys with that word in one of their UIDs. Lists are split into
+ * blocks of up to DB4_POSTING_BLOCK fingerprints, each stored under the
+ * word, a 0 byte, and the length and bytes of the first fingerprint in the
+ * block, so the BTREE order matches fingerprint_cmp() and we can seek
+ * straight to the block that would hold any given key. Within a block each
+ * fingerprint is front coded against the previous one. A record under just
+ * the word holds the number of keys in its list, so searches can start
+ * from the rarest word.
+ */
+#define DB4_POSTING_BLOCK	256
+
+static void db4_varint_put(struct buffer_ctx *buf, uint32_t value)
+{
+	uint8_t c;
+
+	do {
+		c = value & 0x7F;
+		value >>= 7;
+		if (value != 0) {
+			c |= 0x80;
+		}
+		buffer_putchar(buf, 1, &c);
+	} while (value != 0);
+}
+
+static bool db4_varint_get(const uint8_t *data, size_t len, size_t *offset,
+		uint32_t *value)
+{
+	int shift = 0;
+
+	*value = 0;
+	while (*offset < len && shift < 32) {
+		*value |= (uint32_t) (data[*offset] & 0x7F) << shift;
+		if ((data[(*offset)++] & 0x80) == 0) {
+			return true;
+		}
+		shift += 7;
+	}
+
+	return false;
+}
+
+/*
+ * Encode a block of sorted fingerprints; a count, then for each the length,
+ * the number of leading bytes it shares with the one before and the rest.
+ */
+static void db4_posting_encode(struct openpgp_fingerprint *fps, int count,
+		struct buffer_ctx *buf)
+{
+	uint8_t c, shared;
+	int i;
+
+	db4_varint_put(buf, count);
+	for (i = 0; i < count; i++) {
+		shared = 0;
+		while (i > 0 && shared < fps[i].length &&
+				shared < fps[i - 1].length &&
+				fps[i].fp[shared] == fps[i - 1].fp[shared]) {
+			shared++;
+		}
+		c = fps[i].length;
+		buffer_putchar(buf, 1, &c);
+		buffer_putchar(buf, 1, &shared);
+		buffer_putchar(buf, fps[i].length - shared,
+				&fps[i].fp[shared]);
+	}
+}
+
+static bool db4_posting_decode(const uint8_t *data, size_t len,
+		struct keyarray *list)
+{
+	struct openpgp_fingerprint *fp;
+	size_t offset = 0, shared;
+	uint32_t count, i;
+
+	list->count = 0;
+	if (!db4_varint_get(data, len, &offset, &count)) {
+		return false;
+	}
+	if (list->size < count) {
+		fp = realloc(list->keys, count * sizeof(*fp));
+		if (fp == NULL) {
+			return false;
+		}
+		list->keys = fp;
+		list->size = count;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (offset + 2 > len) {
+			return false;
+		}
+		fp = &list->keys[i];
+		fp->length = data[offset++];
+		shared = data[offset++];
+		if (fp->length > MAX_FINGERPRINT_LEN || shared > fp->length ||
+				(i == 0 && shared != 0) ||
+				(i > 0 && shared > fp[-1].length) ||
+				offset + fp->length - shared > len) {
+			return false;
+		}
+		if (shared > 0) {
+			memcpy(fp->fp, fp[-1].fp, shared);
+		}
+		memcpy(&fp->fp[shared], &data[offset], fp->length - shared);
+		offset += fp->length - shared;
+	}
+	list->count = count;
+
+	return true;
+}
+
+/*
+ * Build the DB key for the block of the word's posting list starting with
+ * fp. buf must have room for the word plus MAX_FINGERPRINT_LEN + 2.
+ */
+static size_t db4_posting_key(uint8_t *buf, const char *word, size_t wordlen,
+		struct openpgp_fingerprint *fp)
+{
+	memcpy(buf, word, wordlen);
+	buf[wordlen] = 0;
+	buf[wordlen + 1] = fp->length;
+	memcpy(&buf[wordlen + 2], fp->fp, fp->length);
+
+	return wordlen + 2 + fp->length;
+}
+
+static bool db4_posting_isblock(DBT *key, const char *word, size_t wordlen)
+{
+	uint8_t *data = key->data;
+
+	return key->size > wordlen + 2 &&
+		memcmp(data, word, wordlen) == 0 && data[wordlen] == 0 &&
+		key->size == wordlen + 2 + data[wordlen + 1];
+}
+
+/*
+ * Position the cursor on the block of the word's posting list that fp
+ * belongs in; the last one starting at or before fp, or failing that the
+ * first one. The block is decoded into list and its first fingerprint put
+ * in first. Returns DB_NOTFOUND if the word has no blocks at all.
+ */
+static int db4_posting_find(DBC *cursor, uint8_t *buf, const char *word,
+		size_t wordlen, struct openpgp_fingerprint *fp,
+		struct openpgp_fingerprint *first, struct keyarray *list)
+{
+	DBT key, data;
+	size_t keylen;
+	int ret;
+
+	memset(&key, 0, sizeof(key));
+	memset(&data, 0, sizeof(data));
+	key.data = buf;
+	key.size = keylen = db4_posting_key(buf, word, wordlen, fp);
+	ret = cursor->c_get(cursor, &key, &data, DB_SET_RANGE);
+	if (ret == 0 && !(key.size == keylen &&
+				memcmp(key.data, buf, keylen) == 0)) {
+		ret = cursor->c_get(cursor, &key, &data, DB_PREV);
+		if (ret == 0 && !db4_posting_isblock(&key, word, wordlen)) {
+			ret = DB_NOTFOUND;
+		}
+	} else if (ret == DB_NOTFOUND) {
+		ret = cursor->c_get(cursor, &key, &data, DB_LAST);
+		if (ret == 0 && !db4_posting_isblock(&key, word, wordlen)) {
+			return DB_NOTFOUND;
+		}
+	}
+
+	/* Nothing at or before fp, so try the first block for the word */
+	if (ret == DB_NOTFOUND) {
+		key.data = buf;
+		key.size = wordlen + 1;
+		ret = cursor->c_get(cursor, &key, &data, DB_SET_RANGE);
+		if (ret == 0 && !db4_posting_isblock(&key, word, wordlen)) {
+			ret = DB_NOTFOUND;
+		}
+	}
+	if (ret != 0) {
+		return ret;
+	}
+
+	if (!db4_posting_decode(data.data, data.size, list)) {
+		logthing(LOGTHING_ERROR, "Corrupt posting list for word %s",
+				word);
+		return DB_NOTFOUND;
+	}
+	first->length = ((uint8_t *) key.data)[wordlen + 1];
+	memcpy(first->fp, &((uint8_t *) key.data)[wordlen + 2],
+			first->length);
+
+	return 0;
+}
+
+/*
+ * Store a run of sorted fingerprints from a word's posting list as blocks,
+ * splitting it into evenly sized ones if it's grown too big for one.
+ */
+static int db4_posting_put(struct onak_db4_dbctx *privctx, uint8_t *buf,
+		const char *word, size_t wordlen,
+		struct openpgp_fingerprint *fps, int count)
+{
+	struct buffer_ctx storebuf;
+	DBT key, data;
+	int blocks, blocksize, ret = 0;
+
+	blocks = (count + DB4_POSTING_BLOCK - 1) / DB4_POSTING_BLOCK;
+	blocksize = (blocks > 1) ? (count + blocks - 1) / blocks : count;
+	storebuf.size = 8192;
+	storebuf.buffer = malloc(storebuf.size);
+	if (storebuf.buffer == NULL) {
+		return ENOMEM;
+	}
+
+	while (ret == 0 && count > 0) {
+		if (blocksize > count) {
+			blocksize = count;
+		}
+		storebuf.offset = 0;
+		db4_posting_encode(fps, blocksize, &storebuf);
+
+		memset(&key, 0, sizeof(key));
+		memset(&data, 0, sizeof(data));
+		key.data = buf;
+		key.size = db4_posting_key(buf, word, wordlen, fps);
+		data.data = storebuf.buffer;
+		data.size = storebuf.offset;
+		ret = privctx->worddb->put(privctx->worddb, privctx->txn,
+				&key, &data, 0);
+
+		fps += blocksize;
+		count -= blocksize;
+	}
+	free(storebuf.buffer);
+
+	return ret;
+}
+
+/*
+ * Adjust the count of keys with a word, removing it once there are none.
+ */
+static int db4_posting_count(struct onak_db4_dbctx *privctx,
+		const char *word, size_t wordlen, int change)
+{
+	struct buffer_ctx storebuf;
+	uint8_t countbuf[8];
+	uint32_t count = 0;
+	size_t offset = 0;
+	DBT key, data;
+	int ret;
+
+	memset(&key, 0, sizeof(key));
+	memset(&data, 0, sizeof(data));
+	key.data = (void *) word;
+	key.size = wordlen;
+	ret = privctx->worddb->get(privctx->worddb, privctx->txn,
+			&key, &data, 0);
+	if (ret == 0) {
+		db4_varint_get(data.data, data.size, &offset, &count);
+	} else if (ret != DB_NOTFOUND) {
+		return ret;
+	}
+
+	if (change < 0 && count < (uint32_t) -change) {
+		count = 0;
+	} else {
+		count += change;
+	}
+
+	if (count == 0) {
+		ret = privctx->worddb->del(privctx->worddb, privctx->txn,
+				&key, 0);
+		return (ret == DB_NOTFOUND) ? 0 : ret;
+	}
+
+	storebuf.buffer = (char *) countbuf;
+	storebuf.size = sizeof(countbuf);
+	storebuf.offset = 0;
+	db4_varint_put(&storebuf, count);
+
+	memset(&data, 0, sizeof(data));
+	data.data = countbuf;
+	data.size = storebuf.offset;
+
+	return privctx->worddb->put(privctx->worddb, privctx->txn,
+			&key, &data, 0);
+}
+
+/*
+ * Add or remove a fingerprint from a word's posting list.
+ */
+static int db4_posting_update(struct onak_db4_dbctx *privctx,
+		const char *word, struct openpgp_fingerprint *fp, bool add)
+{
+	struct keyarray list = { NULL, 0, 0 };
+	struct openpgp_fingerprint first;
+	DBC *cursor = NULL;
+	uint8_t *buf;
+	size_t wordlen;
+	bool found, haveblock;
+	size_t pos;
+	int ret;
+
+	wordlen = strlen(word);
+	buf = malloc(wordlen + MAX_FINGERPRINT_LEN + 2);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	ret = privctx->worddb->cursor(privctx->worddb, privctx->txn,
+			&cursor, 0);
+	if (ret != 0) {
+		free(buf);
+		return ret;
+	}
+
+	ret = db4_posting_find(cursor, buf, word, wordlen, fp, &first, &list);
+	haveblock = (ret == 0);
+	if (ret == DB_NOTFOUND) {
+		ret = 0;
+	}
+
+	/* Find where fp is, or where it should go, in the block */
+	for (pos = 0; pos < list.count &&
+			fingerprint_cmp(&list.keys[pos], fp) < 0; pos++) ;
+	found = pos < list.count && fingerprint_cmp(&list.keys[pos], fp) == 0;
+
+	if (ret != 0 || found == add) {
+		goto out;
+	}
+
+	if (add) {
+		if (list.count >= list.size) {
+			list.size = list.size ? list.size * 2 : 1;
+			list.keys = realloc(list.keys,
+					list.size * sizeof(*list.keys));
+			if (list.keys == NULL) {
+				ret = ENOMEM;
+				goto out;
+			}
+		}
+		memmove(&list.keys[pos + 1], &list.keys[pos],
+				(list.count - pos) * sizeof(*list.keys));
+		list.keys[pos] = *fp;
+		list.count++;
+	} else {
+		memmove(&list.keys[pos], &list.keys[pos + 1],
+				(list.count - pos - 1) * sizeof(*list.keys));
+		list.count--;
+	}
+
+	/* If the block now starts somewhere else its key has changed */
+	if (haveblock && (list.count == 0 ||
+			fingerprint_cmp(&first, &list.keys[0]) != 0)) {
+		ret = cursor->c_del(cursor, 0);
+	}
+	if (ret == 0) {
+		ret = db4_posting_put(privctx, buf, word, wordlen,
+				list.keys, list.count);
+	}
+	if (ret == 0) {
+		ret = db4_posting_count(privctx, word, wordlen,
+				add ? 1 : -1);
+	}
+
+out:
+	cursor->c_close(cursor);
+	array_free(&list);
+	free(buf);
+
+	return ret;
+}
+
+/*
+ * Add a word -> fingerprint mapping to the word index. Returns true if we
+ * deadlocked.
+ */
+static bool db4_word_add(struct onak_db4_dbctx *privctx, const char *word,
+		struct openpgp_fingerprint *fp)
+{
+	int ret;
+
+	ret = db4_posting_update(privctx, word, fp, true);
+	if (ret != 0) {
+		logthing(LOGTHING_ERROR, "Problem storing word: %s",
+				db_strerror(ret));
+	}
+
+	return (ret == DB_LOCK_DEADLOCK);
+}
+
+/*
+ * Remove a word -> fingerprint mapping from the word index. Returns true if
+ * we deadlocked.
+ */
+static bool db4_word_del(struct onak_db4_dbctx *privctx, const char *word,
+		struct openpgp_fingerprint *fp)
+{
+	int ret;
+
+	ret = db4_posting_update(privctx, word, fp, false);
+	if (ret != 0) {
+		logthing(LOGTHING_ERROR, "Problem deleting word: %s",
+				db_strerror(ret));
+	}
+
+	return (ret == DB_LOCK_DEADLOCK);
+}
+
+/**
+ * struct db4_posting_iter - Position within a word's posting list.
+ * @word: The word.
+ * @wordlen: The length of @word.
+ * @count: The number of keys with the word.
+ * @buf: Space to build DB keys for the word in.
+ * @block: The block of the posting list we last looked at.
+ */
+struct db4_posting_iter {
+	char *word;
+	size_t wordlen;
+	uint32_t count;
+	uint8_t *buf;
+	struct keyarray block;
+};
+
+static int db4_posting_iter_cmp(const void *a, const void *b)
+{
+	const struct db4_posting_iter *ia = a, *ib = b;
+
+	return (ia->count > ib->count) - (ia->count < ib->count);
+}
+
+/*
+ * Check if a word's posting list contains fp. Successive calls should be
+ * for increasing fingerprints; we only go back to the DB when fp is past
+ * the block we already have.
+ */
+static bool db4_posting_contains(DBC *cursor, struct db4_posting_iter *iter,
+		struct openpgp_fingerprint *fp)
+{
+	struct openpgp_fingerprint first;
+
+	if (iter->block.count == 0 ||
+			fingerprint_cmp(fp, &iter->block.keys[0]) < 0 ||
+			fingerprint_cmp(fp,
+				&iter->block.keys[iter->block.count - 1]) > 0) {
+		if (db4_posting_find(cursor, iter->buf, iter->word,
+				iter->wordlen, fp, &first,
+				&iter->block) != 0) {
+			iter->block.count = 0;
+			return false;
+		}
+	}
+
+	return array_find(&iter->block, fp);
+}
+
+/*
+ * Search an old style word index, with a record for each word/fingerprint
+ * pair. Only used when we've been opened read only on a database that's
+ * still to be converted to posting lists.
+ */
+static int db4_fetch_key_text_dup(struct onak_dbctx *dbctx,
+		struct ll *wordlist, struct openpgp_publickey **publickey)
+{
+	struct onak_db4_dbctx *privctx = (struct onak_db4_dbctx *) dbctx->priv;
+	struct keyarray keylist = { NULL, 0, 0 };
+	struct keyarray newkeylist = { NULL, 0, 0 };
+	struct openpgp_fingerprint fingerprint;
+	struct ll *curword = NULL;
+	DBC *cursor = NULL;
+	DBT key, data;
+	bool firstpass = true;
+	size_t i;
+	int numkeys = 0;
+	int ret;
+
+	for (curword = wordlist; curword != NULL; curword = curword->next) {
+		db4_starttrans(dbctx);
+
+		ret = privctx->worddb->cursor(privctx->worddb,
+				privctx->txn,
+				&cursor,
+				0);   /* flags */
+		if (ret != 0) {
+			db4_endtrans(dbctx);
+			break;
+		}
+
+		memset(&key, 0, sizeof(key));
+		memset(&data, 0, sizeof(data));
+		key.data = curword->object;
+		key.size = strlen(curword->object);
+		ret = cursor->c_get(cursor, &key, &data, DB_SET);
+		while (ret == 0) {
+			/* Skip any old style 64 bit keyid entries */
+			if (data.size >= 16 &&
+					data.size <= MAX_FINGERPRINT_LEN) {
+				fingerprint.length = data.size;
+				memcpy(fingerprint.fp, data.data, data.size);
+				/*
+				 * Only keep keys that had all the previous
+				 * words too.
+				 */
+				if (firstpass ||
+					array_find(&keylist, &fingerprint)) {
+					array_add(&newkeylist, &fingerprint);
+				}
+			}
+			ret = cursor->c_get(cursor, &key, &data, DB_NEXT_DUP);
+		}
+		cursor->c_close(cursor);
+		cursor = NULL;
+		db4_endtrans(dbctx);
+
+		array_free(&keylist);
+		keylist = newkeylist;
+		newkeylist.keys = NULL;
+		newkeylist.count = newkeylist.size = 0;
+		firstpass = false;
+	}
+
+	if (config.maxkeys >= 0 && keylist.count > (size_t) config.maxkeys) {
+		keylist.count = config.maxkeys;
+	}
+
+	db4_starttrans(dbctx);
+	for (i = 0; i < keylist.count; i++) {
+		numkeys += db4_fetch_key_fp(dbctx, &keylist.keys[i],
+			publickey,
+			true);
+	}
+	db4_endtrans(dbctx);
+	array_free(&keylist);
+
+	return numkeys;
+}
+
 /**
  *	fetch_key_text - Trys to find the keys that contain the supplied text.
  *	@search: The text to search for.
  *	@publickey: A pointer to a structure to return the key in.
  *
  *	This function searches for the supplied text and returns the keys that
- *	contain it.
+ *	contain it. We walk the posting list of the rarest word in the search
+ *	and check each key in it against the lists for the other words,
+ *	stopping once we have as many keys as we're allowed to return.
  */
 static int db4_fetch_key_text(struct onak_dbctx *dbctx, const char *search,
 		struct openpgp_publickey **publickey)
 {
 	struct onak_db4_dbctx *privctx = (struct onak_db4_dbctx *) dbctx->priv;
 	DBC *cursor = NULL;
+	DBC *seekcursor = NULL;
 	DBT key, data;
-	int ret;
-	int i;
+	int ret = 0;
+	int i, j;
+	size_t k;
 	int numkeys;
+	int numwords;
 	char *searchtext = NULL;
 	struct ll *wordlist = NULL;
 	struct ll *curword = NULL;
+	struct db4_posting_iter *iters = NULL;
+	struct keyarray block = { NULL, 0, 0 };
 	struct keyarray keylist = { NULL, 0, 0 };
-	struct keyarray newkeylist = { NULL, 0, 0 };
-	int firstpass = 1;
-	struct openpgp_fingerprint fingerprint;
+	size_t offset;
+	bool match, done = false;
 
 	numkeys = 0;
 	searchtext = strdup(search);
 	wordlist = makewordlist(wordlist, searchtext);
+	numwords = llsize(wordlist);
+	if (numwords == 0) {
+		goto out;
+	}
+	if (privctx->oldwords) {
+		numkeys = db4_fetch_key_text_dup(dbctx, wordlist, publickey);
+		goto out;
+	}
+	iters = calloc(numwords, sizeof(*iters));
+	if (iters == NULL) {
+		goto out;
+	}
 
-	for (curword = wordlist; curword != NULL; curword = curword->next) {
-		db4_starttrans(dbctx);
+	db4_starttrans(dbctx);
 
-		ret = privctx->worddb->cursor(privctx->worddb,
-				privctx->txn,
-				&cursor,
-				0);   /* flags */
+	/* Find out how many keys have each word */
+	for (i = 0, curword = wordlist; curword != NULL;
+			i++, curword = curword->next) {
+		iters[i].word = curword->object;
+		iters[i].wordlen = strlen(curword->object);
+		iters[i].buf = malloc(iters[i].wordlen +
+				MAX_FINGERPRINT_LEN + 2);
+		if (iters[i].buf == NULL) {
+			done = true;
+			continue;
+		}
 
+		memset(&key, 0, sizeof(key));
+		memset(&data, 0, sizeof(data));
+		key.data = iters[i].word;
+		key.size = iters[i].wordlen;
+		offset = 0;
+		ret = privctx->worddb->get(privctx->worddb, privctx->txn,
+				&key, &data, 0);
+		if (ret != 0 || !db4_varint_get(data.data, data.size,
+					&offset, &iters[i].count)) {
+			/* No keys with this word means no keys match */
+			done = true;
+		}
+	}
+	qsort(iters, numwords, sizeof(*iters), db4_posting_iter_cmp);
+
+	if (!done) {
+		ret = privctx->worddb->cursor(privctx->worddb, privctx->txn,
+				&cursor, 0);
+		if (ret == 0) {
+			ret = privctx->worddb->cursor(privctx->worddb,
+				privctx->txn, &seekcursor, 0);
+		}
 		if (ret != 0) {
-			db4_endtrans(dbctx);
-			break;
+			done = true;
 		}
+	}
 
+	/* Walk the blocks of the rarest word's posting list */
+	if (!done) {
 		memset(&key, 0, sizeof(key));
 		memset(&data, 0, sizeof(data));
-		key.data = curword->object;
-		key.size = strlen(curword->object);
-		data.flags = DB_DBT_MALLOC;
-		ret = cursor->c_get(cursor,
-				&key,
-				&data,
-				DB_SET);
-		while (ret == 0 && strncmp(key.data, curword->object,
-					key.size) == 0 &&
-				((char *) curword->object)[key.size] == 0) {
-
-			fingerprint.length = data.size;
-			memcpy(fingerprint.fp, data.data, data.size);
-
-			/*
-			 * Only add the keys containing this word if this is
-			 * our first pass (ie we have no existing key list),
-			 * or the key contained a previous word.
-			 */
-			if (firstpass || array_find(&keylist, &fingerprint)) {
-				array_add(&newkeylist, &fingerprint);
-			}
-
-			free(data.data);
-			data.data = NULL;
-
-			ret = cursor->c_get(cursor,
-					&key,
-					&data,
-					DB_NEXT);
+		memcpy(iters[0].buf, iters[0].word, iters[0].wordlen);
+		iters[0].buf[iters[0].wordlen] = 0;
+		key.data = iters[0].buf;
+		key.size = iters[0].wordlen + 1;
+		ret = cursor->c_get(cursor, &key, &data, DB_SET_RANGE);
+	}
+	while (!done && ret == 0 &&
+			db4_posting_isblock(&key, iters[0].word,
+				iters[0].wordlen)) {
+		if (!db4_posting_decode(data.data, data.size, &block)) {
+			logthing(LOGTHING_ERROR,
+				"Corrupt posting list for word %s",
+				iters[0].word);
+			break;
 		}
-		array_free(&keylist);
-		keylist.keys = newkeylist.keys;
-		keylist.count = newkeylist.count;
-		keylist.size = newkeylist.size;
-		newkeylist.keys = NULL;
-		newkeylist.count = newkeylist.size = 0;
-		if (data.data != NULL) {
-			free(data.data);
-			data.data = NULL;
+
+		for (k = 0; !done && k < block.count; k++) {
+			match = true;
+			for (j = 1; match && j < numwords; j++) {
+				match = db4_posting_contains(seekcursor,
+						&iters[j], &block.keys[k]);
+			}
+			if (match) {
+				array_add(&keylist, &block.keys[k]);
+				done = (config.maxkeys >= 0 &&
+					keylist.count >=
+					(size_t) config.maxkeys);
+			}
 		}
-		cursor->c_close(cursor);
-		cursor = NULL;
-		firstpass = 0;
-		db4_endtrans(dbctx);
+
+		ret = cursor->c_get(cursor, &key, &data, DB_NEXT);
 	}
-	llfree(wordlist, NULL);
-	wordlist = NULL;
 
-	if (keylist.count > config.maxkeys) {
-		keylist.count = config.maxkeys;
+	if (seekcursor != NULL) {
+		seekcursor->c_close(seekcursor);
+	}
+	if (cursor != NULL) {
+		cursor->c_close(cursor);
 	}
 
-	db4_starttrans(dbctx);
-	for (i = 0; i < keylist.count; i++) {
-		numkeys += db4_fetch_key_fp(dbctx, &keylist.keys[i],
+	for (k = 0; k < keylist.count; k++) {
+		numkeys += db4_fetch_key_fp(dbctx, &keylist.keys[k],
 			publickey,
 			true);
 	}
+	db4_endtrans(dbctx);
+
+	for (i = 0; i < numwords; i++) {
+		free(iters[i].buf);
+		array_free(&iters[i].block);
+	}
+
+out:
+	free(iters);
+	array_free(&block);
 	array_free(&keylist);
+	llfree(wordlist, NULL);
+	wordlist = NULL;
 	free(searchtext);
 	searchtext = NULL;
 
-	db4_endtrans(dbctx);
-
 	return (numkeys);
 }
 
@@ -705,46 +1516,10 @@ static int db4_delete_key(struct onak_dbctx *dbctx,
 			wordlist = makewordlist(wordlist, uids[i]);
 		}
 
-		privctx->worddb->cursor(privctx->worddb,
-			privctx->txn,
-			&cursor,
-			0);   /* flags */
-
 		for (curword = wordlist; curword != NULL && !deadlock;
 				curword = curword->next) {
-			/*
-			 * New style uses the fingerprint as the data
-			 * Old (unsupported) style was the 64 bit keyid
-			 */
-			memset(&key, 0, sizeof(key));
-			memset(&data, 0, sizeof(data));
-			key.data = curword->object;
-			key.size = strlen(key.data);
-			data.data = fp->fp;
-			data.size = fp->length;
-
-			ret = cursor->c_get(cursor,
-				&key,
-				&data,
-				DB_GET_BOTH);
-
-			if (ret == 0) {
-				ret = cursor->c_del(cursor, 0);
-			}
-
-			if (ret != 0 && ret != DB_NOTFOUND) {
-				logthing(LOGTHING_ERROR,
-					"Problem deleting word: %s "
-					"(0x%016" PRIX64 ")",
-					db_strerror(ret),
-					keyid);
-				if (ret == DB_LOCK_DEADLOCK) {
-					deadlock = true;
-				}
-			}
+			deadlock = db4_word_del(privctx, curword->object, fp);
 		}
-		cursor->c_close(cursor);
-		cursor = NULL;
 
 		/*
 		 * Free our UID and word lists.
@@ -975,17 +1750,119 @@ static int db4_delete_key(struct onak_dbctx *dbctx,
 	return deadlock ? (-1) : (ret == DB_NOTFOUND);
 }
 
+/*
+ * Add an index -> fingerprint mapping to one of the index DBs. Returns true
+ * if we deadlocked.
+ */
+static bool db4_index_add(struct onak_db4_dbctx *privctx, DB *db,
+		void *index, size_t len, struct openpgp_fingerprint *fp,
+		const char *what)
+{
+	DBT key, data;
+	int ret;
+
+	memset(&key, 0, sizeof(key));
+	memset(&data, 0, sizeof(data));
+	key.data = index;
+	key.size = len;
+	data.data = fp->fp;
+	data.size = fp->length;
+
+	ret = db->put(db, privctx->txn, &key, &data, 0);
+	if (ret != 0) {
+		logthing(LOGTHING_ERROR, "Problem storing %s: %s", what,
+				db_strerror(ret));
+	}
+
+	return (ret == DB_LOCK_DEADLOCK);
+}
+
+/*
+ * Remove an index -> fingerprint mapping from one of the index DBs, leaving
+ * any other keys with the same index alone. Returns true if we deadlocked.
+ */
+static bool db4_index_del(struct onak_db4_dbctx *privctx, DB *db,
+		void *index, size_t len, struct openpgp_fingerprint *fp,
+		const char *what)
+{
+	DBT key, data;
+	DBC *cursor = NULL;
+	int ret;
+
+	ret = db->cursor(db, privctx->txn, &cursor, 0);
+	if (ret == 0) {
+		memset(&key, 0, sizeof(key));
+		memset(&data, 0, sizeof(data));
+		key.data = index;
+		key.size = len;
+		data.data = fp->fp;
+		data.size = fp->length;
+
+		ret = cursor->c_get(cursor, &key, &data, DB_GET_BOTH);
+		if (ret == 0) {
+			ret = cursor->c_del(cursor, 0);
+		}
+		cursor->c_close(cursor);
+	}
+	if (ret != 0 && ret != DB_NOTFOUND) {
+		logthing(LOGTHING_ERROR, "Problem deleting %s: %s", what,
+				db_strerror(ret));
+	}
+
+	return (ret == DB_LOCK_DEADLOCK);
+}
+
+/*
+ * Add or remove the subkey fingerprint, 64 bit and 32 bit keyid mappings
+ * for a subkey. Returns true if we deadlocked.
+ */
+static bool db4_index_subkey(struct onak_db4_dbctx *privctx,
+		struct openpgp_fingerprint *subkey,
+		struct openpgp_fingerprint *fp, bool add)
+{
+	bool (*update)(struct onak_db4_dbctx *, DB *, void *, size_t,
+			struct openpgp_fingerprint *, const char *);
+	uint64_t keyid;
+	uint32_t shortkeyid;
+
+	update = add ? db4_index_add : db4_index_del;
+	keyid = fingerprint2keyid(subkey);
+	shortkeyid = keyid & 0xFFFFFFFF;
+
+	return update(privctx, privctx->subkeydb, subkey->fp, subkey->length,
+				fp, "subkey keyid") ||
+		update(privctx, privctx->id64db, &keyid, sizeof(keyid),
+				fp, "keyid") ||
+		update(privctx, privctx->id32db, &shortkeyid,
+				sizeof(shortkeyid), fp, "short keyid");
+}
+
+static bool db4_fp_in(struct openpgp_fingerprint *fps,
+		struct openpgp_fingerprint *fp)
+{
+	int i;
+
+	for (i = 0; fps != NULL && fps[i].length != 0; i++) {
+		if (fingerprint_cmp(&fps[i], fp) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
 /**
  *	store_key - Takes a key and stores it.
  *	@publickey: A pointer to the public key to store.
  *	@intrans: If we're already in a transaction.
  *	@update: If true the key exists and should be updated.
  *
- *	Again we just use the hex representation of the keyid as the filename
- *	to store the key to. We flatten the public key to a list of OpenPGP
- *	packets and then use write_openpgp_stream() to write the stream out to
- *	the file. If update is true then we delete the old key first, otherwise
- *	we trust that it doesn't exist.
+ *	We flatten the public key to a list of OpenPGP packets and store the
+ *	result under the fingerprint, then add the word, keyid, subkey and SKS
+ *	hash index entries for it. If update is true we compare against the
+ *	key that's already stored and only touch the index entries that have
+ *	changed, so a new signature just rewrites the key data and SKS hash.
+ *	Otherwise we trust that the key doesn't exist.
  */
 static int db4_store_key(struct onak_dbctx *dbctx,
 		struct openpgp_publickey *publickey, bool intrans,
@@ -995,6 +1872,7 @@ static int db4_store_key(struct onak_dbctx *dbctx,
 	struct     openpgp_packet_list *packets = NULL;
 	struct     openpgp_packet_list *list_end = NULL;
 	struct     openpgp_publickey *next = NULL;
+	struct     openpgp_publickey *oldkey = NULL;
 	int        ret = 0;
 	int        i = 0;
 	struct     buffer_ctx storebuf;
@@ -1003,13 +1881,15 @@ static int db4_store_key(struct onak_dbctx *dbctx,
 	uint64_t   keyid = 0;
 	uint32_t   shortkeyid = 0;
 	struct openpgp_fingerprint *subkeyids = NULL;
-	char     **uids = NULL;
-	char      *primary = NULL;
+	struct openpgp_fingerprint *oldsubkeyids = NULL;
 	struct ll *wordlist = NULL;
+	struct ll *oldwordlist = NULL;
 	struct ll *curword  = NULL;
 	bool       deadlock = false;
-	struct skshash hash;
+	struct skshash hash, oldhash;
 	struct openpgp_fingerprint fingerprint;
+	int (*strcmpfn)(const void *, const void *) =
+		(int (*)(const void *, const void *)) strcmp;
 
 	if (get_keyid(publickey, &keyid) != ONAK_E_OK) {
 		logthing(LOGTHING_ERROR, "Couldn't find key ID for key.");
@@ -1026,276 +1906,156 @@ static int db4_store_key(struct onak_dbctx *dbctx,
 	}
 
 	/*
-	 * Delete the key if we already have it.
-	 *
-	 * TODO: Can we optimize this perhaps? Possibly when other data is
-	 * involved as well? I suspect this is easiest and doesn't make a lot
-	 * of difference though - the largest chunk of data is the keydata and
-	 * it definitely needs updated.
+	 * Get the version of the key we're replacing, so we can work out which
+	 * index entries need to change.
 	 */
 	if (update) {
-		deadlock = (db4_delete_key(dbctx, &fingerprint, true) == -1);
+		db4_fetch_key(dbctx, &fingerprint, &oldkey, true);
 	}
 
 	/*
 	 * Convert the key to a flat set of binary data.
 	 */
-	if (!deadlock) {
-		next = publickey->next;
-		publickey->next = NULL;
-		flatten_publickey(publickey, &packets, &list_end);
-		publickey->next = next;
-
-		storebuf.offset = 0;
-		storebuf.size = 8192;
-		storebuf.buffer = malloc(8192);
-
-		write_openpgp_stream(buffer_putchar, &storebuf, packets);
-
-		/*
-		 * Now we have the key data store it in the DB; the fingerprint
-		 * is the key.
-		 */
-		memset(&key, 0, sizeof(key));
-		memset(&data, 0, sizeof(data));
-		key.data = fingerprint.fp;
-		key.size = fingerprint.length;
-		data.size = storebuf.offset;
-		data.data = storebuf.buffer;
-
-		ret = keydb_fp(privctx, &fingerprint)->put(
-				keydb_fp(privctx, &fingerprint),
-				privctx->txn,
-				&key,
-				&data,
-				0); /* flags*/
-		if (ret != 0) {
-			logthing(LOGTHING_ERROR,
-					"Problem storing key: %s",
-					db_strerror(ret));
-			if (ret == DB_LOCK_DEADLOCK) {
-				deadlock = true;
-			}
-		}
-
-		free(storebuf.buffer);
-		storebuf.buffer = NULL;
-		storebuf.size = 0;
-		storebuf.offset = 0;
-
-		free_packet_list(packets);
-		packets = NULL;
-	}
-
-	/*
-	 * Walk through our uids storing the words into the db with the
-	 * fingerprint.
-	 */
-	if (!deadlock) {
-		uids = keyuids(publickey, &primary);
-	}
-	if (uids != NULL) {
-		for (i = 0; ret == 0 && uids[i] != NULL; i++) {
-			wordlist = makewordlist(wordlist, uids[i]);
-		}
-
-		for (curword = wordlist; curword != NULL && !deadlock;
-				curword = curword->next) {
-			memset(&key, 0, sizeof(key));
-			memset(&data, 0, sizeof(data));
-			key.data = curword->object;
-			key.size = strlen(key.data);
-			data.data = fingerprint.fp;
-			data.size = fingerprint.length;
-
-			ret = privctx->worddb->put(privctx->worddb,
-				privctx->txn,
-				&key,
-				&data,
-				0);
-			if (ret != 0) {
-				logthing(LOGTHING_ERROR,
-					"Problem storing word: %s",
-					db_strerror(ret));
-				if (ret == DB_LOCK_DEADLOCK) {
-					deadlock = true;
-				}
-			}
-		}
-
-		/*
-		 * Free our UID and word lists.
-		 */
-		llfree(wordlist, NULL);
-		for (i = 0; uids[i] != NULL; i++) {
-			free(uids[i]);
-			uids[i] = NULL;
-		}
-		free(uids);
-		uids = NULL;
-	}
-
-	/*
-	 * Write the truncated 32 bit keyid so we can lookup the fingerprint
-	 * for queries.
-	 */
-	if (!deadlock) {
-		shortkeyid = keyid & 0xFFFFFFFF;
+	next = publickey->next;
+	publickey->next = NULL;
+	flatten_publickey(publickey, &packets, &list_end);
+	publickey->next = next;
 
-		memset(&key, 0, sizeof(key));
-		memset(&data, 0, sizeof(data));
-		key.data = &shortkeyid;
-		key.size = sizeof(shortkeyid);
-		data.data = fingerprint.fp;
-		data.size = fingerprint.length;
+	storebuf.offset = 0;
+	storebuf.size = 8192;
+	storebuf.buffer = malloc(8192);
 
-		ret = privctx->id32db->put(privctx->id32db,
-			privctx->txn,
-			&key,
-			&data,
-			0);
-		if (ret != 0) {
-			logthing(LOGTHING_ERROR,
-				"Problem storing short keyid: %s",
-				db_strerror(ret));
-			if (ret == DB_LOCK_DEADLOCK) {
-				deadlock = true;
-			}
-		}
-	}
+	write_openpgp_stream(buffer_putchar, &storebuf, packets);
 
 	/*
-	 * Write the 64 bit keyid so we can lookup the fingerprint for
-	 * queries.
+	 * Now we have the key data store it in the DB; the fingerprint is the
+	 * key, and any old version is overwritten.
 	 */
-	if (!deadlock) {
-		memset(&key, 0, sizeof(key));
-		memset(&data, 0, sizeof(data));
-		key.data = &keyid;
-		key.size = sizeof(keyid);
-		data.data = fingerprint.fp;
-		data.size = fingerprint.length;
-
-		ret = privctx->id64db->put(privctx->id64db,
-			privctx->txn,
-			&key,
-			&data,
-			0);
-		if (ret != 0) {
-			logthing(LOGTHING_ERROR,
-				"Problem storing keyid: %s",
-				db_strerror(ret));
-			if (ret == DB_LOCK_DEADLOCK) {
-				deadlock = true;
-			}
-		}
-	}
-
-	if (!deadlock) {
-		subkeyids = keysubkeys(publickey);
-		i = 0;
-		while (subkeyids != NULL && subkeyids[i].length != 0) {
-			/* Store the subkey ID -> main key fp mapping */
-			memset(&key, 0, sizeof(key));
-			memset(&data, 0, sizeof(data));
-			key.data = subkeyids[i].fp;
-			key.size = subkeyids[i].length;
-			data.data = fingerprint.fp;
-			data.size = fingerprint.length;
-
-			ret = privctx->subkeydb->put(privctx->subkeydb,
-				privctx->txn,
-				&key,
-				&data,
-				0);
-			if (ret != 0) {
-				logthing(LOGTHING_ERROR,
-					"Problem storing subkey keyid: %s",
-					db_strerror(ret));
-				if (ret == DB_LOCK_DEADLOCK) {
-					deadlock = true;
-				}
-			}
+	memset(&key, 0, sizeof(key));
+	memset(&data, 0, sizeof(data));
+	key.data = fingerprint.fp;
+	key.size = fingerprint.length;
+	data.size = storebuf.offset;
+	data.data = storebuf.buffer;
 
-			/* Store the 64 bit subkey ID -> main key fp mapping */
-			memset(&key, 0, sizeof(key));
-			memset(&data, 0, sizeof(data));
+	ret = keydb_fp(privctx, &fingerprint)->put(
+			keydb_fp(privctx, &fingerprint),
+			privctx->txn,
+			&key,
+			&data,
+			0); /* flags*/
+	if (ret != 0) {
+		logthing(LOGTHING_ERROR,
+				"Problem storing key: %s",
+				db_strerror(ret));
+		if (ret == DB_LOCK_DEADLOCK) {
+			deadlock = true;
+		}
+	}
 
-			keyid = fingerprint2keyid(&subkeyids[i]);
-			key.data = &keyid;
-			key.size = sizeof(keyid);
-			data.data = fingerprint.fp;
-			data.size = fingerprint.length;
+	free(storebuf.buffer);
+	storebuf.buffer = NULL;
+	storebuf.size = 0;
+	storebuf.offset = 0;
 
-			ret = privctx->id64db->put(privctx->id64db,
-				privctx->txn,
-				&key,
-				&data,
-				0);
-			if (ret != 0) {
-				logthing(LOGTHING_ERROR,
-					"Problem storing keyid: %s",
-					db_strerror(ret));
-				if (ret == DB_LOCK_DEADLOCK) {
-					deadlock = true;
-				}
-			}
+	free_packet_list(packets);
+	packets = NULL;
 
-			/* Store the short subkey ID -> main key fp mapping */
-			shortkeyid = keyid & 0xFFFFFFFF;
+	/*
+	 * Update the words from our uids that map to the fingerprint.
+	 */
+	if (!deadlock) {
+		wordlist = makewordlistfromkey(NULL, publickey);
+		if (oldkey != NULL) {
+			oldwordlist = makewordlistfromkey(NULL, oldkey);
+		}
+	}
+	for (curword = oldwordlist; curword != NULL && !deadlock;
+			curword = curword->next) {
+		if (llfind(wordlist, curword->object, strcmpfn) == NULL) {
+			deadlock = db4_word_del(privctx, curword->object,
+					&fingerprint);
+		}
+	}
+	for (curword = wordlist; curword != NULL && !deadlock;
+			curword = curword->next) {
+		if (llfind(oldwordlist, curword->object, strcmpfn) == NULL) {
+			deadlock = db4_word_add(privctx, curword->object,
+					&fingerprint);
+		}
+	}
+	llfree(wordlist, free);
+	wordlist = NULL;
+	llfree(oldwordlist, free);
+	oldwordlist = NULL;
 
-			memset(&key, 0, sizeof(key));
-			memset(&data, 0, sizeof(data));
-			key.data = &shortkeyid;
-			key.size = sizeof(shortkeyid);
-			data.data = fingerprint.fp;
-			data.size = fingerprint.length;
+	/*
+	 * Write the truncated 32 bit and full 64 bit keyids so we can lookup
+	 * the fingerprint for queries. These don't change for an existing
+	 * key.
+	 */
+	if (!deadlock && oldkey == NULL) {
+		shortkeyid = keyid & 0xFFFFFFFF;
+		deadlock = db4_index_add(privctx, privctx->id32db,
+				&shortkeyid, sizeof(shortkeyid),
+				&fingerprint, "short keyid") ||
+			db4_index_add(privctx, privctx->id64db,
+				&keyid, sizeof(keyid),
+				&fingerprint, "keyid");
+	}
 
-			ret = privctx->id32db->put(privctx->id32db,
-				privctx->txn,
-				&key,
-				&data,
-				0);
-			if (ret != 0) {
-				logthing(LOGTHING_ERROR,
-					"Problem storing short keyid: %s",
-					db_strerror(ret));
-				if (ret == DB_LOCK_DEADLOCK) {
-					deadlock = true;
-				}
+	/*
+	 * Update the subkey mappings for any subkeys that have come or gone.
+	 */
+	if (!deadlock) {
+		subkeyids = keysubkeys(publickey);
+		if (oldkey != NULL) {
+			oldsubkeyids = keysubkeys(oldkey);
+		}
+		for (i = 0; oldsubkeyids != NULL &&
+				oldsubkeyids[i].length != 0 && !deadlock;
+				i++) {
+			if (!db4_fp_in(subkeyids, &oldsubkeyids[i])) {
+				deadlock = db4_index_subkey(privctx,
+						&oldsubkeyids[i],
+						&fingerprint, false);
 			}
-			i++;
 		}
-		if (subkeyids != NULL) {
-			free(subkeyids);
-			subkeyids = NULL;
+		for (i = 0; subkeyids != NULL &&
+				subkeyids[i].length != 0 && !deadlock;
+				i++) {
+			if (!db4_fp_in(oldsubkeyids, &subkeyids[i])) {
+				deadlock = db4_index_subkey(privctx,
+						&subkeyids[i],
+						&fingerprint, true);
+			}
 		}
+		free(subkeyids);
+		subkeyids = NULL;
+		free(oldsubkeyids);
+		oldsubkeyids = NULL;
 	}
 
 	if (!deadlock) {
 		get_skshash(publickey, &hash);
-		memset(&key, 0, sizeof(key));
-		memset(&data, 0, sizeof(data));
-		key.data = hash.hash;
-		key.size = sizeof(hash.hash);
-		data.data = fingerprint.fp;
-		data.size = fingerprint.length;
-
-		ret = privctx->skshashdb->put(privctx->skshashdb,
-			privctx->txn,
-			&key,
-			&data,
-			0);
-		if (ret != 0) {
-			logthing(LOGTHING_ERROR,
-				"Problem storing SKS hash: %s",
-				db_strerror(ret));
-			if (ret == DB_LOCK_DEADLOCK) {
-				deadlock = true;
-			}
+		if (oldkey != NULL) {
+			get_skshash(oldkey, &oldhash);
+		}
+		if (oldkey == NULL || memcmp(hash.hash, oldhash.hash,
+					sizeof(hash.hash)) != 0) {
+			deadlock = (oldkey != NULL &&
+				db4_index_del(privctx, privctx->skshashdb,
+					oldhash.hash, sizeof(oldhash.hash),
+					&fingerprint, "skshash")) ||
+				db4_index_add(privctx, privctx->skshashdb,
+					hash.hash, sizeof(hash.hash),
+					&fingerprint, "SKS hash");
 		}
 	}
 
+	free_publickey(oldkey);
+	oldkey = NULL;
+
 	if (!intrans) {
 		db4_endtrans(dbctx);
 	}
@@ -1303,6 +2063,86 @@ static int db4_store_key(struct onak_dbctx *dbctx,
 	return deadlock ? -1 : 0 ;
 }
 
+/**
+ *	fetch_key_skshash_raw - Given an SKS hash fetch the stored key data.
+ *	@hash: The hash to fetch.
+ *	@raw: Returns the key data.
+ */
+static int db4_fetch_key_skshash_raw(struct onak_dbctx *dbctx,
+		const struct skshash *hash,
+		struct openpgp_raw_key *raw)
+{
+	struct onak_db4_dbctx *privctx = (struct onak_db4_dbctx *) dbctx->priv;
+	DBT       key, data;
+	DBC      *cursor = NULL;
+	int       ret;
+	int       count = 0;
+	struct openpgp_fingerprint fingerprint;
+
+	memset(raw, 0, sizeof(*raw));
+
+	ret = privctx->skshashdb->cursor(privctx->skshashdb,
+			privctx->txn,
+			&cursor,
+			0);   /* flags */
+
+	if (ret != 0) {
+		return 0;
+	}
+
+	memset(&key, 0, sizeof(key));
+	memset(&data, 0, sizeof(data));
+	key.data = (void *) hash->hash;
+	key.size = sizeof(hash->hash);
+	data.ulen = MAX_FINGERPRINT_LEN;
+	data.data = fingerprint.fp;
+	data.flags = DB_DBT_USERMEM;
+
+	ret = cursor->c_get(cursor,
+		&key,
+		&data,
+		DB_SET);
+
+	cursor->c_close(cursor);
+	cursor = NULL;
+
+	if (ret == 0) {
+		fingerprint.length = data.size;
+		count = db4_fetch_key_fp_raw(dbctx, &fingerprint, raw, false);
+	}
+
+	return count;
+}
+
+/**
+ *	have_skshash - Check if we have a key with the given SKS hash.
+ *	@hash: The hash to look for.
+ */
+static bool db4_have_skshash(struct onak_dbctx *dbctx,
+		const struct skshash *hash)
+{
+	struct onak_db4_dbctx *privctx = (struct onak_db4_dbctx *) dbctx->priv;
+	DBT       key, data;
+	int       ret;
+	struct openpgp_fingerprint fingerprint;
+
+	memset(&key, 0, sizeof(key));
+	memset(&data, 0, sizeof(data));
+	key.data = (void *) hash->hash;
+	key.size = sizeof(hash->hash);
+	data.ulen = MAX_FINGERPRINT_LEN;
+	data.data = fingerprint.fp;
+	data.flags = DB_DBT_USERMEM;
+
+	ret = privctx->skshashdb->get(privctx->skshashdb,
+			privctx->txn,
+			&key,
+			&data,
+			0);
+
+	return (ret == 0);
+}
+
 /**
  *	iterate_keys - call a function once for each key in the db.
  *	@iterfunc: The function to call.
@@ -1315,7 +2155,7 @@ static int db4_store_key(struct onak_dbctx *dbctx,
  *	Returns the number of keys we iterated over.
  */
 static int db4_iterate_keys(struct onak_dbctx *dbctx,
-		void (*iterfunc)(void *ctx, struct openpgp_publickey *key),
+		bool (*iterfunc)(void *ctx, struct openpgp_publickey *key),
 		void *ctx)
 {
 	struct onak_db4_dbctx *privctx = (struct onak_db4_dbctx *) dbctx->priv;
@@ -1324,11 +2164,11 @@ static int db4_iterate_keys(struct onak_dbctx *dbctx,
 	int                         ret = 0;
 	int                         i = 0;
 	int                         numkeys = 0;
-	struct buffer_ctx           fetchbuf;
 	struct openpgp_packet_list *packets = NULL;
 	struct openpgp_publickey   *key = NULL;
+	bool                        more = true;
 
-	for (i = 0; i < privctx->numdbs; i++) {
+	for (i = 0; more && i < privctx->numdbs; i++) {
 		ret = privctx->dbconns[i]->cursor(privctx->dbconns[i],
 			NULL,
 			&cursor,
@@ -1342,27 +2182,27 @@ static int db4_iterate_keys(struct onak_dbctx *dbctx,
 		memset(&data, 0, sizeof(data));
 		ret = cursor->c_get(cursor, &dbkey, &data, DB_NEXT);
 		while (ret == 0) {
-			fetchbuf.buffer = data.data;
-			fetchbuf.offset = 0;
-			fetchbuf.size = data.size;
-			read_openpgp_stream(buffer_fetchchar, &fetchbuf,
-				&packets, 0);
+			read_openpgp_buffer(data.data, data.size, &packets, 0);
 			parse_keys(packets, &key);
 
-			iterfunc(ctx, key);
+			more = iterfunc(ctx, key);
 
 			free_publickey(key);
 			key = NULL;
 			free_packet_list(packets);
 			packets = NULL;
+			numkeys++;
+
+			if (!more) {
+				break;
+			}
 
 			memset(&dbkey, 0, sizeof(dbkey));
 			memset(&data, 0, sizeof(data));
 			ret = cursor->c_get(cursor, &dbkey, &data,
 					DB_NEXT);
-			numkeys++;
 		}
-		if (ret != DB_NOTFOUND) {
+		if (more && ret != DB_NOTFOUND) {
 			logthing(LOGTHING_ERROR,
 				"Problem reading key: %s",
 				db_strerror(ret));
@@ -1434,6 +2274,199 @@ static void db4_cleanupdb(struct onak_dbctx *dbctx)
 	free(dbctx);
 }
 
+/**
+ *	db4_convert_worddb - Convert an old style word index to posting lists
+ *
+ *	Older versions kept the word index as a DB_DUP BTREE with a record for
+ *	each word/fingerprint pair. Read it a word at a time, writing out the
+ *	posting list for each word in its own transaction to a temporary DB.
+ *	Only once that's complete is it renamed to wordpostdb and opened as our
+ *	word index, and the old index removed; if we fail or are interrupted
+ *	before then we'll start again from the old index next time. The
+ *	upgrade lock file keeps two processes from converting at once.
+ */
+static int db4_convert_worddb(struct onak_dbctx *dbctx)
+{
+	struct onak_db4_dbctx *privctx = (struct onak_db4_dbctx *) dbctx->priv;
+	struct keyarray list = { NULL, 0, 0 };
+	struct openpgp_fingerprint fingerprint;
+	DB *olddb = NULL;
+	DBC *cursor = NULL;
+	DBT key, data;
+	struct stat statbuf;
+	char buf[1024];
+	char *word = NULL;
+	uint8_t *keybuf = NULL;
+	size_t wordlen = 0;
+	int lockfile_fd;
+	int ret, words = 0;
+	bool gotword;
+
+	snprintf(buf, sizeof(buf) - 1, "%s/%s", dbctx->config->location,
+			DB4_UPGRADE_FILE);
+	lockfile_fd = open(buf, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (lockfile_fd < 0) {
+		ret = errno;
+		logthing(LOGTHING_CRITICAL, "Couldn't open database update "
+				"lock file %s to convert word index: %s",
+				buf, strerror(ret));
+		return ret;
+	}
+	close(lockfile_fd);
+
+	logthing(LOGTHING_NOTICE, "Converting word index to posting lists");
+
+	/* Throw away anything left from an earlier attempt */
+	snprintf(buf, sizeof(buf) - 1, "%s/wordpostdb.tmp",
+			dbctx->config->location);
+	if (stat(buf, &statbuf) == 0) {
+		privctx->dbenv->dbremove(privctx->dbenv, NULL,
+				"wordpostdb.tmp", NULL, DB_AUTO_COMMIT);
+	}
+
+	ret = db_create(&privctx->worddb, privctx->dbenv, 0);
+	if (ret == 0) {
+		db4_starttrans(dbctx);
+		ret = privctx->worddb->open(privctx->worddb, privctx->txn,
+				"wordpostdb.tmp", "wordpostdb", DB_BTREE,
+				DB_CREATE, 0664);
+		db4_endtrans(dbctx);
+	}
+	if (ret == 0) {
+		ret = db_create(&olddb, privctx->dbenv, 0);
+	}
+	if (ret == 0) {
+		ret = olddb->set_flags(olddb, DB_DUP);
+	}
+	if (ret == 0) {
+		db4_starttrans(dbctx);
+		ret = olddb->open(olddb, privctx->txn, "worddb", "worddb",
+				DB_BTREE, 0, 0664);
+		db4_endtrans(dbctx);
+	}
+
+	while (ret == 0) {
+		db4_starttrans(dbctx);
+		ret = olddb->cursor(olddb, privctx->txn, &cursor, 0);
+		if (ret != 0) {
+			db4_endtrans(dbctx);
+			break;
+		}
+
+		/* Move on to the word after the last one we did */
+		memset(&key, 0, sizeof(key));
+		memset(&data, 0, sizeof(data));
+		if (word == NULL) {
+			ret = cursor->c_get(cursor, &key, &data, DB_FIRST);
+		} else {
+			key.data = word;
+			key.size = wordlen;
+			ret = cursor->c_get(cursor, &key, &data, DB_SET);
+			if (ret == 0) {
+				ret = cursor->c_get(cursor, &key, &data,
+						DB_NEXT_NODUP);
+			}
+		}
+
+		gotword = (ret == 0);
+		if (ret == 0) {
+			free(word);
+			wordlen = key.size;
+			word = malloc(wordlen + 1);
+			free(keybuf);
+			keybuf = malloc(wordlen + MAX_FINGERPRINT_LEN + 2);
+			if (word == NULL || keybuf == NULL) {
+				ret = ENOMEM;
+			} else {
+				memcpy(word, key.data, wordlen);
+				word[wordlen] = 0;
+			}
+		}
+
+		list.count = 0;
+		while (ret == 0) {
+			/* Skip any old style 64 bit keyid entries */
+			if (data.size >= 16 &&
+					data.size <= MAX_FINGERPRINT_LEN) {
+				fingerprint.length = data.size;
+				memcpy(fingerprint.fp, data.data, data.size);
+				array_add(&list, &fingerprint);
+			}
+			ret = cursor->c_get(cursor, &key, &data, DB_NEXT_DUP);
+		}
+		cursor->c_close(cursor);
+		cursor = NULL;
+
+		if (ret == DB_NOTFOUND && gotword) {
+			ret = 0;
+		}
+		if (ret == 0 && list.count > 0) {
+			ret = db4_posting_put(privctx, keybuf, word, wordlen,
+					list.keys, list.count);
+			if (ret == 0) {
+				ret = db4_posting_count(privctx, word, wordlen,
+						list.count);
+			}
+			if (ret == 0 && ++words % 10000 == 0) {
+				logthing(LOGTHING_INFO,
+					"Converted %d words.", words);
+			}
+		}
+		db4_endtrans(dbctx);
+	}
+	array_free(&list);
+	free(keybuf);
+	free(word);
+	if (olddb != NULL) {
+		olddb->close(olddb, 0);
+	}
+	if (privctx->worddb != NULL) {
+		privctx->worddb->close(privctx->worddb, 0);
+		privctx->worddb = NULL;
+	}
+
+	/* We've read everything; put the new index in place. */
+	if (ret == DB_NOTFOUND) {
+		ret = privctx->dbenv->dbrename(privctx->dbenv, NULL,
+				"wordpostdb.tmp", NULL, "wordpostdb",
+				DB_AUTO_COMMIT);
+	}
+	if (ret == 0) {
+		ret = db_create(&privctx->worddb, privctx->dbenv, 0);
+	}
+	if (ret == 0) {
+		db4_starttrans(dbctx);
+		ret = privctx->worddb->open(privctx->worddb, privctx->txn,
+				"wordpostdb", "wordpostdb", DB_BTREE,
+				0, 0664);
+		db4_endtrans(dbctx);
+	}
+
+	if (ret == 0) {
+		logthing(LOGTHING_NOTICE, "Converted %d words.", words);
+		ret = privctx->dbenv->dbremove(privctx->dbenv, NULL, "worddb",
+				NULL, DB_AUTO_COMMIT);
+		if (ret != 0) {
+			logthing(LOGTHING_ERROR,
+				"Couldn't remove old word index: %s",
+				db_strerror(ret));
+			ret = 0;
+		}
+	} else {
+		logthing(LOGTHING_CRITICAL,
+				"Error converting word index: %s",
+				db_strerror(ret));
+		privctx->dbenv->dbremove(privctx->dbenv, NULL,
+				"wordpostdb.tmp", NULL, DB_AUTO_COMMIT);
+	}
+
+	snprintf(buf, sizeof(buf) - 1, "%s/%s", dbctx->config->location,
+			DB4_UPGRADE_FILE);
+	unlink(buf);
+
+	return ret;
+}
+
 /**
  *	initdb - Initialize the key database.
  *
@@ -1450,10 +2483,11 @@ struct onak_dbctx *keydb_db4_init(struct onak_db_config *dbcfg, bool readonly)
 	uint32_t   flags = 0;
 	struct stat statbuf;
 	int        maxlocks;
+	bool       haveold, havepost, convertwords;
 	struct onak_dbctx *dbctx;
 	struct onak_db4_dbctx *privctx;
 
-	dbctx = malloc(sizeof(*dbctx));
+	dbctx = calloc(1, sizeof(*dbctx));
 	if (dbctx == NULL) {
 		return NULL;
 	}
@@ -1504,6 +2538,20 @@ struct onak_dbctx *keydb_db4_init(struct onak_db_config *dbcfg, bool readonly)
 		}
 	}
 
+	/*
+	 * If we've got a word index from before we used posting lists then
+	 * it needs converted once we've got everything open. wordpostdb only
+	 * appears once a conversion is complete, so if both are there we
+	 * just didn't get as far as removing the old one. If we're read only
+	 * we can't convert, so search the old index instead.
+	 */
+	snprintf(buf, sizeof(buf) - 1, "%s/wordpostdb", dbcfg->location);
+	havepost = stat(buf, &statbuf) == 0;
+	snprintf(buf, sizeof(buf) - 1, "%s/worddb", dbcfg->location);
+	haveold = stat(buf, &statbuf) == 0;
+	convertwords = !readonly && haveold && !havepost;
+	privctx->oldwords = readonly && haveold && !havepost;
+
 	privctx->dbconns = calloc(privctx->numdbs, sizeof (DB *));
 	if (privctx->dbconns == NULL) {
 		logthing(LOGTHING_CRITICAL,
@@ -1630,7 +2678,8 @@ struct onak_dbctx *keydb_db4_init(struct onak_db_config *dbcfg, bool readonly)
 		}
 	}
 
-	if (ret == 0) {
+	/* If we're converting the word index it opens it once it's done */
+	if (ret == 0 && !convertwords) {
 		ret = db_create(&privctx->worddb, privctx->dbenv, 0);
 		if (ret != 0) {
 			logthing(LOGTHING_CRITICAL, "db_create: %s",
@@ -1638,19 +2687,22 @@ struct onak_dbctx *keydb_db4_init(struct onak_db_config *dbcfg, bool readonly)
 		}
 	}
 
-	if (ret == 0) {
+	if (ret == 0 && privctx->oldwords) {
 		ret = privctx->worddb->set_flags(privctx->worddb, DB_DUP);
 	}
 
-	if (ret == 0) {
+	if (ret == 0 && !convertwords) {
 		ret = privctx->worddb->open(privctx->worddb, privctx->txn,
-				"worddb", "worddb", DB_BTREE,
+				privctx->oldwords ? "worddb" : "wordpostdb",
+				privctx->oldwords ? "worddb" : "wordpostdb",
+				DB_BTREE,
 				flags,
 				0664);
 		if (ret != 0) {
 			logthing(LOGTHING_CRITICAL,
 					"Error opening word database: %s (%s)",
-					"worddb",
+					privctx->oldwords ?
+						"worddb" : "wordpostdb",
 					db_strerror(ret));
 		}
 	}
@@ -1753,6 +2805,20 @@ struct onak_dbctx *keydb_db4_init(struct onak_db_config *dbcfg, bool readonly)
 		db4_endtrans(dbctx);
 	}
 
+	if (ret == 0 && convertwords) {
+		ret = db4_convert_worddb(dbctx);
+	} else if (ret == 0 && !readonly && haveold) {
+		logthing(LOGTHING_NOTICE, "Removing converted word index");
+		ret = privctx->dbenv->dbremove(privctx->dbenv, NULL, "worddb",
+				NULL, DB_AUTO_COMMIT);
+		if (ret != 0) {
+			logthing(LOGTHING_ERROR,
+				"Couldn't remove old word index: %s",
+				db_strerror(ret));
+			ret = 0;
+		}
+	}
+
 	if (ret != 0) {
 		db4_cleanupdb(dbctx);
 		logthing(LOGTHING_CRITICAL,
@@ -1763,11 +2829,17 @@ struct onak_dbctx *keydb_db4_init(struct onak_db_config *dbcfg, bool readonly)
 	dbctx->cleanupdb		= db4_cleanupdb;
 	dbctx->starttrans		= db4_starttrans;
 	dbctx->endtrans			= db4_endtrans;
+	dbctx->aborttrans		= db4_aborttrans;
 	dbctx->fetch_key		= db4_fetch_key;
 	dbctx->fetch_key_fp		= db4_fetch_key_fp;
 	dbctx->fetch_key_id		= db4_fetch_key_id;
 	dbctx->fetch_key_text		= db4_fetch_key_text;
 	dbctx->fetch_key_skshash	= db4_fetch_key_skshash;
+	dbctx->fetch_key_raw		= db4_fetch_key_raw;
+	dbctx->fetch_key_fp_raw		= db4_fetch_key_fp_raw;
+	dbctx->fetch_key_id_raw		= db4_fetch_key_id_raw;
+	dbctx->fetch_key_skshash_raw	= db4_fetch_key_skshash_raw;
+	dbctx->have_skshash		= db4_have_skshash;
 	dbctx->store_key		= db4_store_key;
 	dbctx->update_keys		= generic_update_keys;
 	dbctx->delete_key		= db4_delete_key;
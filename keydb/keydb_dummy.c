@@ -150,7 +150,7 @@ static int dummy_update_keys(struct onak_dbctx *dbctx,
  * Returns the number of keys we iterated over.
  */
 static int dummy_iterate_keys(struct onak_dbctx *dbctx,
-		void (*iterfunc)(void *ctx, struct openpgp_publickey *key),
+		bool (*iterfunc)(void *ctx, struct openpgp_publickey *key),
 		void *ctx)
 {
 	struct onak_dummy_dbctx *privctx = (struct onak_dummy_dbctx *) dbctx->priv;
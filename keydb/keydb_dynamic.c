@@ -54,6 +54,14 @@ static void dynamic_endtrans(struct onak_dbctx *dbctx)
 	privctx->loadeddbctx->endtrans(privctx->loadeddbctx);
 }
 
+static void dynamic_aborttrans(struct onak_dbctx *dbctx)
+{
+	struct onak_dynamic_dbctx *privctx =
+			(struct onak_dynamic_dbctx *) dbctx->priv;
+
+	privctx->loadeddbctx->aborttrans(privctx->loadeddbctx);
+}
+
 static int dynamic_fetch_key(struct onak_dbctx *dbctx,
 		struct openpgp_fingerprint *fingerprint,
 		struct openpgp_publickey **publickey, bool intrans)
@@ -112,6 +120,74 @@ static int dynamic_fetch_key_skshash(struct onak_dbctx *dbctx,
 			hash, publickey);
 }
 
+static int dynamic_fetch_keys_skshash(struct onak_dbctx *dbctx,
+		const struct skshash *hashes, int count,
+		struct openpgp_publickey **keys)
+{
+	struct onak_dynamic_dbctx *privctx =
+			(struct onak_dynamic_dbctx *) dbctx->priv;
+
+	return privctx->loadeddbctx->fetch_keys_skshash(privctx->loadeddbctx,
+			hashes, count, keys);
+}
+
+static int dynamic_fetch_key_raw(struct onak_dbctx *dbctx,
+		struct openpgp_fingerprint *fingerprint,
+		struct openpgp_raw_key *raw,
+		bool intrans)
+{
+	struct onak_dynamic_dbctx *privctx =
+			(struct onak_dynamic_dbctx *) dbctx->priv;
+
+	return privctx->loadeddbctx->fetch_key_raw(privctx->loadeddbctx,
+			fingerprint, raw, intrans);
+}
+
+static int dynamic_fetch_key_fp_raw(struct onak_dbctx *dbctx,
+		struct openpgp_fingerprint *fingerprint,
+		struct openpgp_raw_key *raw,
+		bool intrans)
+{
+	struct onak_dynamic_dbctx *privctx =
+			(struct onak_dynamic_dbctx *) dbctx->priv;
+
+	return privctx->loadeddbctx->fetch_key_fp_raw(privctx->loadeddbctx,
+			fingerprint, raw, intrans);
+}
+
+static int dynamic_fetch_key_id_raw(struct onak_dbctx *dbctx,
+		uint64_t keyid,
+		struct openpgp_raw_key *raw,
+		bool intrans)
+{
+	struct onak_dynamic_dbctx *privctx =
+			(struct onak_dynamic_dbctx *) dbctx->priv;
+
+	return privctx->loadeddbctx->fetch_key_id_raw(privctx->loadeddbctx,
+			keyid, raw, intrans);
+}
+
+static int dynamic_fetch_key_skshash_raw(struct onak_dbctx *dbctx,
+		const struct skshash *hash,
+		struct openpgp_raw_key *raw)
+{
+	struct onak_dynamic_dbctx *privctx =
+			(struct onak_dynamic_dbctx *) dbctx->priv;
+
+	return privctx->loadeddbctx->fetch_key_skshash_raw(
+			privctx->loadeddbctx, hash, raw);
+}
+
+static bool dynamic_have_skshash(struct onak_dbctx *dbctx,
+		const struct skshash *hash)
+{
+	struct onak_dynamic_dbctx *privctx =
+			(struct onak_dynamic_dbctx *) dbctx->priv;
+
+	return privctx->loadeddbctx->have_skshash(privctx->loadeddbctx,
+			hash);
+}
+
 static int dynamic_store_key(struct onak_dbctx *dbctx,
 		struct openpgp_publickey *publickey, bool intrans,
 		bool update)
@@ -178,7 +254,7 @@ static char *dynamic_keyid2uid(struct onak_dbctx *dbctx,
 }
 
 static int dynamic_iterate_keys(struct onak_dbctx *dbctx,
-		void (*iterfunc)(void *ctx, struct openpgp_publickey *key),
+		bool (*iterfunc)(void *ctx, struct openpgp_publickey *key),
 		void *ctx)
 {
 	struct onak_dynamic_dbctx *privctx =
@@ -231,7 +307,7 @@ struct onak_dbctx *keydb_dynamic_init(struct onak_db_config *dbcfg,
 		return NULL;
 	}
 
-	dbctx = malloc(sizeof(struct onak_dbctx));
+	dbctx = calloc(1, sizeof(struct onak_dbctx));
 
 	if (dbctx == NULL) {
 		return NULL;
@@ -319,11 +395,34 @@ struct onak_dbctx *keydb_dynamic_init(struct onak_db_config *dbcfg,
 		dbctx->cleanupdb = dynamic_cleanupdb;
 		dbctx->starttrans = dynamic_starttrans;
 		dbctx->endtrans = dynamic_endtrans;
+		if (privctx->loadeddbctx->aborttrans != NULL) {
+			dbctx->aborttrans = dynamic_aborttrans;
+		}
 		dbctx->fetch_key = dynamic_fetch_key;
 		dbctx->fetch_key_fp = dynamic_fetch_key_fp;
 		dbctx->fetch_key_id = dynamic_fetch_key_id;
 		dbctx->fetch_key_text = dynamic_fetch_key_text;
 		dbctx->fetch_key_skshash = dynamic_fetch_key_skshash;
+		if (privctx->loadeddbctx->fetch_keys_skshash != NULL) {
+			dbctx->fetch_keys_skshash =
+				dynamic_fetch_keys_skshash;
+		}
+		if (privctx->loadeddbctx->fetch_key_raw != NULL) {
+			dbctx->fetch_key_raw = dynamic_fetch_key_raw;
+		}
+		if (privctx->loadeddbctx->fetch_key_fp_raw != NULL) {
+			dbctx->fetch_key_fp_raw = dynamic_fetch_key_fp_raw;
+		}
+		if (privctx->loadeddbctx->fetch_key_id_raw != NULL) {
+			dbctx->fetch_key_id_raw = dynamic_fetch_key_id_raw;
+		}
+		if (privctx->loadeddbctx->fetch_key_skshash_raw != NULL) {
+			dbctx->fetch_key_skshash_raw =
+				dynamic_fetch_key_skshash_raw;
+		}
+		if (privctx->loadeddbctx->have_skshash != NULL) {
+			dbctx->have_skshash = dynamic_have_skshash;
+		}
 		dbctx->store_key = dynamic_store_key;
 		dbctx->update_keys = dynamic_update_keys;
 		dbctx->delete_key = dynamic_delete_key;
@@ -68,7 +68,7 @@ static void file_endtrans(__unused struct onak_dbctx *dbctx)
  *
  *	We use the hex representation of the keyid as the filename to fetch the
  *	key from. The key is stored in the file as a binary OpenPGP stream of
- *	packets, so we can just use read_openpgp_stream() to read the packets
+ *	packets, so we can just use read_openpgp_buffer() to read the packets
  *	in and then parse_keys() to parse the packets into a publickey
  *	structure.
  */
@@ -79,22 +79,48 @@ static int file_fetch_key_id(struct onak_dbctx *dbctx,
 {
 	char *db_dir = (char *) dbctx->priv;
 	struct openpgp_packet_list *packets = NULL;
+	struct openpgp_raw_key raw;
 	char keyfile[1024];
 	onak_status_t res;
 
 	snprintf(keyfile, 1023, "%s/0x%" PRIX64, db_dir,
 			keyid & 0xFFFFFFFF);
-	res = onak_read_openpgp_file(keyfile, &packets);
+	res = onak_read_openpgp_file_raw(keyfile, &raw);
 
 	if (res == ONAK_E_OK) {
+		read_openpgp_buffer(raw.data, raw.length, &packets, 0);
 		parse_keys(packets, publickey);
 		free_packet_list(packets);
 		packets = NULL;
+		free_raw_key(&raw);
 	}
 
 	return (res == ONAK_E_OK);
 }
 
+/**
+ *	fetch_key_id_raw - Given a keyid fetch the key data from storage.
+ *	@keyid: The keyid to fetch.
+ *	@raw: Returns the stored key data.
+ *	@intrans: If we're already in a transaction.
+ *
+ *	As fetch_key_id, but as the file is already a binary OpenPGP stream we
+ *	can hand back its contents without parsing them.
+ */
+static int file_fetch_key_id_raw(struct onak_dbctx *dbctx,
+		uint64_t keyid,
+		struct openpgp_raw_key *raw,
+		__unused bool intrans)
+{
+	char *db_dir = (char *) dbctx->priv;
+	char keyfile[1024];
+
+	snprintf(keyfile, 1023, "%s/0x%" PRIX64, db_dir,
+			keyid & 0xFFFFFFFF);
+
+	return (onak_read_openpgp_file_raw(keyfile, raw) == ONAK_E_OK);
+}
+
 /**
  *	store_key - Takes a key and stores it.
  *	@publickey: A pointer to the public key to store.
@@ -190,39 +216,45 @@ static int file_fetch_key_text(__unused struct onak_dbctx *dbctx,
  *	Returns the number of keys we iterated over.
  */
 static int file_iterate_keys(struct onak_dbctx *dbctx,
-		void (*iterfunc)(void *ctx, struct openpgp_publickey *key),
+		bool (*iterfunc)(void *ctx, struct openpgp_publickey *key),
 		void *ctx)
 {
 	char *db_dir = (char *) dbctx->priv;
 	int                         numkeys = 0;
 	struct openpgp_packet_list *packets = NULL;
 	struct openpgp_publickey   *key = NULL;
+	struct openpgp_raw_key      raw;
 	DIR                        *dir;
 	char                        keyfile[1024];
 	struct dirent              *curfile = NULL;
 	onak_status_t               res;
+	bool                        more = true;
 
 	dir = opendir(db_dir);
 
 	if (dir != NULL) {
-		while ((curfile = readdir(dir)) != NULL) {
+		while (more && (curfile = readdir(dir)) != NULL) {
 			if (curfile->d_name[0] == '0' &&
 					curfile->d_name[1] == 'x') {
 				snprintf(keyfile, 1023, "%s/%s",
 						db_dir,
 						curfile->d_name);
-				res = onak_read_openpgp_file(keyfile,
-						&packets);
+				res = onak_read_openpgp_file_raw(keyfile,
+						&raw);
 
 				if (res == ONAK_E_OK) {
+					read_openpgp_buffer(raw.data,
+							raw.length,
+							&packets, 0);
 					parse_keys(packets, &key);
 
-					iterfunc(ctx, key);
+					more = iterfunc(ctx, key);
 
 					free_publickey(key);
 					key = NULL;
 					free_packet_list(packets);
 					packets = NULL;
+					free_raw_key(&raw);
 				}
 				numkeys++;
 			}
@@ -271,7 +303,7 @@ struct onak_dbctx *keydb_file_init(struct onak_db_config *dbcfg,
 {
 	struct onak_dbctx *dbctx;
 
-	dbctx = malloc(sizeof(struct onak_dbctx));
+	dbctx = calloc(1, sizeof(struct onak_dbctx));
 	if (dbctx == NULL) {
 		return NULL;
 	}
@@ -287,6 +319,7 @@ struct onak_dbctx *keydb_file_init(struct onak_db_config *dbcfg,
 	dbctx->fetch_key_fp		= generic_fetch_key_fp;
 	dbctx->fetch_key_id		= file_fetch_key_id;
 	dbctx->fetch_key_text		= file_fetch_key_text;
+	dbctx->fetch_key_id_raw		= file_fetch_key_id_raw;
 	dbctx->store_key		= file_store_key;
 	dbctx->update_keys		= generic_update_keys;
 	dbctx->delete_key		= file_delete_key;
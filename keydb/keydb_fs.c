@@ -97,7 +97,7 @@ static void keydir(char *buffer, size_t length, uint64_t _keyid,
 
 static void prove_path_to(uint64_t keyid, char *what, char *basepath)
 {
-	static char buffer[PATH_MAX];
+	char buffer[PATH_MAX];
 	snprintf(buffer, sizeof(buffer), "%s/%s", basepath, what);
 	mkdir(buffer, 0777);
 
@@ -210,7 +210,7 @@ static void fs_endtrans(struct onak_dbctx *dbctx)
 
 static uint64_t fs_getfullkeyid(struct onak_dbctx *dbctx, uint64_t keyid)
 {
-	static char buffer[PATH_MAX];
+	char buffer[PATH_MAX];
 	DIR *d = NULL;
 	struct dirent *de = NULL;
 	uint64_t ret = 0;
@@ -258,9 +258,10 @@ static int fs_fetch_key_id(struct onak_dbctx *dbctx,
 	      struct openpgp_publickey **publickey,
 	      bool intrans)
 {
-	static char buffer[PATH_MAX];
+	char buffer[PATH_MAX];
 	int ret = 0;
 	struct openpgp_packet_list *packets = NULL;
+	struct openpgp_raw_key raw;
 	onak_status_t res;
 
 	if (!intrans)
@@ -270,20 +271,20 @@ static int fs_fetch_key_id(struct onak_dbctx *dbctx,
 		keyid = fs_getfullkeyid(dbctx, keyid);
 
 	keypath(buffer, sizeof(buffer), keyid, dbctx->config->location);
-	res = onak_read_openpgp_file(buffer,
-					&packets);
+	res = onak_read_openpgp_file_raw(buffer, &raw);
 	if (res == ONAK_E_NOT_FOUND) {
 		subkeypath(buffer, sizeof(buffer), keyid,
 			dbctx->config->location);
-		res = onak_read_openpgp_file(buffer,
-					&packets);
+		res = onak_read_openpgp_file_raw(buffer, &raw);
 	}
 
 	if (res == ONAK_E_OK) {
 		/* File is present, load it in... */
+		read_openpgp_buffer(raw.data, raw.length, &packets, 0);
 		parse_keys(packets, publickey);
 		free_packet_list(packets);
 		packets = NULL;
+		free_raw_key(&raw);
 		ret = 1;
 	}
 
@@ -302,8 +303,8 @@ static int fs_store_key(struct onak_dbctx *dbctx,
 	      struct openpgp_publickey *publickey, bool intrans,
 	      bool update)
 {
-	static char buffer[PATH_MAX];
-	static char wbuffer[PATH_MAX];
+	char buffer[PATH_MAX];
+	char wbuffer[PATH_MAX];
 	int ret = 0, fd;
 	struct openpgp_packet_list *packets = NULL;
 	struct openpgp_packet_list *list_end = NULL;
@@ -407,7 +408,7 @@ static int fs_store_key(struct onak_dbctx *dbctx,
 static int fs_delete_key(struct onak_dbctx *dbctx,
 		struct openpgp_fingerprint *fp, bool intrans)
 {
-	static char buffer[PATH_MAX];
+	char buffer[PATH_MAX];
 	int ret;
 	struct openpgp_publickey *pk = NULL;
 	struct skshash hash;
@@ -594,23 +595,78 @@ static int fs_fetch_key_skshash(struct onak_dbctx *dbctx,
 	      const struct skshash *hash,
 	      struct openpgp_publickey **publickey)
 {
-	static char buffer[PATH_MAX];
+	char buffer[PATH_MAX];
 	int ret = 0;
 	struct openpgp_packet_list *packets = NULL;
+	struct openpgp_raw_key raw;
 	onak_status_t res;
 
 	skshashpath(buffer, sizeof(buffer), hash, dbctx->config->location);
-	res = onak_read_openpgp_file(buffer, &packets);
+	res = onak_read_openpgp_file_raw(buffer, &raw);
 	if (res == ONAK_E_OK) {
+		read_openpgp_buffer(raw.data, raw.length, &packets, 0);
 		parse_keys(packets, publickey);
 		free_packet_list(packets);
 		packets = NULL;
+		free_raw_key(&raw);
 		ret = 1;
 	}
 
 	return ret;
 }
 
+/**
+ *	fetch_key_id_raw - Given a keyid fetch the key data from storage.
+ *	@keyid: The keyid to fetch.
+ *	@raw: Returns the stored key data.
+ *	@intrans: If we're already in a transaction.
+ *
+ *	As fetch_key_id, but returns the stored key file without parsing it.
+ */
+static int fs_fetch_key_id_raw(struct onak_dbctx *dbctx,
+	      uint64_t keyid,
+	      struct openpgp_raw_key *raw,
+	      bool intrans)
+{
+	char buffer[PATH_MAX];
+	onak_status_t res;
+
+	if (!intrans)
+		fs_starttrans(dbctx);
+
+	if ((keyid >> 32) == 0)
+		keyid = fs_getfullkeyid(dbctx, keyid);
+
+	keypath(buffer, sizeof(buffer), keyid, dbctx->config->location);
+	res = onak_read_openpgp_file_raw(buffer, raw);
+	if (res == ONAK_E_NOT_FOUND) {
+		subkeypath(buffer, sizeof(buffer), keyid,
+			dbctx->config->location);
+		res = onak_read_openpgp_file_raw(buffer, raw);
+	}
+
+	if (!intrans)
+		fs_endtrans(dbctx);
+
+	return (res == ONAK_E_OK);
+}
+
+/**
+ *	fetch_key_skshash_raw - Given an SKS hash fetch the key data.
+ *	@hash: The hash to fetch.
+ *	@raw: Returns the stored key data.
+ */
+static int fs_fetch_key_skshash_raw(struct onak_dbctx *dbctx,
+	      const struct skshash *hash,
+	      struct openpgp_raw_key *raw)
+{
+	char buffer[PATH_MAX];
+
+	skshashpath(buffer, sizeof(buffer), hash, dbctx->config->location);
+
+	return (onak_read_openpgp_file_raw(buffer, raw) == ONAK_E_OK);
+}
+
 /**
  *	iterate_keys - call a function once for each key in the db.
  *	@iterfunc: The function to call.
@@ -623,7 +679,7 @@ static int fs_fetch_key_skshash(struct onak_dbctx *dbctx,
  *	Returns the number of keys we iterated over.
  */
 static int fs_iterate_keys(__unused struct onak_dbctx *dbctx,
-		__unused void (*iterfunc)(void *ctx,
+		__unused bool (*iterfunc)(void *ctx,
 			struct openpgp_publickey *key),
 		__unused void *ctx)
 {
@@ -664,7 +720,7 @@ struct onak_dbctx *keydb_fs_init(struct onak_db_config *dbcfg, bool readonly)
 	struct onak_dbctx *dbctx;
 	struct onak_fs_dbctx *privctx;
 
-	dbctx = malloc(sizeof(struct onak_dbctx));
+	dbctx = calloc(1, sizeof(struct onak_dbctx));
 	if (dbctx == NULL) {
 		return NULL;
 	}
@@ -718,6 +774,8 @@ struct onak_dbctx *keydb_fs_init(struct onak_db_config *dbcfg, bool readonly)
 	dbctx->fetch_key_id		= fs_fetch_key_id;
 	dbctx->fetch_key_text		= fs_fetch_key_text;
 	dbctx->fetch_key_skshash	= fs_fetch_key_skshash;
+	dbctx->fetch_key_id_raw		= fs_fetch_key_id_raw;
+	dbctx->fetch_key_skshash_raw	= fs_fetch_key_skshash_raw;
 	dbctx->store_key		= fs_store_key;
 	dbctx->update_keys		= generic_update_keys;
 	dbctx->delete_key		= fs_delete_key;
@@ -291,7 +291,7 @@ static int hkp_delete_key(__unused struct onak_dbctx *dbctx,
  *	Not applicable for HKP backend.
  */
 static int hkp_iterate_keys(__unused struct onak_dbctx *dbctx,
-		__unused void (*iterfunc)(void *ctx, struct openpgp_publickey *key),
+		__unused bool (*iterfunc)(void *ctx, struct openpgp_publickey *key),
 		__unused void *ctx)
 {
 	return 0;
@@ -356,7 +356,7 @@ struct onak_dbctx *keydb_hkp_init(struct onak_db_config *dbcfg,
 	struct onak_hkp_dbctx *privctx;
 	curl_version_info_data *curl_info;
 
-	dbctx = malloc(sizeof(struct onak_dbctx));
+	dbctx = calloc(1, sizeof(struct onak_dbctx));
 	if (dbctx == NULL) {
 		return NULL;
 	}
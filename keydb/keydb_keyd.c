@@ -18,6 +18,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -40,6 +41,13 @@
 #include "onak-conf.h"
 #include "parsekey.h"
 
+struct onak_keyd_dbctx {
+	/** Our connection to keyd. */
+	int fd;
+	/** The protocol version keyd told us it speaks. */
+	uint32_t version;
+};
+
 /**
  *	starttrans - Start a transaction.
  *
@@ -98,7 +106,9 @@ static int keyd_fetch_key(struct onak_dbctx *dbctx,
 		struct openpgp_publickey **publickey,
 		__unused bool intrans)
 {
-	int keyd_fd = (intptr_t) dbctx->priv;
+	struct onak_keyd_dbctx *privctx =
+			(struct onak_keyd_dbctx *) dbctx->priv;
+	int keyd_fd = privctx->fd;
 	struct buffer_ctx           keybuf;
 	struct openpgp_packet_list *packets = NULL;
 	ssize_t                     bytes = 0;
@@ -128,7 +138,7 @@ static int keyd_fetch_key(struct onak_dbctx *dbctx,
 						"Read %zd bytes.", bytes);
 				count += bytes;
 			}
-			read_openpgp_stream(buffer_fetchchar, &keybuf,
+			read_openpgp_buffer(keybuf.buffer, keybuf.size,
 					&packets, 0);
 			parse_keys(packets, publickey);
 			free_packet_list(packets);
@@ -147,7 +157,9 @@ static int keyd_fetch_key_fp(struct onak_dbctx *dbctx,
 		struct openpgp_publickey **publickey,
 		__unused bool intrans)
 {
-	int keyd_fd = (intptr_t) dbctx->priv;
+	struct onak_keyd_dbctx *privctx =
+			(struct onak_keyd_dbctx *) dbctx->priv;
+	int keyd_fd = privctx->fd;
 	struct buffer_ctx           keybuf;
 	struct openpgp_packet_list *packets = NULL;
 	ssize_t                     bytes = 0;
@@ -177,7 +189,7 @@ static int keyd_fetch_key_fp(struct onak_dbctx *dbctx,
 						"Read %zd bytes.", bytes);
 				count += bytes;
 			}
-			read_openpgp_stream(buffer_fetchchar, &keybuf,
+			read_openpgp_buffer(keybuf.buffer, keybuf.size,
 					&packets, 0);
 			parse_keys(packets, publickey);
 			free_packet_list(packets);
@@ -196,7 +208,9 @@ static int keyd_fetch_key_id(struct onak_dbctx *dbctx,
 		struct openpgp_publickey **publickey,
 		__unused bool intrans)
 {
-	int keyd_fd = (intptr_t) dbctx->priv;
+	struct onak_keyd_dbctx *privctx =
+			(struct onak_keyd_dbctx *) dbctx->priv;
+	int keyd_fd = privctx->fd;
 	struct buffer_ctx           keybuf;
 	struct openpgp_packet_list *packets = NULL;
 	ssize_t                     bytes = 0;
@@ -219,7 +233,7 @@ static int keyd_fetch_key_id(struct onak_dbctx *dbctx,
 						"Read %zd bytes.", bytes);
 				count += bytes;
 			}
-			read_openpgp_stream(buffer_fetchchar, &keybuf,
+			read_openpgp_buffer(keybuf.buffer, keybuf.size,
 					&packets, 0);
 			parse_keys(packets, publickey);
 			free_packet_list(packets);
@@ -245,10 +259,24 @@ static int keyd_delete_key(struct onak_dbctx *dbctx,
 		struct openpgp_fingerprint *fp,
 		__unused bool intrans)
 {
-	int keyd_fd = (intptr_t) dbctx->priv;
+	struct onak_keyd_dbctx *privctx =
+			(struct onak_keyd_dbctx *) dbctx->priv;
+	int keyd_fd = privctx->fd;
+	uint32_t reply;
 
 	if (keyd_send_cmd(keyd_fd, KEYD_CMD_DELETE)) {
 		write(keyd_fd, fp, sizeof(*fp));
+
+		/*
+		 * Newer keyd versions tell us once the key's actually gone,
+		 * or if it wasn't there to delete.
+		 */
+		if (privctx->version >= 6 &&
+				(read(keyd_fd, &reply, sizeof(reply)) !=
+					sizeof(reply) ||
+				reply != KEYD_REPLY_OK)) {
+			return 1;
+		}
 	}
 
 	return 0;
@@ -273,13 +301,16 @@ static int keyd_store_key(struct onak_dbctx *dbctx,
 		__unused bool intrans,
 		bool update)
 {
-	int keyd_fd = (intptr_t) dbctx->priv;
+	struct onak_keyd_dbctx *privctx =
+			(struct onak_keyd_dbctx *) dbctx->priv;
+	int keyd_fd = privctx->fd;
 	struct buffer_ctx           keybuf;
 	struct openpgp_packet_list *packets = NULL;
 	struct openpgp_packet_list *list_end = NULL;
 	struct openpgp_publickey   *next = NULL;
 	uint64_t                    keyid;
 	enum keyd_ops               cmd = KEYD_CMD_STORE;
+	uint32_t                    reply;
 
 	if (get_keyid(publickey, &keyid) != ONAK_E_OK) {
 		logthing(LOGTHING_ERROR, "Couldn't find key ID for key.");
@@ -312,6 +343,21 @@ static int keyd_store_key(struct onak_dbctx *dbctx,
 		free(keybuf.buffer);
 		keybuf.buffer = NULL;
 		keybuf.size = keybuf.offset = 0;
+
+		/*
+		 * keyd may group our update with others into a single
+		 * transaction; if it's new enough to tell us, wait until it's
+		 * actually been committed.
+		 */
+		if (privctx->version >= 6 &&
+				(read(keyd_fd, &reply, sizeof(reply)) !=
+					sizeof(reply) ||
+				reply != KEYD_REPLY_OK)) {
+			logthing(LOGTHING_ERROR,
+				"keyd failed to store key 0x%016" PRIX64,
+				keyid);
+			return -1;
+		}
 	}
 
 	return 0;
@@ -329,7 +375,9 @@ static int keyd_fetch_key_text(struct onak_dbctx *dbctx,
 		const char *search,
 		struct openpgp_publickey **publickey)
 {
-	int keyd_fd = (intptr_t) dbctx->priv;
+	struct onak_keyd_dbctx *privctx =
+			(struct onak_keyd_dbctx *) dbctx->priv;
+	int keyd_fd = privctx->fd;
 	struct buffer_ctx           keybuf;
 	struct openpgp_packet_list *packets = NULL;
 	ssize_t                     bytes = 0;
@@ -354,7 +402,7 @@ static int keyd_fetch_key_text(struct onak_dbctx *dbctx,
 						"Read %zd bytes.", bytes);
 				count += bytes;
 			}
-			read_openpgp_stream(buffer_fetchchar, &keybuf,
+			read_openpgp_buffer(keybuf.buffer, keybuf.size,
 					&packets, 0);
 			parse_keys(packets, publickey);
 			free_packet_list(packets);
@@ -372,7 +420,9 @@ static int keyd_fetch_key_skshash(struct onak_dbctx *dbctx,
 		const struct skshash *hash,
 		struct openpgp_publickey **publickey)
 {
-	int keyd_fd = (intptr_t) dbctx->priv;
+	struct onak_keyd_dbctx *privctx =
+			(struct onak_keyd_dbctx *) dbctx->priv;
+	int keyd_fd = privctx->fd;
 	struct buffer_ctx           keybuf;
 	struct openpgp_packet_list *packets = NULL;
 	ssize_t                     bytes = 0;
@@ -395,7 +445,7 @@ static int keyd_fetch_key_skshash(struct onak_dbctx *dbctx,
 						"Read %zd bytes.", bytes);
 				count += bytes;
 			}
-			read_openpgp_stream(buffer_fetchchar, &keybuf,
+			read_openpgp_buffer(keybuf.buffer, keybuf.size,
 					&packets, 0);
 			parse_keys(packets, publickey);
 			free_packet_list(packets);
@@ -409,6 +459,279 @@ static int keyd_fetch_key_skshash(struct onak_dbctx *dbctx,
 	return (count > 0) ? 1 : 0;
 }
 
+/**
+ *	keyd_read_all - Read an exact number of bytes from keyd.
+ *	@fd: The keyd socket.
+ *	@buf: The buffer to read into.
+ *	@count: The number of bytes to read.
+ */
+static bool keyd_read_all(int fd, void *buf, size_t count)
+{
+	uint8_t *p = buf;
+	ssize_t  bytes;
+
+	while (count > 0) {
+		bytes = read(fd, p, count);
+		if (bytes <= 0) {
+			return false;
+		}
+		p += bytes;
+		count -= bytes;
+	}
+
+	return true;
+}
+
+/**
+ *	keyd_write_all - Write an exact number of bytes to keyd.
+ *	@fd: The keyd socket.
+ *	@buf: The data to write.
+ *	@count: The number of bytes to write.
+ */
+static bool keyd_write_all(int fd, const void *buf, size_t count)
+{
+	const uint8_t *p = buf;
+	ssize_t        bytes;
+
+	while (count > 0) {
+		bytes = write(fd, p, count);
+		if (bytes <= 0) {
+			return false;
+		}
+		p += bytes;
+		count -= bytes;
+	}
+
+	return true;
+}
+
+/**
+ *	fetch_keys_skshash - Fetch several keys by SKS hash in one go.
+ *	@hashes: The hashes to fetch.
+ *	@count: The number of hashes.
+ *	@keys: Array of @count pointers to return the keys in.
+ *
+ *	With a version 6 or later keyd we send all of the lookups as a single
+ *	KEYD_CMD_GET_BATCH request, without waiting for the reply to the
+ *	command, and get the results back in one frame. Older keyd versions
+ *	get a request per hash.
+ */
+static int keyd_fetch_keys_skshash(struct onak_dbctx *dbctx,
+		const struct skshash *hashes, int count,
+		struct openpgp_publickey **keys)
+{
+	struct onak_keyd_dbctx *privctx =
+			(struct onak_keyd_dbctx *) dbctx->priv;
+	struct openpgp_packet_list *packets = NULL;
+	struct buffer_ctx           reqbuf, keybuf;
+	uint32_t                    cmd, num;
+	uint8_t                     op, len;
+	size_t                      size;
+	int                         found = 0, start, i;
+
+	for (start = 0; start < count; start += num) {
+		num = count - start;
+		if (num > KEYD_MAX_BATCH) {
+			num = KEYD_MAX_BATCH;
+		}
+
+		if (privctx->version < 6) {
+			for (i = start; i < start + num; i++) {
+				found += keyd_fetch_key_skshash(dbctx,
+						&hashes[i], &keys[i]);
+			}
+			continue;
+		}
+
+		/* Build the whole request so it goes out in a single write */
+		reqbuf.offset = 0;
+		reqbuf.size = 8192;
+		reqbuf.buffer = malloc(reqbuf.size);
+		cmd = KEYD_CMD_GET_BATCH;
+		buffer_putchar(&reqbuf, sizeof(cmd), &cmd);
+		buffer_putchar(&reqbuf, sizeof(num), &num);
+		for (i = start; i < start + num; i++) {
+			op = KEYD_CMD_GET_SKSHASH;
+			len = sizeof(hashes[i].hash);
+			buffer_putchar(&reqbuf, 1, &op);
+			buffer_putchar(&reqbuf, 1, &len);
+			buffer_putchar(&reqbuf, len,
+					(void *) hashes[i].hash);
+		}
+
+		if (!keyd_write_all(privctx->fd, reqbuf.buffer,
+					reqbuf.offset) ||
+				!keyd_read_all(privctx->fd, &cmd,
+					sizeof(cmd)) ||
+				cmd != KEYD_REPLY_OK ||
+				!keyd_read_all(privctx->fd, &size,
+					sizeof(size))) {
+			logthing(LOGTHING_ERROR,
+				"Failed to send batch request to keyd.");
+			free(reqbuf.buffer);
+			return found;
+		}
+		free(reqbuf.buffer);
+		reqbuf.buffer = NULL;
+
+		keybuf.offset = 0;
+		keybuf.size = size;
+		keybuf.buffer = malloc(size);
+		if (keybuf.buffer == NULL ||
+				!keyd_read_all(privctx->fd, keybuf.buffer,
+					size)) {
+			logthing(LOGTHING_ERROR,
+				"Failed to read batch reply from keyd.");
+			free(keybuf.buffer);
+			return found;
+		}
+		logthing(LOGTHING_TRACE,
+				"Got %zu bytes of batched key data.", size);
+
+		for (i = start; i < start + num; i++) {
+			if (buffer_fetchchar(&keybuf, sizeof(size), &size) !=
+					sizeof(size) ||
+					size > keybuf.size - keybuf.offset) {
+				break;
+			}
+			if (size > 0) {
+				struct buffer_ctx onekey;
+
+				onekey.buffer = &keybuf.buffer[keybuf.offset];
+				onekey.size = size;
+				onekey.offset = 0;
+				read_openpgp_buffer(onekey.buffer, onekey.size,
+						&packets, 0);
+				parse_keys(packets, &keys[i]);
+				free_packet_list(packets);
+				packets = NULL;
+				keybuf.offset += size;
+				if (keys[i] != NULL) {
+					found++;
+				}
+			}
+		}
+		free(keybuf.buffer);
+		keybuf.buffer = NULL;
+	}
+
+	return found;
+}
+
+/**
+ *	keyd_fetch_raw - Read a key reply from keyd without parsing it.
+ *	@fd: The keyd socket.
+ *	@raw: The raw key structure to fill in.
+ *
+ *	Reads the length prefixed key data keyd sends in reply to one of the
+ *	GET commands into a freshly allocated buffer. Returns 1 if a key was
+ *	returned, 0 otherwise.
+ */
+static int keyd_fetch_raw(int fd, struct openpgp_raw_key *raw)
+{
+	uint8_t *data;
+	size_t   size = 0;
+
+	if (!keyd_read_all(fd, &size, sizeof(size)) || size == 0) {
+		return 0;
+	}
+
+	data = malloc(size);
+	if (data == NULL) {
+		logthing(LOGTHING_ERROR,
+			"Couldn't allocate %zu bytes for key data.", size);
+		return 0;
+	}
+	logthing(LOGTHING_TRACE, "Getting %zu bytes of key data.", size);
+	if (!keyd_read_all(fd, data, size)) {
+		free(data);
+		return 0;
+	}
+
+	raw->data = data;
+	raw->length = size;
+	raw->storage = OPENPGP_RAW_MALLOC;
+
+	return 1;
+}
+
+static int keyd_fetch_key_raw_int(struct onak_dbctx *dbctx,
+		enum keyd_ops cmd,
+		struct openpgp_fingerprint *fingerprint,
+		struct openpgp_raw_key *raw)
+{
+	struct onak_keyd_dbctx *privctx =
+			(struct onak_keyd_dbctx *) dbctx->priv;
+	uint8_t size;
+
+	memset(raw, 0, sizeof(*raw));
+	if (fingerprint->length > MAX_FINGERPRINT_LEN) {
+		return 0;
+	}
+
+	if (!keyd_send_cmd(privctx->fd, cmd)) {
+		return 0;
+	}
+	size = fingerprint->length;
+	if (!keyd_write_all(privctx->fd, &size, sizeof(size)) ||
+			!keyd_write_all(privctx->fd, fingerprint->fp, size)) {
+		return 0;
+	}
+
+	return keyd_fetch_raw(privctx->fd, raw);
+}
+
+static int keyd_fetch_key_raw(struct onak_dbctx *dbctx,
+		struct openpgp_fingerprint *fingerprint,
+		struct openpgp_raw_key *raw,
+		__unused bool intrans)
+{
+	return keyd_fetch_key_raw_int(dbctx, KEYD_CMD_GET, fingerprint, raw);
+}
+
+static int keyd_fetch_key_fp_raw(struct onak_dbctx *dbctx,
+		struct openpgp_fingerprint *fingerprint,
+		struct openpgp_raw_key *raw,
+		__unused bool intrans)
+{
+	return keyd_fetch_key_raw_int(dbctx, KEYD_CMD_GET_FP, fingerprint,
+			raw);
+}
+
+static int keyd_fetch_key_id_raw(struct onak_dbctx *dbctx,
+		uint64_t keyid,
+		struct openpgp_raw_key *raw,
+		__unused bool intrans)
+{
+	struct onak_keyd_dbctx *privctx =
+			(struct onak_keyd_dbctx *) dbctx->priv;
+
+	memset(raw, 0, sizeof(*raw));
+	if (!keyd_send_cmd(privctx->fd, KEYD_CMD_GET_ID) ||
+			!keyd_write_all(privctx->fd, &keyid, sizeof(keyid))) {
+		return 0;
+	}
+
+	return keyd_fetch_raw(privctx->fd, raw);
+}
+
+static int keyd_fetch_key_skshash_raw(struct onak_dbctx *dbctx,
+		const struct skshash *hash,
+		struct openpgp_raw_key *raw)
+{
+	struct onak_keyd_dbctx *privctx =
+			(struct onak_keyd_dbctx *) dbctx->priv;
+
+	memset(raw, 0, sizeof(*raw));
+	if (!keyd_send_cmd(privctx->fd, KEYD_CMD_GET_SKSHASH) ||
+			!keyd_write_all(privctx->fd, hash->hash,
+				sizeof(hash->hash))) {
+		return 0;
+	}
+
+	return keyd_fetch_raw(privctx->fd, raw);
+}
+
 /**
  *	iterate_keys - call a function once for each key in the db.
  *	@iterfunc: The function to call.
@@ -421,16 +744,19 @@ static int keyd_fetch_key_skshash(struct onak_dbctx *dbctx,
  *	Returns the number of keys we iterated over.
  */
 static int keyd_iterate_keys(struct onak_dbctx *dbctx,
-		void (*iterfunc)(void *ctx,
+		bool (*iterfunc)(void *ctx,
 		struct openpgp_publickey *key),	void *ctx)
 {
-	int keyd_fd = (intptr_t) dbctx->priv;
+	struct onak_keyd_dbctx *privctx =
+			(struct onak_keyd_dbctx *) dbctx->priv;
+	int keyd_fd = privctx->fd;
 	struct buffer_ctx           keybuf;
 	struct openpgp_packet_list *packets = NULL;
 	struct openpgp_publickey   *key = NULL;
 	ssize_t                     bytes = 0;
 	ssize_t                     count = 0;
 	int                         numkeys = 0;
+	bool                        more = true;
 
 	if (keyd_send_cmd(keyd_fd, KEYD_CMD_KEYITER)) {
 		keybuf.offset = 0;
@@ -448,24 +774,30 @@ static int keyd_iterate_keys(struct onak_dbctx *dbctx,
 						"Read %zd bytes.", bytes);
 				count += bytes;
 			}
-			read_openpgp_stream(buffer_fetchchar, &keybuf,
-					&packets, 0);
-			parse_keys(packets, &key);
-
-			if (iterfunc != NULL && key != NULL) {
-				iterfunc(ctx, key);
+			/*
+			 * keyd has no way to be told to stop, so once the
+			 * caller has had enough we still have to read the
+			 * rest of the keys to keep the connection in step.
+			 */
+			if (more) {
+				read_openpgp_buffer(keybuf.buffer, keybuf.size,
+						&packets, 0);
+				parse_keys(packets, &key);
+
+				if (iterfunc != NULL && key != NULL) {
+					more = iterfunc(ctx, key);
+				}
+
+				free_publickey(key);
+				key = NULL;
+				free_packet_list(packets);
+				packets = NULL;
+				numkeys++;
 			}
-
-			free_publickey(key);
-			key = NULL;
-			free_packet_list(packets);
-			packets = NULL;
 			free(keybuf.buffer);
 			keybuf.buffer = NULL;
 			keybuf.size = keybuf.offset = 0;
 
-			numkeys++;
-
 			read(keyd_fd, &keybuf.size, sizeof(keybuf.size));
 		}
 	}
@@ -486,7 +818,9 @@ static int keyd_iterate_keys(struct onak_dbctx *dbctx,
  */
 static void keyd_cleanupdb(struct onak_dbctx *dbctx)
 {
-	int keyd_fd = (intptr_t) dbctx->priv;
+	struct onak_keyd_dbctx *privctx =
+			(struct onak_keyd_dbctx *) dbctx->priv;
+	int keyd_fd = privctx->fd;
 	uint32_t cmd = KEYD_CMD_CLOSE;
 
 	if (write(keyd_fd, &cmd, sizeof(cmd)) != sizeof(cmd)) {
@@ -515,6 +849,7 @@ static void keyd_cleanupdb(struct onak_dbctx *dbctx)
 				errno);
 	}
 
+	free(privctx);
 	free(dbctx);
 
 	return;
@@ -537,12 +872,18 @@ struct onak_dbctx *keydb_keyd_init(struct onak_db_config *dbcfg,
 	ssize_t		   count;
 	int keyd_fd;
 	struct onak_dbctx *dbctx;
+	struct onak_keyd_dbctx *privctx;
 
-	dbctx = malloc(sizeof(*dbctx));
+	dbctx = calloc(1, sizeof(*dbctx));
 	if (dbctx == NULL) {
 		return NULL;
 	}
 	dbctx->config = dbcfg;
+	dbctx->priv = privctx = calloc(1, sizeof(*privctx));
+	if (privctx == NULL) {
+		free(dbctx);
+		return NULL;
+	}
 
 	keyd_fd = socket(PF_UNIX, SOCK_STREAM, 0);
 	if (keyd_fd < 0) {
@@ -566,6 +907,19 @@ struct onak_dbctx *keydb_keyd_init(struct onak_db_config *dbcfg,
 		exit(EXIT_FAILURE);
 	}
 
+	/*
+	 * Tell keyd which version we speak, so it knows it can use it with
+	 * us. A version 5 keyd doesn't know the command, and will just talk
+	 * version 5 to us.
+	 */
+	reply = keyd_version;
+	if (keyd_send_cmd(keyd_fd, KEYD_CMD_CLIENT_VERSION) &&
+			write(keyd_fd, &reply, sizeof(reply)) !=
+			sizeof(reply)) {
+		logthing(LOGTHING_ERROR,
+			"Couldn't send our keyd protocol version.");
+	}
+
 	cmd = KEYD_CMD_VERSION;
 	if (write(keyd_fd, &cmd, sizeof(cmd)) != sizeof(cmd)) {
 		logthing(LOGTHING_CRITICAL,
@@ -595,16 +949,18 @@ struct onak_dbctx *keydb_keyd_init(struct onak_db_config *dbcfg,
 			logthing(LOGTHING_DEBUG,
 					"keyd protocol version %d",
 					reply);
-			if (reply != keyd_version) {
+			if (reply < keyd_min_version ||
+					reply > keyd_version) {
 				logthing(LOGTHING_CRITICAL,
 					"Error! keyd protocol version "
 					"mismatch. (us = %d, it = %d)",
 						keyd_version, reply);
 			}
+			privctx->version = reply;
 		}
 	}
 
-	dbctx->priv			= (void *) (intptr_t) keyd_fd;
+	privctx->fd			= keyd_fd;
 	dbctx->cleanupdb		= keyd_cleanupdb;
 	dbctx->starttrans		= keyd_starttrans;
 	dbctx->endtrans			= keyd_endtrans;
@@ -613,6 +969,11 @@ struct onak_dbctx *keydb_keyd_init(struct onak_db_config *dbcfg,
 	dbctx->fetch_key_id		= keyd_fetch_key_id;
 	dbctx->fetch_key_text		= keyd_fetch_key_text;
 	dbctx->fetch_key_skshash	= keyd_fetch_key_skshash;
+	dbctx->fetch_keys_skshash	= keyd_fetch_keys_skshash;
+	dbctx->fetch_key_raw		= keyd_fetch_key_raw;
+	dbctx->fetch_key_fp_raw		= keyd_fetch_key_fp_raw;
+	dbctx->fetch_key_id_raw		= keyd_fetch_key_id_raw;
+	dbctx->fetch_key_skshash_raw	= keyd_fetch_key_skshash_raw;
 	dbctx->store_key		= keyd_store_key;
 	dbctx->update_keys		= generic_update_keys;
 	dbctx->delete_key		= keyd_delete_key;
@@ -81,16 +81,12 @@ static int keyring_fetch_key_idx(struct onak_keyring_dbctx *privctx,
 		struct openpgp_publickey **publickey)
 {
 	struct openpgp_packet_list *packets = NULL;
-	struct buffer_ctx buf;
 
 	if (index > privctx->count)
 		return 0;
 
-	buf.buffer = (char *) privctx->keys[index].start;
-	buf.size = privctx->keys[index].len;
-	buf.offset = 0;
-
-	read_openpgp_stream(buffer_fetchchar, &buf, &packets, 0);
+	read_openpgp_buffer(privctx->keys[index].start,
+			privctx->keys[index].len, &packets, 0);
 	parse_keys(packets, publickey);
 	free_packet_list(packets);
 	packets = NULL;
@@ -149,6 +145,90 @@ static int keyring_fetch_key_id(struct onak_dbctx *dbctx,
 	return count;
 }
 
+/*
+ * Add a key's packets to a raw key. The first key is just a view of the
+ * mapped keyring; if there's more than one we have to copy them.
+ */
+static void keyring_add_raw(struct onak_keyring_dbctx *privctx,
+		unsigned int index,
+		struct openpgp_raw_key *raw)
+{
+	uint8_t *data;
+
+	if (raw->data == NULL) {
+		raw->data = privctx->keys[index].start;
+		raw->length = privctx->keys[index].len;
+		raw->storage = OPENPGP_RAW_BORROWED;
+		return;
+	}
+
+	if (raw->storage == OPENPGP_RAW_BORROWED) {
+		data = malloc(raw->length + privctx->keys[index].len);
+		memcpy(data, raw->data, raw->length);
+	} else {
+		data = realloc((void *) raw->data,
+				raw->length + privctx->keys[index].len);
+	}
+	memcpy(&data[raw->length], privctx->keys[index].start,
+			privctx->keys[index].len);
+	raw->data = data;
+	raw->length += privctx->keys[index].len;
+	raw->storage = OPENPGP_RAW_MALLOC;
+}
+
+/**
+ *	fetch_key_raw - Given a fingerprint fetch the key data from storage.
+ *	@fingerprint: The fingerprint to fetch.
+ *	@raw: Returns the key data, pointing into the mapped keyring.
+ *	@intrans: If we're already in a transaction.
+ */
+static int keyring_fetch_key_raw(struct onak_dbctx *dbctx,
+			struct openpgp_fingerprint *fingerprint,
+			struct openpgp_raw_key *raw,
+			__unused bool intrans)
+{
+	struct onak_keyring_dbctx *privctx =
+		(struct onak_keyring_dbctx *) dbctx->priv;
+	int i;
+
+	memset(raw, 0, sizeof(*raw));
+	for (i = 0; i < privctx->count; i++) {
+		if (fingerprint_cmp(fingerprint, &privctx->keys[i].fp) == 0) {
+			keyring_add_raw(privctx, i, raw);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ *	fetch_key_id_raw - Given a keyid fetch the key data from storage.
+ *	@keyid: The keyid to fetch.
+ *	@raw: Returns the key data.
+ *	@intrans: If we're already in a transaction.
+ */
+static int keyring_fetch_key_id_raw(struct onak_dbctx *dbctx,
+		uint64_t keyid,
+		struct openpgp_raw_key *raw,
+		__unused bool intrans)
+{
+	struct onak_keyring_dbctx *privctx =
+		(struct onak_keyring_dbctx *) dbctx->priv;
+	int count, i;
+
+	memset(raw, 0, sizeof(*raw));
+	count = 0;
+	for (i = 0; i < privctx->count; i++) {
+		if (fingerprint2keyid(&privctx->keys[i].fp) == keyid) {
+			keyring_add_raw(privctx, i, raw);
+			count++;
+		}
+	}
+
+	return count;
+}
+
 /**
  *	store_key - Takes a key and stores it.
  *	@publickey: A pointer to the public key to store.
@@ -207,19 +287,20 @@ static int keyring_fetch_key_text(__unused struct onak_dbctx *dbctx,
  *	Returns the number of keys we iterated over.
  */
 static int keyring_iterate_keys(struct onak_dbctx *dbctx,
-		void (*iterfunc)(void *ctx, struct openpgp_publickey *key),
+		bool (*iterfunc)(void *ctx, struct openpgp_publickey *key),
 		void *ctx)
 {
 	struct onak_keyring_dbctx *privctx =
 		(struct onak_keyring_dbctx *) dbctx->priv;
 	struct openpgp_publickey  *key = NULL;
 	int count, i;
+	bool more = true;
 
 	count = 0;
-	for (i = 0; i < privctx->count; i++) {
+	for (i = 0; more && i < privctx->count; i++) {
 		if (keyring_fetch_key_idx(privctx, i, &key)) {
 			count++;
-			iterfunc(ctx, key);
+			more = iterfunc(ctx, key);
 			free_publickey(key);
 			key = NULL;
 		}
@@ -247,7 +328,7 @@ static int keyring_update_keys(__unused struct onak_dbctx *dbctx,
 static int keyring_parse_keys(struct onak_keyring_dbctx *privctx)
 {
 	size_t len, pos, start, totlen;
-	struct openpgp_publickey *key;
+	struct openpgp_publickey *key = NULL;
 	uint8_t tag;
 
 	if (privctx == NULL) {
@@ -389,7 +470,7 @@ struct onak_dbctx *keydb_keyring_init(struct onak_db_config *dbcfg,
 	struct stat sb;
 	int fd;
 
-	dbctx = malloc(sizeof(struct onak_dbctx));
+	dbctx = calloc(1, sizeof(struct onak_dbctx));
 	if (dbctx == NULL) {
 		return NULL;
 	}
@@ -453,6 +534,9 @@ struct onak_dbctx *keydb_keyring_init(struct onak_db_config *dbcfg,
 	dbctx->fetch_key_fp		= keyring_fetch_key;
 	dbctx->fetch_key_id		= keyring_fetch_key_id;
 	dbctx->fetch_key_text		= keyring_fetch_key_text;
+	dbctx->fetch_key_raw		= keyring_fetch_key_raw;
+	dbctx->fetch_key_fp_raw		= keyring_fetch_key_raw;
+	dbctx->fetch_key_id_raw		= keyring_fetch_key_id_raw;
 	dbctx->store_key		= keyring_store_key;
 	dbctx->update_keys		= keyring_update_keys;
 	dbctx->delete_key		= keyring_delete_key;
@@ -530,6 +530,7 @@ static struct ll *pg_getkeysigs(struct onak_dbctx *dbctx,
 	PGconn *dbconn = (PGconn *) dbctx->priv;
 	PGresult *result = NULL;
 	uint64_t signer;
+	struct stats_key *sigkey;
 	char statement[1024];
 	int i, j;
 	int numsigs = 0;
@@ -562,7 +563,10 @@ static struct ll *pg_getkeysigs(struct onak_dbctx *dbctx,
 				}
 				j++;
 			}
-			sigs = lladd(sigs, createandaddtohash(signer));
+			sigkey = createandaddtohash(signer);
+			if (sigkey != NULL) {
+				sigs = lladd(sigs, sigkey);
+			}
 		}
 	} else if (PQresultStatus(result) != PGRES_TUPLES_OK) {
 		logthing(LOGTHING_ERROR, "Problem retrieving key from DB.");
@@ -599,7 +603,7 @@ static struct ll *pg_getkeysigs(struct onak_dbctx *dbctx,
  *	Returns the number of keys we iterated over.
  */
 static int pg_iterate_keys(struct onak_dbctx *dbctx,
-		void (*iterfunc)(void *ctx,
+		bool (*iterfunc)(void *ctx,
 		struct openpgp_publickey *key),	void *ctx)
 {
 	struct openpgp_packet_list *packets = NULL;
@@ -611,12 +615,13 @@ static int pg_iterate_keys(struct onak_dbctx *dbctx,
 	int numkeys = 0;
 	Oid key_oid;
 	struct pg_fc_ctx fcctx;
+	bool more = true;
 
 	result = PQexec(dbconn, "SELECT keydata FROM onak_keys;");
 
 	if (PQresultStatus(result) == PGRES_TUPLES_OK) {
 		numkeys = PQntuples(result);
-		for (i = 0; i < numkeys; i++) {
+		for (i = 0; more && i < numkeys; i++) {
 			oids = PQgetvalue(result, i, 0);
 			key_oid = (Oid) atoi(oids);
 
@@ -631,7 +636,7 @@ static int pg_iterate_keys(struct onak_dbctx *dbctx,
 				parse_keys(packets, &key);
 				lo_close(dbconn, fcctx.fd);
 
-				iterfunc(ctx, key);
+				more = iterfunc(ctx, key);
 
 				free_publickey(key);
 				key = NULL;
@@ -685,7 +690,7 @@ struct onak_dbctx *keydb_pg_init(struct onak_db_config *dbcfg,
 	struct onak_dbctx *dbctx;
 	PGconn *dbconn;
 
-	dbctx = malloc(sizeof(struct onak_dbctx));
+	dbctx = calloc(1, sizeof(struct onak_dbctx));
 	if (dbctx == NULL) {
 		return NULL;
 	}
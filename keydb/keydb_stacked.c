@@ -58,6 +58,16 @@ static void stacked_endtrans(struct onak_dbctx *dbctx)
 	backend->endtrans(backend);
 }
 
+static void stacked_aborttrans(struct onak_dbctx *dbctx)
+{
+	struct onak_stacked_dbctx *privctx =
+			(struct onak_stacked_dbctx *) dbctx->priv;
+	struct onak_dbctx *backend =
+			(struct onak_dbctx *) privctx->backends->object;
+
+	backend->aborttrans(backend);
+}
+
 static int stacked_store_key(struct onak_dbctx *dbctx,
 		struct openpgp_publickey *publickey, bool intrans,
 		bool update)
@@ -100,7 +110,7 @@ static int stacked_update_keys(struct onak_dbctx *dbctx,
 }
 
 static int stacked_iterate_keys(struct onak_dbctx *dbctx,
-		void (*iterfunc)(void *ctx, struct openpgp_publickey *key),
+		bool (*iterfunc)(void *ctx, struct openpgp_publickey *key),
 		void *ctx)
 {
 	struct onak_stacked_dbctx *privctx =
@@ -344,7 +354,7 @@ struct onak_dbctx *keydb_stacked_init(struct onak_db_config *dbcfg,
 	struct onak_stacked_dbctx *privctx;
 	struct onak_dbctx *backend;
 	struct onak_db_config *backend_cfg;
-	char *backend_name, *saveptr = NULL;
+	char *backend_name, *backend_list, *saveptr = NULL;
 
 	if (dbcfg == NULL) {
 		logthing(LOGTHING_CRITICAL,
@@ -352,7 +362,7 @@ struct onak_dbctx *keydb_stacked_init(struct onak_db_config *dbcfg,
 		return NULL;
 	}
 
-	dbctx = malloc(sizeof(struct onak_dbctx));
+	dbctx = calloc(1, sizeof(struct onak_dbctx));
 
 	if (dbctx == NULL) {
 		return NULL;
@@ -369,7 +379,16 @@ struct onak_dbctx *keydb_stacked_init(struct onak_db_config *dbcfg,
 	privctx->store_on_fallback = true;
 	privctx->backends = NULL;
 
-	backend_name = strtok_r(dbcfg->location, ":", &saveptr);
+	/*
+	 * Work on a copy of the backend list; we may be initialised more than
+	 * once from the same config (e.g. by each keyd worker).
+	 */
+	backend_list = strdup(dbcfg->location);
+	if (backend_list == NULL) {
+		stacked_cleanupdb(dbctx);
+		return NULL;
+	}
+	backend_name = strtok_r(backend_list, ":", &saveptr);
 	while (backend_name != NULL) {
 		backend_cfg = find_db_backend_config(config.backends,
 				backend_name);
@@ -377,6 +396,7 @@ struct onak_dbctx *keydb_stacked_init(struct onak_db_config *dbcfg,
 			logthing(LOGTHING_CRITICAL,
 				"Couldn't find configuration for %s backend",
 				backend_name);
+			free(backend_list);
 			stacked_cleanupdb(dbctx);
 			return NULL;
 		}
@@ -388,11 +408,16 @@ struct onak_dbctx *keydb_stacked_init(struct onak_db_config *dbcfg,
 
 		backend_name = strtok_r(NULL, ":", &saveptr);
 	}
+	free(backend_list);
 
 	if (privctx->backends != NULL) {
 		dbctx->cleanupdb = stacked_cleanupdb;
 		dbctx->starttrans = stacked_starttrans;
 		dbctx->endtrans = stacked_endtrans;
+		if (((struct onak_dbctx *)
+				privctx->backends->object)->aborttrans != NULL) {
+			dbctx->aborttrans = stacked_aborttrans;
+		}
 		dbctx->fetch_key = stacked_fetch_key;
 		dbctx->fetch_key_fp = stacked_fetch_key_fp;
 		dbctx->fetch_key_id = stacked_fetch_key_id;
@@ -33,6 +33,8 @@
 
 static int keyd_fd = -1;
 static int verbose = 0;
+/** The protocol version keyd has agreed to talk to us. */
+static uint32_t keyd_server_version = 0;
 
 static int keyd_do_command(enum keyd_ops cmd, void *buf, size_t len)
 {
@@ -109,8 +111,19 @@ static void keyd_connect(void)
 		exit(EXIT_FAILURE);
 	}
 
+	/* A version 5 keyd doesn't know this, and will stick to version 5. */
+	if (keyd_do_command(KEYD_CMD_CLIENT_VERSION, NULL, 0) == 0 &&
+			write(keyd_fd, &keyd_version, sizeof(keyd_version)) !=
+			sizeof(keyd_version)) {
+		if (verbose >= 0) {
+			fprintf(stderr, "Couldn't send our keyd protocol "
+				"version: %s (%d)\n", strerror(errno), errno);
+		}
+		exit(EXIT_FAILURE);
+	}
+
 	keyd_do_command(KEYD_CMD_VERSION, &reply, sizeof(reply));
-	if (reply != keyd_version) {
+	if (reply < keyd_min_version || reply > keyd_version) {
 		if (verbose >= 0) {
 			fprintf(stderr, "Error! keyd protocol version "
 				"mismatch. (us = %d, it = %d)\n",
@@ -118,6 +131,7 @@ static void keyd_connect(void)
 		}
 		exit(EXIT_FAILURE);
 	}
+	keyd_server_version = reply;
 
 	return;
 }
@@ -158,6 +172,8 @@ static void keyd_status(void)
 	}
 	printf("Using keyd protocol version %d.\n", reply);
 
+	/* A version 5 keyd sends a shorter reply, leaving the rest as 0 */
+	memset(&stats, 0, sizeof(stats));
 	if (keyd_do_command(KEYD_CMD_STATS, &stats, sizeof(stats)) == -1) {
 		printf("Got failure asking for keyd statistics.\n");
 		return;
@@ -175,12 +191,18 @@ static void keyd_status(void)
 		stats.command_stats[KEYD_CMD_GET_FP]);
 	printf("  Get key by hash:  %d\n",
 		stats.command_stats[KEYD_CMD_GET_SKSHASH]);
+	printf("  Batch get:        %d\n",
+		stats.command_stats[KEYD_CMD_GET_BATCH]);
 	printf("  Store key:        %d\n",
 		stats.command_stats[KEYD_CMD_STORE]);
 	printf("  Delete key:       %d\n",
 		stats.command_stats[KEYD_CMD_DELETE]);
 	printf("  Update key:       %d\n",
 		stats.command_stats[KEYD_CMD_UPDATE]);
+	printf("  Sync writes:      %d\n",
+		stats.command_stats[KEYD_CMD_SYNC]);
+	printf("  Client version:   %d\n",
+		stats.command_stats[KEYD_CMD_CLIENT_VERSION]);
 	printf("  Search key:       %d\n",
 		stats.command_stats[KEYD_CMD_GET_TEXT]);
 	printf("  Get full keyid:   %d\n",
@@ -192,9 +214,67 @@ static void keyd_status(void)
 	printf("  Quit:             %d\n", stats.command_stats[KEYD_CMD_QUIT]);
 	printf("  Get statistics:   %d\n",
 		stats.command_stats[KEYD_CMD_STATS]);
+	printf("  Get metrics:      %d\n",
+		stats.command_stats[KEYD_CMD_METRICS]);
 	printf("  Unknown:          %d\n",
 		stats.command_stats[KEYD_CMD_UNKNOWN]);
 
+	if (keyd_server_version >= 6) {
+		printf("Key cache:\n");
+		printf("  Hits:             %d\n", stats.cache_hits);
+		printf("  Misses:           %d\n", stats.cache_misses);
+	}
+
+	return;
+}
+
+/*
+ * The metrics reply can be arbitrarily large, so unlike the other commands
+ * we don't use keyd_do_command() to read it into a fixed size buffer.
+ */
+static void keyd_metrics(void)
+{
+	uint32_t tmp;
+	char *buf;
+	ssize_t count;
+	size_t offset;
+
+	tmp = KEYD_CMD_METRICS;
+	if (write(keyd_fd, &tmp, sizeof(tmp)) != sizeof(tmp) ||
+			read(keyd_fd, &tmp, sizeof(tmp)) != sizeof(tmp)) {
+		fprintf(stderr, "Couldn't send metrics request: %s (%d)\n",
+				strerror(errno), errno);
+		return;
+	}
+	if (tmp != KEYD_REPLY_OK) {
+		fprintf(stderr, "keyd doesn't support the metrics command.\n");
+		return;
+	}
+	if (read(keyd_fd, &tmp, sizeof(tmp)) != sizeof(tmp)) {
+		fprintf(stderr, "Couldn't read metrics length: %s (%d)\n",
+				strerror(errno), errno);
+		return;
+	}
+
+	buf = malloc(tmp);
+	if (buf == NULL) {
+		fprintf(stderr, "Couldn't allocate %u bytes for metrics.\n",
+				tmp);
+		return;
+	}
+	for (offset = 0; offset < tmp; offset += count) {
+		count = read(keyd_fd, &buf[offset], tmp - offset);
+		if (count <= 0) {
+			fprintf(stderr, "Couldn't read metrics: %s (%d)\n",
+				strerror(errno), errno);
+			free(buf);
+			return;
+		}
+	}
+
+	fwrite(buf, 1, tmp, stdout);
+	free(buf);
+
 	return;
 }
 
@@ -205,6 +285,7 @@ static void usage(void)
 	puts("\tkeydctl [options] <command> <parameters>\n");
 	puts("\tCommands:\n");
 	puts("\tcheck    - check if keyd is running");
+	puts("\tmetrics  - dump keyd metrics in Prometheus text format");
 	puts("\tquit     - request that keyd cleanly shuts down");
 	puts("\tstatus   - display running keyd status");
 	exit(EXIT_FAILURE);
@@ -243,6 +324,10 @@ int main(int argc, char *argv[])
 		keyd_connect();
 		keyd_status();
 		keyd_close();
+	} else if (!strcmp("metrics", argv[optind])) {
+		keyd_connect();
+		keyd_metrics();
+		keyd_close();
 	} else if (!strcmp("quit", argv[optind])) {
 		keyd_connect();
 		keyd_do_command(KEYD_CMD_QUIT, NULL, 0);
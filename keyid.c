@@ -16,6 +16,7 @@
  * this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
@@ -24,8 +25,6 @@
 #include "keyid.h"
 #include "keystructs.h"
 #include "onak.h"
-#include "parsekey.h"
-#include "mem.h"
 #include "merge.h"
 
 #ifdef HAVE_NETTLE
@@ -251,60 +250,112 @@ onak_status_t get_packetid(struct openpgp_packet *packet, uint64_t *keyid)
 	return ONAK_E_OK;
 }
 
-static struct openpgp_packet_list *sortpackets(struct openpgp_packet_list
-							*packets)
+static int sortpackets_cmp(const void *a, const void *b)
 {
-	struct openpgp_packet_list *sorted, **cur, *next;
-
-	sorted = NULL;
-	while (packets != NULL) {
-		cur = &sorted;
-		while (*cur != NULL && compare_packets((*cur)->packet,
-				packets->packet) < 0) {
-			cur = &((*cur)->next);
+	return compare_packets(*(struct openpgp_packet * const *) a,
+			*(struct openpgp_packet * const *) b);
+}
+
+/**
+ *	keypackets - Get an array of the packets making up a key.
+ *	@key: The key (only this key; key->next is ignored).
+ *	@count: The number of packets returned.
+ *
+ *	Returns a malloced array of pointers to the packets on the key, or
+ *	NULL if we couldn't allocate it.
+ */
+static struct openpgp_packet **keypackets(struct openpgp_publickey *key,
+		size_t *count)
+{
+	struct openpgp_packet **packets;
+	struct openpgp_packet_list *curpacket;
+	struct openpgp_signedpacket_list *cursigned;
+	struct openpgp_signedpacket_list *lists[2] = { key->uids,
+							key->subkeys };
+	size_t i, num;
+
+	num = 1;
+	for (curpacket = key->sigs; curpacket != NULL;
+			curpacket = curpacket->next) {
+		num++;
+	}
+	for (i = 0; i < 2; i++) {
+		for (cursigned = lists[i]; cursigned != NULL;
+				cursigned = cursigned->next) {
+			num++;
+			for (curpacket = cursigned->sigs; curpacket != NULL;
+					curpacket = curpacket->next) {
+				num++;
+			}
 		}
-		next = *cur;
-		*cur = packets;
-		packets = packets->next;
-		(*cur)->next = next;
 	}
 
-	return sorted;
+	packets = malloc(num * sizeof(*packets));
+	if (packets == NULL) {
+		return NULL;
+	}
+
+	num = 0;
+	packets[num++] = key->publickey;
+	for (curpacket = key->sigs; curpacket != NULL;
+			curpacket = curpacket->next) {
+		packets[num++] = curpacket->packet;
+	}
+	for (i = 0; i < 2; i++) {
+		for (cursigned = lists[i]; cursigned != NULL;
+				cursigned = cursigned->next) {
+			packets[num++] = cursigned->packet;
+			for (curpacket = cursigned->sigs; curpacket != NULL;
+					curpacket = curpacket->next) {
+				packets[num++] = curpacket->packet;
+			}
+		}
+	}
+	*count = num;
+
+	return packets;
 }
 
 onak_status_t get_skshash(struct openpgp_publickey *key, struct skshash *hash)
 {
-	struct openpgp_packet_list *packets = NULL, *list_end = NULL;
-	struct openpgp_packet_list *curpacket;
+	struct openpgp_packet **packets;
 	struct md5_ctx md5_context;
-	struct openpgp_publickey *next;
+	size_t count, i;
 	uint32_t tmp;
 
+	if (key->have_skshash) {
+		*hash = key->skshash;
+		return ONAK_E_OK;
+	}
+
 	/*
-	 * We only want a single key, so clear any link to the next
-	 * one for the period during the flatten.
+	 * Sort pointers to the packets rather than copies of them; equal
+	 * packets are identical so the order qsort leaves them in doesn't
+	 * change the hash.
 	 */
-	next = key->next;
-	key->next = NULL;
-	flatten_publickey(key, &packets, &list_end);
-	key->next = next;
-	packets = sortpackets(packets);
+	packets = keypackets(key, &count);
+	if (packets == NULL) {
+		return ONAK_E_NOMEM;
+	}
+	qsort(packets, count, sizeof(*packets), sortpackets_cmp);
 
 	md5_init(&md5_context);
 
-	for (curpacket = packets; curpacket != NULL;
-			curpacket = curpacket->next) {
-		tmp = htonl(curpacket->packet->tag);
+	for (i = 0; i < count; i++) {
+		tmp = htonl(packets[i]->tag);
 		md5_update(&md5_context, sizeof(tmp), (void *) &tmp);
-		tmp = htonl(curpacket->packet->length);
+		tmp = htonl(packets[i]->length);
 		md5_update(&md5_context, sizeof(tmp), (void *) &tmp);
 		md5_update(&md5_context,
-				curpacket->packet->length,
-				curpacket->packet->data);
+				packets[i]->length,
+				packets[i]->data);
 	}
 
 	md5_digest(&md5_context, 16, (uint8_t *) &hash->hash);
-	free_packet_list(packets);
+	free(packets);
+
+	key->skshash = *hash;
+	key->have_skshash = true;
 
 	return ONAK_E_OK;
 }
@@ -72,7 +72,8 @@ onak_status_t get_packetid(struct openpgp_packet *packet, uint64_t *keyid);
  *	This function returns the SKS hash for a given public key. This
  *	is an MD5 hash over a sorted list of all of the packets that
  *	make up the key. The caller should allocate the memory for the
- *	hash.
+ *	hash. The result is cached on the key, so code that changes a key's
+ *	packets must clear key->have_skshash.
  */
 onak_status_t get_skshash(struct openpgp_publickey *publickey,
 	struct skshash *hash);
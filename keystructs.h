@@ -38,6 +38,12 @@
 #define FINGERPRINT_V5_LEN	32
 #define MAX_FINGERPRINT_LEN	32
 
+/*
+ * An arena that a parsed key's packets and lists can be allocated from, so
+ * the whole key can be freed in one go. See mem.h.
+ */
+struct onak_arena;
+
 /**
  * @brief Stores the fingerprint of an OpenPGP key
  */
@@ -63,6 +69,13 @@ struct openpgp_packet {
 	size_t length;
 	/** The actual packet data. */
 	unsigned char *data;
+	/**
+	 * True if data points into a buffer we don't own (see
+	 * read_openpgp_buffer), so shouldn't be freed with the packet.
+	 */
+	bool borrowed;
+	/** The arena this packet and its data live in; NULL if malloced. */
+	struct onak_arena *arena;
 };
 
 /**
@@ -76,6 +89,8 @@ struct openpgp_packet_list {
 	struct openpgp_packet *packet;
 	/** A pointer to the next packet in the list. */
 	struct openpgp_packet_list *next;
+	/** The arena this entry lives in; NULL if malloced. */
+	struct onak_arena *arena;
 };
 
 /**
@@ -94,6 +109,16 @@ struct openpgp_signedpacket_list {
 	struct openpgp_packet_list *last_sig;
 	/** A pointer to the next packet with signatures. */
 	struct openpgp_signedpacket_list *next;
+	/** The arena this entry lives in; NULL if malloced. */
+	struct onak_arena *arena;
+};
+
+/**
+ * @brief Holds an SKS key hash (md5 over sorted packet list)
+ */
+struct skshash {
+	/** The 128 bit MD5 hash of the sorted packet list from the key */
+	uint8_t hash[16];
 };
 
 /**
@@ -118,14 +143,45 @@ struct openpgp_publickey {
 	struct openpgp_signedpacket_list	*last_subkey;
 	/** The next public key. */
 	struct openpgp_publickey		*next;
+	/**
+	 * The arena this key lives in, along with anything attached to it.
+	 * NULL if it's all individually malloced.
+	 */
+	struct onak_arena			*arena;
+	/**
+	 * True if @a skshash is valid. Anything that changes the packets on
+	 * the key must clear this.
+	 */
+	bool					 have_skshash;
+	/** The SKS hash of the key, cached by get_skshash() */
+	struct skshash				 skshash;
 };
 
 /**
- * @brief Holds an SKS key hash (md5 over sorted packet list)
+ * @brief How the data in a @a openpgp_raw_key is held
  */
-struct skshash {
-	/** The 128 bit MD5 hash of the sorted packet list from the key */
-	uint8_t hash[16];
+enum openpgp_raw_storage {
+	/**
+	 * Borrowed from the DB backend, such as a view of a mapped keyring;
+	 * valid until the next call to the backend
+	 */
+	OPENPGP_RAW_BORROWED = 0,
+	/** Allocated with malloc() */
+	OPENPGP_RAW_MALLOC,
+};
+
+/**
+ * @brief Unparsed key data, as stored by a DB backend
+ *
+ * Should be released with free_raw_key() once finished with.
+ */
+struct openpgp_raw_key {
+	/** The binary OpenPGP packets making up the key(s) */
+	const uint8_t *data;
+	/** The length of data in bytes */
+	size_t length;
+	/** How data is held, and thus how to release it */
+	enum openpgp_raw_storage storage;
 };
 
 #endif /* __KEYSTRUCTS_H__ */
@@ -24,33 +24,46 @@
 
 /**
  * @brief Take a packet and add it to a linked list
+ *
+ * The new list entry comes from the same arena as @a list (see mem.h).
  */
 #define ADD_PACKET_TO_LIST_END(list, name, item)                              \
 	if (list->name##s != NULL) {                                          \
-		list->last_##name->next = malloc(sizeof (*list->last_##name));\
+		list->last_##name->next = onak_arena_alloc(list->arena,       \
+				sizeof (*list->last_##name));                 \
 		list->last_##name = list->last_##name->next;                  \
 	} else {                                                              \
 		list->name##s = list->last_##name =                           \
-			malloc(sizeof (*list->last_##name));                  \
+			onak_arena_alloc(list->arena,                         \
+				sizeof (*list->last_##name));                 \
 	}                                                                     \
-	memset(list->last_##name, 0, sizeof(*list->last_##name));             \
+	list->last_##name->arena = list->arena;                               \
 	list->last_##name->packet = item;
 
 /**
- * @brief Add an item to the end of a linked list
+ * @brief Add an item to the end of a linked list, allocated from an arena
+ * @param from The arena to allocate from; NULL to use malloc
  * @param list A pointer to the last element in the list
  * @param item the item to add
  */
-#define ADD_PACKET_TO_LIST(list, item)                                        \
+#define ADD_PACKET_TO_LIST_ARENA(from, list, item)                            \
 	if (list != NULL) {                                                   \
-		list->next = malloc(sizeof (*list));                          \
+		list->next = onak_arena_alloc(from, sizeof (*list));          \
 		list = list->next;                                            \
 	} else {                                                              \
-		list = malloc(sizeof (*list));                                \
+		list = onak_arena_alloc(from, sizeof (*list));                \
 	}                                                                     \
-	memset(list, 0, sizeof(*list));                                       \
+	list->arena = from;                                                   \
 	list->packet = item;
 
+/**
+ * @brief Add an item to the end of a linked list
+ * @param list A pointer to the last element in the list
+ * @param item the item to add
+ */
+#define ADD_PACKET_TO_LIST(list, item)                                        \
+	ADD_PACKET_TO_LIST_ARENA(NULL, list, item)
+
 /**
  * @brief A generic linked list structure.
  */
@@ -22,7 +22,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "graph.h"
 #include "hash.h"
 #include "keydb.h"
 #include "ll.h"
@@ -30,20 +32,21 @@
 #include "onak-conf.h"
 #include "stats.h"
 
-void findmaxpath(struct onak_dbctx *dbctx, unsigned long max)
+/*
+ * My (noodles@earth.li, RSA) key is in the strongly connected set of keys,
+ * so we use it as a suitable starting seed by default.
+ */
+#define DEFAULT_SEED	0x94FA372B2DA8B985
+
+void findmaxpath(struct onak_dbctx *dbctx, uint64_t seed, unsigned long max)
 {
-	struct stats_key *from, *to, *tmp;
-	struct ll *curkey;
+	struct stats_key *from, *to, *tmp, *curkey;
 	unsigned long distance, loop;
 
 	distance = 0;
 	from = to = tmp = NULL;
 
-	/*
-	 * My (noodles@earth.li, RSA) key is in the strongly connected set of
-	 * keys, so we use it as a suitable starting seed.
-	 */
-	if (dbctx->cached_getkeysigs(dbctx, 0x94FA372B2DA8B985) == NULL) {
+	if (statskeysigs(dbctx, seed) == NULL) {
 		printf("Couldn't find starting key.\n");
 		return;
 	}
@@ -54,28 +57,22 @@ void findmaxpath(struct onak_dbctx *dbctx, unsigned long max)
 	 * store it as our new max and print out the fact we've found a new
 	 * max.
 	 */
-	for (loop = 0; (loop < HASHSIZE) && (distance < max); loop++) {
-		curkey = gethashtableentry(loop);
-		while (curkey != NULL && distance < max) {
-			dbctx->cached_getkeysigs(dbctx,
-					((struct stats_key *)
-					curkey->object)->keyid);
-			initcolour(false);
-			tmp = furthestkey(dbctx, (struct stats_key *)
-						curkey->object);
-			if (tmp->colour > distance) {
-				from = (struct stats_key *)curkey->object;
-				to = tmp;
-				distance = to->colour;
-				printf("Current max path (#%ld) is from %"
-						PRIX64 " to %" PRIX64
-						" (%ld steps)\n",
-						loop,
-						from->keyid,
-						to->keyid,
-						distance);
-			}
-			curkey=curkey->next;
+	for (loop = 0; (loop < hashelements()) && (distance < max); loop++) {
+		curkey = gethashelement(loop);
+		statskeysigs(dbctx, curkey->keyid);
+		initcolour(false);
+		tmp = furthestkey(dbctx, curkey);
+		if (tmp->colour > distance) {
+			from = curkey;
+			to = tmp;
+			distance = to->colour;
+			printf("Current max path (#%ld) is from %"
+					PRIX64 " to %" PRIX64
+					" (%ld steps)\n",
+					loop,
+					from->keyid,
+					to->keyid,
+					distance);
 		}
 	}
 
@@ -91,22 +88,80 @@ void findmaxpath(struct onak_dbctx *dbctx, unsigned long max)
 	dofindpath(dbctx, to->keyid, from->keyid, false, 1);
 }
 
+/*
+ * With the graph snapshot we can search out from every key at once over
+ * several threads, rather than a key at a time through the hash, so we get
+ * the exact answer. If bounded is set we only look at the strong set around
+ * the seed, which lets us stop searching much sooner.
+ */
+void findgraphmaxpath(struct onak_dbctx *dbctx, struct onak_graph *graph,
+		uint64_t seed, bool bounded, int threads)
+{
+	struct onak_graph_path path;
+	uint32_t node;
+	onak_status_t ret;
+
+	if (bounded) {
+		node = onak_graph_find(graph, seed);
+		if (node == ONAK_GRAPH_NONE) {
+			printf("Couldn't find starting key.\n");
+			return;
+		}
+		ret = onak_graph_diameter_bounded(graph, threads, node, &path);
+	} else {
+		ret = onak_graph_diameter(graph, threads, &path);
+	}
+	if (ret != ONAK_E_OK) {
+		printf("Couldn't search key graph (%d).\n", ret);
+		return;
+	}
+
+	if (path.length == 0) {
+		printf("No path found?\n");
+		return;
+	}
+
+	printf("Max path is from %" PRIX64 " to %" PRIX64 " (%" PRIu32
+			" steps)\n",
+			graph->keyids[path.end],
+			graph->keyids[path.start],
+			path.length);
+	dofindpath(dbctx, graph->keyids[path.start], graph->keyids[path.end],
+			false, 1);
+}
+
 int main(int argc, char *argv[])
 {
 	int optchar;
 	char *configfile = NULL;
 	struct onak_dbctx *dbctx;
+	uint64_t seed = DEFAULT_SEED;
+	bool bounded = false;
+	long threads;
 
-	while ((optchar = getopt(argc, argv, "c:")) != -1 ) {
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((optchar = getopt(argc, argv, "bc:s:t:")) != -1 ) {
 		switch (optchar) {
+		case 'b':
+			bounded = true;
+			break;
 		case 'c':
 			if (configfile != NULL) {
 				free(configfile);
 			}
 			configfile = strdup(optarg);
 			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 16);
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
 		}
 	}
+	if (threads < 1) {
+		threads = 1;
+	}
 
 	readconfig(configfile);
 	free(configfile);
@@ -114,9 +169,16 @@ int main(int argc, char *argv[])
 	dbctx = config.dbinit(config.backend, true);
 	if (dbctx != NULL) {
 		inithash();
-		findmaxpath(dbctx, 30);
-		printf("--------\n");
-		findmaxpath(dbctx, 30);
+		initgraph();
+		if (statsgraph() != NULL && statsgraph()->nodes > 0) {
+			findgraphmaxpath(dbctx, statsgraph(), seed, bounded,
+					threads);
+		} else {
+			findmaxpath(dbctx, seed, 30);
+			printf("--------\n");
+			findmaxpath(dbctx, seed, 30);
+		}
+		cleanupgraph();
 		destroyhash();
 		dbctx->cleanupdb(dbctx);
 	} else {
@@ -16,6 +16,8 @@
  * this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,27 +27,166 @@
 #include "mem.h"
 #include "stats.h"
 
+/*
+ * Arena chunks are at least this big; anything larger than a quarter of it
+ * gets a chunk of its own so we don't waste the end of the current one.
+ */
+#define ARENA_CHUNK_SIZE	(64 * 1024)
+
+/* All arena allocations are aligned to this. */
+#define ARENA_ALIGN		(sizeof(max_align_t))
+
+struct onak_arena_chunk {
+	/** The next (older) chunk. */
+	struct onak_arena_chunk *next;
+	/** Number of bytes of data. */
+	size_t size;
+	/** Number of bytes of data handed out. */
+	size_t used;
+	/** The memory we hand out. */
+	max_align_t data[];
+};
+
+struct onak_arena {
+	/** The chunk we're currently allocating from, followed by the rest. */
+	struct onak_arena_chunk *chunks;
+	/**
+	 * Number of keys using the arena. Keys from the same arena can end up
+	 * being freed by different threads, so this has to be atomic.
+	 */
+	atomic_uint refs;
+};
+
 /**
- *	packet_dup - duplicate an OpenPGP packet.
+ *	onak_arena_new - Create a new, empty, arena.
+ *
+ *	Returns the arena with no references, or NULL if we couldn't allocate
+ *	it.
+ */
+struct onak_arena *onak_arena_new(void)
+{
+	struct onak_arena *arena;
+
+	arena = calloc(1, sizeof(struct onak_arena));
+	if (arena != NULL) {
+		atomic_init(&arena->refs, 0);
+	}
+
+	return arena;
+}
+
+/**
+ *	onak_arena_alloc - Allocate some zeroed memory from an arena.
+ *	@arena: The arena to allocate from. If NULL uses calloc().
+ *	@size: The number of bytes to allocate.
+ */
+void *onak_arena_alloc(struct onak_arena *arena, size_t size)
+{
+	struct onak_arena_chunk *chunk;
+	size_t chunksize;
+	void *mem;
+
+	if (arena == NULL) {
+		return calloc(1, size);
+	}
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	chunk = arena->chunks;
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		chunksize = ARENA_CHUNK_SIZE;
+		if (size > ARENA_CHUNK_SIZE / 4) {
+			chunksize = size;
+		}
+		chunk = malloc(sizeof(*chunk) + chunksize);
+		if (chunk == NULL) {
+			return NULL;
+		}
+		chunk->size = chunksize;
+		chunk->used = 0;
+		if (chunksize == size && arena->chunks != NULL) {
+			/* Keep allocating from the current chunk. */
+			chunk->next = arena->chunks->next;
+			arena->chunks->next = chunk;
+		} else {
+			chunk->next = arena->chunks;
+			arena->chunks = chunk;
+		}
+	}
+
+	mem = (char *) chunk->data + chunk->used;
+	chunk->used += size;
+	memset(mem, 0, size);
+
+	return mem;
+}
+
+/**
+ *	onak_arena_ref - Take a reference to an arena.
+ *	@arena: The arena.
+ */
+void onak_arena_ref(struct onak_arena *arena)
+{
+	atomic_fetch_add_explicit(&arena->refs, 1, memory_order_relaxed);
+}
+
+/**
+ *	onak_arena_unref - Drop a reference to an arena.
+ *	@arena: The arena.
+ *
+ *	Once the last reference is gone everything allocated from the arena is
+ *	freed at once.
+ */
+void onak_arena_unref(struct onak_arena *arena)
+{
+	struct onak_arena_chunk *chunk;
+
+	/*
+	 * Whoever drops the last reference frees everything, and needs to see
+	 * any changes the other threads made before dropping theirs.
+	 */
+	if (atomic_fetch_sub_explicit(&arena->refs, 1,
+			memory_order_acq_rel) > 1) {
+		return;
+	}
+
+	while (arena->chunks != NULL) {
+		chunk = arena->chunks;
+		arena->chunks = chunk->next;
+		free(chunk);
+	}
+	free(arena);
+}
+
+/**
+ *	packet_dup_arena - duplicate an OpenPGP packet into an arena.
+ *	@arena: The arena to allocate the duplicate from; NULL to use malloc.
  *	@packet: The packet to duplicate.
  *
  *	This function takes an OpenPGP packet structure and duplicates it,
  *	including the data part. It returns NULL if there is a problem
  *	allocating memory for the duplicate.
  */
-struct openpgp_packet *packet_dup(struct openpgp_packet *packet)
+struct openpgp_packet *packet_dup_arena(struct onak_arena *arena,
+		struct openpgp_packet *packet)
 {
 	struct openpgp_packet *newpacket = NULL;
 
 	if (packet == NULL)
 		return NULL;
 
-	newpacket = malloc(sizeof (struct openpgp_packet));
+	newpacket = onak_arena_alloc(arena, sizeof (struct openpgp_packet));
 	if (newpacket != NULL) {
 		newpacket->tag = packet->tag;
 		newpacket->newformat = packet->newformat;
 		newpacket->length = packet->length;
-		newpacket->data = malloc(newpacket->length);
+		newpacket->borrowed = false;
+		newpacket->arena = arena;
+		if (arena != NULL) {
+			newpacket->data = onak_arena_alloc(arena,
+					newpacket->length);
+		} else {
+			newpacket->data = malloc(newpacket->length);
+		}
 		if (newpacket->data != NULL) {
 			memcpy(newpacket->data, packet->data,
 					newpacket->length);
@@ -55,6 +196,19 @@ struct openpgp_packet *packet_dup(struct openpgp_packet *packet)
 	return newpacket;
 }
 
+/**
+ *	packet_dup - duplicate an OpenPGP packet.
+ *	@packet: The packet to duplicate.
+ *
+ *	This function takes an OpenPGP packet structure and duplicates it,
+ *	including the data part. It returns NULL if there is a problem
+ *	allocating memory for the duplicate.
+ */
+struct openpgp_packet *packet_dup(struct openpgp_packet *packet)
+{
+	return packet_dup_arena(NULL, packet);
+}
+
 /**
  *	packet_list_add - Adds an OpenPGP packet list to another.
  *	@list: The packet list to add to.
@@ -69,10 +223,28 @@ struct openpgp_packet *packet_dup(struct openpgp_packet *packet)
 void packet_list_add(struct openpgp_packet_list **list,
 		struct openpgp_packet_list **list_end,
 		struct openpgp_packet_list *packet_list)
+{
+	packet_list_add_arena(NULL, list, list_end, packet_list);
+}
+
+/**
+ *	packet_list_add_arena - Adds an OpenPGP packet list to another.
+ *	@arena: The arena to allocate the copies from; NULL to use malloc.
+ *	@list: The packet list to add to.
+ *	@list_end: The end of the packet list to add to.
+ *	@packet_list: The packet list to add.
+ *
+ *	As packet_list_add, but for adding to a list that belongs to an arena
+ *	backed key.
+ */
+void packet_list_add_arena(struct onak_arena *arena,
+		struct openpgp_packet_list **list,
+		struct openpgp_packet_list **list_end,
+		struct openpgp_packet_list *packet_list)
 {
 	for (; packet_list != NULL; packet_list = packet_list->next) {
-		ADD_PACKET_TO_LIST((*list_end),
-				packet_dup(packet_list->packet));
+		ADD_PACKET_TO_LIST_ARENA(arena, (*list_end),
+				packet_dup_arena(arena, packet_list->packet));
 		if (*list == NULL) {
 			*list = *list_end;
 		}
@@ -86,10 +258,14 @@ void packet_list_add(struct openpgp_packet_list **list,
  *	@packet: The packet to free.
  *
  *	Takes an OpenPGP packet structure and frees the memory used by it,
- *	including the data part.
+ *	including the data part unless it's borrowed from someone else.
+ *	Packets in an arena are left for the arena to free.
  */
 void free_packet(struct openpgp_packet *packet) {
-	if (packet->data != NULL) {
+	if (packet->arena != NULL) {
+		return;
+	}
+	if (packet->data != NULL && !packet->borrowed) {
 		free(packet->data);
 		packet->data = NULL;
 	}
@@ -111,7 +287,9 @@ void free_packet_list(struct openpgp_packet_list *packet_list) {
 		if (packet_list->packet != NULL) {
 			free_packet(packet_list->packet);
 		}
-		free(packet_list);
+		if (packet_list->arena == NULL) {
+			free(packet_list);
+		}
 		packet_list = nextpacket;
 	}
 }
@@ -135,7 +313,9 @@ void free_signedpacket_list(
 		if (signedpacket_list->sigs != NULL) {
 			free_packet_list(signedpacket_list->sigs);
 		}
-		free(signedpacket_list);
+		if (signedpacket_list->arena == NULL) {
+			free(signedpacket_list);
+		}
 		signedpacket_list = nextpacket;
 	}
 }
@@ -145,13 +325,19 @@ void free_signedpacket_list(
  *	@key: The key to free.
  *
  *	Takes an OpenPGP key and frees the memory used by all the structures it
- *	contains.
+ *	contains. Keys from an arena just drop their reference to it, rather
+ *	than walking everything attached to them.
  */
 void free_publickey(struct openpgp_publickey *key) {
 	struct openpgp_publickey *nextkey = NULL;
 
 	while (key != NULL) {
 		nextkey = key->next;
+		if (key->arena != NULL) {
+			onak_arena_unref(key->arena);
+			key = nextkey;
+			continue;
+		}
 		if (key->publickey != NULL) {
 			free_packet(key->publickey);
 			key->publickey = NULL;
@@ -172,3 +358,27 @@ void free_publickey(struct openpgp_publickey *key) {
 		key = nextkey;
 	}
 }
+
+/**
+ *	free_raw_key - release the data held by an unparsed key.
+ *	@raw: The raw key to release.
+ *
+ *	Frees the data returned by one of the fetch_key_*_raw DB functions, if
+ *	it was allocated for us, and resets raw to be empty.
+ */
+void free_raw_key(struct openpgp_raw_key *raw)
+{
+	if (raw->data != NULL) {
+		switch (raw->storage) {
+		case OPENPGP_RAW_MALLOC:
+			free((void *) raw->data);
+			break;
+		case OPENPGP_RAW_BORROWED:
+			break;
+		}
+	}
+
+	raw->data = NULL;
+	raw->length = 0;
+	raw->storage = OPENPGP_RAW_BORROWED;
+}
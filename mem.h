@@ -19,9 +19,64 @@
 #ifndef __MEM_H_
 #define __MEM_H_
 
+#include <stddef.h>
+
 #include "keystructs.h"
 #include "stats.h"
 
+/**
+ *	onak_arena_new - Create a new, empty, arena.
+ *
+ *	parse_keys() allocates everything for the keys it parses from a single
+ *	arena, so the lot can be freed at once rather than packet by packet.
+ *	Each key holds a reference to its arena (key->arena), and the arena is
+ *	freed when free_publickey() drops the last one. Anything attached to
+ *	such a key must come from the same arena, so packets from elsewhere are
+ *	copied in (see packet_dup_arena()) rather than linked to; freeing
+ *	individual packets or list entries from an arena is allowed but does
+ *	nothing until the key itself is freed.
+ *
+ *	References can be taken and dropped from any thread, but allocating
+ *	from an arena isn't locked: only one thread at a time may change the
+ *	keys in a given arena.
+ *
+ *	Returns the arena with no references, or NULL if we couldn't allocate
+ *	it.
+ */
+struct onak_arena *onak_arena_new(void);
+
+/**
+ *	onak_arena_alloc - Allocate some zeroed memory from an arena.
+ *	@arena: The arena to allocate from. If NULL uses calloc().
+ *	@size: The number of bytes to allocate.
+ */
+void *onak_arena_alloc(struct onak_arena *arena, size_t size);
+
+/**
+ *	onak_arena_ref - Take a reference to an arena.
+ *	@arena: The arena.
+ */
+void onak_arena_ref(struct onak_arena *arena);
+
+/**
+ *	onak_arena_unref - Drop a reference to an arena.
+ *	@arena: The arena.
+ *
+ *	Once the last reference is gone everything allocated from the arena is
+ *	freed at once.
+ */
+void onak_arena_unref(struct onak_arena *arena);
+
+/**
+ *	packet_dup_arena - duplicate an OpenPGP packet into an arena.
+ *	@arena: The arena to allocate the duplicate from; NULL to use malloc.
+ *	@packet: The packet to duplicate.
+ *
+ *	As packet_dup, but the copy (including its data) comes from @arena.
+ */
+struct openpgp_packet *packet_dup_arena(struct onak_arena *arena,
+		struct openpgp_packet *packet);
+
 /**
  *	packet_dup - duplicate an OpenPGP packet.
  *	@packet: The packet to duplicate.
@@ -47,12 +102,28 @@ void packet_list_add(struct openpgp_packet_list **list,
 		struct openpgp_packet_list **list_end,
 		struct openpgp_packet_list *packet_list);
 
+/**
+ *	packet_list_add_arena - Adds an OpenPGP packet list to another.
+ *	@arena: The arena to allocate the copies from; NULL to use malloc.
+ *	@list: The packet list to add to.
+ *	@list_end: The end of the packet list to add to.
+ *	@packet_list: The packet list to add.
+ *
+ *	As packet_list_add, but for adding to a list that belongs to an arena
+ *	backed key.
+ */
+void packet_list_add_arena(struct onak_arena *arena,
+		struct openpgp_packet_list **list,
+		struct openpgp_packet_list **list_end,
+		struct openpgp_packet_list *packet_list);
+
 /**
  *	free_packet - free the memory used by an OpenPGP packet.
  *	@packet: The packet to free.
  *
  *	Takes an OpenPGP packet structure and frees the memory used by it,
- *	including the data part.
+ *	including the data part unless it's borrowed from someone else.
+ *	Packets in an arena are left for the arena to free.
  */
 void free_packet(struct openpgp_packet *packet);
 
@@ -84,4 +155,13 @@ void free_signedpacket_list(
  */
 void free_publickey(struct openpgp_publickey *key);
 
+/**
+ *	free_raw_key - release the data held by an unparsed key.
+ *	@raw: The raw key to release.
+ *
+ *	Frees the data returned by one of the fetch_key_*_raw DB functions, if
+ *	it was allocated for us, and resets raw to be empty.
+ */
+void free_raw_key(struct openpgp_raw_key *raw);
+
 #endif /* __MEM_H_ */
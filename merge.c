@@ -17,6 +17,7 @@
  */
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,10 +26,54 @@
 #include "keyid.h"
 #include "keystructs.h"
 #include "ll.h"
+#include "log.h"
 #include "mem.h"
 #include "merge.h"
 #include "onak.h"
 
+/* Marks the end of a merge_index bucket chain */
+#define MERGE_INDEX_END		SIZE_MAX
+
+/**
+ * struct merge_index_entry - A packet in a merge_index.
+ * @hash: The hash of the packet (or signature details).
+ * @next: The next entry in the same bucket.
+ * @item: The list entry the packet came from; NULL once it's been removed.
+ * @packet: The packet.
+ * @keyid: For signatures, the issuer key ID.
+ * @creation: For signatures, the creation time.
+ */
+struct merge_index_entry {
+	uint32_t hash;
+	size_t next;
+	void *item;
+	struct openpgp_packet *packet;
+	uint64_t keyid;
+	time_t creation;
+};
+
+/**
+ * struct merge_index - A hash of the packets in a list.
+ * @sigs: Compare signatures with compare_signatures rather than by content.
+ * @buckets: The first entry in each hash bucket.
+ * @mask: Number of buckets - 1.
+ * @entries: The entries, in the order they were added.
+ * @count: Number of entries.
+ * @size: Number of entries we have space for.
+ *
+ * Saves walking the whole of the existing list for every packet we merge,
+ * which is quadratic for keys with lots of signatures. Entries in a bucket
+ * are chained newest first.
+ */
+struct merge_index {
+	bool sigs;
+	size_t *buckets;
+	size_t mask;
+	struct merge_index_entry *entries;
+	size_t count;
+	size_t size;
+};
+
 /**
  *	compare_packets - Check to see if 2 OpenPGP packets are the same.
  *	@a: The first packet to compare.
@@ -155,39 +200,197 @@ struct openpgp_signedpacket_list *find_signed_packet(
 }
 
 /**
- *	remove_signed_packet - Removes a signed packet from a list.
- *	@packet_list: The list of packets to look in.
- *	@packet: The packet to remove.
+ *	merge_hash - FNV-1a hash some data.
+ *	@hash: The hash so far.
+ *	@data: The data to add to the hash.
+ *	@len: The length of the data.
+ */
+static uint32_t merge_hash(uint32_t hash, const void *data, size_t len)
+{
+	const uint8_t *buf = data;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= buf[i];
+		hash *= 16777619;
+	}
+
+	return hash;
+}
+
+/**
+ *	merge_index_key - Fill in the hash details for a packet.
+ *	@index: The index the entry is for.
+ *	@packet: The packet.
+ *	@entry: The entry to fill in.
  *
- *	Walks through the signedpacket_list looking for the supplied packet and
- *	removes it if found. Assumes the packet can only exist a maximum of
- *	once in the list.
+ *	For signature indexes we hash the details compare_signatures looks at,
+ *	rather than the entire packet.
+ */
+static void merge_index_key(struct merge_index *index,
+		struct openpgp_packet *packet,
+		struct merge_index_entry *entry)
+{
+	uint8_t type[2];
+
+	entry->packet = packet;
+	entry->hash = 2166136261;
+	if (index->sigs) {
+		entry->keyid = 0;
+		entry->creation = 0;
+		sig_info(packet, &entry->keyid, &entry->creation);
+		type[0] = packet->data[0];
+		type[1] = (packet->data[0] == 4) ? packet->data[1] : 0;
+		entry->hash = merge_hash(entry->hash, type, sizeof(type));
+		entry->hash = merge_hash(entry->hash, &entry->keyid,
+				sizeof(entry->keyid));
+		entry->hash = merge_hash(entry->hash, &entry->creation,
+				sizeof(entry->creation));
+	} else {
+		entry->hash = merge_hash(entry->hash, &packet->tag,
+				sizeof(packet->tag));
+		entry->hash = merge_hash(entry->hash, packet->data,
+				packet->length);
+	}
+}
+
+/**
+ *	merge_index_match - Check if an index entry matches a packet.
+ *	@index: The index.
+ *	@entry: The entry in the index.
+ *	@key: The details of the packet we're looking for.
+ *
+ *	Works out the same result as compare_packets or compare_signatures,
+ *	but using the signature details we've already extracted.
+ */
+static bool merge_index_match(struct merge_index *index,
+		struct merge_index_entry *entry,
+		struct merge_index_entry *key)
+{
+	if (entry->hash != key->hash) {
+		return false;
+	}
+	if (!index->sigs) {
+		return compare_packets(entry->packet, key->packet) == 0;
+	}
+	if (entry->packet->data[0] != key->packet->data[0]) {
+		return false;
+	}
+	if (key->packet->data[0] == 4 &&
+			entry->packet->data[1] != key->packet->data[1]) {
+		return false;
+	}
+	return entry->keyid == key->keyid && entry->creation == key->creation;
+}
+
+/**
+ *	merge_index_init - Initialise an empty index.
+ *	@index: The index to initialise.
+ *	@sigs: true to match signatures as compare_signatures does, false to
+ *	       match packets by content.
+ */
+static void merge_index_init(struct merge_index *index, bool sigs)
+{
+	memset(index, 0, sizeof(*index));
+	index->sigs = sigs;
+}
+
+/**
+ *	merge_index_free - Free the memory used by an index.
+ *	@index: The index to free.
+ */
+static void merge_index_free(struct merge_index *index)
+{
+	free(index->buckets);
+	free(index->entries);
+	merge_index_init(index, index->sigs);
+}
+
+/**
+ *	merge_index_add - Add a packet to an index.
+ *	@index: The index to add to.
+ *	@packet: The packet to add.
+ *	@item: The list entry the packet belongs to.
+ *
+ *	Returns false if we couldn't allocate memory to grow the index.
+ */
+static bool merge_index_add(struct merge_index *index,
+		struct openpgp_packet *packet, void *item)
+{
+	struct merge_index_entry *entries;
+	struct merge_index_entry *entry;
+	size_t *buckets;
+	size_t bucket, i, size;
+
+	if (index->count == index->size) {
+		size = index->size ? index->size * 2 : 16;
+		entries = realloc(index->entries, size * sizeof(*entries));
+		if (entries == NULL) {
+			return false;
+		}
+		index->entries = entries;
+		index->size = size;
+
+		/* Keep the number of buckets in step with the entries */
+		buckets = malloc(size * sizeof(*buckets));
+		if (buckets == NULL) {
+			return false;
+		}
+		free(index->buckets);
+		index->buckets = buckets;
+		index->mask = size - 1;
+		for (i = 0; i < size; i++) {
+			index->buckets[i] = MERGE_INDEX_END;
+		}
+		for (i = 0; i < index->count; i++) {
+			bucket = index->entries[i].hash & index->mask;
+			index->entries[i].next = index->buckets[bucket];
+			index->buckets[bucket] = i;
+		}
+	}
+
+	entry = &index->entries[index->count];
+	merge_index_key(index, packet, entry);
+	entry->item = item;
+	bucket = entry->hash & index->mask;
+	entry->next = index->buckets[bucket];
+	index->buckets[bucket] = index->count++;
+
+	return true;
+}
+
+/**
+ *	merge_index_find - Find a packet in an index.
+ *	@index: The index to look in.
+ *	@packet: The packet to look for.
+ *
+ *	Returns the first matching entry that was added to the index and hasn't
+ *	since been removed, so we find the same thing a walk of the list
+ *	would. Returns NULL if there's no match.
  */
-static void remove_signed_packet(struct openpgp_signedpacket_list **packet_list,
-		struct openpgp_signedpacket_list **list_end,
+static struct merge_index_entry *merge_index_find(struct merge_index *index,
 		struct openpgp_packet *packet)
 {
-	struct openpgp_signedpacket_list *cur = NULL;
-	struct openpgp_signedpacket_list *prev = NULL;
+	struct merge_index_entry key;
+	struct merge_index_entry *found = NULL;
+	size_t cur;
 
-	for (cur = *packet_list; cur != NULL; cur = cur->next) {
-		if (compare_packets(cur->packet, packet) == 0) {
-			if (prev == NULL) {
-				*packet_list = cur->next;
-			} else {
-				prev->next = cur->next;
-			}
-			if (cur->next == NULL) {
-				*list_end = prev;
-			}
-			cur->next = NULL;
-			free_signedpacket_list(cur);
-			break;
+	if (index->count == 0) {
+		return NULL;
+	}
+
+	merge_index_key(index, packet, &key);
+	for (cur = index->buckets[key.hash & index->mask];
+			cur != MERGE_INDEX_END;
+			cur = index->entries[cur].next) {
+		if (index->entries[cur].item != NULL &&
+				merge_index_match(index,
+					&index->entries[cur], &key)) {
+			found = &index->entries[cur];
 		}
-		prev = cur;
 	}
 
-	return;
+	return found;
 }
 
 /**
@@ -206,9 +409,21 @@ int merge_packet_sigs(struct openpgp_signedpacket_list *old,
 	struct openpgp_packet_list	*lastpacket = NULL;
 	struct openpgp_packet_list	*curpacket = NULL;
 	struct openpgp_packet_list	*nextpacket = NULL;
+	struct merge_index		 index;
 
 	assert(compare_packets(old->packet, new->packet) == 0);
 
+	merge_index_init(&index, true);
+	for (curpacket = old->sigs; curpacket != NULL;
+			curpacket = curpacket->next) {
+		if (!merge_index_add(&index, curpacket->packet, curpacket)) {
+			logthing(LOGTHING_ERROR,
+				"Couldn't allocate memory to merge sigs");
+			merge_index_free(&index);
+			return -1;
+		}
+	}
+
 	curpacket = new->sigs;
 	while (curpacket != NULL) {
 		nextpacket = curpacket->next;
@@ -218,7 +433,7 @@ int merge_packet_sigs(struct openpgp_signedpacket_list *old,
 		 * really. For now this stops us adding the same one twice
 		 * however.
 		 */
-		if (find_signature(old->sigs, curpacket->packet)) {
+		if (merge_index_find(&index, curpacket->packet) != NULL) {
 			/*
 			 * We already have this sig, remove it from the
 			 * difference list and free the memory allocated for
@@ -238,18 +453,21 @@ int merge_packet_sigs(struct openpgp_signedpacket_list *old,
 		curpacket = nextpacket;
 	}
 	new->last_sig = lastpacket;
+	merge_index_free(&index);
 
 	/*
 	 * What's left on new->sigs now are the new signatures, so add them to
 	 * old->sigs.
 	 */
-	packet_list_add(&old->sigs, &old->last_sig, new->sigs);
+	packet_list_add_arena(old->arena, &old->sigs, &old->last_sig,
+			new->sigs);
 
 	return 0;
 }
 
 /**
  *	merge_signed_packets - Takes 2 lists of signed packets and merges them.
+ *	@arena: The arena the old list belongs to; NULL if malloced.
  *	@old: The old signed packet list.
  *	@new: The new signed packet list.
  *
@@ -257,52 +475,100 @@ int merge_packet_sigs(struct openpgp_signedpacket_list *old,
  *	signed packets & sigs is returned in old and the minimal set of
  *	differences required to get from old to new in new.
  */
-int merge_signed_packets(struct openpgp_signedpacket_list **old,
+int merge_signed_packets(struct onak_arena *arena,
+			struct openpgp_signedpacket_list **old,
 			struct openpgp_signedpacket_list **old_end,
 			struct openpgp_signedpacket_list **new,
 			struct openpgp_signedpacket_list **new_end)
 {
 	struct openpgp_signedpacket_list *curelem = NULL;
 	struct openpgp_signedpacket_list *newelem = NULL;
+	struct openpgp_signedpacket_list *prevelem = NULL;
+	struct openpgp_signedpacket_list *nextelem = NULL;
+	struct merge_index_entry *entry = NULL;
+	struct merge_index index;
+	size_t i;
+
+	merge_index_init(&index, false);
+	for (curelem = *new; curelem != NULL; curelem = curelem->next) {
+		if (!merge_index_add(&index, curelem->packet, curelem)) {
+			goto nomem;
+		}
+	}
 
 	for (curelem = *old; curelem != NULL; curelem = curelem->next) {
-		newelem = find_signed_packet(*new, curelem->packet);
-		if (newelem != NULL) {
-			merge_packet_sigs(curelem, newelem);
+		entry = merge_index_find(&index, curelem->packet);
+		if (entry != NULL) {
+			newelem = entry->item;
+			if (merge_packet_sigs(curelem, newelem) != 0) {
+				goto nomem;
+			}
 
 			/*
 			 * If there are no sigs left on the new signed packet
-			 * then remove it from the list.
+			 * then it needs removed from the list; mark it so we
+			 * can do them all in one pass.
 			 */
 			if (newelem->sigs == NULL) {
-				remove_signed_packet(new,
-						new_end,
-						newelem->packet);
+				entry->item = NULL;
+			}
+		}
+	}
+
+	/* The index entries are in the same order as the list. */
+	for (i = 0, curelem = *new; curelem != NULL; i++, curelem = nextelem) {
+		nextelem = curelem->next;
+		if (index.entries[i].item == NULL) {
+			if (prevelem == NULL) {
+				*new = nextelem;
+			} else {
+				prevelem->next = nextelem;
 			}
+			curelem->next = NULL;
+			free_signedpacket_list(curelem);
+		} else {
+			prevelem = curelem;
 		}
 	}
+	*new_end = prevelem;
+	merge_index_free(&index);
 
 	/*
 	 * If *new != NULL now then there might be UIDs on the new key that
 	 * weren't on the old key. Walk through them, checking if the UID is
 	 * on the old key and if not adding them to it.
 	 */
+	for (curelem = *old; curelem != NULL; curelem = curelem->next) {
+		if (!merge_index_add(&index, curelem->packet, curelem)) {
+			goto nomem;
+		}
+	}
 	for (curelem = *new; curelem != NULL;
 			curelem = curelem->next) {
 
-		if (find_signed_packet(*old, curelem->packet) == NULL) {
-			ADD_PACKET_TO_LIST((*old_end),
-				packet_dup(curelem->packet));
+		if (merge_index_find(&index, curelem->packet) == NULL) {
+			ADD_PACKET_TO_LIST_ARENA(arena, (*old_end),
+				packet_dup_arena(arena, curelem->packet));
 			if (*old == NULL) {
 				*old = *old_end;
 			}
-			packet_list_add(&(*old_end)->sigs,
+			packet_list_add_arena(arena, &(*old_end)->sigs,
 				&(*old_end)->last_sig,
 				curelem->sigs);
+			if (!merge_index_add(&index, (*old_end)->packet,
+					*old_end)) {
+				goto nomem;
+			}
 		}
 	}
+	merge_index_free(&index);
 
 	return 0;
+
+nomem:
+	logthing(LOGTHING_ERROR, "Couldn't allocate memory to merge packets");
+	merge_index_free(&index);
+	return -1;
 }
 
 /**
@@ -317,6 +583,15 @@ int merge_signed_packets(struct openpgp_signedpacket_list **old,
  *	convert olda to newa). The intention is that olda is provided from
  *	internal storage and oldb from the remote user. newa is then stored in
  *	internal storage and newb is sent to all our keysync peers.
+ *
+ *	Anything added to a is copied into a's arena (or malloced, if a has
+ *	none) rather than shared with b, so the two keys can still be freed
+ *	separately.
+ *
+ *	Returns 0 if the keys were merged, 1 if either is missing or has no
+ *	key ID, or -1 if they're different keys or we ran out of memory part
+ *	way through. In the last case a and b may only be partly merged, and
+ *	shouldn't be stored.
  */
 int merge_keys(struct openpgp_publickey *a, struct openpgp_publickey *b)
 {
@@ -324,6 +599,7 @@ int merge_keys(struct openpgp_publickey *a, struct openpgp_publickey *b)
 	struct openpgp_packet_list	*curpacket = NULL;
 	struct openpgp_packet_list	*lastpacket = NULL;
 	struct openpgp_packet_list	*nextpacket = NULL;
+	struct merge_index		 index;
 	uint64_t keya, keyb;
 
 	if (a == NULL || b == NULL) {
@@ -346,10 +622,22 @@ int merge_keys(struct openpgp_publickey *a, struct openpgp_publickey *b)
 		/*
 		 * Key IDs are the same, so I guess we have to merge them.
 		 */
+		merge_index_init(&index, false);
+		for (curpacket = a->sigs; curpacket != NULL;
+				curpacket = curpacket->next) {
+			if (!merge_index_add(&index, curpacket->packet,
+					curpacket)) {
+				logthing(LOGTHING_ERROR,
+					"Couldn't allocate memory to merge key");
+				merge_index_free(&index);
+				return -1;
+			}
+		}
+
 		curpacket = b->sigs;
 		while (curpacket != NULL) {
 			nextpacket = curpacket->next;
-			if (find_packet(a->sigs, curpacket->packet)) {
+			if (merge_index_find(&index, curpacket->packet)) {
 				/*
 				 * We already have this signature, remove it
 				 * from the difference list and free the memory
@@ -371,12 +659,14 @@ int merge_keys(struct openpgp_publickey *a, struct openpgp_publickey *b)
 			curpacket = nextpacket;
 		}
 		b->last_sig = lastpacket;
+		merge_index_free(&index);
 
 		/*
 		 * Anything left on b->sigs doesn't exist on
 		 * a->sigs, so add them to the list.
 		 */
-		packet_list_add(&a->sigs,
+		packet_list_add_arena(a->arena,
+				&a->sigs,
 				&a->last_sig,
 				b->sigs);
 
@@ -384,10 +674,15 @@ int merge_keys(struct openpgp_publickey *a, struct openpgp_publickey *b)
 		 * Merge uids (signed list).
 		 * Merge subkeys (signed list).
 		 */
-		merge_signed_packets(&a->uids, &a->last_uid,
-				&b->uids, &b->last_uid);
-		merge_signed_packets(&a->subkeys, &a->last_subkey,
-				&b->subkeys, &b->last_subkey);
+		if (merge_signed_packets(a->arena, &a->uids, &a->last_uid,
+				&b->uids, &b->last_uid) != 0 ||
+				merge_signed_packets(a->arena, &a->subkeys,
+					&a->last_subkey, &b->subkeys,
+					&b->last_subkey) != 0) {
+			rc = -1;
+		}
+
+		a->have_skshash = b->have_skshash = false;
 
 	}
 
@@ -42,6 +42,11 @@ int compare_packets(struct openpgp_packet *a, struct openpgp_packet *b);
  *	convert olda to newa). The intention is that olda is provided from
  *	internal storage and oldb from the remote user. newa is then stored in
  *	internal storage and newb is sent to all our keysync peers.
+ *
+ *	Returns 0 if the keys were merged, 1 if either is missing or has no
+ *	key ID, or -1 if they're different keys or we ran out of memory part
+ *	way through. In the last case a and b may only be partly merged, and
+ *	shouldn't be stored.
  */
 int merge_keys(struct openpgp_publickey *a, struct openpgp_publickey *b);
 
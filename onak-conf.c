@@ -27,6 +27,7 @@
 #include "ll.h"
 #include "log.h"
 #include "onak-conf.h"
+#include "sigcache.h"
 
 #ifdef DBINIT
 extern struct onak_dbctx *DBINIT(struct onak_db_config *dbcfg, bool readonly);
@@ -48,6 +49,12 @@ struct onak_config config = {
 
 	.use_keyd = false,
 	.sock_dir = NULL,
+	.keyd_workers = 4,
+	.keyd_cache_size = 64,
+	.keyd_commit_window = 0,
+	.update_batch_keys = 1,
+	.update_batch_time = 0,
+	.graph_file = NULL,
 
 	.backends = NULL,
 	.backends_dir = NULL,
@@ -58,6 +65,8 @@ struct onak_config config = {
 	.dbinit = NULL,
 #endif
 
+	.sigcache_entries = 1000000,
+	.verify_workers = 1,
 	.clean_policies = ONAK_CLEAN_DROP_V3_KEYS | ONAK_CLEAN_CHECK_SIGHASH,
 
 	.bin_dir = NULL,
@@ -267,6 +276,18 @@ static bool parseconfigline(char *line)
 					config.use_keyd);
 		} else if (MATCH("main", "sock_dir")) {
 			config.sock_dir = strdup(value);
+		} else if (MATCH("main", "keyd_workers")) {
+			config.keyd_workers = atoi(value);
+		} else if (MATCH("main", "keyd_cache_size")) {
+			config.keyd_cache_size = atoi(value);
+		} else if (MATCH("main", "keyd_commit_window")) {
+			config.keyd_commit_window = atoi(value);
+		} else if (MATCH("main", "update_batch_keys")) {
+			config.update_batch_keys = atoi(value);
+		} else if (MATCH("main", "update_batch_time")) {
+			config.update_batch_time = atoi(value);
+		} else if (MATCH("main", "graph_file")) {
+			config.graph_file = strdup(value);
 		} else if (MATCH("main", "max_reply_keys")) {
 			config.maxkeys = atoi(value);
 		/* [mail] section */
@@ -286,6 +307,12 @@ static bool parseconfigline(char *line)
 		/* [verification] section */
 		} else if (MATCH("verification", "blacklist")) {
 			array_load(&config.blacklist, value);
+		} else if (MATCH("verification", "sigcache")) {
+			config.sigcache = strdup(value);
+		} else if (MATCH("verification", "sigcache_entries")) {
+			config.sigcache_entries = atoi(value);
+		} else if (MATCH("verification", "verify_workers")) {
+			config.verify_workers = atoi(value);
 		} else if (MATCH("verification", "drop_v3")) {
 			if (parsebool(value, config.clean_policies &
 					ONAK_CLEAN_DROP_V3_KEYS)) {
@@ -527,12 +554,22 @@ void writeconfig(const char *configfile)
 	fprintf(conffile, "loglevel=%d\n", getlogthreshold());
 	WRITE_BOOL(config.use_keyd, "use_keyd");
 	WRITE_IF_NOT_NULL(config.sock_dir, "sock_dir");
+	fprintf(conffile, "keyd_workers=%d\n", config.keyd_workers);
+	fprintf(conffile, "keyd_cache_size=%d\n", config.keyd_cache_size);
+	fprintf(conffile, "keyd_commit_window=%d\n",
+			config.keyd_commit_window);
+	fprintf(conffile, "update_batch_keys=%d\n", config.update_batch_keys);
+	fprintf(conffile, "update_batch_time=%d\n", config.update_batch_time);
+	WRITE_IF_NOT_NULL(config.graph_file, "graph_file");
 	fprintf(conffile, "max_reply_keys=%d\n", config.maxkeys);
 	fprintf(conffile, "\n");
 
 	fprintf(conffile, "[verification]\n");
 	WRITE_BOOL(config.clean_policies & ONAK_CLEAN_CHECK_SIGHASH,
 			"check_sighash");
+	WRITE_IF_NOT_NULL(config.sigcache, "sigcache");
+	fprintf(conffile, "sigcache_entries=%d\n", config.sigcache_entries);
+	fprintf(conffile, "verify_workers=%d\n", config.verify_workers);
 	fprintf(conffile, "\n");
 
 	fprintf(conffile, "[mail]\n");
@@ -635,6 +672,10 @@ void cleanupconfig(void) {
 		free(config.sock_dir);
 		config.sock_dir = NULL;
 	}
+	if (config.graph_file != NULL) {
+		free(config.graph_file);
+		config.graph_file = NULL;
+	}
 	if (config.bin_dir != NULL) {
 		free(config.bin_dir);
 		config.bin_dir = NULL;
@@ -646,4 +687,10 @@ void cleanupconfig(void) {
 	if (config.blacklist.count != 0) {
 		array_free(&config.blacklist);
 	}
+	cleankeys_cleanup();
+	if (config.sigcache != NULL) {
+		sigcache_cleanup();
+		free(config.sigcache);
+		config.sigcache = NULL;
+	}
 }
@@ -72,6 +72,18 @@ struct onak_config {
 	bool use_keyd;
 	/** The path to the directory the keyd socket lives in. */
 	char *sock_dir;
+	/** Number of worker threads keyd should use to service requests. */
+	int keyd_workers;
+	/** Size, in megabytes, of keyd's cache of recently fetched keys. */
+	int keyd_cache_size;
+	/** Milliseconds keyd waits to group writes into one transaction. */
+	int keyd_commit_window;
+	/** Maximum number of keys to update in a single transaction. */
+	int update_batch_keys;
+	/** Milliseconds after which to commit a batch of key updates. */
+	int update_batch_time;
+	/** Web of trust graph snapshot for the stats tools to use. */
+	char *graph_file;
 
 	/** List of backend configurations */
 	struct ll *backends;
@@ -93,6 +105,13 @@ struct onak_config {
 	/** Blacklist of fingerprints to reject */
 	struct keyarray blacklist;
 
+	/** File to keep a cache of already verified signatures in. */
+	char *sigcache;
+	/** Maximum number of entries to keep in the signature cache. */
+	int sigcache_entries;
+	/** Number of threads to use for verifying signatures. */
+	int verify_workers;
+
 	/** What policies should we use for cleaning keys? */
 	uint64_t clean_policies;
 
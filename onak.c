@@ -30,9 +30,11 @@
 #include "build-config.h"
 
 #include "armor.h"
+#include "bulkadd.h"
 #include "charfuncs.h"
 #include "cleankey.h"
 #include "cleanup.h"
+#include "graph.h"
 #include "keydb.h"
 #include "keyid.h"
 #include "keyindex.h"
@@ -44,6 +46,28 @@
 #include "parsekey.h"
 #include "photoid.h"
 
+/**
+ *	output_raw_key - Write out a key fetched with one of the raw functions.
+ *	@raw: The raw key; freed once it's been output.
+ *	@binary: True to output the binary packets rather than armoring them.
+ */
+static void output_raw_key(struct openpgp_raw_key *raw, bool binary)
+{
+	if (raw->length == 0) {
+		puts("Key not found");
+		return;
+	}
+
+	logthing(LOGTHING_INFO, "Got key.");
+	if (binary) {
+		stdout_putchar(NULL, raw->length, (void *) raw->data);
+	} else {
+		armor_openpgp_buffer(stdout_putchar, NULL, raw->data,
+				raw->length);
+	}
+	free_raw_key(raw);
+}
+
 void find_keys(struct onak_dbctx *dbctx,
 		char *search, uint64_t keyid,
 		struct openpgp_fingerprint *fingerprint,
@@ -95,7 +119,7 @@ struct dump_ctx {
 	char *filebase;
 };
 
-void dump_func(void *ctx, struct openpgp_publickey *key)
+bool dump_func(void *ctx, struct openpgp_publickey *key)
 {
 	struct openpgp_packet_list *packets = NULL;
 	struct openpgp_packet_list *list_end = NULL;
@@ -119,7 +143,50 @@ void dump_func(void *ctx, struct openpgp_publickey *key)
 	free_packet_list(packets);
 	packets = list_end = NULL;
 
-	return;
+	return true;
+}
+
+/**
+ *	add_keys_stream - Add binary keys from stdin, a chunk at a time.
+ *	@dbctx: The DB to add the keys to.
+ *	@chunksize: How many keys to read in each chunk.
+ *	@update: Output the changes made to the keys on stdout.
+ *
+ *	Rather than reading all of stdin in one go only @chunksize keys are
+ *	read, parsed, cleaned and added before moving on to the next lot, so
+ *	the memory used stays the same no matter how large the input is.
+ *	Returns 0 if some keys were changed, 1 otherwise.
+ */
+static int add_keys_stream(struct onak_dbctx *dbctx, int chunksize,
+		bool update)
+{
+	struct openpgp_packet_list *packets = NULL;
+	struct openpgp_packet_list *next = NULL;
+	struct openpgp_publickey *keys = NULL;
+	struct add_keys_stats stats;
+	onak_status_t res;
+
+	memset(&stats, 0, sizeof(stats));
+	do {
+		res = read_openpgp_stream_keys(stdin_getchar, NULL, &packets,
+				&next, chunksize);
+		if (res != ONAK_E_OK) {
+			logthing(LOGTHING_INFO, "read_openpgp_stream: %d",
+					res);
+		}
+		if (packets == NULL) {
+			break;
+		}
+
+		stats.count += parse_keys(packets, &keys);
+		free_packet_list(packets);
+		packets = NULL;
+
+		add_keys_chunk(dbctx, &keys, true, update, true, &stats);
+	} while (res == ONAK_E_OK);
+	free_packet_list(next);
+
+	return add_keys_finish(&stats);
 }
 
 static uint8_t hex2bin(char c)
@@ -141,7 +208,11 @@ void usage(void) {
 	puts("\tonak [options] <command> <parameters>\n");
 	puts("\tCommands:\n");
 	puts("\tadd      - read armored OpenPGP keys from stdin and add to the"
-		" keyserver");
+		" keyserver\n\t           (-n <num> with -b adds <num> keys at"
+		" a time)");
+	puts("\tbulkadd  - read armored OpenPGP keys from stdin and add to the"
+		" keyserver\n\t           using several threads (-j <threads>,"
+		" -n <num> keys at a time)");
 	puts("\tclean    - read armored OpenPGP keys from stdin, run the"
 		" cleaning\n\t       	   routines against them and dump to"
 		" stdout");
@@ -151,6 +222,8 @@ void usage(void) {
 	puts("\tget      - retrieves the key requested from the keyserver");
 	puts("\tgetphoto - retrieves the first photoid on the given key and"
 		" dumps to\n\t           stdout");
+	puts("\tgraph-build - build the web of trust graph snapshot used by"
+		" the\n\t           path finding and stats tools");
 	puts("\tindex    - search for a key and list it");
 	puts("\treindex  - retrieve and re-store a key in the backend db");
 	puts("\tvindex   - search for a key and list it and its signatures");
@@ -166,6 +239,7 @@ int main(int argc, char *argv[])
 	int				 result = 0;
 	char				*search = NULL;
 	char				*end = NULL;
+	char				*graphfile = NULL;
 	uint64_t			 keyid = 0;
 	int				 i;
 	bool				 exact = false;
@@ -176,12 +250,15 @@ int main(int argc, char *argv[])
 	bool				 dispfp = false;
 	bool				 skshash = false;
 	int				 optchar;
+	int				 chunksize = 0;
+	int				 workers = 0;
 	struct dump_ctx                  dumpstate;
 	struct skshash			 hash;
+	struct openpgp_raw_key		 raw;
 	struct onak_dbctx		*dbctx;
 	struct openpgp_fingerprint	 fingerprint;
 
-	while ((optchar = getopt(argc, argv, "bc:efsuv")) != -1 ) {
+	while ((optchar = getopt(argc, argv, "bc:efj:n:suv")) != -1 ) {
 		switch (optchar) {
 		case 'b':
 			binary = true;
@@ -198,6 +275,12 @@ int main(int argc, char *argv[])
 		case 'f':
 			dispfp = true;
 			break;
+		case 'j':
+			workers = atoi(optarg);
+			break;
+		case 'n':
+			chunksize = atoi(optarg);
+			break;
 		case 's':
 			skshash = true;
 			break;
@@ -234,6 +317,30 @@ int main(int argc, char *argv[])
 			dumpstate.fd = -1;
 		}
 		dbctx->cleanupdb(dbctx);
+	} else if (!strcmp("add", argv[optind]) && binary && chunksize > 0) {
+		dbctx = config.dbinit(config.backend, false);
+		if (dbctx == NULL) {
+			logthing(LOGTHING_ERROR,
+				"Failed to open key database.");
+			rc = EXIT_FAILURE;
+			goto err;
+		}
+		rc = add_keys_stream(dbctx, chunksize, update);
+		dbctx->cleanupdb(dbctx);
+	} else if (!strcmp("bulkadd", argv[optind])) {
+		dbctx = config.dbinit(config.backend, false);
+		if (dbctx == NULL) {
+			logthing(LOGTHING_ERROR,
+				"Failed to open key database.");
+			rc = EXIT_FAILURE;
+			goto err;
+		}
+		if (workers <= 0) {
+			workers = sysconf(_SC_NPROCESSORS_ONLN);
+		}
+		rc = bulk_add_keys(dbctx, chunksize > 0 ? chunksize : 1000,
+				workers, binary, update);
+		dbctx->cleanupdb(dbctx);
 	} else if (!strcmp("add", argv[optind])) {
 		if (binary) {
 			result = read_openpgp_stream(stdin_getchar, NULL,
@@ -353,6 +460,26 @@ int main(int argc, char *argv[])
 			keys = NULL;
 		}
 		dbctx->cleanupdb(dbctx);
+	} else if (!strcmp("graph-build", argv[optind])) {
+		graphfile = ((argc - optind) == 2) ? argv[optind + 1] :
+			config.graph_file;
+		if (graphfile == NULL) {
+			logthing(LOGTHING_ERROR,
+				"No graph_file configured to build.");
+			rc = EXIT_FAILURE;
+			goto err;
+		}
+		dbctx = config.dbinit(config.backend, true);
+		if (dbctx == NULL) {
+			logthing(LOGTHING_ERROR,
+				"Failed to open key database.");
+			rc = EXIT_FAILURE;
+			goto err;
+		}
+		if (onak_graph_build(dbctx, graphfile) != ONAK_E_OK) {
+			rc = EXIT_FAILURE;
+		}
+		dbctx->cleanupdb(dbctx);
 	} else if (!strcmp("dumpconfig", argv[optind])) {
 		if ((argc - optind) == 2) {
 			writeconfig(argv[optind + 1]);
@@ -444,6 +571,14 @@ int main(int argc, char *argv[])
 				puts("Can't get a key on uid text."
 					" You must supply a keyid / "
 					"fingerprint.");
+			} else if (isfp && dbctx->fetch_key_fp_raw != NULL) {
+				dbctx->fetch_key_fp_raw(dbctx, &fingerprint,
+						&raw, false);
+				output_raw_key(&raw, binary);
+			} else if (ishex && dbctx->fetch_key_id_raw != NULL) {
+				dbctx->fetch_key_id_raw(dbctx, keyid, &raw,
+						false);
+				output_raw_key(&raw, binary);
 			} else if ((isfp &&
 					dbctx->fetch_key_fp(dbctx,
 						&fingerprint,
@@ -473,6 +608,10 @@ int main(int argc, char *argv[])
 		} else if (!strcmp("hget", argv[optind])) {
 			if (!parse_skshash(search, &hash)) {
 				puts("Couldn't parse sks hash.");
+			} else if (dbctx->fetch_key_skshash_raw != NULL) {
+				dbctx->fetch_key_skshash_raw(dbctx, &hash,
+						&raw);
+				output_raw_key(&raw, binary);
 			} else if (dbctx->fetch_key_skshash(dbctx, &hash,
 					&keys)) {
 				logthing(LOGTHING_INFO, "Got key.");
@@ -34,7 +34,15 @@
  *	@keys: The returned list of public keys.
  *
  *	This function takes an list of OpenPGP packets and attempts to parse it
- *	into a list of public keys with signatures and subkeys.
+ *	into a list of public keys with signatures and subkeys. The new keys
+ *	are all allocated from a single arena, so freeing them is cheap.
+ *
+ *	Every packet we keep has its data copied into the arena, even when it
+ *	was borrowed by read_openpgp_buffer(). The buffers it's used on (a DB
+ *	record, a file, a keyd request) are usually gone long before the keys
+ *	are; keyd, for one, hands the keys it parses to the writer thread.
+ *	Trust and comment packets, and any we don't understand, are dropped
+ *	without being copied.
  *
  *      Returns a count of how many keys we parsed.
  */
@@ -42,6 +50,8 @@ int parse_keys(struct openpgp_packet_list *packets,
 		struct openpgp_publickey **keys)
 {
 	struct openpgp_publickey *curkey = NULL;
+	struct onak_arena *arena = NULL;
+	bool newarena = true;
 	int count;
 
 	count = 0;
@@ -52,6 +62,9 @@ int parse_keys(struct openpgp_packet_list *packets,
 	 */
 	for (curkey = *keys; curkey != NULL && curkey->next != NULL;
 			curkey = curkey->next) ;
+	if (curkey != NULL) {
+		curkey->have_skshash = false;
+	}
 
 	while (packets != NULL) {
 		switch (packets->packet->tag) {
@@ -65,15 +78,18 @@ int parse_keys(struct openpgp_packet_list *packets,
 			if (curkey->subkeys != NULL) {
 				ADD_PACKET_TO_LIST_END(curkey->last_subkey,
 					sig,
-					packet_dup(packets->packet));
+					packet_dup_arena(curkey->arena,
+						packets->packet));
 			} else if (curkey->uids != NULL) {
 				ADD_PACKET_TO_LIST_END(curkey->last_uid,
 					sig,
-					packet_dup(packets->packet));
+					packet_dup_arena(curkey->arena,
+						packets->packet));
 			} else {
 				ADD_PACKET_TO_LIST_END(curkey,
 					sig,
-					packet_dup(packets->packet));
+					packet_dup_arena(curkey->arena,
+						packets->packet));
 				/*
 				 * This is a signature on the public key; check
 				 * if it's a revocation.
@@ -100,15 +116,26 @@ int parse_keys(struct openpgp_packet_list *packets,
 			 * It's a public key packet, so start a new key in our
 			 * list.
 			 */
+			if (newarena) {
+				/* Fall back to malloc if we can't get one */
+				arena = onak_arena_new();
+				newarena = false;
+			}
 			if (curkey != NULL) {
-				curkey->next = malloc(sizeof (*curkey));
+				curkey->next = onak_arena_alloc(arena,
+						sizeof (*curkey));
 				curkey = curkey->next;
 			} else {
 				*keys = curkey =
-					malloc(sizeof (*curkey));
+					onak_arena_alloc(arena,
+						sizeof (*curkey));
 			}
-			memset(curkey, 0, sizeof(*curkey));
-			curkey->publickey = packet_dup(packets->packet);
+			if (arena != NULL) {
+				curkey->arena = arena;
+				onak_arena_ref(arena);
+			}
+			curkey->publickey = packet_dup_arena(arena,
+					packets->packet);
 			count++;
 			break;
 		case OPENPGP_PACKET_UID:
@@ -122,7 +149,8 @@ int parse_keys(struct openpgp_packet_list *packets,
 				return ONAK_E_INVALID_PARAM;
 			ADD_PACKET_TO_LIST_END(curkey,
 				uid,
-				packet_dup(packets->packet));
+				packet_dup_arena(curkey->arena,
+					packets->packet));
 			break;
 		case OPENPGP_PACKET_PUBLICSUBKEY:
 			/*
@@ -132,7 +160,8 @@ int parse_keys(struct openpgp_packet_list *packets,
 				return ONAK_E_INVALID_PARAM;
 			ADD_PACKET_TO_LIST_END(curkey,
 				subkey,
-				packet_dup(packets->packet));
+				packet_dup_arena(curkey->arena,
+					packets->packet));
 			break;
 		case OPENPGP_PACKET_TRUST:
 		case OPENPGP_PACKET_COMMENT:
@@ -171,6 +200,149 @@ int debug_packet(struct openpgp_packet *packet)
 	return 0;
 }
 
+/**
+ *	openpgp_header_size - Work out the size of an OpenPGP packet header.
+ *	@hdr: The start of the header. Only the first byte is needed for an old
+ *	      format packet; new format packets need the first 2.
+ *
+ *	Returns the size of the entire header, including the tag byte, or 0 if
+ *	it uses a length encoding we don't support (partial body lengths, or
+ *	old format packets of indeterminate length).
+ */
+static size_t openpgp_header_size(const unsigned char *hdr)
+{
+	if (hdr[0] & 0x40) {
+		if (hdr[1] < 192) {
+			return 2;
+		} else if (hdr[1] < 224) {
+			return 3;
+		} else if (hdr[1] == 255) {
+			/* 5 byte length; ie 255 followed by 4 bytes of MSB */
+			return 6;
+		}
+		return 0;
+	}
+
+	switch (hdr[0] & 3) {
+	case 0:
+		return 2;
+	case 1:
+		return 3;
+	case 2:
+		return 5;
+	}
+
+	return 0;
+}
+
+/**
+ *	openpgp_header_parse - Decode an OpenPGP packet header.
+ *	@hdr: The complete header, as sized by openpgp_header_size().
+ *	@packet: The packet to fill in the tag, format and length of.
+ */
+static void openpgp_header_parse(const unsigned char *hdr,
+		struct openpgp_packet *packet)
+{
+	packet->newformat = (hdr[0] & 0x40);
+	if (packet->newformat) {
+		packet->tag = (hdr[0] & 0x3F);
+		if (hdr[1] < 192) {
+			packet->length = hdr[1];
+		} else if (hdr[1] < 224) {
+			packet->length = ((hdr[1] - 192) << 8) + hdr[2] + 192;
+		} else {
+			packet->length = ((size_t) hdr[2] << 24) +
+				(hdr[3] << 16) + (hdr[4] << 8) + hdr[5];
+		}
+	} else {
+		packet->tag = (hdr[0] & 0x3C) >> 2;
+		switch (hdr[0] & 3) {
+		case 0:
+			packet->length = hdr[1];
+			break;
+		case 1:
+			packet->length = (hdr[1] << 8) + hdr[2];
+			break;
+		case 2:
+			packet->length = ((size_t) hdr[1] << 24) +
+				(hdr[2] << 16) + (hdr[3] << 8) + hdr[4];
+			break;
+		}
+	}
+}
+
+/**
+ *	openpgp_packet_check - Make sure a packet's version is sane.
+ *	@packet: The packet to check.
+ */
+static onak_status_t openpgp_packet_check(struct openpgp_packet *packet)
+{
+	switch (packet->tag) {
+	case OPENPGP_PACKET_ENCRYPTED_MDC:
+		/* These packets must be v1 */
+		if (packet->length == 0 || packet->data[0] != 1) {
+			return ONAK_E_INVALID_PKT;
+		}
+		break;
+	case OPENPGP_PACKET_PKSESSIONKEY:
+	case OPENPGP_PACKET_ONEPASSSIG:
+		/* These packets must be v3 */
+		if (packet->length == 0 || packet->data[0] != 3) {
+			return ONAK_E_INVALID_PKT;
+		}
+		break;
+	case OPENPGP_PACKET_SYMSESSIONKEY:
+		/* These packets must be v4 */
+		if (packet->length == 0 || packet->data[0] != 4) {
+			return ONAK_E_INVALID_PKT;
+		}
+		break;
+	case OPENPGP_PACKET_SIGNATURE:
+	case OPENPGP_PACKET_SECRETKEY:
+	case OPENPGP_PACKET_PUBLICKEY:
+		/* Must be v2 onwards */
+		if (packet->length == 0 || packet->data[0] < 2) {
+			return ONAK_E_INVALID_PKT;
+		}
+		break;
+	default:
+		break;
+	}
+
+	return ONAK_E_OK;
+}
+
+/**
+ *	openpgp_packet_append - Add a decoded packet to the end of a list.
+ *	@packetend: Pointer to the next pointer of the last list entry; updated
+ *	            to point to the new entry's.
+ *	@packet: The packet to add; its contents are copied, but not its data.
+ */
+static onak_status_t openpgp_packet_append(
+		struct openpgp_packet_list ***packetend,
+		struct openpgp_packet *packet)
+{
+	struct openpgp_packet_list *curpacket;
+
+	curpacket = malloc(sizeof (*curpacket));
+	if (curpacket == NULL) {
+		return ONAK_E_NOMEM;
+	}
+	curpacket->packet = malloc(sizeof (*curpacket->packet));
+	if (curpacket->packet == NULL) {
+		free(curpacket);
+		return ONAK_E_NOMEM;
+	}
+	*curpacket->packet = *packet;
+	curpacket->next = NULL;
+	curpacket->arena = NULL;
+
+	**packetend = curpacket;
+	*packetend = &curpacket->next;
+
+	return ONAK_E_OK;
+}
+
 /**
  *	read_openpgp_stream - Reads a stream of OpenPGP packets.
  *	@getchar_func: The function to get the next character from the stream.
@@ -181,6 +353,10 @@ int debug_packet(struct openpgp_packet *packet)
  *	This function uses getchar_func to read characters from an OpenPGP
  *	packet stream and reads the packets into a linked list of packets
  *	ready for parsing as a public key or whatever.
+ *
+ *	We never read past the end of the last packet we return, so the stream
+ *	can be picked up again where we left off. If the data is already in
+ *	memory read_openpgp_buffer() avoids copying it.
  */
 onak_status_t read_openpgp_stream(size_t (*getchar_func)(void *ctx, size_t count,
 				void *c),
@@ -188,225 +364,199 @@ onak_status_t read_openpgp_stream(size_t (*getchar_func)(void *ctx, size_t count
 				struct openpgp_packet_list **packets,
 				int maxnum)
 {
-	unsigned char			 curchar = 0;
-	struct openpgp_packet_list	*curpacket = NULL, **packetend = NULL;
+	unsigned char			 hdr[6];
+	struct openpgp_packet_list	**packetend = NULL;
+	struct openpgp_packet		 packet;
 	onak_status_t			 rc = ONAK_E_OK;
+	size_t				 hdrlen, size;
 	int				 keys = 0;
 
 	if (packets == NULL)
 		return ONAK_E_INVALID_PARAM;
 
-	curpacket = *packets;
-	if (curpacket != NULL) {
-		while (curpacket->next != NULL) {
-			curpacket = curpacket->next;
-		}
-	}
+	for (packetend = packets; *packetend != NULL;
+			packetend = &(*packetend)->next) ;
 
 	while (rc == ONAK_E_OK && (maxnum == 0 || keys < maxnum) &&
-			(getchar_func(ctx, 1, &curchar) == 1)) {
-		if (curchar & 0x80) {
-			/*
-			 * New packet. Allocate memory for it.
-			 */
-			if (curpacket != NULL) {
-				curpacket->next = malloc(sizeof (*curpacket));
-				packetend = &curpacket->next;
-				curpacket = curpacket->next;
-			} else {
-				*packets = curpacket =
-					malloc(sizeof (*curpacket));
-				packetend = packets;
-			}
-			memset(curpacket, 0, sizeof(*curpacket));
-			curpacket->packet =
-				malloc(sizeof (*curpacket->packet));
-			memset(curpacket->packet, 0,
-					sizeof(*curpacket->packet));
+			(getchar_func(ctx, 1, &hdr[0]) == 1)) {
+		if (!(hdr[0] & 0x80)) {
+			rc = ONAK_E_INVALID_PKT;
+			break;
+		}
 
-			curpacket->packet->newformat = (curchar & 0x40);
+		/*
+		 * Fetch enough of the header to know how long it is, then
+		 * the rest of it in one go.
+		 */
+		hdrlen = 1;
+		if ((hdr[0] & 0x40) &&
+				getchar_func(ctx, 1, &hdr[hdrlen++]) != 1) {
+			rc = ONAK_E_INVALID_PKT;
+			break;
+		}
+		size = openpgp_header_size(hdr);
+		if (size == 0) {
+			rc = ONAK_E_UNSUPPORTED_FEATURE;
+			break;
+		}
+		if (size > hdrlen && getchar_func(ctx, size - hdrlen,
+					&hdr[hdrlen]) != size - hdrlen) {
+			rc = ONAK_E_INVALID_PKT;
+			break;
+		}
 
-			/*
-			 * TODO: Better error checking on getchar_func.
-			 */
-			if (curpacket->packet->newformat) {
-				curpacket->packet->tag = (curchar & 0x3F);
-				if (getchar_func(ctx, 1, &curchar) == 0) {
-					rc = ONAK_E_INVALID_PKT;
-					break;
-				}
-				curpacket->packet->length = curchar;
-				if (curpacket->packet->length > 191 &&
-					curpacket->packet->length < 224) {
-					rc = getchar_func(ctx, 1, &curchar) ? ONAK_E_OK : ONAK_E_IO_ERROR;
-					curpacket->packet->length -= 192;
-					curpacket->packet->length <<= 8;
-					curpacket->packet->length += curchar;
-					curpacket->packet->length += 192;
-				} else if (curpacket->packet->length > 223 &&
-					curpacket->packet->length < 255) {
-					free(curpacket->packet);
-					curpacket->packet = NULL;
-					rc = ONAK_E_UNSUPPORTED_FEATURE;
-				} else if (curpacket->packet->length == 255) {
-					/*
-					 * 5 byte length; ie 255 followed by 4
-					 * bytes of MSB length.
-					 */
-					if (getchar_func(ctx, 1, &curchar) != 1) {
-						rc = ONAK_E_INVALID_PKT;
-						break;
-					}
-					curpacket->packet->length = curchar;
-					curpacket->packet->length <<= 8;
-					if (getchar_func(ctx, 1, &curchar) != 1) {
-						rc = ONAK_E_INVALID_PKT;
-						break;
-					}
-					curpacket->packet->length += curchar;
-					curpacket->packet->length <<= 8;
-					if (getchar_func(ctx, 1, &curchar) != 1) {
-						rc = ONAK_E_INVALID_PKT;
-						break;
-					}
-					curpacket->packet->length += curchar;
-					curpacket->packet->length <<= 8;
-					if (getchar_func(ctx, 1, &curchar) != 1) {
-						rc = ONAK_E_INVALID_PKT;
-						break;
-					}
-					curpacket->packet->length += curchar;
-				}
-			} else {
-				curpacket->packet->tag = (curchar & 0x3C) >> 2;
-				switch (curchar & 3) {
-				case 0:
-					if (getchar_func(ctx, 1, &curchar) != 1) {
-						rc = ONAK_E_INVALID_PKT;
-						break;
-					}
-					curpacket->packet->length = curchar;
-					break;
-				case 1:
-					if (getchar_func(ctx, 1, &curchar) != 1) {
-						rc = ONAK_E_INVALID_PKT;
-						break;
-					}
-					curpacket->packet->length = curchar;
-					curpacket->packet->length <<= 8;
-					if (getchar_func(ctx, 1, &curchar) != 1) {
-						rc = ONAK_E_INVALID_PKT;
-						break;
-					}
-					curpacket->packet->length += curchar;
-					break;
-				case 2:
-					if (getchar_func(ctx, 1, &curchar) != 1) {
-						rc = ONAK_E_INVALID_PKT;
-						break;
-					}
-					curpacket->packet->length =
-						((unsigned) curchar << 24);
-					if (getchar_func(ctx, 1, &curchar) != 1) {
-						rc = ONAK_E_INVALID_PKT;
-						break;
-					}
-					curpacket->packet->length +=
-						(curchar << 16);
-					if (getchar_func(ctx, 1, &curchar) != 1) {
-						rc = ONAK_E_INVALID_PKT;
-						break;
-					}
-					curpacket->packet->length +=
-						(curchar << 8);
-					if (getchar_func(ctx, 1, &curchar) != 1) {
-						rc = ONAK_E_INVALID_PKT;
-						break;
-					}
-					curpacket->packet->length += curchar;
-					break;
-				case 3:
-					rc = ONAK_E_UNSUPPORTED_FEATURE;
-					free(curpacket->packet);
-					curpacket->packet = NULL;
-					break;
-				}
-			}
+		memset(&packet, 0, sizeof(packet));
+		openpgp_header_parse(hdr, &packet);
+		if (packet.tag == OPENPGP_PACKET_PUBLICKEY) {
+			keys++;
+		}
 
-			if (rc == 0) {
-				if (curpacket->packet->tag ==
-						OPENPGP_PACKET_PUBLICKEY) {
-					keys++;
-				}
-				curpacket->packet->data =
-					malloc(curpacket->packet->length *
-					sizeof(unsigned char));
-				if (curpacket->packet->data == NULL) {
-					rc = ONAK_E_NOMEM;
-				} else {
-					size_t res = getchar_func(ctx,
-						curpacket->packet->length,
-						curpacket->packet->data);
-					rc = (res == curpacket->packet->length) ? ONAK_E_OK : ONAK_E_IO_ERROR;
-				}
-			}
-		} else {
-			rc = ONAK_E_INVALID_PKT;
+		packet.data = malloc(packet.length);
+		if (packet.data == NULL && packet.length > 0) {
+			rc = ONAK_E_NOMEM;
+			break;
+		}
+		if (getchar_func(ctx, packet.length, packet.data) !=
+				packet.length) {
+			rc = ONAK_E_IO_ERROR;
 		}
 		if (rc == ONAK_E_OK) {
-			/* Make sure the packet version is sane */
-			switch (curpacket->packet->tag) {
-			case OPENPGP_PACKET_ENCRYPTED_MDC:
-				/* These packets must be v1 */
-				if (curpacket->packet->data[0] != 1) {
-					rc = ONAK_E_INVALID_PKT;
-				}
-				break;
-			case OPENPGP_PACKET_PKSESSIONKEY:
-			case OPENPGP_PACKET_ONEPASSSIG:
-				/* These packets must be v3 */
-				if (curpacket->packet->data[0] != 3) {
-					rc = ONAK_E_INVALID_PKT;
-				}
-				break;
-			case OPENPGP_PACKET_SYMSESSIONKEY:
-				/* These packets must be v4 */
-				if (curpacket->packet->data[0] != 4) {
-					rc = ONAK_E_INVALID_PKT;
-				}
-				break;
-			case OPENPGP_PACKET_SIGNATURE:
-			case OPENPGP_PACKET_SECRETKEY:
-			case OPENPGP_PACKET_PUBLICKEY:
-				/* Must be v2 onwards */
-				if (curpacket->packet->data[0] < 2) {
-					rc = ONAK_E_INVALID_PKT;
-				}
-				break;
-			default:
-				break;
-			}
+			rc = openpgp_packet_check(&packet);
+		}
+		if (rc == ONAK_E_OK) {
+			rc = openpgp_packet_append(&packetend, &packet);
+		}
+		if (rc != ONAK_E_OK) {
+			/* If we got an invalid final packet, discard it. */
+			free(packet.data);
 		}
 	}
 
-	if (packetend != NULL) {
-		if ((*packetend)->packet != NULL) {
-			/* If we got an invalid final packet, discard it. */
-			if ((*packetend)->packet->data != NULL &&
-					rc != ONAK_E_OK) {
-				free((*packetend)->packet->data);
-				(*packetend)->packet->data = NULL;
-			}
-			/* If we didn't get any data, clean it up. */
-			if ((*packetend)->packet->data == NULL) {
-				free((*packetend)->packet);
-				(*packetend)->packet = NULL;
-			}
+	return (rc);
+}
+
+/**
+ *	read_openpgp_stream_keys - Reads a chunk of whole keys from a stream.
+ *	@getchar_func: The function to get the next character from the stream.
+ *	@ctx: A pointer to the context structure for getchar_func.
+ *	@packets: The outputted list of packets.
+ *	@next: The start of the next key, carried between calls.
+ *	@maxnum: The maximum number of keys to read.
+ *
+ *	read_openpgp_stream stops once it has read the public key packet of
+ *	the key after the last one we asked for. We hang on to that packet in
+ *	@next, which should be NULL for the first call, and use it to start
+ *	the following chunk. *packets is NULL once the stream is finished.
+ */
+onak_status_t read_openpgp_stream_keys(size_t (*getchar_func)(void *ctx,
+					size_t count, void *c),
+				void *ctx,
+				struct openpgp_packet_list **packets,
+				struct openpgp_packet_list **next,
+				int maxnum)
+{
+	struct openpgp_packet_list *tmp;
+	onak_status_t rc;
+	int keys = 0;
+
+	*packets = *next;
+	*next = NULL;
+
+	rc = read_openpgp_stream(getchar_func, ctx, packets,
+			(*packets == NULL) ? maxnum + 1 : maxnum);
+	if (rc != ONAK_E_OK || *packets == NULL) {
+		return rc;
+	}
+
+	/*
+	 * Only if we stopped because we'd read enough keys is the last packet
+	 * the start of the next key; otherwise we hit the end of the stream,
+	 * and a public key packet there is a key on its own.
+	 */
+	for (tmp = *packets; tmp != NULL; tmp = tmp->next) {
+		if (tmp->packet->tag == OPENPGP_PACKET_PUBLICKEY) {
+			keys++;
 		}
-		/* Trim the last packet if it doesn't actually exist */
-		if ((*packetend)->packet == NULL) {
-			free(*packetend);
-			*packetend = NULL;
+	}
+	if (keys <= maxnum) {
+		return rc;
+	}
+
+	for (tmp = *packets; tmp->next != NULL && tmp->next->next != NULL;
+			tmp = tmp->next) ;
+	if (tmp->next != NULL &&
+			tmp->next->packet->tag == OPENPGP_PACKET_PUBLICKEY) {
+		*next = tmp->next;
+		tmp->next = NULL;
+	}
+
+	return rc;
+}
+
+/**
+ *	read_openpgp_buffer - Reads OpenPGP packets from a buffer, in place.
+ *	@buf: The buffer holding the packets.
+ *	@length: The length of buf.
+ *	@packets: The outputted list of packets.
+ *	@maxnum: The maximum number of keys to read. 0 means unlimited.
+ *
+ *	As read_openpgp_stream, but for packets that are already held in
+ *	memory. Rather than being copied the packet data is left where it is;
+ *	the returned packets point into buf, which must not be freed or
+ *	changed until they have been. free_packet_list() knows not to free the
+ *	packet data itself.
+ */
+onak_status_t read_openpgp_buffer(const void *buf, size_t length,
+				struct openpgp_packet_list **packets,
+				int maxnum)
+{
+	const unsigned char		*data = buf;
+	struct openpgp_packet_list	**packetend = NULL;
+	struct openpgp_packet		 packet;
+	onak_status_t			 rc = ONAK_E_OK;
+	size_t				 offset = 0, size;
+	int				 keys = 0;
+
+	if (packets == NULL)
+		return ONAK_E_INVALID_PARAM;
+
+	for (packetend = packets; *packetend != NULL;
+			packetend = &(*packetend)->next) ;
+
+	while (rc == ONAK_E_OK && (maxnum == 0 || keys < maxnum) &&
+			offset < length) {
+		if (!(data[offset] & 0x80) ||
+				((data[offset] & 0x40) && length - offset < 2)) {
+			rc = ONAK_E_INVALID_PKT;
+			break;
+		}
+		size = openpgp_header_size(&data[offset]);
+		if (size == 0) {
+			rc = ONAK_E_UNSUPPORTED_FEATURE;
+			break;
+		}
+		if (size > length - offset) {
+			rc = ONAK_E_INVALID_PKT;
+			break;
+		}
+
+		memset(&packet, 0, sizeof(packet));
+		openpgp_header_parse(&data[offset], &packet);
+		offset += size;
+		if (packet.length > length - offset) {
+			rc = ONAK_E_IO_ERROR;
+			break;
+		}
+		if (packet.tag == OPENPGP_PACKET_PUBLICKEY) {
+			keys++;
+		}
+		packet.data = (unsigned char *) &data[offset];
+		packet.borrowed = true;
+		offset += packet.length;
+
+		rc = openpgp_packet_check(&packet);
+		if (rc == ONAK_E_OK) {
+			rc = openpgp_packet_append(&packetend, &packet);
 		}
 	}
 
@@ -28,7 +28,8 @@
  *	@keys: The returned list of public keys.
  *
  *	This function takes an list of OpenPGP packets and attempts to parse it
- *	into a list of public keys with signatures and subkeys.
+ *	into a list of public keys with signatures and subkeys. The packet
+ *	data is copied, so the keys don't depend on @packets.
  *
  *      Returns a count of how many keys we parsed.
  */
@@ -65,6 +66,43 @@ onak_status_t read_openpgp_stream(size_t (*getchar_func)(void *ctx, size_t count
 				struct openpgp_packet_list **packets,
 				int maxnum);
 
+/**
+ *	read_openpgp_stream_keys - Reads a chunk of whole keys from a stream.
+ *	@getchar_func: The function to get the next character from the stream.
+ *	@ctx: A pointer to the context structure for getchar_func.
+ *	@packets: The outputted list of packets.
+ *	@next: The start of the next key, carried between calls.
+ *	@maxnum: The maximum number of keys to read.
+ *
+ *	Reads up to maxnum complete keys, for processing a stream a chunk at a
+ *	time. next should point to NULL for the first call; it is used to hold
+ *	the start of the next key between calls. packets is set to NULL once
+ *	there is nothing left to read.
+ */
+onak_status_t read_openpgp_stream_keys(size_t (*getchar_func)(void *ctx,
+					size_t count, void *c),
+				void *ctx,
+				struct openpgp_packet_list **packets,
+				struct openpgp_packet_list **next,
+				int maxnum);
+
+/**
+ *	read_openpgp_buffer - Reads OpenPGP packets from a buffer, in place.
+ *	@buf: The buffer holding the packets.
+ *	@length: The length of buf.
+ *	@packets: The outputted list of packets.
+ *	@maxnum: The maximum number of keys to read. 0 means unlimited.
+ *
+ *	As read_openpgp_stream, but for packets that are already held in
+ *	memory. The packet data isn't copied; the returned packets point into
+ *	buf, which must outlive them. Keys made from them with parse_keys()
+ *	have their own copy of the data, so buf can go once the packet list
+ *	has been freed.
+ */
+onak_status_t read_openpgp_buffer(const void *buf, size_t length,
+				struct openpgp_packet_list **packets,
+				int maxnum);
+
 /**
  *	write_openpgp_stream - Reads a stream of OpenPGP packets.
  *	@putchar_func: The function to put the next character to the stream.
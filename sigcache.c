@@ -0,0 +1,419 @@
+/*
+ * sigcache.c - Cache of signatures we've already verified.
+ *
+ * Copyright 2026 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "build-config.h"
+#include "hash-helper.h"
+#include "keystructs.h"
+#include "log.h"
+#include "onak-conf.h"
+#include "sigcache.h"
+
+/*
+ * The cache file is just a sequence of SHA-1 digests, one per verified
+ * signature, which we append to. Each digest covers the signature packet,
+ * the hash of the data it's over and the fingerprint of the signing key.
+ */
+#define SIGCACHE_DIGEST_LEN	SHA1_DIGEST_SIZE
+
+struct sigcache_entry {
+	uint8_t digest[SIGCACHE_DIGEST_LEN];
+};
+
+/**
+ * struct sigcache - The in memory copy of the cache.
+ * @lock: Protects everything else. Lookups only need it for reading.
+ * @entries: Open addressed hash of entries; all zero means empty.
+ * @size: Number of slots in @entries (a power of 2).
+ * @count: Number of slots in use.
+ * @pending: Entries not yet written to the cache file.
+ * @pendingcount: Number of entries in @pending.
+ * @pendingsize: Number of entries @pending has space for.
+ * @loaded: How far into the cache file we've read.
+ * @inode: The inode of the cache file we've read from, so we notice when
+ *         it's been compacted.
+ */
+static struct sigcache {
+	pthread_rwlock_t lock;
+	struct sigcache_entry *entries;
+	size_t size;
+	size_t count;
+	struct sigcache_entry *pending;
+	size_t pendingcount;
+	size_t pendingsize;
+	off_t loaded;
+	ino_t inode;
+} sigcache = {
+	.lock = PTHREAD_RWLOCK_INITIALIZER,
+};
+
+static void sigcache_digest(struct openpgp_packet *sig, uint8_t hashtype,
+		uint8_t *hash, struct openpgp_fingerprint *signer,
+		struct sigcache_entry *entry)
+{
+	struct sha1_ctx sha1_ctx;
+	size_t hashlen;
+
+	hashlen = onak_hash_length(hashtype);
+
+	sha1_init(&sha1_ctx);
+	sha1_update(&sha1_ctx, sig->length, sig->data);
+	sha1_update(&sha1_ctx, 1, &hashtype);
+	sha1_update(&sha1_ctx, hashlen, hash);
+	sha1_update(&sha1_ctx, signer->length, signer->fp);
+	sha1_digest(&sha1_ctx, SIGCACHE_DIGEST_LEN, entry->digest);
+}
+
+static size_t sigcache_slot(struct sigcache_entry *entries, size_t size,
+		struct sigcache_entry *entry)
+{
+	static const struct sigcache_entry empty;
+	uint64_t hash;
+	size_t slot;
+
+	/* The digest is already well distributed, just use the start of it */
+	memcpy(&hash, entry->digest, sizeof(hash));
+	slot = hash & (size - 1);
+	while (memcmp(&entries[slot], entry, sizeof(*entry)) != 0 &&
+			memcmp(&entries[slot], &empty, sizeof(empty)) != 0) {
+		slot = (slot + 1) & (size - 1);
+	}
+
+	return slot;
+}
+
+static bool sigcache_insert(struct sigcache_entry *entry)
+{
+	struct sigcache_entry *entries;
+	size_t i, size, slot;
+
+	/* Keep the table no more than half full */
+	if ((sigcache.count + 1) * 2 > sigcache.size) {
+		size = sigcache.size ? sigcache.size * 2 : 1024;
+		entries = calloc(size, sizeof(*entries));
+		if (entries == NULL) {
+			return false;
+		}
+		for (i = 0; i < sigcache.size; i++) {
+			slot = sigcache_slot(entries, size,
+					&sigcache.entries[i]);
+			entries[slot] = sigcache.entries[i];
+		}
+		free(sigcache.entries);
+		sigcache.entries = entries;
+		sigcache.size = size;
+	}
+
+	slot = sigcache_slot(sigcache.entries, sigcache.size, entry);
+	if (memcmp(&sigcache.entries[slot], entry, sizeof(*entry)) == 0) {
+		return false;
+	}
+	sigcache.entries[slot] = *entry;
+	sigcache.count++;
+
+	return true;
+}
+
+/*
+ * Empty the in memory table, keeping only the entries we've still to write
+ * out, so it can be reloaded from a rewritten cache file.
+ */
+static void sigcache_reset(void)
+{
+	size_t i;
+
+	free(sigcache.entries);
+	sigcache.entries = NULL;
+	sigcache.size = sigcache.count = 0;
+	sigcache.loaded = 0;
+	for (i = 0; i < sigcache.pendingcount; i++) {
+		sigcache_insert(&sigcache.pending[i]);
+	}
+}
+
+/*
+ * Read anything that's been added to the cache file since we last looked,
+ * which includes entries written by other processes. Called with the lock
+ * held for writing.
+ */
+static void sigcache_load(void)
+{
+	struct sigcache_entry entries[256];
+	struct stat st;
+	ssize_t len;
+	int fd, i;
+
+	fd = open(config.sigcache, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT) {
+			logthing(LOGTHING_ERROR,
+				"Couldn't open signature cache %s: %s",
+				config.sigcache, strerror(errno));
+		}
+		return;
+	}
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return;
+	}
+	if (st.st_ino != sigcache.inode || st.st_size < sigcache.loaded) {
+		sigcache_reset();
+		sigcache.inode = st.st_ino;
+	}
+	if (st.st_size <= sigcache.loaded ||
+			lseek(fd, sigcache.loaded, SEEK_SET) < 0) {
+		close(fd);
+		return;
+	}
+
+	/* Only consume whole entries; the last one may still be in flight */
+	while ((len = read(fd, entries, sizeof(entries))) >= (ssize_t)
+			sizeof(entries[0])) {
+		len /= sizeof(entries[0]);
+		for (i = 0; i < len; i++) {
+			sigcache_insert(&entries[i]);
+		}
+		sigcache.loaded += len * sizeof(entries[0]);
+		if (lseek(fd, sigcache.loaded, SEEK_SET) < 0) {
+			break;
+		}
+	}
+	close(fd);
+
+	logthing(LOGTHING_DEBUG, "Signature cache has %zu entries.",
+			sigcache.count);
+}
+
+void sigcache_refresh(void)
+{
+	struct stat st;
+
+	if (config.sigcache == NULL) {
+		return;
+	}
+
+	if (stat(config.sigcache, &st) < 0) {
+		if (errno != ENOENT) {
+			logthing(LOGTHING_ERROR,
+				"Couldn't stat signature cache %s: %s",
+				config.sigcache, strerror(errno));
+		}
+		return;
+	}
+
+	pthread_rwlock_wrlock(&sigcache.lock);
+	if (st.st_ino != sigcache.inode || st.st_size != sigcache.loaded) {
+		sigcache_load();
+	}
+	pthread_rwlock_unlock(&sigcache.lock);
+}
+
+bool sigcache_find(struct openpgp_packet *sig, uint8_t hashtype,
+		uint8_t *hash, struct openpgp_fingerprint *signer)
+{
+	struct sigcache_entry entry;
+	size_t slot;
+	bool found = false;
+
+	if (config.sigcache == NULL) {
+		return false;
+	}
+
+	sigcache_digest(sig, hashtype, hash, signer, &entry);
+
+	pthread_rwlock_rdlock(&sigcache.lock);
+	if (sigcache.size != 0) {
+		slot = sigcache_slot(sigcache.entries, sigcache.size, &entry);
+		found = memcmp(&sigcache.entries[slot], &entry,
+				sizeof(entry)) == 0;
+	}
+	pthread_rwlock_unlock(&sigcache.lock);
+
+	return found;
+}
+
+void sigcache_add(struct openpgp_packet *sig, uint8_t hashtype,
+		uint8_t *hash, struct openpgp_fingerprint *signer)
+{
+	struct sigcache_entry entry, *pending;
+	size_t size;
+
+	if (config.sigcache == NULL) {
+		return;
+	}
+
+	sigcache_digest(sig, hashtype, hash, signer, &entry);
+
+	pthread_rwlock_wrlock(&sigcache.lock);
+	if (sigcache_insert(&entry)) {
+		if (sigcache.pendingcount == sigcache.pendingsize) {
+			size = sigcache.pendingsize ?
+				sigcache.pendingsize * 2 : 64;
+			pending = realloc(sigcache.pending,
+					size * sizeof(*pending));
+			if (pending != NULL) {
+				sigcache.pending = pending;
+				sigcache.pendingsize = size;
+			}
+		}
+		if (sigcache.pendingcount < sigcache.pendingsize) {
+			sigcache.pending[sigcache.pendingcount++] = entry;
+		}
+	}
+	pthread_rwlock_unlock(&sigcache.lock);
+}
+
+/*
+ * Rewrite the cache file keeping only the most recently added half (rounded
+ * up) of the configured maximum number of entries, and reload our table from it. Called
+ * with the lock held for writing. Entries another process appends while we're
+ * doing this may be lost, which just means checking those signatures again.
+ */
+static void sigcache_compact(int fd, off_t filesize)
+{
+	struct sigcache_entry *keep;
+	struct stat st;
+	size_t count, len, i;
+	char *tmpname;
+	int tmpfd;
+
+	/* Round up, so a limit of 1 still keeps the newest entry. */
+	count = (config.sigcache_entries + 1) / 2;
+	len = count * sizeof(*keep);
+	keep = malloc(len);
+	tmpname = malloc(strlen(config.sigcache) + 16);
+	if (keep == NULL || tmpname == NULL) {
+		goto out;
+	}
+	if (pread(fd, keep, len, filesize - len) != (ssize_t) len) {
+		logthing(LOGTHING_ERROR,
+			"Couldn't read signature cache %s: %s",
+			config.sigcache, strerror(errno));
+		goto out;
+	}
+
+	sprintf(tmpname, "%s.%d", config.sigcache, getpid());
+	tmpfd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (tmpfd < 0) {
+		logthing(LOGTHING_ERROR,
+			"Couldn't create %s to compact signature cache: %s",
+			tmpname, strerror(errno));
+		goto out;
+	}
+	if (write(tmpfd, keep, len) != (ssize_t) len ||
+			fstat(tmpfd, &st) < 0 ||
+			rename(tmpname, config.sigcache) < 0) {
+		logthing(LOGTHING_ERROR,
+			"Couldn't compact signature cache %s: %s",
+			config.sigcache, strerror(errno));
+		close(tmpfd);
+		unlink(tmpname);
+		goto out;
+	}
+	close(tmpfd);
+
+	sigcache_reset();
+	for (i = 0; i < count; i++) {
+		sigcache_insert(&keep[i]);
+	}
+	sigcache.loaded = len;
+	sigcache.inode = st.st_ino;
+
+	logthing(LOGTHING_INFO, "Compacted signature cache %s to %zu entries.",
+			config.sigcache, count);
+out:
+	free(tmpname);
+	free(keep);
+}
+
+void sigcache_flush(void)
+{
+	struct stat st;
+	ssize_t len;
+	int fd;
+
+	pthread_rwlock_wrlock(&sigcache.lock);
+	if (config.sigcache == NULL || sigcache.pendingcount == 0) {
+		goto out;
+	}
+
+	fd = open(config.sigcache, O_RDWR | O_APPEND | O_CREAT, 0644);
+	if (fd < 0) {
+		logthing(LOGTHING_ERROR,
+			"Couldn't open signature cache %s for writing: %s",
+			config.sigcache, strerror(errno));
+		goto out;
+	}
+	/*
+	 * A single O_APPEND write keeps our entries together even if another
+	 * process is adding to the file at the same time.
+	 */
+	len = write(fd, sigcache.pending,
+			sigcache.pendingcount * sizeof(sigcache.pending[0]));
+	if (len < 0) {
+		logthing(LOGTHING_ERROR,
+			"Couldn't write to signature cache %s: %s",
+			config.sigcache, strerror(errno));
+	} else if (fstat(fd, &st) == 0) {
+		/*
+		 * If nothing else was added to the file since we last read it
+		 * there's no need to read back what we've just written.
+		 */
+		if (st.st_ino == sigcache.inode &&
+				st.st_size == sigcache.loaded + len) {
+			sigcache.loaded = st.st_size;
+		}
+		if (config.sigcache_entries > 0 && (size_t) st.st_size /
+				sizeof(sigcache.pending[0]) >
+				(size_t) config.sigcache_entries) {
+			sigcache.pendingcount = 0;
+			sigcache_compact(fd, st.st_size);
+		}
+	}
+	close(fd);
+	sigcache.pendingcount = 0;
+
+out:
+	pthread_rwlock_unlock(&sigcache.lock);
+}
+
+void sigcache_cleanup(void)
+{
+	sigcache_flush();
+
+	pthread_rwlock_wrlock(&sigcache.lock);
+	free(sigcache.entries);
+	sigcache.entries = NULL;
+	sigcache.size = sigcache.count = 0;
+	free(sigcache.pending);
+	sigcache.pending = NULL;
+	sigcache.pendingsize = sigcache.pendingcount = 0;
+	sigcache.loaded = 0;
+	sigcache.inode = 0;
+	pthread_rwlock_unlock(&sigcache.lock);
+}
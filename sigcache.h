@@ -0,0 +1,78 @@
+/*
+ * sigcache.h - Cache of signatures we've already verified.
+ *
+ * Copyright 2026 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIGCACHE_H__
+#define __SIGCACHE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "keystructs.h"
+
+/**
+ * @brief Pick up any new entries in the cache file
+ *
+ * Reads anything added to the cache file configured with the
+ * verification:sigcache option, by us or another process, since we last
+ * looked. Only touches the file if its size has changed. Called before each
+ * batch of signature checks, rather than on every lookup.
+ */
+void sigcache_refresh(void);
+
+/**
+ * @brief Check if a signature is known to be good
+ * @param sig The signature packet
+ * @param hashtype The type of hash the signature is over (OPENPGP_HASH_*)
+ * @param hash The hash of the signed data
+ * @param signer The fingerprint of the key that made the signature
+ *
+ * Looks up the signature in the cache of ones that have previously been
+ * verified. The signed data hash is part of the lookup, so a signature only
+ * matches for the data it was made over. Returns false if there's no match
+ * or the cache isn't configured. Safe to call from several threads at once.
+ */
+bool sigcache_find(struct openpgp_packet *sig, uint8_t hashtype,
+		uint8_t *hash, struct openpgp_fingerprint *signer);
+
+/**
+ * @brief Record a signature as verified
+ * @param sig The signature packet
+ * @param hashtype The type of hash the signature is over (OPENPGP_HASH_*)
+ * @param hash The hash of the signed data
+ * @param signer The fingerprint of the key that made the signature
+ *
+ * Adds the signature to the cache. It's not written to the cache file
+ * until sigcache_flush() is called.
+ */
+void sigcache_add(struct openpgp_packet *sig, uint8_t hashtype,
+		uint8_t *hash, struct openpgp_fingerprint *signer);
+
+/**
+ * @brief Write any new cache entries out to the cache file
+ *
+ * If the file now holds more than verification:sigcache_entries entries it's
+ * rewritten with just the most recent half of them.
+ */
+void sigcache_flush(void);
+
+/**
+ * @brief Flush and free the signature cache
+ */
+void sigcache_cleanup(void);
+
+#endif /* __SIGCACHE_H__ */
@@ -17,6 +17,7 @@
  */
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "build-config.h"
@@ -74,7 +75,6 @@
 
 /*
  * Hold the crypto material for a public key.
- * May want to move to a header at some point.
  */
 struct onak_key_material {
 	uint8_t type;
@@ -278,6 +278,33 @@ static onak_status_t onak_parse_key_material(struct openpgp_packet *pk,
 	return ret;
 }
 
+onak_status_t onak_key_material_new(struct openpgp_packet *pk,
+		struct onak_key_material **key)
+{
+	onak_status_t ret;
+
+	*key = malloc(sizeof(**key));
+	if (*key == NULL) {
+		return ONAK_E_NOMEM;
+	}
+
+	ret = onak_parse_key_material(pk, *key);
+	if (ret != ONAK_E_OK) {
+		free(*key);
+		*key = NULL;
+	}
+
+	return ret;
+}
+
+void onak_key_material_free(struct onak_key_material *key)
+{
+	if (key != NULL) {
+		onak_free_key_material(key);
+		free(key);
+	}
+}
+
 onak_status_t onak_check_hash_sig(struct openpgp_packet *sigkey,
 		struct openpgp_packet *sig,
 		uint8_t *hash,
@@ -285,35 +312,46 @@ onak_status_t onak_check_hash_sig(struct openpgp_packet *sigkey,
 {
 	onak_status_t ret;
 	struct onak_key_material pubkey;
-	struct dsa_signature dsasig;
-	uint8_t sigkeytype;
-	uint8_t edsig[64];
-	int len, ofs;
-	size_t count;
-	mpz_t s;
 
 	ret = onak_parse_key_material(sigkey, &pubkey);
 	if (ret != ONAK_E_OK) {
 		return ret;
 	}
 
+	ret = onak_check_hash_sig_material(&pubkey, sig, hash, hashtype);
+
+	onak_free_key_material(&pubkey);
+
+	return ret;
+}
+
+onak_status_t onak_check_hash_sig_material(struct onak_key_material *pubkey,
+		struct openpgp_packet *sig,
+		uint8_t *hash,
+		uint8_t hashtype)
+{
+	onak_status_t ret = ONAK_E_OK;
+	struct dsa_signature dsasig;
+	uint8_t keytype, sigkeytype;
+	uint8_t edsig[64];
+	int len, ofs;
+	size_t count;
+	mpz_t s;
+
 	/* Sanity check the length of the signature packet */
 	if (sig->length < 8) {
-		ret = ONAK_E_INVALID_PKT;
-		goto out;
+		return ONAK_E_INVALID_PKT;
 	}
 
 	if (sig->data[0] == 3) {
 		/* Must be 5 bytes hashed */
 		if (sig->data[1] != 5) {
-			ret = ONAK_E_INVALID_PARAM;
-			goto out;
+			return ONAK_E_INVALID_PARAM;
 		}
 
 		/* Need at least 19 bytes for the sig header */
 		if (sig->length < 19) {
-			ret = ONAK_E_INVALID_PKT;
-			goto out;
+			return ONAK_E_INVALID_PKT;
 		}
 
 		/* Skip to the signature material */
@@ -323,27 +361,23 @@ onak_status_t onak_check_hash_sig(struct openpgp_packet *sigkey,
 		/* Skip the hashed data */
 		ofs = (sig->data[4] << 8) + sig->data[5] + 6;
 		if (sig->length < ofs + 2) {
-			ret = ONAK_E_INVALID_PKT;
-			goto out;
+			return ONAK_E_INVALID_PKT;
 		}
 		/* Skip the unhashed data */
 		ofs += (sig->data[ofs] << 8) + sig->data[ofs + 1] + 2;
 		if (sig->length < ofs + 2) {
-			ret = ONAK_E_INVALID_PKT;
-			goto out;
+			return ONAK_E_INVALID_PKT;
 		}
 		/* Skip the sig hash bytes */
 		ofs += 2;
 		sigkeytype = sig->data[2];
 	} else {
-		ret = ONAK_E_UNSUPPORTED_FEATURE;
-		goto out;
+		return ONAK_E_UNSUPPORTED_FEATURE;
 	}
 
 	/* Is the key the same type as the signature we're checking? */
-	if (pubkey.type != sigkeytype) {
-		ret = ONAK_E_INVALID_PARAM;
-		goto out;
+	if (pubkey->type != sigkeytype) {
+		return ONAK_E_INVALID_PARAM;
 	}
 
 	/* Parse the actual signature values */
@@ -402,119 +436,120 @@ onak_status_t onak_check_hash_sig(struct openpgp_packet *sigkey,
 		goto sigerr;
 
 	/* Squash a signing only RSA key to a standard RSA key for below */
-	if (pubkey.type == OPENPGP_PKALGO_RSA_SIGN) {
-		pubkey.type = OPENPGP_PKALGO_RSA;
+	keytype = pubkey->type;
+	if (keytype == OPENPGP_PKALGO_RSA_SIGN) {
+		keytype = OPENPGP_PKALGO_RSA;
 	}
 
 #define KEYHASH(key, hash) ((key << 8) | hash)
 
-	switch KEYHASH(pubkey.type, hashtype) {
+	switch KEYHASH(keytype, hashtype) {
 	case KEYHASH(OPENPGP_PKALGO_DSA, OPENPGP_HASH_MD5):
-		ret = dsa_verify(&pubkey.dsa, pubkey.y,
+		ret = dsa_verify(&pubkey->dsa, pubkey->y,
 				MD5_DIGEST_SIZE, hash, &dsasig) ?
 			ONAK_E_WEAK_SIGNATURE : ONAK_E_BAD_SIGNATURE;
 		break;
 	case KEYHASH(OPENPGP_PKALGO_DSA, OPENPGP_HASH_RIPEMD160):
-		ret = dsa_verify(&pubkey.dsa, pubkey.y,
+		ret = dsa_verify(&pubkey->dsa, pubkey->y,
 				RIPEMD160_DIGEST_SIZE, hash, &dsasig) ?
 			ONAK_E_OK : ONAK_E_BAD_SIGNATURE;
 		break;
 	case KEYHASH(OPENPGP_PKALGO_DSA, OPENPGP_HASH_SHA1):
-		ret = dsa_verify(&pubkey.dsa, pubkey.y,
+		ret = dsa_verify(&pubkey->dsa, pubkey->y,
 				SHA1_DIGEST_SIZE, hash, &dsasig) ?
 			ONAK_E_OK : ONAK_E_BAD_SIGNATURE;
 		break;
 	case KEYHASH(OPENPGP_PKALGO_DSA, OPENPGP_HASH_SHA1X):
-		ret = dsa_verify(&pubkey.dsa, pubkey.y,
+		ret = dsa_verify(&pubkey->dsa, pubkey->y,
 				SHA1X_DIGEST_SIZE, hash, &dsasig) ?
 			ONAK_E_OK : ONAK_E_BAD_SIGNATURE;
 		break;
 	case KEYHASH(OPENPGP_PKALGO_DSA, OPENPGP_HASH_SHA224):
-		ret = dsa_verify(&pubkey.dsa, pubkey.y,
+		ret = dsa_verify(&pubkey->dsa, pubkey->y,
 				SHA224_DIGEST_SIZE, hash, &dsasig) ?
 			ONAK_E_OK : ONAK_E_BAD_SIGNATURE;
 		break;
 	case KEYHASH(OPENPGP_PKALGO_DSA, OPENPGP_HASH_SHA256):
-		ret = dsa_verify(&pubkey.dsa, pubkey.y,
+		ret = dsa_verify(&pubkey->dsa, pubkey->y,
 				SHA256_DIGEST_SIZE, hash, &dsasig) ?
 			ONAK_E_OK : ONAK_E_BAD_SIGNATURE;
 		break;
 	case KEYHASH(OPENPGP_PKALGO_DSA, OPENPGP_HASH_SHA384):
-		ret = dsa_verify(&pubkey.dsa, pubkey.y,
+		ret = dsa_verify(&pubkey->dsa, pubkey->y,
 				SHA384_DIGEST_SIZE, hash, &dsasig) ?
 			ONAK_E_OK : ONAK_E_BAD_SIGNATURE;
 		break;
 	case KEYHASH(OPENPGP_PKALGO_DSA, OPENPGP_HASH_SHA512):
-		ret = dsa_verify(&pubkey.dsa, pubkey.y,
+		ret = dsa_verify(&pubkey->dsa, pubkey->y,
 				SHA512_DIGEST_SIZE, hash, &dsasig) ?
 			ONAK_E_OK : ONAK_E_BAD_SIGNATURE;
 		break;
 	case KEYHASH(OPENPGP_PKALGO_ECDSA, OPENPGP_HASH_SHA1):
-		ret = ecdsa_verify(&pubkey.ecc,
+		ret = ecdsa_verify(&pubkey->ecc,
 				SHA1_DIGEST_SIZE, hash, &dsasig) ?
 			ONAK_E_OK : ONAK_E_BAD_SIGNATURE;
 		break;
 	case KEYHASH(OPENPGP_PKALGO_ECDSA, OPENPGP_HASH_SHA256):
-		ret = ecdsa_verify(&pubkey.ecc,
+		ret = ecdsa_verify(&pubkey->ecc,
 				SHA256_DIGEST_SIZE, hash, &dsasig) ?
 			ONAK_E_OK : ONAK_E_BAD_SIGNATURE;
 		break;
 	case KEYHASH(OPENPGP_PKALGO_ECDSA, OPENPGP_HASH_SHA384):
-		ret = ecdsa_verify(&pubkey.ecc,
+		ret = ecdsa_verify(&pubkey->ecc,
 				SHA384_DIGEST_SIZE, hash, &dsasig) ?
 			ONAK_E_OK : ONAK_E_BAD_SIGNATURE;
 		break;
 	case KEYHASH(OPENPGP_PKALGO_ECDSA, OPENPGP_HASH_SHA512):
-		ret = ecdsa_verify(&pubkey.ecc,
+		ret = ecdsa_verify(&pubkey->ecc,
 				SHA512_DIGEST_SIZE, hash, &dsasig) ?
 			ONAK_E_OK : ONAK_E_BAD_SIGNATURE;
 		break;
 	case KEYHASH(OPENPGP_PKALGO_EDDSA, OPENPGP_HASH_RIPEMD160):
-		ret = ed25519_sha512_verify(pubkey.ed25519,
+		ret = ed25519_sha512_verify(pubkey->ed25519,
 				RIPEMD160_DIGEST_SIZE, hash, edsig) ?
 			ONAK_E_OK : ONAK_E_BAD_SIGNATURE;
 		break;
 	case KEYHASH(OPENPGP_PKALGO_EDDSA, OPENPGP_HASH_SHA256):
-		ret = ed25519_sha512_verify(pubkey.ed25519,
+		ret = ed25519_sha512_verify(pubkey->ed25519,
 				SHA256_DIGEST_SIZE, hash, edsig) ?
 			ONAK_E_OK : ONAK_E_BAD_SIGNATURE;
 		break;
 	case KEYHASH(OPENPGP_PKALGO_EDDSA, OPENPGP_HASH_SHA384):
-		ret = ed25519_sha512_verify(pubkey.ed25519,
+		ret = ed25519_sha512_verify(pubkey->ed25519,
 				SHA384_DIGEST_SIZE, hash, edsig) ?
 			ONAK_E_OK : ONAK_E_BAD_SIGNATURE;
 		break;
 	case KEYHASH(OPENPGP_PKALGO_EDDSA, OPENPGP_HASH_SHA512):
-		ret = ed25519_sha512_verify(pubkey.ed25519,
+		ret = ed25519_sha512_verify(pubkey->ed25519,
 				SHA512_DIGEST_SIZE, hash, edsig) ?
 			ONAK_E_OK : ONAK_E_BAD_SIGNATURE;
 		break;
 	case KEYHASH(OPENPGP_PKALGO_RSA, OPENPGP_HASH_MD5):
-		ret = rsa_md5_verify_digest(&pubkey.rsa, hash, s) ?
+		ret = rsa_md5_verify_digest(&pubkey->rsa, hash, s) ?
 			ONAK_E_WEAK_SIGNATURE : ONAK_E_BAD_SIGNATURE;
 		break;
 	case KEYHASH(OPENPGP_PKALGO_RSA, OPENPGP_HASH_RIPEMD160):
-		ret = rsa_ripemd160_verify_digest(&pubkey.rsa, hash, s) ?
+		ret = rsa_ripemd160_verify_digest(&pubkey->rsa, hash, s) ?
 			ONAK_E_OK : ONAK_E_BAD_SIGNATURE;
 		break;
 	case KEYHASH(OPENPGP_PKALGO_RSA, OPENPGP_HASH_SHA1):
-		ret = rsa_sha1_verify_digest(&pubkey.rsa, hash, s) ?
+		ret = rsa_sha1_verify_digest(&pubkey->rsa, hash, s) ?
 			ONAK_E_OK : ONAK_E_BAD_SIGNATURE;
 		break;
 	case KEYHASH(OPENPGP_PKALGO_RSA, OPENPGP_HASH_SHA224):
-		ret = rsa_sha224_verify_digest(&pubkey.rsa, hash, s) ?
+		ret = rsa_sha224_verify_digest(&pubkey->rsa, hash, s) ?
 			ONAK_E_OK : ONAK_E_BAD_SIGNATURE;
 		break;
 	case KEYHASH(OPENPGP_PKALGO_RSA, OPENPGP_HASH_SHA256):
-		ret = rsa_sha256_verify_digest(&pubkey.rsa, hash, s) ?
+		ret = rsa_sha256_verify_digest(&pubkey->rsa, hash, s) ?
 			ONAK_E_OK : ONAK_E_BAD_SIGNATURE;
 		break;
 	case KEYHASH(OPENPGP_PKALGO_RSA, OPENPGP_HASH_SHA384):
-		ret = rsa_sha384_verify_digest(&pubkey.rsa, hash, s) ?
+		ret = rsa_sha384_verify_digest(&pubkey->rsa, hash, s) ?
 			ONAK_E_OK : ONAK_E_BAD_SIGNATURE;
 		break;
 	case KEYHASH(OPENPGP_PKALGO_RSA, OPENPGP_HASH_SHA512):
-		ret = rsa_sha512_verify_digest(&pubkey.rsa, hash, s) ?
+		ret = rsa_sha512_verify_digest(&pubkey->rsa, hash, s) ?
 			ONAK_E_OK : ONAK_E_BAD_SIGNATURE;
 		break;
 	default:
@@ -535,16 +570,115 @@ sigerr:
 		break;
 	}
 
-out:
-	onak_free_key_material(&pubkey);
-
 	return ret;
 }
 
 #endif /* HAVE_CRYPTO */
 
-onak_status_t calculate_packet_sighash(struct openpgp_publickey *key,
-			struct openpgp_packet *packet,
+/*
+ * Hash the data a signature of the given version is over that comes before
+ * the signature itself; the primary key and then the UID or subkey.
+ */
+static void sighash_prefix(struct openpgp_publickey *key,
+		struct openpgp_packet *packet,
+		uint8_t version,
+		struct onak_hash_ctx *ctx)
+{
+	uint8_t keyheader[5];
+	uint8_t packetheader[5];
+
+	switch (version) {
+	case 3:
+		keyheader[0] = 0x99;
+		keyheader[1] = key->publickey->length >> 8;
+		keyheader[2] = key->publickey->length & 0xFF;
+		onak_hash_update(ctx, 3, keyheader);
+		onak_hash_update(ctx, key->publickey->length,
+				key->publickey->data);
+
+		if (packet != NULL) {
+			if (packet->tag == OPENPGP_PACKET_PUBLICSUBKEY) {
+				packetheader[0] = 0x99;
+				packetheader[1] = packet->length >> 8;
+				packetheader[2] = packet->length & 0xFF;
+				onak_hash_update(ctx, 3, packetheader);
+			}
+
+			// TODO: Things other than UIDS/subkeys?
+			onak_hash_update(ctx, packet->length, packet->data);
+		}
+		break;
+	case 4:
+		keyheader[0] = 0x99;
+		keyheader[1] = key->publickey->length >> 8;
+		keyheader[2] = key->publickey->length & 0xFF;
+		onak_hash_update(ctx, 3, keyheader);
+		onak_hash_update(ctx, key->publickey->length,
+				key->publickey->data);
+
+		if (packet != NULL) {
+			if (packet->tag == OPENPGP_PACKET_PUBLICSUBKEY) {
+				packetheader[0] = 0x99;
+				packetheader[1] = packet->length >> 8;
+				packetheader[2] = packet->length & 0xFF;
+				onak_hash_update(ctx, 3, packetheader);
+			} else if (packet->tag == OPENPGP_PACKET_UID ||
+					packet->tag == OPENPGP_PACKET_UAT) {
+				packetheader[0] = (packet->tag ==
+					OPENPGP_PACKET_UID) ?  0xB4 : 0xD1;
+				packetheader[1] = packet->length >> 24;
+				packetheader[2] = (packet->length >> 16) & 0xFF;
+				packetheader[3] = (packet->length >> 8) & 0xFF;
+				packetheader[4] = packet->length & 0xFF;
+				onak_hash_update(ctx, 5, packetheader);
+			}
+			onak_hash_update(ctx, packet->length, packet->data);
+		}
+		break;
+	case 5:
+		keyheader[0] = 0x9A;
+		keyheader[1] = 0;
+		keyheader[2] = 0;
+		keyheader[3] = key->publickey->length >> 8;
+		keyheader[4] = key->publickey->length & 0xFF;
+		onak_hash_update(ctx, 5, keyheader);
+		onak_hash_update(ctx, key->publickey->length,
+				key->publickey->data);
+
+		if (packet != NULL) {
+			if (packet->tag == OPENPGP_PACKET_PUBLICSUBKEY) {
+				packetheader[0] = 0x9A;
+				packetheader[1] = 0;
+				packetheader[2] = 0;
+				packetheader[3] = packet->length >> 8;
+				packetheader[4] = packet->length & 0xFF;
+				onak_hash_update(ctx, 5, packetheader);
+			} else if (packet->tag == OPENPGP_PACKET_UID ||
+					packet->tag == OPENPGP_PACKET_UAT) {
+				packetheader[0] = (packet->tag ==
+					OPENPGP_PACKET_UID) ?  0xB4 : 0xD1;
+				packetheader[1] = packet->length >> 24;
+				packetheader[2] = (packet->length >> 16) & 0xFF;
+				packetheader[3] = (packet->length >> 8) & 0xFF;
+				packetheader[4] = packet->length & 0xFF;
+				onak_hash_update(ctx, 5, packetheader);
+			}
+			onak_hash_update(ctx, packet->length, packet->data);
+		}
+		break;
+	}
+}
+
+void onak_sighash_cache_init(struct onak_sighash_cache *cache,
+		struct openpgp_publickey *key,
+		struct openpgp_packet *packet)
+{
+	cache->key = key;
+	cache->packet = packet;
+	cache->count = 0;
+}
+
+onak_status_t calculate_packet_sighash_cached(struct onak_sighash_cache *cache,
 			struct openpgp_packet *sig,
 			uint8_t *hashtype,
 			uint8_t *hash,
@@ -552,11 +686,12 @@ onak_status_t calculate_packet_sighash(struct openpgp_publickey *key,
 {
 	size_t siglen, unhashedlen;
 	struct onak_hash_data hashdata;
-	uint8_t keyheader[5];
-	uint8_t packetheader[5];
+	struct onak_hash_ctx ctx;
 	uint8_t trailer[10];
+	uint8_t version;
 	uint64_t keyid;
 	onak_status_t res;
+	int i;
 
 	*hashtype = 0;
 	*sighash = NULL;
@@ -573,48 +708,15 @@ onak_status_t calculate_packet_sighash(struct openpgp_publickey *key,
 		if (sig->length < 19) {
 			return ONAK_E_INVALID_PKT;
 		}
-		keyheader[0] = 0x99;
-		keyheader[1] = key->publickey->length >> 8;
-		keyheader[2] = key->publickey->length & 0xFF;
-		hashdata.data[0] = keyheader;
-		hashdata.len[0] = 3;
-		hashdata.data[1] = key->publickey->data;
-		hashdata.len[1] = key->publickey->length;
-		hashdata.chunks = 2;
-
+		version = 3;
 		*hashtype = sig->data[16];
 
-		if (packet != NULL) {
-			if (packet->tag == OPENPGP_PACKET_PUBLICSUBKEY) {
-				packetheader[0] = 0x99;
-				packetheader[1] = packet->length >> 8;
-				packetheader[2] = packet->length & 0xFF;
-				hashdata.data[hashdata.chunks] = packetheader;
-				hashdata.len[hashdata.chunks] = 3;
-				hashdata.chunks++;
-			}
-
-			// TODO: Things other than UIDS/subkeys?
-			hashdata.data[hashdata.chunks] = packet->data;
-			hashdata.len[hashdata.chunks] = packet->length;
-			hashdata.chunks++;
-		}
-
 		hashdata.data[hashdata.chunks] = &sig->data[2];
 		hashdata.len[hashdata.chunks] = 5;
 		hashdata.chunks++;
 		*sighash = &sig->data[17];
 		break;
 	case 4:
-		keyheader[0] = 0x99;
-		keyheader[1] = key->publickey->length >> 8;
-		keyheader[2] = key->publickey->length & 0xFF;
-		hashdata.data[0] = keyheader;
-		hashdata.len[0] = 3;
-		hashdata.data[1] = key->publickey->data;
-		hashdata.len[1] = key->publickey->length;
-		hashdata.chunks = 2;
-
 		/* Check to see if this is an X509 based signature */
 		if (sig->data[2] == 0 || sig->data[2] == 100) {
 			size_t len;
@@ -644,33 +746,9 @@ onak_status_t calculate_packet_sighash(struct openpgp_publickey *key,
 			}
 		}
 
+		version = 4;
 		*hashtype = sig->data[3];
 
-		if (packet != NULL) {
-			if (packet->tag == OPENPGP_PACKET_PUBLICSUBKEY) {
-				packetheader[0] = 0x99;
-				packetheader[1] = packet->length >> 8;
-				packetheader[2] = packet->length & 0xFF;
-				hashdata.data[hashdata.chunks] = packetheader;
-				hashdata.len[hashdata.chunks] = 3;
-				hashdata.chunks++;
-			} else if (packet->tag == OPENPGP_PACKET_UID ||
-					packet->tag == OPENPGP_PACKET_UAT) {
-				packetheader[0] = (packet->tag ==
-					OPENPGP_PACKET_UID) ?  0xB4 : 0xD1;
-				packetheader[1] = packet->length >> 24;
-				packetheader[2] = (packet->length >> 16) & 0xFF;
-				packetheader[3] = (packet->length >> 8) & 0xFF;
-				packetheader[4] = packet->length & 0xFF;
-				hashdata.data[hashdata.chunks] = packetheader;
-				hashdata.len[hashdata.chunks] = 5;
-				hashdata.chunks++;
-			}
-			hashdata.data[hashdata.chunks] = packet->data;
-			hashdata.len[hashdata.chunks] = packet->length;
-			hashdata.chunks++;
-		}
-
 		hashdata.data[hashdata.chunks] = sig->data;
 		hashdata.len[hashdata.chunks] = siglen = (sig->data[4] << 8) +
 			sig->data[5] + 6;
@@ -700,46 +778,9 @@ onak_status_t calculate_packet_sighash(struct openpgp_publickey *key,
 		*sighash = &sig->data[siglen + unhashedlen + 2];
 		break;
 	case 5:
-		keyheader[0] = 0x9A;
-		keyheader[1] = 0;
-		keyheader[2] = 0;
-		keyheader[3] = key->publickey->length >> 8;
-		keyheader[4] = key->publickey->length & 0xFF;
-		hashdata.data[0] = keyheader;
-		hashdata.len[0] = 5;
-		hashdata.data[1] = key->publickey->data;
-		hashdata.len[1] = key->publickey->length;
-		hashdata.chunks = 2;
-
+		version = 5;
 		*hashtype = sig->data[3];
 
-		if (packet != NULL) {
-			if (packet->tag == OPENPGP_PACKET_PUBLICSUBKEY) {
-				packetheader[0] = 0x9A;
-				packetheader[1] = 0;
-				packetheader[2] = 0;
-				packetheader[3] = packet->length >> 8;
-				packetheader[4] = packet->length & 0xFF;
-				hashdata.data[hashdata.chunks] = packetheader;
-				hashdata.len[hashdata.chunks] = 5;
-				hashdata.chunks++;
-			} else if (packet->tag == OPENPGP_PACKET_UID ||
-					packet->tag == OPENPGP_PACKET_UAT) {
-				packetheader[0] = (packet->tag ==
-					OPENPGP_PACKET_UID) ?  0xB4 : 0xD1;
-				packetheader[1] = packet->length >> 24;
-				packetheader[2] = (packet->length >> 16) & 0xFF;
-				packetheader[3] = (packet->length >> 8) & 0xFF;
-				packetheader[4] = packet->length & 0xFF;
-				hashdata.data[hashdata.chunks] = packetheader;
-				hashdata.len[hashdata.chunks] = 5;
-				hashdata.chunks++;
-			}
-			hashdata.data[hashdata.chunks] = packet->data;
-			hashdata.len[hashdata.chunks] = packet->length;
-			hashdata.chunks++;
-		}
-
 		hashdata.data[hashdata.chunks] = sig->data;
 		hashdata.len[hashdata.chunks] = siglen = (sig->data[4] << 8) +
 			sig->data[5] + 6;;
@@ -774,9 +815,52 @@ onak_status_t calculate_packet_sighash(struct openpgp_publickey *key,
 		return ONAK_E_UNSUPPORTED_FEATURE;
 	}
 
-	hashdata.hashtype = *hashtype;
+	/*
+	 * The key and UID/subkey are the same for every signature on them,
+	 * so only hash them once for each signature version and hash type
+	 * and take a copy of the hash state from then on.
+	 */
+	for (i = 0; i < cache->count; i++) {
+		if (cache->prefix[i].version == version &&
+				cache->prefix[i].hashtype == *hashtype) {
+			break;
+		}
+	}
+	if (i < cache->count) {
+		ctx = cache->prefix[i].ctx;
+	} else {
+		res = onak_hash_init(&ctx, *hashtype);
+		if (res != ONAK_E_OK) {
+			return res;
+		}
+		sighash_prefix(cache->key, cache->packet, version, &ctx);
+		if (cache->count < ONAK_SIGHASH_CACHE_SIZE) {
+			cache->prefix[cache->count].version = version;
+			cache->prefix[cache->count].hashtype = *hashtype;
+			cache->prefix[cache->count].ctx = ctx;
+			cache->count++;
+		}
+	}
+
+	for (i = 0; i < hashdata.chunks; i++) {
+		onak_hash_update(&ctx, hashdata.len[i], hashdata.data[i]);
+	}
+	onak_hash_digest(&ctx, hash);
+
+	return ONAK_E_OK;
+}
+
+onak_status_t calculate_packet_sighash(struct openpgp_publickey *key,
+			struct openpgp_packet *packet,
+			struct openpgp_packet *sig,
+			uint8_t *hashtype,
+			uint8_t *hash,
+			uint8_t **sighash)
+{
+	struct onak_sighash_cache cache;
 
-	res = onak_hash(&hashdata, hash);
+	onak_sighash_cache_init(&cache, key, packet);
 
-	return res;
+	return calculate_packet_sighash_cached(&cache, sig, hashtype, hash,
+			sighash);
 }
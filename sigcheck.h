@@ -1,7 +1,35 @@
 #ifndef __SIGCHECK_H__
 #define __SIGCHECK_H__
+#include "hash-helper.h"
 #include "keystructs.h"
 
+struct onak_key_material;
+
+/* Number of signature version / hash type combinations we cache */
+#define ONAK_SIGHASH_CACHE_SIZE	4
+
+/**
+ * struct onak_sighash_cache - hash state for data shared between signatures
+ * @key: The key the signatures are on
+ * @packet: The UID or subkey the signatures are over; NULL for the key
+ * @count: Number of entries used in @prefix
+ * @prefix: The hash state after the key and UID/subkey have been hashed
+ *
+ * Every signature on a UID or subkey is over the same key and UID/subkey
+ * data, followed by the signature specific part. Keeping the state after
+ * the common part means we don't need to hash it again for every signature.
+ */
+struct onak_sighash_cache {
+	struct openpgp_publickey *key;
+	struct openpgp_packet *packet;
+	int count;
+	struct {
+		uint8_t version;
+		uint8_t hashtype;
+		struct onak_hash_ctx ctx;
+	} prefix[ONAK_SIGHASH_CACHE_SIZE];
+};
+
 onak_status_t calculate_packet_sighash(struct openpgp_publickey *key,
 			struct openpgp_packet *packet,
 			struct openpgp_packet *sig,
@@ -9,6 +37,34 @@ onak_status_t calculate_packet_sighash(struct openpgp_publickey *key,
 			uint8_t *hash,
 			uint8_t **sighash);
 
+/**
+ * onak_sighash_cache_init - prepare to calculate hashes for a set of sigs
+ * @cache: The cache to initialise
+ * @key: The key the signatures are on
+ * @packet: The UID or subkey the signatures are over; NULL for the key
+ */
+void onak_sighash_cache_init(struct onak_sighash_cache *cache,
+		struct openpgp_publickey *key,
+		struct openpgp_packet *packet);
+
+/**
+ * calculate_packet_sighash_cached - calculate the hash a signature is over
+ * @cache: The key and UID/subkey the signature is on, from
+ *         onak_sighash_cache_init
+ * @sig: The signature packet
+ * @hashtype: Set to the type of hash the signature uses
+ * @hash: Set to the hash of the signed data
+ * @sighash: Set to the start of the hash stored in the signature
+ *
+ * As calculate_packet_sighash, but reuses the hash of the key and
+ * UID/subkey from earlier signatures with the same cache.
+ */
+onak_status_t calculate_packet_sighash_cached(struct onak_sighash_cache *cache,
+			struct openpgp_packet *sig,
+			uint8_t *hashtype,
+			uint8_t *hash,
+			uint8_t **sighash);
+
 /**
  * onak_check_hash_sig - check the signature on a hash is valid
  * @sigkey: The public key that made the signature
@@ -21,4 +77,36 @@ onak_status_t onak_check_hash_sig(struct openpgp_packet *sigkey,
 		uint8_t *hash,
 		uint8_t hashtype);
 
+/**
+ * onak_key_material_new - parse the crypto material from a public key
+ * @pk: The public key packet
+ * @key: Set to the parsed key material; free with onak_key_material_free
+ *
+ * Allows a key that's going to be used to check several signatures to
+ * be parsed once, rather than every time.
+ */
+onak_status_t onak_key_material_new(struct openpgp_packet *pk,
+		struct onak_key_material **key);
+
+/**
+ * onak_key_material_free - free key material from onak_key_material_new
+ * @key: The key material to free
+ */
+void onak_key_material_free(struct onak_key_material *key);
+
+/**
+ * onak_check_hash_sig_material - check a signature using parsed key material
+ * @key: The parsed material for the public key that made the signature
+ * @sig: The signature packet
+ * @hash: Hash digest the signature is over
+ * @hashtype: Type of hash (OPENPGP_HASH_*)
+ *
+ * As onak_check_hash_sig. @key isn't modified, so may be used from several
+ * threads at once.
+ */
+onak_status_t onak_check_hash_sig_material(struct onak_key_material *key,
+		struct openpgp_packet *sig,
+		uint8_t *hash,
+		uint8_t hashtype);
+
 #endif /* __SIGCHECK_H__ */
@@ -34,7 +34,6 @@ unsigned long countdegree(struct onak_dbctx *dbctx,
 {
 	unsigned long     count = 0, curdegree = 0;
 	struct ll        *curll, *nextll, *sigll, *tmp;
-	struct stats_key *key = NULL;
 
 	++curdegree;
 
@@ -43,18 +42,14 @@ unsigned long countdegree(struct onak_dbctx *dbctx,
 
 	while (curll != NULL && curdegree <= maxdegree) {
 		if (sigs) {
-			sigll = dbctx->cached_getkeysigs(dbctx,
+			sigll = statskeysigs(dbctx,
 				((struct stats_key *)
 				curll->object)->keyid);
 		} else {
-			sigll = NULL;
-			key = findinhash(((struct stats_key *)
-				curll->object)->keyid);
-			if (key != NULL) {
-				sigll = key->signs;
-			}
+			sigll = statskeysigns(dbctx, curll->object);
 		}
 		while (sigll != NULL) {
+			checkcolour(sigll->object);
 			if (((struct stats_key *) sigll->object)->colour==0) {
 				/* We've never seen it. Count it, mark it and
 					explore its subtree */
@@ -96,7 +91,7 @@ void sixdegrees(struct onak_dbctx *dbctx, uint64_t keyid)
 	long degree;
 	char *uid;
 
-	dbctx->cached_getkeysigs(dbctx, keyid);
+	statskeysigs(dbctx, keyid);
 
 	if ((keyinfo = findinhash(keyid)) == NULL) {
 		printf("Couldn't find key 0x%016" PRIX64 ".\n", keyid);
@@ -160,7 +155,9 @@ int main(int argc, char *argv[])
 	dbctx = config.dbinit(config.backend, true);
 	if (dbctx != NULL) {
 		inithash();
+		initgraph();
 		sixdegrees(dbctx, keyid);
+		cleanupgraph();
 		destroyhash();
 		dbctx->cleanupdb(dbctx);
 	} else {
@@ -21,13 +21,29 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "build-config.h"
 #include "cleanup.h"
+#include "graph.h"
 #include "hash.h"
 #include "keydb.h"
 #include "keyindex.h"
 #include "ll.h"
+#include "log.h"
+#include "onak-conf.h"
 #include "stats.h"
 
+/*
+ * The web of trust graph snapshot, if we're using one.
+ */
+static struct onak_graph *graph;
+
+/*
+ * The search that's currently in progress, and the last one that asked for
+ * the parent pointers to be cleared.
+ */
+static unsigned long colourgen;
+static unsigned long parentgen;
+
 /**
  *	initcolour - Clear the key graph ready for use.
  *	@parent: Do we want to clear the parent pointers too?
@@ -37,24 +53,257 @@
  */
 void initcolour(bool parent)
 {
-	unsigned int loop;
-	struct ll *curkey;
+	colourgen++;
+	if (parent) {
+		parentgen = colourgen;
+	}
+}
+
+void checkcolour(struct stats_key *key)
+{
+	if (key->colourgen != colourgen) {
+		key->colour = 0;
+		if (key->colourgen < parentgen) {
+			key->parent = 0;
+		}
+		key->colourgen = colourgen;
+	}
+}
+
+void initgraph(void)
+{
+	onak_status_t ret;
+
+	if (config.graph_file == NULL) {
+		return;
+	}
+
+	ret = onak_graph_open(config.graph_file, &graph);
+	if (ret != ONAK_E_OK) {
+		logthing(LOGTHING_ERROR,
+			"Couldn't open graph %s (%d); using the key DB.",
+			config.graph_file, ret);
+		graph = NULL;
+	}
+}
+
+void cleanupgraph(void)
+{
+	onak_graph_close(graph);
+	graph = NULL;
+}
+
+struct onak_graph *statsgraph(void)
+{
+	return graph;
+}
+
+/*
+ * Fill in the sigs and signs of a key in the hash from the graph snapshot.
+ * The lists are built with lladd, so they end up in the same order as the
+ * ones cached_getkeysigs builds from the DB. Keys that have only been seen
+ * signing others get their signs, but we don't know their sigs, so those are
+ * left for the DB.
+ */
+static struct stats_key *graphloadkey(uint64_t keyid)
+{
+	struct stats_key *key, *sig;
+	uint32_t node, i;
+
+	key = findinhash(keyid);
+	if (key != NULL && key->gotsigns) {
+		return key;
+	}
+
+	node = onak_graph_find(graph, keyid);
+	if (node == ONAK_GRAPH_NONE) {
+		return key;
+	}
+	if (key == NULL && (key = createandaddtohash(keyid)) == NULL) {
+		return NULL;
+	}
+
+	for (i = graph->signstart[node]; i < graph->signstart[node + 1];
+			i++) {
+		sig = createandaddtohash(graph->keyids[graph->signs[i]]);
+		if (sig != NULL) {
+			key->signs = lladd(key->signs, sig);
+		}
+	}
+	key->gotsigns = true;
+
+	if (!(graph->flags[node] & ONAK_GRAPH_PRESENT)) {
+		return key;
+	}
+	for (i = graph->sigstart[node]; i < graph->sigstart[node + 1]; i++) {
+		sig = createandaddtohash(graph->keyids[graph->sigs[i]]);
+		if (sig != NULL) {
+			key->sigs = lladd(key->sigs, sig);
+		}
+	}
+	key->revoked = graph->flags[node] & ONAK_GRAPH_REVOKED;
+	key->gotsigs = true;
+
+	return key;
+}
+
+struct ll *statskeysigs(struct onak_dbctx *dbctx, uint64_t keyid)
+{
+	struct stats_key *key;
+
+	if (graph != NULL) {
+		key = graphloadkey(keyid);
+		if (key != NULL && key->gotsigs) {
+			return key->sigs;
+		}
+	}
 
 	/*
-	 * Init the colour/parent values. We get each entry list from the hash
-	 * table and walk along it, zeroing the values.
+	 * Either there's no snapshot or the key has been added since it was
+	 * built, so go to the DB.
 	 */
-	for (loop = 0; loop < HASHSIZE; loop++) {
-		curkey = gethashtableentry(loop);
-		while (curkey != NULL) {
-			((struct stats_key *)curkey->object)->colour = 0;
-			if (parent) {
-				((struct stats_key *)curkey->object)->parent =
-					0;
+	return dbctx->cached_getkeysigs(dbctx, keyid);
+}
+
+struct ll *statskeysigns(__unused struct onak_dbctx *dbctx,
+		struct stats_key *key)
+{
+	if (graph != NULL) {
+		graphloadkey(key->keyid);
+	}
+
+	return key->signs;
+}
+
+/*
+ * Expand one level of a bidirectional path search. Going forwards we follow
+ * the signatures on each key, away from the key we want; going backwards we
+ * follow the keys each key has signed, away from the key we have. Keys
+ * reached forwards are coloured with their distance from the key we want
+ * plus one and keys reached backwards with minus their distance from the key
+ * we have plus one, so reaching a key coloured by the other side means the
+ * two halves of the search have met. Frees the current level and returns the
+ * next one.
+ */
+static struct ll *findpathlevel(struct onak_dbctx *dbctx, struct ll *keys,
+		bool forward, unsigned long *count, unsigned long *size,
+		struct stats_key **meet, struct stats_key **via)
+{
+	struct ll *curll, *sigs, *nextkeys = NULL;
+	struct stats_key *key, *sig;
+
+	*size = 0;
+	for (curll = keys; (!cleanup()) && curll != NULL && *meet == NULL;
+			curll = curll->next) {
+		key = (struct stats_key *) curll->object;
+		if (forward) {
+			sigs = statskeysigs(dbctx, key->keyid);
+		} else {
+			sigs = statskeysigns(dbctx, key);
+		}
+		for (; sigs != NULL; sigs = sigs->next) {
+			sig = (struct stats_key *) sigs->object;
+			checkcolour(sig);
+			if (sig->colour == 0) {
+				/*
+				 * We don't know if a key is revoked until
+				 * it's loaded, and we may meet it from the
+				 * other side without ever expanding it.
+				 */
+				if (!sig->gotsigs) {
+					statskeysigs(dbctx, sig->keyid);
+				}
+				if (sig->disabled || sig->revoked) {
+					continue;
+				}
+				(*count)++;
+				(*size)++;
+				sig->colour = forward ? key->colour + 1 :
+					key->colour - 1;
+				sig->parent = key->keyid;
+				nextkeys = lladd(nextkeys, sig);
+			} else if ((sig->colour < 0) == forward) {
+				*meet = sig;
+				*via = key;
+				break;
 			}
-			curkey = curkey->next;
 		}
 	}
+	llfree(keys, NULL);
+
+	return nextkeys;
+}
+
+/*
+ * Search outwards from both ends at once, always expanding the smaller
+ * frontier, so we examine a small fraction of the keys a one sided search
+ * would on a well connected graph. This needs the keys each key has signed,
+ * which we only have in full from the graph snapshot.
+ *
+ * Both sides expand a whole level at a time and neither has met the other
+ * before, so the first meeting we find is on a shortest path.
+ */
+static unsigned long findpathboth(struct onak_dbctx *dbctx,
+		struct stats_key *have, struct stats_key *want)
+{
+	struct ll *fwdkeys, *bwdkeys;
+	struct stats_key *meet = NULL, *via = NULL;
+	struct stats_key *fwdkey, *bwdkey, *nextkey, *prevkey;
+	unsigned long fwdsize = 1, bwdsize = 1;
+	unsigned long count = 0;
+
+	checkcolour(have);
+	checkcolour(want);
+	if (have->disabled || have->revoked) {
+		return 0;
+	}
+
+	want->colour = 1;
+	have->colour = -1;
+	fwdkeys = lladd(NULL, want);
+	bwdkeys = lladd(NULL, have);
+
+	while ((!cleanup()) && meet == NULL && fwdkeys != NULL &&
+			bwdkeys != NULL) {
+		if (fwdsize <= bwdsize) {
+			fwdkeys = findpathlevel(dbctx, fwdkeys, true, &count,
+					&fwdsize, &meet, &via);
+		} else {
+			bwdkeys = findpathlevel(dbctx, bwdkeys, false, &count,
+					&bwdsize, &meet, &via);
+		}
+	}
+	llfree(fwdkeys, NULL);
+	llfree(bwdkeys, NULL);
+
+	if (meet == NULL) {
+		have->colour = 0;
+		return count;
+	}
+
+	if (meet->colour > 0) {
+		fwdkey = meet;
+		bwdkey = via;
+	} else {
+		fwdkey = via;
+		bwdkey = meet;
+	}
+
+	/*
+	 * The parents on the backwards side point towards the key we have;
+	 * turn them round so the whole path can be followed from the key we
+	 * have to the key we want.
+	 */
+	have->colour = fwdkey->colour - bwdkey->colour - 1;
+	nextkey = fwdkey;
+	while (bwdkey != NULL) {
+		prevkey = (bwdkey == have) ? NULL : findinhash(bwdkey->parent);
+		bwdkey->parent = nextkey->keyid;
+		nextkey = bwdkey;
+		bwdkey = prevkey;
+	}
+
+	return count;
 }
 
 /**
@@ -76,18 +325,25 @@ unsigned long findpath(struct onak_dbctx *dbctx,
 	long curdegree = 0;
 	unsigned long count = 0;
 
+	if (graph != NULL && have != want) {
+		return findpathboth(dbctx, have, want);
+	}
+
 	curdegree = 1;
 	keys = lladd(NULL, want);
 	oldkeys = keys;
+	checkcolour(have);
+	checkcolour(want);
 
 	while ((!cleanup()) && keys != NULL && have->colour == 0) {
-		sigs = dbctx->cached_getkeysigs(dbctx, ((struct stats_key *)
+		sigs = statskeysigs(dbctx, ((struct stats_key *)
 					keys->object)->keyid);
 		while ((!cleanup()) && sigs != NULL && have->colour == 0) {
 			/*
 			 * Check if we've seen this key before and if not mark
 			 * it and add its sigs to the list we want to look at.
 			 */
+			checkcolour(sigs->object);
 			if (!((struct stats_key *)sigs->object)->disabled &&
 			    !((struct stats_key *)sigs->object)->revoked &&
 			    ((struct stats_key *)sigs->object)->colour == 0) {
@@ -145,8 +401,8 @@ void dofindpath(struct onak_dbctx *dbctx,
 	/*
 	 * Make sure the keys we have and want are in the cache.
 	 */
-	(void) dbctx->cached_getkeysigs(dbctx, have);
-	(void) dbctx->cached_getkeysigs(dbctx, want);
+	(void) statskeysigs(dbctx, have);
+	(void) statskeysigs(dbctx, want);
 
 	if ((keyinfoa = findinhash(have)) == NULL) {
 		printf("Couldn't find key 0x%016" PRIX64 ".\n", have);
@@ -271,12 +527,14 @@ struct stats_key *furthestkey(struct onak_dbctx *dbctx, struct stats_key *have)
 
 	nextll = NULL;
 	max = have;
+	checkcolour(have);
 	curll = lladd(NULL, have);
 
 	while (curll != NULL) {
-		sigs = dbctx->cached_getkeysigs(dbctx, ((struct stats_key *)
+		sigs = statskeysigs(dbctx, ((struct stats_key *)
 				curll->object)->keyid);
 		while (sigs != NULL) {
+			checkcolour(sigs->object);
 			if (((struct stats_key *) sigs->object)->colour == 0) {
 				/*
 				 * We've never seen it. Count it, mark it and
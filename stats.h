@@ -32,6 +32,7 @@ key_getsigns - get the keys a key signs. */
 #include <inttypes.h>
 #include <stdbool.h>
 
+#include "graph.h"
 #include "keydb.h"
 #include "ll.h"
 
@@ -45,12 +46,16 @@ struct stats_key {
 	int colour;
 	/** The key that lead us to this one for DFS/BFS. */
 	uint64_t parent;
+	/** The search colour and parent belong to; see checkcolour(). */
+	unsigned long colourgen;
 	/** A linked list of the signatures on this key. */
 	struct ll *sigs;
 	/** A linked list of the keys this key signs. */
 	struct ll *signs;
 	/** A bool indicating if we've initialized the sigs element yet. */
 	bool gotsigs;
+	/** A bool indicating if we've loaded signs from the graph snapshot. */
+	bool gotsigns;
 	/** If we shouldn't consider the key in calculations. */
 	bool disabled;
 	/** If the key is revoked (and shouldn't be considered). */
@@ -62,10 +67,63 @@ struct stats_key {
  *	@parent: Do we want to clear the parent pointers too?
  *
  *	Clears the parent and colour information on all elements in the key
- *	graph.
+ *	graph. Rather than walking the whole graph this just starts a new
+ *	search; keys are cleared by checkcolour() when the search reaches
+ *	them, so this is cheap to call however many keys we've loaded.
  */
 void initcolour(bool parent);
 
+/**
+ *	checkcolour - Make sure a key's colour is for the current search.
+ *	@key: The key we're about to look at.
+ *
+ *	Clears the colour (and parent, if requested) of the key if it was
+ *	last touched by a search before the most recent initcolour() call.
+ *	Must be called on a key before looking at its colour or parent.
+ */
+void checkcolour(struct stats_key *key);
+
+/**
+ *	initgraph - Use the web of trust graph snapshot, if we have one.
+ *
+ *	If the graph_file option is set we map the snapshot it points to, so
+ *	the signatures on keys come from there rather than fetching and
+ *	parsing each key we look at from the DB. If the snapshot can't be
+ *	read we carry on using the DB.
+ */
+void initgraph(void);
+
+/**
+ *	cleanupgraph - Stop using the web of trust graph snapshot.
+ */
+void cleanupgraph(void);
+
+/**
+ *	statsgraph - Get the web of trust graph snapshot we're using.
+ *
+ *	Returns NULL if we're not using one.
+ */
+struct onak_graph *statsgraph(void);
+
+/**
+ *	statskeysigs - Gets the signatures on a key.
+ *	@keyid: The key we want the signatures for.
+ *
+ *	Returns the list of keys that have signed the key, from the graph
+ *	snapshot if we have one and the key is in it, otherwise from the DB
+ *	via cached_getkeysigs. Either way the keys are cached in the hash.
+ */
+struct ll *statskeysigs(struct onak_dbctx *dbctx, uint64_t keyid);
+
+/**
+ *	statskeysigns - Gets the keys a key has signed.
+ *	@key: The key we want the signees of.
+ *
+ *	With the graph snapshot this is complete. Without it we only know
+ *	about signatures on keys we've already fetched the signatures of.
+ */
+struct ll *statskeysigns(struct onak_dbctx *dbctx, struct stats_key *key);
+
 /**
  *	findpath - Given 2 keys finds a path between them.
  *	@have: The key we have.
@@ -73,7 +131,9 @@ void initcolour(bool parent);
  *
  *	This does a breadth first search on the key tree, starting with the
  *	key we have. It returns as soon as a path is found or when we run out
- *	of keys; whichever comes sooner.
+ *	of keys; whichever comes sooner. With the graph snapshot it searches
+ *	from both keys at once, which finds a path of the same length while
+ *	examining far fewer keys.
  */
 unsigned long findpath(struct onak_dbctx *dbctx,
 		struct stats_key *have, struct stats_key *want);
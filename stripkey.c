@@ -69,6 +69,7 @@ int main(int argc, char** argv) {
           }
           sig->next = NULL;
           free_packet_list( sig );
+          key->have_skshash = false;
           goto REPEATTHISUID;
         }
       }
@@ -0,0 +1,36 @@
+#!/bin/sh
+# Check adding keys a chunk at a time adds all of them, including when the
+# last chunk is short and ends with a key that's only a public key packet
+
+set -e
+
+cd ${WORKDIR}
+sed -e 's/^loglevel=.*/loglevel=2/' \
+	-e "s;^logfile=.*;logfile=${WORKDIR}/chunked.log;" $1 > chunked.ini
+
+trap cleanup exit
+cleanup () {
+	rm -f chunked.ini chunked.log pubkey.key
+}
+
+# Just the public key packet from autodns.key; no UIDs or signatures
+head -c 421 ${TESTSDIR}/../keys/autodns.key > pubkey.key
+
+cat ${TESTSDIR}/../keys/noodles.key ${TESTSDIR}/../keys/noodles-ecc.key \
+	${TESTSDIR}/../keys/v5-test.key ${TESTSDIR}/../keys/v4.key \
+	pubkey.key | \
+	${BUILDDIR}/onak -b -n 3 -c chunked.ini add
+for keyid in 0x94FA372B2DA8B985 0x9026108FB942BEA4 0x19347BC987246402 \
+		0x5DE480FC; do
+	if ! ${BUILDDIR}/onak -c $1 get $keyid 2> /dev/null | \
+		grep -q -- '-----BEGIN PGP PUBLIC KEY BLOCK-----'; then
+		echo "* Did not correctly retrieve key $keyid."
+		exit 1
+	fi
+done
+if ! grep -q 'Processed 5 keys in 2 chunks' chunked.log; then
+	echo "* Did not read the last two keys as one chunk."
+	exit 1
+fi
+
+exit 0
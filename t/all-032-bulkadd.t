@@ -0,0 +1,59 @@
+#!/bin/sh
+# Check bulk adding keys with several threads adds all of them, and outputs
+# the changes in the order the keys were read, for binary and armored input
+
+set -e
+
+cd ${WORKDIR}
+sed -e "s;${WORKDIR}/db/;${WORKDIR}/db2/;" $1 > bulkadd.ini
+sed -e "s;${WORKDIR}/db/;${WORKDIR}/db3/;" $1 > bulkarmor.ini
+
+trap cleanup exit
+cleanup () {
+	rm -rf bulkadd.ini bulkarmor.ini db2 db3 keys.in keys.asc bulk.out \
+		add.out key.out key.armor
+}
+
+for key in noodles.key noodles-ecc.key v5-test.key v4.key swhite.key \
+		manysubkeys.key putro.key DDA252EBB8EBE1AF-1.key; do
+	cat ${TESTSDIR}/../keys/$key
+done > keys.in
+
+${BUILDDIR}/onak -b -u -j 4 -n 1 -c $1 bulkadd < keys.in > bulk.out
+for keyid in 0x94FA372B2DA8B985 0x9026108FB942BEA4 0x19347BC987246402 \
+		0x5DE480FC 0xDDA252EBB8EBE1AF; do
+	if ! ${BUILDDIR}/onak -c $1 get $keyid 2> /dev/null | \
+		grep -q -- '-----BEGIN PGP PUBLIC KEY BLOCK-----'; then
+		echo "* Did not correctly retrieve key $keyid."
+		exit 1
+	fi
+done
+
+# A plain add into an empty DB should output exactly the same
+mkdir db2
+${BUILDDIR}/onak -b -u -c bulkadd.ini add < keys.in > add.out
+if [ ! -s bulk.out ] || ! cmp -s bulk.out add.out; then
+	echo "* Bulk add output differs from a normal add."
+	exit 1
+fi
+
+# Armored blocks, with some junk between them, should be dearmored by the
+# workers and give us the same keys
+for keyid in 0x94FA372B2DA8B985 0x9026108FB942BEA4 0x19347BC987246402 \
+		0x5DE480FC 0xDDA252EBB8EBE1AF; do
+	${BUILDDIR}/onak -c $1 get $keyid 2> /dev/null
+	echo "Not part of a key"
+done > keys.asc
+mkdir db3
+${BUILDDIR}/onak -j 4 -n 2 -c bulkarmor.ini bulkadd < keys.asc
+for keyid in 0x94FA372B2DA8B985 0x9026108FB942BEA4 0x19347BC987246402 \
+		0x5DE480FC 0xDDA252EBB8EBE1AF; do
+	${BUILDDIR}/onak -c $1 get $keyid > key.out 2> /dev/null
+	${BUILDDIR}/onak -c bulkarmor.ini get $keyid > key.armor 2> /dev/null
+	if [ ! -s key.armor ] || ! cmp -s key.out key.armor; then
+		echo "* Did not correctly bulk add armored key $keyid."
+		exit 1
+	fi
+done
+
+exit 0
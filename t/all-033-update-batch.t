@@ -0,0 +1,75 @@
+#!/bin/sh
+# Check committing several keys per transaction, by count or by time, stores
+# the same keys as committing each on its own, including when two updates
+# race each other and a backend has to roll a batch back and retry it
+
+set -e
+
+cd ${WORKDIR}
+sed -e "s;^\[main\]\$;[main]\nupdate_batch_keys=3;" \
+	-e "s;${WORKDIR}/db/;${WORKDIR}/db2/;" $1 > batchkeys.ini
+sed -e "s;^\[main\]\$;[main]\nupdate_batch_keys=1000\nupdate_batch_time=1;" \
+	-e "s;${WORKDIR}/db/;${WORKDIR}/db3/;" $1 > batchtime.ini
+
+trap cleanup exit
+cleanup () {
+	rm -rf batchkeys.ini batchtime.ini db2 db3 keys.in add.out batch.out \
+		key.out key.batch
+}
+
+# Some keys appear twice, so they're merged with a copy stored earlier in
+# the same transaction.
+for key in noodles.key noodles-ecc.key v5-test.key v4.key swhite.key \
+		manysubkeys.key noodles-ecc.key putro.key DDA252EBB8EBE1AF-1.key \
+		swhite.key; do
+	cat ${TESTSDIR}/../keys/$key
+done > keys.in
+
+${BUILDDIR}/onak -b -u -c $1 add < keys.in > add.out
+
+for ini in batchkeys.ini batchtime.ini; do
+	mkdir -p db2 db3
+	${BUILDDIR}/onak -b -u -c $ini add < keys.in > batch.out
+	if [ ! -s batch.out ] || ! cmp -s add.out batch.out; then
+		echo "* Batched update output differs with $ini."
+		exit 1
+	fi
+	for keyid in 0x94FA372B2DA8B985 0x9026108FB942BEA4 \
+			0x19347BC987246402 0x5DE480FC 0xDDA252EBB8EBE1AF; do
+		${BUILDDIR}/onak -c $1 get $keyid > key.out 2> /dev/null
+		${BUILDDIR}/onak -c $ini get $keyid > key.batch 2> /dev/null
+		if [ ! -s key.batch ] || ! cmp -s key.out key.batch; then
+			echo "* Batched update stored $keyid wrongly with $ini."
+			exit 1
+		fi
+	done
+done
+
+# The file backend doesn't lock, so can't have two updates at once.
+if [ "$2" = "file" ]; then
+	exit 0
+fi
+
+rm -rf db2
+mkdir db2
+# Whichever update runs last may find it has nothing to do, which onak
+# reports as a failure, so only check what ends up stored.
+pids=
+for i in 1 2 3; do
+	${BUILDDIR}/onak -b -c batchkeys.ini add < keys.in &
+	pids="$pids $!"
+done
+for pid in $pids; do
+	wait $pid || true
+done
+for keyid in 0x94FA372B2DA8B985 0x9026108FB942BEA4 0x19347BC987246402 \
+		0x5DE480FC 0xDDA252EBB8EBE1AF; do
+	${BUILDDIR}/onak -c $1 get $keyid > key.out 2> /dev/null
+	${BUILDDIR}/onak -c batchkeys.ini get $keyid > key.batch 2> /dev/null
+	if [ ! -s key.batch ] || ! cmp -s key.out key.batch; then
+		echo "* Concurrent batched updates stored $keyid wrongly."
+		exit 1
+	fi
+done
+
+exit 0
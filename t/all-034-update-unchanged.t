@@ -0,0 +1,50 @@
+#!/bin/sh
+# Check resending a key we already have changes nothing, while a key with
+# something new in it is still merged
+
+set -e
+
+cd ${WORKDIR}
+sed -e "s;^logfile=onak.log\$;logfile=${WORKDIR}/unchanged.log;" \
+	-e "s;^loglevel=7\$;loglevel=2;" $1 > unchanged.ini
+echo verify_signatures=true >> unchanged.ini
+
+trap cleanup exit
+cleanup () {
+	rm -f unchanged.ini unchanged.log update.out key.before key.after
+}
+
+${BUILDDIR}/onak -b -c unchanged.ini add < ${TESTSDIR}/../keys/noodles-ecc.key
+${BUILDDIR}/onak -b -c unchanged.ini add < ${TESTSDIR}/../keys/noodles.key
+${BUILDDIR}/onak -c $1 get 0x94FA372B2DA8B985 > key.before 2> /dev/null
+
+rm -f unchanged.log
+${BUILDDIR}/onak -b -u -c unchanged.ini add \
+	< ${TESTSDIR}/../keys/noodles.key > update.out || true
+${BUILDDIR}/onak -c $1 get 0x94FA372B2DA8B985 > key.after 2> /dev/null
+if [ -s update.out ] || ! cmp -s key.before key.after; then
+	echo "* Resending an unchanged key changed something."
+	exit 1
+fi
+# Backends that index keys by SKS hash shouldn't even look at the old key.
+if [ "$2" = "db4" ] && ! grep -q 'Skipping unchanged key\.' unchanged.log; then
+	echo "* Did not skip unchanged key by its SKS hash."
+	exit 1
+fi
+
+# noodles-ecc was stored without the signature from 0x94FA372B2DA8B985, as
+# we couldn't check it then; now we can it must not be skipped.
+rm -f unchanged.log
+${BUILDDIR}/onak -b -u -c unchanged.ini add \
+	< ${TESTSDIR}/../keys/noodles-ecc.key > update.out
+if [ ! -s update.out ] || grep -q 'Skipping unchanged key\.' unchanged.log; then
+	echo "* Skipped a key with a new signature."
+	exit 1
+fi
+if ! ${BUILDDIR}/onak -c $1 vindex 0x9026108FB942BEA4 2>&1 | \
+	grep -q '0x94FA372B2DA8B985'; then
+	echo "* Did not merge new signature."
+	exit 1
+fi
+
+exit 0
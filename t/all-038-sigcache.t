@@ -0,0 +1,57 @@
+#!/bin/sh
+# Check that verified signatures are cached, and re-adding with the cache works
+
+set -e
+
+cd ${WORKDIR}
+cp $1 sigcache.ini
+
+trap cleanup exit
+cleanup () {
+	rm -f sigcache.ini sigcache
+}
+echo verify_signatures=true >> sigcache.ini
+echo sigcache=${WORKDIR}/sigcache >> sigcache.ini
+
+${BUILDDIR}/onak -b -c sigcache.ini add < ${TESTSDIR}/../keys/noodles.key || true
+${BUILDDIR}/onak -b -c sigcache.ini add < ${TESTSDIR}/../keys/noodles-ecc.key || true
+if [ ! -s sigcache ]; then
+	echo "* Did not record verified signatures"
+	exit 1
+fi
+size=$(wc -c < sigcache)
+
+${BUILDDIR}/onak -b -c $1 delete 0x9026108FB942BEA4
+${BUILDDIR}/onak -b -c sigcache.ini add < ${TESTSDIR}/../keys/noodles-ecc.key || true
+if ! ${BUILDDIR}/onak -c $1 vindex 0x9026108FB942BEA4 2>&1 | \
+	grep -q '0x94FA372B2DA8B985'; then
+	echo "* Did not keep cached signature"
+	exit 1
+fi
+if [ "$(wc -c < sigcache)" -ne "$size" ]; then
+	echo "* Added duplicate signature cache entries"
+	exit 1
+fi
+
+# Once it's over the limit the cache is cut down to the newest half
+echo sigcache_entries=2 >> sigcache.ini
+rm -f sigcache
+${BUILDDIR}/onak -b -c $1 delete 0x9026108FB942BEA4
+${BUILDDIR}/onak -b -c sigcache.ini add < ${TESTSDIR}/../keys/noodles-ecc.key || true
+if [ ! -s sigcache ] || [ "$(wc -c < sigcache)" -gt 40 ]; then
+	echo "* Did not compact signature cache"
+	exit 1
+fi
+size=$(wc -c < sigcache)
+
+# Even a limit of 1 keeps the newest entry
+echo sigcache_entries=1 >> sigcache.ini
+rm -f sigcache
+${BUILDDIR}/onak -b -c $1 delete 0x9026108FB942BEA4
+${BUILDDIR}/onak -b -c sigcache.ini add < ${TESTSDIR}/../keys/noodles-ecc.key || true
+if [ "$(wc -c < sigcache)" -ne "$size" ]; then
+	echo "* Did not compact signature cache to a single entry"
+	exit 1
+fi
+
+exit 0
@@ -0,0 +1,49 @@
+#!/bin/sh
+# Check a key's SKS hash follows the changes made to it when it's stored
+
+set -e
+
+# The file backend can't look keys up by SKS hash. Skip the test for it.
+if [ "$2" = "file" ]; then
+	exit 0
+fi
+
+cd ${WORKDIR}
+cp $1 check-sigs.ini
+
+trap cleanup exit
+cleanup () {
+	rm check-sigs.ini
+}
+echo verify_signatures=true >> check-sigs.ini
+
+skshash () {
+	${BUILDDIR}/onak -s -c $1 index $2 2> /dev/null | \
+		sed -n 's/^ *Key hash = //p'
+}
+
+# The signature from 0x94FA372B2DA8B985 can't be checked yet, so it's
+# stripped; the key must be stored under the hash of what's left.
+${BUILDDIR}/onak -b -c check-sigs.ini add < ${TESTSDIR}/../keys/noodles-ecc.key
+oldhash=$(skshash $1 0x9026108FB942BEA4)
+if ! ${BUILDDIR}/onak -c $1 hget $oldhash 2> /dev/null | \
+	grep -q -- '-----BEGIN PGP PUBLIC KEY BLOCK-----'; then
+	echo "* Did not store key under SKS hash of its cleaned version"
+	exit 1
+fi
+
+# Now the signature can be checked, and merging it changes the hash.
+${BUILDDIR}/onak -b -c check-sigs.ini add < ${TESTSDIR}/../keys/noodles.key
+${BUILDDIR}/onak -b -c check-sigs.ini add < ${TESTSDIR}/../keys/noodles-ecc.key
+newhash=$(skshash $1 0x9026108FB942BEA4)
+if [ -z "$newhash" -o "$newhash" = "$oldhash" ]; then
+	echo "* SKS hash did not change when key was updated"
+	exit 1
+fi
+if ! ${BUILDDIR}/onak -c $1 hget $newhash 2> /dev/null | \
+	grep -q -- '-----BEGIN PGP PUBLIC KEY BLOCK-----'; then
+	echo "* Did not store updated key under its new SKS hash"
+	exit 1
+fi
+
+exit 0
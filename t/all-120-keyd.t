@@ -0,0 +1,65 @@
+#!/bin/sh
+# Check keyd's worker threads serve several clients at once
+
+set -e
+
+cd ${WORKDIR}
+sed -e "s;^use_keyd=false\$;use_keyd=true\nsock_dir=${WORKDIR}\nkeyd_workers=2;" \
+	$1 > keyd.ini
+
+${BUILDDIR}/keydb/onak-keyd -f -c keyd.ini &
+keyd=$!
+trap cleanup exit
+cleanup () {
+	${BUILDDIR}/keydb/onak-keydctl -c keyd.ini quit 2> /dev/null || true
+	wait $keyd || true
+	rm -f keyd.ini keyd.sock get.*
+}
+tries=0
+until ${BUILDDIR}/keydb/onak-keydctl -c keyd.ini check 2> /dev/null; do
+	tries=$((tries + 1))
+	if [ $tries -ge 50 ]; then
+		echo "* keyd did not start."
+		exit 1
+	fi
+	sleep 0.1
+done
+
+# More clients than workers, all adding at once
+pids=
+for key in noodles.key noodles-ecc.key DDA252EBB8EBE1AF-1.key \
+		huggie-rev.key; do
+	${BUILDDIR}/onak -b -c keyd.ini add < ${TESTSDIR}/../keys/$key &
+	pids="$pids $!"
+done
+for pid in $pids; do
+	if ! wait $pid; then
+		echo "* Could not add key through keyd."
+		exit 1
+	fi
+done
+
+pids=
+for keyid in 0x94FA372B2DA8B985 0x9026108FB942BEA4 0xDDA252EBB8EBE1AF \
+		0xC3BCF639D77ECD47; do
+	${BUILDDIR}/onak -c keyd.ini get $keyid > get.$keyid 2> /dev/null &
+	pids="$pids $!"
+done
+for pid in $pids; do
+	wait $pid || true
+done
+for keyid in 0x94FA372B2DA8B985 0x9026108FB942BEA4 0xDDA252EBB8EBE1AF \
+		0xC3BCF639D77ECD47; do
+	if ! grep -q -- '-----BEGIN PGP PUBLIC KEY BLOCK-----' get.$keyid; then
+		echo "* Did not correctly retrieve key $keyid through keyd."
+		exit 1
+	fi
+done
+
+if ! ${BUILDDIR}/keydb/onak-keydctl -c keyd.ini status | \
+		grep -q '^  Get key by FP: *[1-9]'; then
+	echo "* keyd did not count the lookups."
+	exit 1
+fi
+
+exit 0
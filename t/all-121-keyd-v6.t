@@ -0,0 +1,104 @@
+#!/bin/sh
+# Check the keyd version 6 protocol: version negotiation, pipelining, batched
+# lookups and SYNC
+
+set -e
+
+cd ${WORKDIR}
+sed -e "s;^use_keyd=false\$;use_keyd=true\nsock_dir=${WORKDIR};" \
+	$1 > keyd.ini
+
+${BUILDDIR}/keydb/onak-keyd -f -c keyd.ini &
+keyd=$!
+trap cleanup exit
+cleanup () {
+	${BUILDDIR}/keydb/onak-keydctl -c keyd.ini quit 2> /dev/null || true
+	wait $keyd || true
+	rm -f keyd.ini keyd.sock onak.ini hashes.in
+}
+tries=0
+until ${BUILDDIR}/keydb/onak-keydctl -c keyd.ini check 2> /dev/null; do
+	tries=$((tries + 1))
+	if [ $tries -ge 50 ]; then
+		echo "* keyd did not start."
+		exit 1
+	fi
+	sleep 0.1
+done
+
+if ! ${BUILDDIR}/keydb/onak-keydctl -c keyd.ini status | \
+		grep -q '^Using keyd protocol version 6\.'; then
+	echo "* keydctl did not negotiate protocol version 6."
+	exit 1
+fi
+
+${BUILDDIR}/onak -b -c keyd.ini add < ${TESTSDIR}/../keys/noodles.key
+
+# hashquery asks for all its hashes in a single batch; one of these is there.
+# The file backend can't look keys up by SKS hash, so skip this for it.
+if [ "$2" != "file" ]; then
+	perl -e 'print pack("N", 2),
+		pack("N H32", 16, "81929DAE08B8F80888DA524923B93067"),
+		pack("N", 16), "\0" x 16;' > hashes.in
+	ln -s ${WORKDIR}/keyd.ini ${WORKDIR}/onak.ini
+	if ! XDG_CONFIG_HOME=${WORKDIR} REQUEST_METHOD=POST \
+			CONTENT_LENGTH=$(wc -c < hashes.in) \
+			${BUILDDIR}/cgi/hashquery < hashes.in 2> /dev/null | \
+			perl -e 'local $/; $_ = <STDIN>; s/^.*?\n\n//s;
+				exit(unpack("N", $_) != 1);'; then
+		echo "* Did not get the right keys from a batched hash query."
+		exit 1
+	fi
+	if ! ${BUILDDIR}/keydb/onak-keydctl -c keyd.ini status | \
+			grep -q '^  Batch get: *1$'; then
+		echo "* hashquery did not use a batched lookup."
+		exit 1
+	fi
+fi
+
+# Talk to keyd directly for the parts the tools don't use
+if ! perl -MIO::Socket::UNIX -e '
+	my $s = IO::Socket::UNIX->new(Peer => $ARGV[0]) or die "$!\n";
+	sub rd {
+		my $buf = "";
+		while (length($buf) < $_[0]) {
+			sysread($s, $buf, $_[0] - length($buf), length($buf))
+				or die "short read\n";
+		}
+		return $buf;
+	}
+	sub reply { return unpack("L", rd(4)); }
+	sub version {
+		reply() == 0 or die "VERSION failed\n";
+		rd(4);
+		return reply();
+	}
+
+	# Clients that do not say what they speak get version 5
+	syswrite($s, pack("L", 1));
+	version() == 5 or die "Unannounced client did not get version 5\n";
+
+	# They are not told whether a delete worked, but SYNC reports it,
+	# once. No backend has a key with an ID of 0.
+	syswrite($s, pack("L", 4));
+	reply() == 0 or die "DELETE failed\n";
+	syswrite($s, pack("Q a32", 20, "\xff" x 12));
+	syswrite($s, pack("L L", 17, 17));
+	reply() == 2 or die "SYNC did not report failed delete\n";
+	reply() == 0 or die "SYNC did not reset\n";
+
+	# Announce version 6, then pipeline commands without waiting
+	syswrite($s, pack("L", 18));
+	reply() == 0 or die "CLIENT_VERSION failed\n";
+	syswrite($s, pack("L L L L", 6, 1, 1, 17));
+	version() == 6 or die "Did not get version 6\n";
+	version() == 6 or die "Did not get pipelined reply\n";
+	reply() == 0 or die "Did not get pipelined SYNC reply\n";
+
+	syswrite($s, pack("L", 8));
+	' ${WORKDIR}/keyd.sock; then
+	echo "* keyd did not speak protocol version 6 correctly."
+	exit 1
+fi
+
+exit 0
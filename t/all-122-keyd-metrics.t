@@ -0,0 +1,88 @@
+#!/bin/sh
+# Check keyd's metrics are well formed and count what we've done
+
+set -e
+
+cd ${WORKDIR}
+sed -e "s;^use_keyd=false\$;use_keyd=true\nsock_dir=${WORKDIR};" \
+	$1 > keyd.ini
+
+${BUILDDIR}/keydb/onak-keyd -f -c keyd.ini &
+keyd=$!
+trap cleanup exit
+cleanup () {
+	${BUILDDIR}/keydb/onak-keydctl -c keyd.ini quit 2> /dev/null || true
+	wait $keyd || true
+	rm -f keyd.ini keyd.sock metrics.out
+}
+tries=0
+until ${BUILDDIR}/keydb/onak-keydctl -c keyd.ini check 2> /dev/null; do
+	tries=$((tries + 1))
+	if [ $tries -ge 50 ]; then
+		echo "* keyd did not start."
+		exit 1
+	fi
+	sleep 0.1
+done
+
+${BUILDDIR}/onak -b -c keyd.ini add < ${TESTSDIR}/../keys/noodles.key
+${BUILDDIR}/onak -c keyd.ini get 0x94FA372B2DA8B985 > /dev/null 2>&1
+${BUILDDIR}/onak -c keyd.ini get 0x94FA372B2DA8B985 > /dev/null 2>&1
+${BUILDDIR}/keydb/onak-keydctl -c keyd.ini metrics > metrics.out
+
+# Every sample should parse, and each histogram's buckets should only ever
+# go up, ending with its count.
+if ! awk '
+	/^#/ { next }
+	!/^onak_keyd_[a-z_]+({[^}]*})? [0-9.]+$/ {
+		print "bad sample: " $0; bad = 1; next
+	}
+	/_bucket{/ {
+		series = $1
+		sub(/_bucket/, "", series)
+		sub(/,le="[^"]*"}/, "}", series)
+		if (series == last && $2 + 0 < prev + 0) {
+			print "bucket went down: " $0; bad = 1
+		}
+		last = series
+		prev = $2
+		if ($1 ~ /le="\+Inf"/) {
+			inf[series] = $2
+		}
+		next
+	}
+	/_count{/ {
+		series = $1
+		sub(/_count/, "", series)
+		count[series] = $2
+	}
+	END {
+		for (series in count) {
+			if (inf[series] != count[series]) {
+				print "+Inf bucket is not the count: " series
+				bad = 1
+			}
+		}
+		exit bad
+	}' metrics.out; then
+	echo "* keyd metrics are not well formed."
+	exit 1
+fi
+
+for metric in 'onak_keyd_commands_total{command="get_id"} 2' \
+		'onak_keyd_command_duration_seconds_count{command="get_id"} 2' \
+		'onak_keyd_command_duration_seconds_count{command="store"} 1' \
+		'onak_keyd_cache_hits_total 1' \
+		'onak_keyd_commands_total{command="store"} 1'; do
+	if ! grep -qxF "$metric" metrics.out; then
+		echo "* keyd metrics did not include: $metric"
+		exit 1
+	fi
+done
+if ! grep -q '^onak_keyd_sent_bytes_total{command="get_id"} [1-9]' \
+		metrics.out; then
+	echo "* keyd metrics did not count the bytes sent."
+	exit 1
+fi
+
+exit 0
@@ -0,0 +1,119 @@
+#!/bin/sh
+# Check keyd groups writes from several clients into one transaction, and
+# only tells clients a write is done once it's been committed
+
+set -e
+
+cd ${WORKDIR}
+sed -e "s;^use_keyd=false\$;use_keyd=true\nsock_dir=${WORKDIR}\nkeyd_workers=4\nkeyd_commit_window=5000;" \
+	$1 > keyd.ini
+
+${BUILDDIR}/keydb/onak-keyd -f -c keyd.ini &
+keyd=$!
+trap cleanup exit
+cleanup () {
+	exec 3>&-
+	${BUILDDIR}/keydb/onak-keydctl -c keyd.ini quit 2> /dev/null || true
+	wait $keyd || true
+	rm -f keyd.ini keyd.sock hold
+}
+tries=0
+until ${BUILDDIR}/keydb/onak-keydctl -c keyd.ini check 2> /dev/null; do
+	tries=$((tries + 1))
+	if [ $tries -ge 50 ]; then
+		echo "* keyd did not start."
+		exit 1
+	fi
+	sleep 0.1
+done
+
+metric () {
+	${BUILDDIR}/keydb/onak-keydctl -c keyd.ini metrics | \
+		awk -v name="$1" '$1 == name { print $2 }'
+}
+wait_metric () {
+	tries=0
+	until [ "$(metric "$1")" = "$2" ]; do
+		tries=$((tries + 1))
+		if [ $tries -ge 50 ]; then
+			echo "* keyd never reached $1 $2."
+			exit 1
+		fi
+		sleep 0.1
+	done
+}
+
+# Keep a worker busy part way through a store, so the writer thread waits
+# for the rest of the commit window rather than committing as soon as the
+# other clients are waiting. It stores nothing once we let it go.
+mkfifo hold
+perl -MIO::Socket::UNIX -e '
+	my $s = IO::Socket::UNIX->new(Peer => $ARGV[0]) or die "$!\n";
+	syswrite($s, pack("L", 3));
+	sysread($s, my $reply, 4) == 4 && unpack("L", $reply) == 0
+		or die "STORE failed\n";
+	<STDIN>;
+	syswrite($s, pack("Q L", 0, 8));
+	' ${WORKDIR}/keyd.sock < hold &
+holder=$!
+exec 3> hold
+wait_metric 'onak_keyd_commands_total{command="store"}' 1
+
+pids=
+for key in noodles.key noodles-ecc.key; do
+	${BUILDDIR}/onak -b -c keyd.ini add < ${TESTSDIR}/../keys/$key &
+	pids="$pids $!"
+done
+wait_metric 'onak_keyd_commands_total{command="store"}' 3
+sleep 0.5
+echo >&3
+exec 3>&-
+for pid in $holder $pids; do
+	if ! wait $pid; then
+		echo "* Could not add key through keyd."
+		exit 1
+	fi
+done
+
+if [ "$(metric onak_keyd_commits_total)" != 1 -o \
+		"$(metric onak_keyd_committed_keys_total)" != 2 ]; then
+	echo "* keyd did not commit both keys in one transaction."
+	exit 1
+fi
+
+# Once a client's been told its write is done, it must be visible to
+# anything else using the database, not just through keyd.
+${BUILDDIR}/onak -b -c keyd.ini add < ${TESTSDIR}/../keys/huggie-rev.key
+if ! ${BUILDDIR}/onak -c $1 get 0xC3BCF639D77ECD47 2> /dev/null | \
+		grep -q -- '-----BEGIN PGP PUBLIC KEY BLOCK-----'; then
+	echo "* Added key was not committed before keyd replied."
+	exit 1
+fi
+${BUILDDIR}/onak -b -c keyd.ini delete 0xC3BCF639D77ECD47
+if ${BUILDDIR}/onak -c $1 get 0xC3BCF639D77ECD47 2> /dev/null | \
+		grep -q -- '-----BEGIN PGP PUBLIC KEY BLOCK-----'; then
+	echo "* Deleted key was not committed before keyd replied."
+	exit 1
+fi
+
+# Version 6 clients are told if the writer thread couldn't delete a key. No
+# backend has a key with an ID of 0.
+if ! perl -MIO::Socket::UNIX -e '
+	my $s = IO::Socket::UNIX->new(Peer => $ARGV[0]) or die "$!\n";
+	sub reply {
+		sysread($s, my $buf, 4) == 4 or die "short read\n";
+		return unpack("L", $buf);
+	}
+	syswrite($s, pack("L L", 18, 6));
+	reply() == 0 or die "CLIENT_VERSION failed\n";
+	syswrite($s, pack("L", 4));
+	reply() == 0 or die "DELETE failed\n";
+	syswrite($s, pack("Q a32", 20, "\xff" x 12));
+	reply() == 2 or die "Failed delete was not reported\n";
+	syswrite($s, pack("L", 8));
+	' ${WORKDIR}/keyd.sock; then
+	echo "* keyd did not report a failed delete."
+	exit 1
+fi
+
+exit 0
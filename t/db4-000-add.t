@@ -5,7 +5,7 @@ set -e
 
 cd ${WORKDIR}
 ${BUILDDIR}/onak -b -c $1 add < ${TESTSDIR}/../keys/noodles.key
-if [ ! -e db/worddb -o ! -e db/id32db -o ! -e db/keydb.0.db ]; then
+if [ ! -e db/wordpostdb -o ! -e db/id32db -o ! -e db/keydb.0.db ]; then
 	echo Did not correctly add key using db4 backend.
 	exit 1
 fi
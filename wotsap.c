@@ -129,7 +129,7 @@ static void wotsap(struct onak_dbctx *dbctx, uint64_t keyid, char *dir)
 		goto err;
 	}
 
-	dbctx->cached_getkeysigs(dbctx, keyid);
+	statskeysigs(dbctx, keyid);
 	curkey = findinhash(keyid);
 	curkey->colour = ++curidx;
 	pending = lladd(NULL, curkey);
@@ -138,7 +138,7 @@ static void wotsap(struct onak_dbctx *dbctx, uint64_t keyid, char *dir)
 
 	while (pending != NULL) {
 		curkey = (struct stats_key *) pending->object;
-		sigll = dbctx->cached_getkeysigs(dbctx, curkey->keyid);
+		sigll = statskeysigs(dbctx, curkey->keyid);
 		sigsave = sigll = sortkeyll(sigll);
 		sigcount = 0;
 		while (sigll != NULL) {
@@ -147,7 +147,7 @@ static void wotsap(struct onak_dbctx *dbctx, uint64_t keyid, char *dir)
 				uid = dbctx->keyid2uid(dbctx, addkey->keyid);
 				if (uid != NULL) {
 					/* Force it to be loaded so we know if it's revoked */
-					dbctx->cached_getkeysigs(dbctx,
+					statskeysigs(dbctx,
 							addkey->keyid);
 					if (!addkey->revoked) {
 						addkey->colour = ++curidx;
@@ -214,7 +214,9 @@ int main(int argc, char *argv[])
 	dbctx = config.dbinit(config.backend, true);
 	if (dbctx != NULL) {
 		inithash();
+		initgraph();
 		wotsap(dbctx, keyid, dir ? dir : ".");
+		cleanupgraph();
 		destroyhash();
 		dbctx->cleanupdb(dbctx);
 	} else {